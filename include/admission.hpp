@@ -0,0 +1,142 @@
+/* Tinjac - admission.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file admission.hpp
+ *  @brief Holds job launches back while the system is too busy
+ */
+
+
+#ifndef ADMISSION_HPP_
+#define ADMISSION_HPP_
+
+#include <string>
+#include <map>
+#include <set>
+#include <boost/function.hpp>
+#include "crontabs.hpp"
+
+using namespace std;
+
+class Scheduler;
+
+/* how often a held job looks at the load again */
+#define ADMIT_RECHECK	5
+/* how long DEFER=delay waits between looks (and jitter at most) */
+#define ADMIT_DELAY	SECONDS_PER_MINUTE
+/* the longest a job is held back before it runs anyway */
+#define ADMIT_DEFER_MAX	(15 * SECONDS_PER_MINUTE)
+
+/** @brief Decides whether a due job can start now, or has to wait
+ *
+ * A crontab limits its jobs by setting any of LOAD_MAX (the one minute
+ * load average), or CPU_PRESSURE_MAX, IO_PRESSURE_MAX and
+ * MEMORY_PRESSURE_MAX (the percentage of the last ten seconds that some
+ * tasks were stalled on each, from /proc/pressure). @hourly, @daily and
+ * the rest are limited to a load of one per CPU unless LOAD_MAX says
+ * otherwise; 0 turns a limit off.
+ *
+ * A job over its limits is copied and put aside. DEFER says what happens
+ * then: "hold" (the default) looks again every ADMIT_RECHECK seconds and
+ * starts it as soon as things are quiet, "delay" looks again every
+ * DEFER_DELAY seconds, and "jitter" waits a random time up to DEFER_DELAY
+ * each time, so that a crowd of held jobs doesn't all start at once.
+ * However busy the system stays, a job starts DEFER_MAX seconds after it
+ * was due, so its schedule never slips further than that. An entry is
+ * only held once: a firing that comes due while it is still held is
+ * skipped, rather than queued up to start with it when things are quiet.
+ *
+ * The readings are taken at most once a second, with pread() from files
+ * kept open, so a minute with thousands of due jobs costs one look. Jobs
+ * with no limits never look at all. JOB_CLASS names the class a job is
+ * counted under in the statistics (logged on SIGUSR1).
+ */
+class Admission {
+public:
+	enum Policy { HOLD, DELAY, JITTER };
+	struct Sample {
+		time_t when;
+		double load;		/* one minute load average, -1 if unknown */
+		double cpu, io, memory;	/* "some avg10" pressure, -1 if unknown */
+	};
+	struct ClassStats {
+		unsigned long admitted;	/* started when they were due */
+		unsigned long deferred;	/* held back */
+		unsigned long released;	/* and later started as the load allowed */
+		unsigned long forced;	/* or started at DEFER_MAX regardless */
+		unsigned long skipped;	/* due again while still held, and dropped */
+		unsigned long waited;	/* seconds, by all of those */
+		time_t maxwait;
+	};
+	typedef boost::function<void (const entry *e, const string &fname, JobGraph *graph)> LaunchCallback;
+	/* proc is where loadavg and pressure/ are, for testing */
+	Admission(Scheduler *sched, const string &proc = "/proc");
+	~Admission();
+	/* called to start the jobs that were held back */
+	void setLaunch(LaunchCallback cb) { this->launch = cb; }
+	/* true if e can start now. If not it is kept and launched once it
+	 * can, or at the latest DEFER_MAX seconds from now
+	 */
+	bool admit(const entry *e, const CrontabFile *file, time_t now);
+	/* launch whatever has waited long enough */
+	void retry(time_t now);
+	/* when retry() next has something to look at, -1 if nothing is held */
+	time_t nextCheck() const;
+	size_t deferred() const { return this->queue.size(); }
+	const Sample &sample(time_t now);
+	const map<string, ClassStats> &getStats() const { return this->stats; }
+	void logStats() const;
+	/* the first field of /proc/loadavg, and "some avg10" of a pressure file */
+	static bool parseLoad(const char *buf, double *load);
+	static bool parsePressure(const char *buf, double *avg10);
+private:
+	struct Limits {
+		string cls;
+		double load, cpu, io, memory;	/* 0 for none */
+		Policy policy;
+		time_t delay, maxdefer;
+	};
+	struct Deferred {
+		entry *e;		/* our copy */
+		string fname;
+		JobGraph *graph;	/* held, if it has one */
+		Limits limits;
+		time_t due;
+	};
+	enum { LOADAVG, CPU, IO, MEMORY, PROBES };
+	Admission(const Admission &);
+	Admission &operator=(const Admission &);
+	bool getLimits(const entry *e, Limits &limits) const;
+	const char *over(const Limits &limits, time_t now);
+	time_t next(const Limits &limits, time_t due, time_t now);
+	double readProbe(int probe);
+	void release(Deferred *d, time_t now, bool forced);
+	Scheduler *sched;
+	LaunchCallback launch;
+	int fds[PROBES];
+	int ncpu;
+	Sample last;
+	multimap<time_t, Deferred *> queue;	/* by when to look again */
+	set<pair<string, int> > held;		/* file and line of each of them */
+	map<string, ClassStats> stats;
+};
+
+#endif /* ADMISSION_HPP_ */
@@ -0,0 +1,81 @@
+/* Tinjac - arena.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file arena.hpp
+ *  @brief Region allocator for everything loaded from one crontab
+ */
+
+
+#ifndef ARENA_HPP_
+#define ARENA_HPP_
+
+#include <cstddef>
+
+/* the first chunk is this big, each one after that twice the last */
+#define ARENA_MIN_CHUNK		1024
+#define ARENA_MAX_CHUNK		(64 * 1024)
+
+/** @brief Bump allocator that is freed all at once
+ *
+ * Memory is handed out from a list of chunks and never given back one
+ * piece at a time; it all goes when the Arena is destroyed. A crontab
+ * file puts its entries and their commands in one, so dropping the file
+ * on reload is a handful of free()s however many entries it had.
+ *
+ * Things that live outside the arena but have to be let go with it
+ * (shared passwd records, interned environments) are registered with
+ * keep(), and released when it goes.
+ */
+class Arena {
+public:
+	Arena();
+	~Arena();
+	/* size zeroed bytes, aligned for anything. NULL if out of memory */
+	void *alloc(size_t size);
+	char *strndup(const char *s, size_t len);
+	/* call release(p) when the arena is destroyed */
+	bool keep(void *p, void (*release)(void *));
+	/* bytes malloc()ed for chunks, and how much of that is handed out */
+	size_t allocated() const { return this->total; }
+	size_t used() const { return this->inuse; }
+	size_t chunkCount() const { return this->nchunks; }
+private:
+	struct Chunk {
+		Chunk *next;
+		size_t size;
+	};
+	struct Cleanup {
+		void *p;
+		void (*release)(void *);
+		Cleanup *next;
+	};
+	Arena(const Arena &);
+	Arena &operator=(const Arena &);
+	Chunk *chunks;
+	char *pos, *end;	/* free space in the current chunk */
+	size_t next;		/* size of the next chunk */
+	size_t total, inuse, nchunks;
+	Cleanup *cleanups;
+};
+
+#endif /* ARENA_HPP_ */
@@ -0,0 +1,116 @@
+/* Tinjac - cgroups.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file cgroups.hpp
+ *  @brief Puts each job in a cgroup of its own, to limit and account for it
+ */
+
+
+#ifndef CGROUPS_HPP_
+#define CGROUPS_HPP_
+
+#include <string>
+#include <map>
+#include <vector>
+#include "crontabs.hpp"
+#include "spawner.hpp"
+
+using namespace std;
+
+/* the controllers we limit jobs with, if the kernel has them */
+#define CGROUP_CONTROLLERS	"cpu memory io"
+/* the period "CPU_MAX=50%" is a share of, in microseconds */
+#define CGROUP_CPU_PERIOD	100000
+
+/** @brief Contains every job in a cgroup v2 leaf of its own
+ *
+ * setup() finds the daemon's cgroup (from /proc/self/cgroup) and, if the
+ * daemon may write to it (it owns the whole of a delegated subtree, as
+ * systemd's Delegate=yes gives a service), moves the daemon and its
+ * spawner into a "daemon" leaf, turns on the cpu, memory and io
+ * controllers and makes a "jobs" cgroup beside it. Each run then gets
+ * jobs/default/<id>, or jobs/<uid>/<class>/<id> if it has a JOB_CLASS.
+ *
+ * A crontab limits its jobs with CPU_MAX (a percentage of one CPU, or
+ * "quota period" in microseconds as cpu.max takes it), MEMORY_MAX (bytes,
+ * or with K, M or G) and IO_MAX (a line for io.max, "8:0 wbps=1048576").
+ * Without a class each run has the limits to itself; with one, they are
+ * set on the class and its jobs share them, so a class of batch jobs
+ * together can't use more than it is given. A class belongs to the user
+ * the jobs run as, so one user's "backup" is never another's.
+ *
+ * create() hands back the leaf's cgroup.procs, which the Spawner passes
+ * to the job to write itself into before it execs. When the job exits
+ * finish() reads what the cgroup used, CPU time, peak memory and bytes
+ * read and written (which rusage doesn't know for the job's own
+ * children), and removes the leaf. If something the job started is still
+ * in there, the leaf is left for sweep() to try again.
+ *
+ * Without cgroup v2, or delegation, jobs run where the daemon does and
+ * nothing is limited or accounted.
+ */
+class Cgroups {
+public:
+	struct Usage {
+		unsigned long long cpu;		/* microseconds, user and system */
+		unsigned long long memory;	/* peak bytes, 0 if the kernel doesn't say */
+		unsigned long long rbytes, wbytes;
+	};
+	/* root is where cgroup2 is mounted, self says which cgroup is ours */
+	Cgroups(const string &root = "/sys/fs/cgroup", const string &self = "/proc/self/cgroup");
+	/* make our part of the tree, after the spawner has started. false if
+	 * jobs won't be contained
+	 */
+	bool setup();
+	bool enabled() const { return !this->jobs.empty(); }
+	/* a leaf for run id of e, with e's limits. The descriptor of its
+	 * cgroup.procs for the job, which the caller closes, or -1 if it
+	 * won't be contained
+	 */
+	int create(Spawner::JobId id, const entry *e);
+	/* what run id used, and remove its leaf. false if it wasn't contained */
+	bool finish(Spawner::JobId id, Usage *usage);
+	/* remove the leaves that were still busy when their jobs exited */
+	void sweep();
+	size_t lingering() const { return this->busy.size(); }
+	/* the cgroup v2 path in /proc/self/cgroup, empty if there isn't one */
+	static string parseSelf(const char *buf);
+	/* usage_usec from cpu.stat */
+	static bool parseCpuStat(const char *buf, unsigned long long *usec);
+	/* rbytes and wbytes from io.stat, summed over the devices */
+	static void parseIoStat(const char *buf, unsigned long long *rbytes, unsigned long long *wbytes);
+	/* CPU_MAX as cpu.max takes it, false if it makes no sense */
+	static bool cpuMax(const char *value, string &out);
+private:
+	Cgroups(const Cgroups &);
+	Cgroups &operator=(const Cgroups &);
+	bool setLimit(const string &dir, const char *file, const char *value);
+	bool enable(const string &dir);
+	string root, self;
+	string jobs;		/* where the leaves go, empty if nowhere */
+	string controllers;	/* what enable() writes to subtree_control */
+	map<Spawner::JobId, string> leaves;
+	vector<string> busy;	/* leaves with something still in them */
+};
+
+#endif /* CGROUPS_HPP_ */
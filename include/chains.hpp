@@ -0,0 +1,105 @@
+/* Tinjac - chains.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file chains.hpp
+ *  @brief Runs chains of dependent jobs as their jobs finish
+ */
+
+
+#ifndef CHAINS_HPP_
+#define CHAINS_HPP_
+
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+#include "crontabs.hpp"
+#include "jobgraph.hpp"
+#include "supervisor.hpp"
+
+using namespace std;
+
+/* jobs a chain runs at once, unless its first job sets CHAIN_PARALLEL */
+#define CHAIN_PARALLEL	4
+
+/** @brief Runs each chain from its first job through to the last
+ *
+ * When a scheduled job that others follow comes due, start() runs it and
+ * keeps the chain's state: for each job in the chain how many of the jobs
+ * it follows have still to finish. As each job finishes (jobDone()) only
+ * its children are looked at; a child whose count reaches zero either
+ * becomes ready, or is skipped if its @success or @failure condition
+ * doesn't hold (or a job it follows was skipped), which in turn finishes
+ * it. Nothing rescans the graph.
+ *
+ * Ready jobs are started while fewer than the chain's limit are running,
+ * so independent branches run side by side. A job with a @pipe is started
+ * together with it, the one's stdout joined straight to the other's stdin
+ * by a pipe between them.
+ */
+class Chains {
+public:
+	struct Stats {
+		unsigned long started;		/* chains */
+		unsigned long finished;
+		unsigned long jobs;		/* jobs started for them */
+		unsigned long skipped;		/* and the ones that weren't */
+	};
+	Chains(Supervisor *supervisor);
+	~Chains();
+	/* if e starts a chain in its crontab's graph, start it, e reading
+	 * from infd if there is one. False if it doesn't, and it should be
+	 * run on its own
+	 */
+	bool start(const entry *e, JobGraph *graph, int infd = -1);
+	/* a job has finished, false if it wasn't one of ours */
+	bool jobDone(const Supervisor::JobRun &run);
+	void setParallel(size_t parallel) { this->parallel = parallel; }
+	/* chains that haven't finished */
+	size_t running() const { return this->runs.size(); }
+	const Stats &getStats() const { return this->stats; }
+private:
+	enum Result { PENDING, SUCCEEDED, FAILED, SKIPPED };
+	struct Run {
+		JobGraph *graph;
+		int root;
+		vector<int> pending;	/* parents yet to finish, -1 if not in the chain */
+		vector<char> results;
+		deque<int> ready;
+		size_t running, left, parallel;
+		unsigned long counts[4];	/* by Result */
+	};
+	Chains(const Chains &);
+	Chains &operator=(const Chains &);
+	void launch(Run *run, int n, int infd);
+	void complete(Run *run, int n, Result result);
+	bool runnable(Run *run, int n) const;
+	void pump(Run *run);
+	void end(Run *run);
+	Supervisor *supervisor;
+	set<Run *> runs;
+	map<Spawner::JobId, pair<Run *, int> > jobs;
+	size_t parallel;
+	Stats stats;
+};
+
+#endif /* CHAINS_HPP_ */
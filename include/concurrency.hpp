@@ -0,0 +1,166 @@
+/* Tinjac - concurrency.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file concurrency.hpp
+ *  @brief Limits how many copies of a job, and how many jobs, run at once
+ */
+
+
+#ifndef CONCURRENCY_HPP_
+#define CONCURRENCY_HPP_
+
+#include <string>
+#include <deque>
+#include <list>
+#include <boost/unordered_map.hpp>
+#include "crontabs.hpp"
+#include "supervisor.hpp"
+
+using namespace std;
+
+/* how many @period jobs run at once, unless TINJAC_PERIOD_JOBS_MAX says */
+#define PERIOD_JOBS_MAX		4
+
+/** @brief Starts jobs for the daemon, within their concurrency limits
+ *
+ * cron starts a job every time it comes due, however many copies of it
+ * are still running; a minutely job that starts taking 90 seconds piles
+ * up until the machine falls over. Here a crontab can set MAX_INSTANCES,
+ * how many copies of each of its jobs may run at once, and OVERLAP, what
+ * happens when one is due and that many are running:
+ *
+ *   allow	start it anyway (the default, unless MAX_INSTANCES is set)
+ *   skip	don't run it this time
+ *   queue	run it as soon as a copy finishes. One run waits at most, so a
+ *		slow job catches up once rather than forever
+ *   kill	send the oldest copy's process group SIGTERM, and start it
+ *
+ * OVERLAP on its own means a MAX_INSTANCES of 1, and so does neither,
+ * for an @period job.
+ *
+ * On top of that, setMax() caps the jobs running in all, and
+ * USER_JOBS_MAX the jobs running as the crontab's user. A job over either
+ * cap waits in its user's queue, and the users whose next job is held up
+ * only by the overall cap take turns as jobs finish, so one busy user
+ * can't hold up the rest. A job that already has a run waiting for a cap
+ * is skipped, so the queues never hold more than one run of each job.
+ *
+ * @period jobs come under one more cap, setPeriodMax(). A host that has
+ * been down for a week has every one of them due when it comes back;
+ * anacron runs them one after another (-s) or all at once. Here at most
+ * that many run at a time, and the rest wait their turn, in the order
+ * they came due, before going on to the other caps.
+ *
+ * Jobs are told apart by their crontab, user and command. Everything is
+ * found through hash tables and counted as it starts and ends, so the
+ * cost of a launch or a finish doesn't grow with the number of jobs
+ * running or waiting. Chains limit themselves (see Chains) and aren't
+ * counted here.
+ */
+class Concurrency {
+public:
+	enum Policy { ALLOW, SKIP, QUEUE, KILL };
+	struct Stats {
+		unsigned long started;
+		unsigned long skipped;		/* as too many copies were running */
+		unsigned long queued;		/* waited for a copy to finish */
+		unsigned long killed;		/* copies killed for a new one */
+		unsigned long capped;		/* waited for the overall or user cap */
+	};
+	Concurrency(Supervisor *supervisor);
+	~Concurrency();
+	/* how many jobs may run at once in all, 0 for no limit */
+	void setMax(size_t max) { this->max = max; }
+	/* and how many @period jobs, 0 for no limit */
+	void setPeriodMax(size_t max) { this->periodmax = max; }
+	/* start e, or queue or skip it, as its limits say, with its stdin
+	 * from infd if there is one. False if it isn't running (or waiting to)
+	 */
+	bool launch(const entry *e, const string &fname, int infd = -1);
+	/* a job has finished, false if it wasn't one of ours. Starts
+	 * whatever was waiting for it
+	 */
+	bool jobDone(const Supervisor::JobRun &run);
+	/* jobs we started that haven't finished */
+	size_t running() const { return this->jobs.size(); }
+	/* and those that are waiting */
+	size_t waiting() const { return this->nwaiting; }
+	const Stats &getStats() const { return this->stats; }
+	/* users with jobs running or waiting */
+	size_t userCount() const { return this->users.size(); }
+	void logStats() const;
+	/* MAX_INSTANCES and OVERLAP from e's environment */
+	static Policy getPolicy(const entry *e, size_t *instances);
+private:
+	struct User;
+	struct Slot;
+	struct Waiting {
+		entry *e;		/* our copy */
+		string fname;
+		int infd;		/* ours too, -1 for none */
+		Slot *slot;
+	};
+	/* one for each job with copies running or waiting */
+	struct Slot {
+		string key;
+		list<Spawner::JobId> ids;	/* running, oldest first */
+		Waiting *queued;		/* by OVERLAP=queue */
+		bool capped;			/* a run waits for a cap */
+	};
+	struct User {
+		string name;
+		size_t running, max;
+		deque<Waiting *> waiting;	/* for a cap */
+		bool ready;			/* in this->ready */
+	};
+	struct Job {
+		Slot *slot;
+		User *user;
+		list<Spawner::JobId>::iterator pos;
+		bool periodic;		/* counted in periodic */
+	};
+	Concurrency(const Concurrency &);
+	Concurrency &operator=(const Concurrency &);
+	Waiting *hold(const entry *e, const string &fname, int infd, Slot *slot);
+	void drop(Waiting *w);
+	bool start(const entry *e, const string &fname, int infd, Slot *slot, User *user);
+	bool admit(const entry *e, const string &fname, int infd, Slot *slot);
+	void release(User *user);
+	void pump();
+	void catchUp();
+	void tidy(Slot *slot);
+	void tidy(User *user);
+	Supervisor *supervisor;
+	size_t max;
+	size_t nwaiting;
+	boost::unordered_map<string, Slot> slots;
+	boost::unordered_map<string, User> users;
+	boost::unordered_map<Spawner::JobId, Job> jobs;
+	deque<User *> ready;		/* waiting only for the overall cap */
+	size_t periodmax;
+	size_t periodic;		/* @period jobs running, or past their cap */
+	deque<Waiting *> periods;	/* and waiting for it */
+	Stats stats;
+};
+
+#endif /* CONCURRENCY_HPP_ */
@@ -0,0 +1,133 @@
+/* Tinjac - crontabcache.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file crontabcache.hpp
+ *  @brief Precompiled crontabs, so startup doesn't have to parse them
+ */
+
+
+#ifndef CRONTABCACHE_HPP_
+#define CRONTABCACHE_HPP_
+
+#include <string>
+#include <map>
+#include <stdint.h>
+#include "crontabs.hpp"
+#include "mappedfile.hpp"
+
+using namespace std;
+
+/* where the daemon keeps its cache */
+#define CRONTAB_CACHE_FILE	"/var/cache/tinjac.crontabs"
+/* bump whenever the layout below, or what the flags mean, changes */
+#define CRONTAB_CACHE_VERSION	6
+
+class UserCache;
+
+/** @brief The compiled form of every loaded crontab, in one file
+ *
+ * save() writes out the entries of each crontab that loaded cleanly:
+ * their bitsets and flags, the commands and job environments (each
+ * distinct one once), and the users they run as. Every crontab is keyed
+ * by the device, inode, size and mtime it had when it was parsed.
+ *
+ * At startup the cache is mmap'd, and a crontab whose stat() still
+ * matches is rebuilt straight from it into the file's Arena, without
+ * reading or parsing the crontab itself. The users are looked up (they
+ * may have changed since) and if one has gone or has a different uid,
+ * gid or home directory the crontab is parsed as usual.
+ *
+ * The cache is only a hint: anything that doesn't look exactly right
+ * (wrong magic, version or layout, offsets out of range) is ignored as a
+ * whole, and crontabs that aren't in it are parsed.
+ */
+class CrontabCache {
+public:
+	struct Stats {
+		unsigned long hits;		/* crontabs loaded from the cache */
+		unsigned long misses;		/* not in it, or changed since */
+	};
+	CrontabCache(const string &fname = CRONTAB_CACHE_FILE);
+	~CrontabCache();
+	/* map the cache. False if there isn't one or it isn't valid */
+	bool open();
+	void close();
+	/* fill in ct's entries if the cache has an up to date copy of it */
+	bool load(CrontabFile *ct, UserCache *users);
+	/* write out files to a new cache, replacing the old one */
+	bool save(const CrontabFileMap &files);
+	const Stats &getStats() const { return this->stats; }
+	const string &getName() const { return this->fname; }
+private:
+	struct Header {
+		char magic[4];
+		uint32_t version;
+		uint32_t entrysize;	/* sizeof(Entry), in case a bitset changes */
+		uint32_t nfiles, nusers, nentries, nenvs, nenvstrs;
+		uint64_t strsize;	/* bytes in the string table, at the end */
+	};
+	struct File {
+		uint64_t dev, ino, size;
+		int64_t mtime, mtimensec;
+		uint32_t name;		/* string table offset */
+		uint32_t first, count;	/* its entries */
+		uint32_t unused;
+	};
+	struct User {
+		uint32_t name, dir;
+		uint32_t uid, gid;
+	};
+	struct Env {
+		uint32_t first, count;	/* its strings, in envstrs */
+	};
+	struct Entry {
+		uint32_t cmd;
+		uint32_t name, after, watch;	/* 0 if the entry has none */
+		uint32_t user, env;	/* indexes into users and envs */
+		int32_t lineno;
+		int32_t spread;
+		int32_t period;
+		int32_t flags;
+		bitstr_t bit_decl(minute, MINUTE_COUNT);
+		bitstr_t bit_decl(hour, HOUR_COUNT);
+		bitstr_t bit_decl(dom, DOM_COUNT);
+		bitstr_t bit_decl(month, MONTH_COUNT);
+		bitstr_t bit_decl(dow, DOW_COUNT);
+	};
+	CrontabCache(const CrontabCache &);
+	CrontabCache &operator=(const CrontabCache &);
+	bool validate();
+	const char *str(uint32_t off) const { return (this->strings + off); }
+	string fname;
+	MappedFile file;
+	const Header *header;
+	const File *files;
+	const User *users;
+	const Entry *entries;
+	const Env *envs;
+	const uint32_t *envstrs;
+	const char *strings;
+	map<string, const File *> index;
+	Stats stats;
+};
+
+#endif /* CRONTABCACHE_HPP_ */
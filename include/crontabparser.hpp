@@ -0,0 +1,169 @@
+/* Tinjac - crontabparser.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+** Portions Copyright:
+** Copyright 1988,1990,1993,1994 by Paul Vixie
+**
+** Copyright (c) 2004 by Internet Systems Consortium, Inc. ("ISC")
+** Copyright (c) 1997,2000 by Internet Software Consortium, Inc.
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file crontabparser.hpp
+ *  @brief Single pass tokenizer for Vixie/cronie formated crontabs
+ */
+
+
+#ifndef CRONTABPARSER_HPP_
+#define CRONTABPARSER_HPP_
+
+#include <string>
+#include <map>
+#include <set>
+#include <utility>
+#include <pwd.h>
+#include "crontabs.hpp"
+
+using namespace std;
+
+class UserCache;
+class Arena;
+
+/** @brief Parse crontab entries out of an in memory buffer
+ *
+ * This is the Vixie load_entry() state machine, but instead of pulling
+ * the file through getc()/ungetc() it walks a cursor over a buffer that
+ * holds the whole file (see MappedFile), so there is no per character
+ * stdio locking and no copying of the fields into temporary buffers.
+ *
+ * Each call to load_env() or load_entry() consumes one line (plus any
+ * comments and blank lines in front of it); load_env() rewinds if the
+ * line turns out not to be a VAR=value setting. LineNumber tracks the
+ * current line so errors can be reported against the line they
+ * occurred on.
+ *
+ * With a UserCache set, entries share its passwd records rather than
+ * each getting their own pw_dup() copy. Entry environments are interned
+ * (see env_intern()), so entries with the same settings and user share
+ * one.
+ *
+ * With an Arena set, entries are allocated from it and the arena keeps
+ * the references to their passwd records and environments. They go when
+ * the arena does, and must not be passed to free_entry().
+ */
+class CrontabParser {
+public:
+	CrontabParser(const char *data, size_t len, string fname);
+	~CrontabParser();
+	int load_env(char *envstr);
+	entry *load_entry(struct passwd *pw, char **envp);
+	void setUserCache(UserCache *users) { this->users = users; }
+	void setArena(Arena *arena) { this->arena = arena; }
+	bool eof() const { return this->pos >= this->end; }
+	int getLineNumber() const { return this->LineNumber; }
+	int getErrors() const { return this->Errors; }
+	/* users whose lines were left out as the UserCache is still looking
+	 * them up
+	 */
+	const set<string> &getWaiting() const { return this->waiting; }
+private:
+	CrontabParser(const CrontabParser &);
+	CrontabParser &operator=(const CrontabParser &);
+	int get_list(bitstr_t * bits, int low, int high, const char *names[], int ch);
+	int get_range(bitstr_t * bits, int low, int high, const char *names[], int ch);
+	int get_number(int *numptr, int low, const char *names[], int ch, const char *terms);
+	int set_element(bitstr_t * bits, int low, int high, int number);
+	char **job_env(char **envp, struct passwd *pw, int line);
+	bool adopt(void *p, void (*release)(void *));
+	char *dup_token(const char *tok, size_t len);
+	void discard(entry *e);
+	void skip_comments();
+	int get_token(const char **start, size_t *len, const char *terms);
+	inline int get_char();
+	inline void unget_char(int ch);
+	const char *begin;
+	const char *pos;
+	const char *end;
+	string fname;
+	UserCache *users;
+	Arena *arena;
+	set<void *> kept;	/* what the arena already holds a reference to */
+	/* job environments worked out so far, by interned settings and user */
+	map<pair<char **, struct passwd *>, char **> envs;
+	set<string> waiting;
+	int LineNumber;
+	int Errors;
+};
+
+/* free an entry that wasn't loaded into an Arena */
+void free_entry(entry *e);
+/* a copy of e that stands on its own, with its own references to the
+ * user and environment. NULL if out of memory; free it with free_entry()
+ */
+entry *copy_entry(const entry *e);
+/* whether s is a job label, or a comma separated list of them */
+bool valid_label(const char *s, size_t len);
+bool valid_labels(const char *s, size_t len);
+/* whether s is a list of paths for @watch */
+bool valid_paths(const char *s, size_t len);
+/* a spread window, seconds with an optional s, m or h after them, up to
+ * a day. -1 if it isn't one
+ */
+int parse_window(const char *s, size_t len);
+/* the longest @period there can be */
+#define PERIOD_MAX	(3650 * SECONDS_PER_DAY)
+/* an @period: daily, weekly or monthly (PERIOD_MONTHLY), or a number of
+ * days, or of hours or minutes with an h or m after it. In seconds, 0 if
+ * it isn't one
+ */
+int parse_period(const char *s, size_t len);
+/* hash of what an entry runs, as whom and when, but not where in the
+ * file it is, and whether two entries are the same by that measure.
+ * Environments are compared by pointer, so only entries that are both
+ * loaded can be compared.
+ */
+size_t entry_hash(const entry *e);
+bool entry_same(const entry *a, const entry *b);
+
+/* get_char() : like getc() but from our buffer, and increment
+ * LineNumber on newlines
+ */
+inline int CrontabParser::get_char() {
+	int ch;
+
+	if (this->pos >= this->end)
+		return (EOF);
+	ch = (unsigned char)*this->pos++;
+	if (ch == '\n')
+		this->LineNumber++;
+	return (ch);
+}
+
+/* unget_char(ch) : like ungetc but do LineNumber processing
+ */
+inline void CrontabParser::unget_char(int ch) {
+	if (ch == EOF)
+		return;
+	this->pos--;
+	if (ch == '\n')
+		this->LineNumber--;
+}
+
+#endif /* CRONTABPARSER_HPP_ */
@@ -40,11 +40,17 @@
 #include <boost/iostreams/operations.hpp>
 #include <boost/iostreams/device/file.hpp>
 #include <boost/filesystem.hpp>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
 
 #include <pwd.h>
+#include <sys/stat.h>
 
 #include "bitstring.h"
 #include "macros.h"
+#include "arena.hpp"
 
 
 using namespace std;
@@ -54,15 +60,23 @@ using namespace boost::iostreams;
 
 
 typedef	struct _entry {
-	//struct _entry	*next;
 	struct passwd	*pwd;
 	char		**envp;
 	char		*cmd;
+	char		*name;		/* label, for others to chain to */
+	char		*after;		/* labels of the jobs this one follows */
+	char		*watch;		/* paths whose changes run it */
 	bitstr_t	bit_decl(minute, MINUTE_COUNT);
 	bitstr_t	bit_decl(hour,   HOUR_COUNT);
 	bitstr_t	bit_decl(dom,    DOM_COUNT);
 	bitstr_t	bit_decl(month,  MONTH_COUNT);
 	bitstr_t	bit_decl(dow,    DOW_COUNT);
+	int		lineno;
+	int		spread;		/* seconds to spread its launches over, 0 for none;
+					 * for @watch, to gather changes over, and for
+					 * @period, the most its runs are put off by */
+	int		period;		/* for @period, seconds from one run to the next */
+#define	PERIOD_MONTHLY	(-1)	/* or once a calendar month */
 	int		flags;
 #define	MIN_STAR	0x01
 #define	HR_STAR		0x02
@@ -71,11 +85,56 @@ typedef	struct _entry {
 #define	WHEN_REBOOT	0x10
 #define	DONT_LOG	0x20
 #define MON_STAR	0x40
+#define	WHEN_AFTER	0x80	/* run when the jobs in after finish */
+#define	AFTER_SUCCESS	0x100	/* if all of them succeeded */
+#define	AFTER_FAILURE	0x200	/* if any of them failed */
+#define	AFTER_PIPE	0x400	/* alongside the one job, reading its output */
+#define	LOAD_LIMITED	0x800	/* @hourly and so on, wait for the load to drop */
+#define	WHEN_WATCH	0x1000	/* run when files change under watch */
+#define	WHEN_PERIOD	0x2000	/* run every period, catching up on missed runs */
 } entry;
 
 
 
 
+class JobGraph;
+
+/** @brief One crontab file and everything that was loaded from it
+ *
+ * The file owns its entries (and their environments), so replacing or
+ * dropping one file on reload never touches any other files entries.
+ * The entries are allocated from the file's arena (see
+ * CrontabParser::setArena()) and all go with it at once.
+ */
+class CrontabFile {
+public:
+	CrontabFile(string fname, struct passwd *pw);
+	~CrontabFile();
+	string fname;
+	struct passwd *pw;		/* owner, NULL for system crontabs */
+	vector<entry *> entries;
+	time_t mtime;
+	struct stat sb;			/* the file as it was when it was loaded */
+	int errors;			/* lines that couldn't be parsed */
+	bool partial;			/* lines left out until their users are looked up */
+	double loadtime;		/* seconds spent parsing the file */
+	JobGraph *graph;		/* its chains of jobs, if it has any */
+	Arena arena;
+private:
+	CrontabFile(const CrontabFile &);
+	CrontabFile &operator=(const CrontabFile &);
+};
+
+typedef map<string, CrontabFile *> CrontabFileMap;
+
+/* without inotify, how often (seconds) to rescan the crontab directory */
+#define CRONTAB_POLL	SECONDS_PER_MINUTE
+
+class Scheduler;
+class FileWatch;
+class UserCache;
+class CrontabCache;
+
 class crontabs {
 public:
 	crontabs ();
@@ -83,28 +142,53 @@ public:
 	~crontabs();
 	bool setPath(path dbdir, bool system);
 	bool parseCrontab(string fname, bool system);
+	bool removeCrontab(string fname);
+	CrontabFile *getCrontab(string fname);
+	const CrontabFileMap &getCrontabs() const { return this->files; }
+	size_t countEntries() const;
+	/* log how much memory each file is using */
+	void logMemory() const;
+	/* watch the directory for changes. Returns a descriptor that is
+	 * readable when processEvents() has something to do, or -1 if
+	 * there's no inotify and rescan() has to be called now and then
+	 */
+	int watch();
+	bool watching() const { return (this->inotifyfd != -1); }
+	void processEvents();
+	/* reload whatever has changed in the directory, going by mtime */
+	void rescan();
+	/* load again the crontabs whose entries run as user, after the
+	 * UserCache found them changed or gone, and those that were waiting
+	 * for it to find them
+	 */
+	void userChanged(const string &user);
+	/* how many times a crontab has been parsed */
+	unsigned long getParseCount() const { return this->parses; }
+	void setScheduler(Scheduler *sched) { this->sched = sched; }
+	/* and the @watch entries to it */
+	void setFileWatch(FileWatch *filewatch) { this->filewatch = filewatch; }
+	void setUserCache(UserCache *users) { this->users = users; }
+	/* load crontabs that haven't changed from cache rather than parsing
+	 * them, and save them to it with saveCache()
+	 */
+	void setCache(CrontabCache *cache) { this->cache = cache; }
+	/* write out the cache if anything has been (re)parsed since */
+	bool saveCache();
 	bool printTime(entry *);
 private:
-	entry *load_entry(FILE * file, void (*error_func) (), struct passwd *pw, char **envp, string fname);
-	int get_list(bitstr_t * bits, int low, int high, const char *names[], int ch, FILE * file);
-	int get_range(bitstr_t * bits, int low, int high, const char *names[], int ch, FILE * file);
-	int get_number(int *numptr, int low, const char *names[], int ch, FILE * file, const char *terms);
-	int set_element(bitstr_t * bits, int low, int high, int number);
-	void skip_comments(FILE * file);
-	int get_string(char *string, int size, FILE * file, char *terms);
-	void unget_char(int ch, FILE * file);
-	int get_char(FILE * file);
-	struct passwd *pw_dup(const struct passwd *pw);
-	char **env_set(char **envp, char *envstr);
-	char **env_copy(char **envp);
-	void env_free(char **envp);
-	char **env_init(void);
-	char *env_get(char *name, char **envp);
-	int glue_strings(char *buffer, size_t buffer_size, const char *a, const char *b, char separator);
-	int strcmp_until(const char *left, const char *right, char until);
+	void install(CrontabFile *ct);
 	path crontabdir;
 	bool SystemDir;
-	int LineNumber;
+	CrontabFileMap files;
+	/* crontabs to load again once the UserCache has looked a user up */
+	map<string, set<string> > waiting;
+	Scheduler *sched;
+	FileWatch *filewatch;
+	UserCache *users;
+	CrontabCache *cache;
+	bool dirty;		/* changed since the cache was saved */
+	int inotifyfd;
+	unsigned long parses;
 };
 
 
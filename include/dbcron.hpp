@@ -0,0 +1,176 @@
+/* Tinjac - dbcron.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file dbcron.hpp
+ *  @brief Runs database jobs' SQL on pooled connections, from threads of its own
+ */
+
+
+#ifndef DBCRON_HPP_
+#define DBCRON_HPP_
+
+#include <string>
+#include <map>
+#include <deque>
+#include <list>
+#include <vector>
+#include <pthread.h>
+#include <boost/function.hpp>
+#include "spawner.hpp"
+#include "outputcapture.hpp"
+
+using namespace std;
+
+class Scheduler;
+
+/* how long a job's SQL gets, connecting and all, unless DB_TIMEOUT says */
+#define DBCRON_TIMEOUT		300
+/* threads, and so queries in flight at once, unless TINJAC_DB_WORKERS says */
+#define DBCRON_WORKERS		4
+/* how long an idle connection is kept for the next job on its database */
+#define DBCRON_KEEPALIVE	300
+/* the commands whose prepared statements a connection keeps */
+#define DBCRON_STATEMENTS	64
+
+/** @brief Runs the SQL of jobs whose command names a database
+ *
+ * "@daily sqlite:/var/lib/app/app.db DELETE FROM sessions WHERE ..."
+ * and "@hourly postgresql://app@localhost/app SELECT purge()" are run
+ * here, without a psql or sqlite3 process, and without connecting
+ * afresh every time: a connection is kept for the next job on the same
+ * database for DBCRON_KEEPALIVE seconds. The SQL is one statement or
+ * several separated by ';', each prepared once per connection and kept,
+ * so a job that runs every minute is parsed and planned the first time
+ * only. The DBCRON_STATEMENTS most recently run commands are kept on
+ * each connection.
+ *
+ * A query blocks, so each runs on one of a fixed set of threads, which
+ * take requests from a queue in order; that bounds the connections in
+ * use at once too. As with WebCron, a finished job's Response goes on a
+ * queue and a byte down a pipe the Scheduler watches, and the done
+ * callback is called from the Scheduler's loop.
+ *
+ * Rows go into the request's OutputCapture as psql -A and sqlite3 print
+ * them, columns separated by '|' and NULL as nothing, so they're filtered,
+ * logged and mailed like a process's output. An error stops the job
+ * there, and is added to the output. A transaction the SQL left open is
+ * rolled back before the connection goes back to the pool; anything
+ * else it set on its session stays for the next job on that connection.
+ *
+ * Each kind of database is only there if configure found its library
+ * (HAVE_SQLITE3, HAVE_LIBPQ); a job on one that wasn't built in fails
+ * with that as its error, rather than being run as a shell command.
+ *
+ * The connection is the daemon's, not the job's user's, so the
+ * Supervisor only runs these for crontab entries of the daemon's own
+ * user.
+ */
+class DbCron {
+public:
+	struct Request {
+		Spawner::JobId id;
+		string database;	/* sqlite:/path or a postgresql:// URI */
+		string sql;
+		int timeout;		/* seconds */
+		OutputCapture output;	/* where the rows go */
+	};
+	struct Response {
+		Spawner::JobId id;
+		bool ok;
+		string error;		/* why not */
+		unsigned long rows;	/* returned */
+		unsigned long changes;	/* inserted, updated or deleted */
+		unsigned long long bytes;	/* of rows */
+		OutputCapture output;
+		struct timeval finished;
+	};
+	typedef boost::function<void (const Response &response)> DoneCallback;
+	struct Stats {
+		unsigned long requests;
+		unsigned long failed;
+		unsigned long connections;	/* opened */
+		unsigned long reused;		/* requests on a kept connection */
+		unsigned long prepared;		/* commands prepared */
+		unsigned long cached;		/* commands a connection had prepared */
+	};
+	class Connection;
+	DbCron(Scheduler *sched, size_t workers = DBCRON_WORKERS);
+	~DbCron();
+	/* start the threads. False if there can't be any */
+	bool start();
+	void setDone(DoneCallback cb) { this->done = cb; }
+	/* before start() */
+	void setWorkers(size_t workers) { this->nworkers = workers ? workers : 1; }
+	/* run the request's SQL. False if its database won't do */
+	bool query(const Request &request);
+	/* give up on a request, which finishes with an error */
+	void cancel(Spawner::JobId id);
+	/* requests not yet done */
+	size_t running() const { return this->pending; }
+	Stats getStats();
+	/* does this command name a database */
+	static bool isDatabase(const char *cmd);
+	/* "sqlite:/path SQL..." into its database and its SQL */
+	static bool parseCommand(const string &cmd, string &database, string &sql);
+	/* sql's statements, for a server that prepares one at a time */
+	static void splitStatements(const string &sql, vector<string> &out);
+	/* a Request in the hands of a worker */
+	struct Job {
+		Request request;
+		Response response;
+		time_t deadline;
+		volatile int cancelled;
+		Connection *conn;	/* once it has one, for cancel() */
+		unsigned long prepared, cached;
+	};
+private:
+	DbCron(const DbCron &);
+	DbCron &operator=(const DbCron &);
+	static void *loop(void *arg);
+	/* the rest run in a worker */
+	void work();
+	void run(Job &job);
+	Connection *take(const string &database);
+	void reap(time_t now, vector<Connection *> &stale);
+	/* queue a finished Response for the Scheduler's thread, under lock */
+	void post(const Response &response);
+	/* and this runs in the Scheduler's */
+	void processDone();
+	Scheduler *sched;
+	size_t nworkers;
+	vector<pthread_t> workers;
+	/* the rest is shared, under lock */
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	bool stopping;
+	deque<Request> queue;
+	map<Spawner::JobId, Job *> jobs;	/* being run */
+	map<string, list<Connection *> > idle;	/* the most recently used first */
+	deque<Response> finished;
+	Stats stats;
+	int wake[2];
+	size_t pending;
+	DoneCallback done;
+};
+
+#endif /* DBCRON_HPP_ */
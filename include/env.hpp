@@ -0,0 +1,58 @@
+/* Tinjac - env.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+** Portions Copyright:
+** Copyright 1988,1990,1993,1994 by Paul Vixie
+**
+** Copyright (c) 2004 by Internet Systems Consortium, Inc. ("ISC")
+** Copyright (c) 1997,2000 by Internet Software Consortium, Inc.
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file env.hpp
+ *  @brief Vixie style environment array helpers
+ */
+
+
+#ifndef ENV_HPP_
+#define ENV_HPP_
+
+#include <cstddef>
+
+char **env_init(void);
+void env_free(char **envp);
+char **env_copy(char **envp);
+char **env_set(char **envp, char *envstr);
+char *env_get(char *name, char **envp);
+
+/* Interned environments are immutable, reference counted, and shared by
+ * everything with the same contents, so entries with the same settings
+ * and user hold one block between them. It is a plain NULL terminated
+ * array that can go straight to execve(). Never env_free() or env_set()
+ * one; take another reference with env_hold() and drop one with
+ * env_release().
+ */
+char **env_intern(char **envp);
+char **env_hold(char **envp);
+void env_release(char **envp);
+/* how many distinct environments are interned */
+size_t env_interned(void);
+
+#endif /* ENV_HPP_ */
@@ -0,0 +1,180 @@
+/* Tinjac - filewatch.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file filewatch.hpp
+ *  @brief Runs @watch jobs as the files under their paths change
+ */
+
+
+#ifndef FILEWATCH_HPP_
+#define FILEWATCH_HPP_
+
+#include <ctime>
+#include <string>
+#include <map>
+#include <set>
+#include <vector>
+#include <sys/types.h>
+#include <boost/function.hpp>
+#include "crontabs.hpp"
+
+using namespace std;
+
+class Scheduler;
+struct inotify_event;
+
+/* how long changes are gathered for a run, unless it's @watch~window */
+#define WATCH_WINDOW	5
+/* in windows, the longest a steady stream of changes holds a run back */
+#define WATCH_HOLD	6
+/* the most paths listed for a run; past that it's given its roots */
+#define WATCH_LIST_MAX	10000
+/* how often paths that couldn't be watched are tried again */
+#define WATCH_RETRY	SECONDS_PER_MINUTE
+
+/** @brief Watches the paths of every @watch entry with one inotify instance
+ *
+ * "@watch /srv/incoming /usr/local/bin/ingest" runs ingest when files
+ * are written (and closed) or moved into /srv/incoming, and
+ * "@watch /etc/app.conf ..." when that file is. cron only ever watches
+ * its own crontab directory. Here the @watch entries of every crontab
+ * share one inotify descriptor on the Scheduler's loop, and a directory
+ * watched for several of them is one watch.
+ *
+ * A change isn't a run. The first one starts a burst, and the job runs
+ * once it has been quiet for its window (WATCH_WINDOW seconds, or
+ * @watch~30s), or WATCH_HOLD windows after the burst started if it never
+ * is; so a hundred thousand files dropped in at once make a run or two,
+ * not a hundred thousand. The run's stdin lists the paths that changed,
+ * once each. If more than WATCH_LIST_MAX did, or some may have been
+ * missed, it lists the watched paths instead, and the job has to look.
+ *
+ * A directory is watched for the files in it, and with ** as the last
+ * part of its path for the files in every directory under it as well.
+ * New ones (made or moved in) are watched as they appear, and walked for
+ * the files that got into them before the watch did. Any other path is
+ * a file, watched through its directory, so it need not exist yet and an
+ * editor replacing it with a rename still counts. If the kernel's queue
+ * overflows there's no knowing what was lost: every job gets a run
+ * listing its paths, and the trees are walked again for directories that
+ * were missed. Paths that can't be watched yet are tried again every
+ * WATCH_RETRY seconds.
+ *
+ * The daemon can read anything, so a job only watches directories its
+ * user could list, and could get to: going by the mode bits, with every
+ * group the user is in, of the directory and each one above it.
+ */
+class FileWatch {
+public:
+	/* run e, from file, with the list of what changed on infd (or -1) */
+	typedef boost::function<void (const entry *e, CrontabFile *file, int infd)> LaunchCallback;
+	struct Stats {
+		unsigned long events;		/* read from inotify */
+		unsigned long changes;		/* to files a job watches */
+		unsigned long runs;
+		unsigned long overflows;	/* of the kernel's queue */
+		unsigned long rescans;		/* trees walked again after one */
+	};
+	FileWatch(Scheduler *sched);
+	~FileWatch();
+	/* false if there's no inotify, and so no @watch jobs */
+	bool start();
+	void setLaunch(LaunchCallback cb) { this->launch = cb; }
+	/* as for the Scheduler, from crontabs as files are (re)loaded. A
+	 * @watch entry that is the same in both keeps its burst
+	 */
+	void addFile(CrontabFile *file);
+	void removeFile(CrontabFile *file);
+	size_t replaceFile(CrontabFile *old, CrontabFile *file);
+	/* read what inotify has, from the Scheduler */
+	void processEvents();
+	/* run the jobs whose bursts are over, and try again at what couldn't
+	 * be watched. When it next has something to do, -1 if nothing
+	 */
+	time_t tick(time_t now);
+	/* directories watched, and @watch entries */
+	size_t watchCount() const { return this->watches.size(); }
+	size_t size() const { return this->count; }
+	const Stats &getStats() const { return this->stats; }
+	void logStats() const;
+private:
+	struct Trigger;
+	/* what a trigger wants of a watched directory */
+	struct Use {
+		Trigger *trigger;
+		string name;	/* the one file in it, empty for all of them */
+		bool tree;	/* and the directories under it */
+		bool root;	/* it is one of the trigger's paths */
+	};
+	struct Watch {
+		string path;
+		vector<Use> uses;
+	};
+	struct Root {
+		string path;	/* without a ** on the end */
+		bool tree;
+		bool watched;
+		bool logged;	/* why it isn't */
+	};
+	/* an @watch entry */
+	struct Trigger {
+		entry *e;
+		CrontabFile *file;
+		vector<gid_t> groups;	/* that e's user is in */
+		vector<Root> roots;
+		set<int> wds;		/* watches with a Use of it */
+		time_t window;
+		time_t first, last;	/* the burst's changes, -1 if there isn't one */
+		set<string> changed;
+		bool lost;		/* more changed than that */
+		unsigned long changes;
+	};
+	FileWatch(const FileWatch &);
+	FileWatch &operator=(const FileWatch &);
+	Trigger *add(entry *e, CrontabFile *file);
+	void remove(Trigger *t);
+	bool install(Trigger *t, Root &root);
+	int watch(const string &path, Trigger *t, const string &name, bool tree, bool root);
+	void walk(Trigger *t, const string &dir, bool changed, time_t now);
+	void forget(int wd);
+	void forgetTree(const string &path);
+	void dispatch(int wd, const struct inotify_event *ev, time_t now);
+	void note(Trigger *t, const string &path, time_t now);
+	void overflow(time_t now);
+	int listing(Trigger *t);
+	void fire(Trigger *t);
+	time_t deadline(const Trigger *t) const;
+	Scheduler *sched;
+	int fd;
+	map<int, Watch> watches;	/* by watch descriptor */
+	map<string, int> wds;		/* and by path */
+	map<CrontabFile *, vector<Trigger *> > byfile;
+	set<Trigger *> pending;		/* with a burst going */
+	set<Trigger *> missing;		/* with a path to try again */
+	size_t count;
+	time_t retry;
+	LaunchCallback launch;
+	Stats stats;
+};
+
+#endif /* FILEWATCH_HPP_ */
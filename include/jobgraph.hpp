@@ -0,0 +1,89 @@
+/* Tinjac - jobgraph.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file jobgraph.hpp
+ *  @brief The chains of dependent jobs in one crontab
+ */
+
+
+#ifndef JOBGRAPH_HPP_
+#define JOBGRAPH_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include "crontabs.hpp"
+
+using namespace std;
+
+/** @brief Which jobs in a crontab run after which
+ *
+ * An entry can be labelled ("backup: 0 3 * * * ...") and others can run
+ * @after it finishes, only on @success or @failure, or as a @pipe that
+ * starts alongside it and reads its output ("@success backup,dump ...").
+ * Labels are local to their crontab. build() resolves them once when the
+ * crontab is loaded into a graph of nodes with their parents, children
+ * and pipe, checked for cycles; anything in or after a cycle, or after a
+ * label that doesn't exist, is left out and logged.
+ *
+ * The nodes hold their own copies of the entries, and the graph is
+ * reference counted, so chains that are still running when the crontab
+ * is reloaded finish with the jobs they started with.
+ */
+class JobGraph {
+public:
+	struct Node {
+		entry *e;		/* our copy */
+		vector<int> parents;	/* that it runs @after, @success or @failure */
+		vector<int> children;	/* and the other way round */
+		int pipe;		/* the @pipe child started with it, or -1 */
+		int pipeparent;		/* or the job this one is a @pipe of */
+		bool usable;
+	};
+	/* the chains in file, or NULL if it has none */
+	static JobGraph *build(const CrontabFile *file);
+	void hold() { this->refs++; }
+	void release() { if (--this->refs == 0) delete this; }
+	/* the node for a label, -1 if there isn't a usable one */
+	int find(const char *name) const;
+	const Node &node(int i) const { return this->nodes[i]; }
+	size_t size() const { return this->nodes.size(); }
+	const string &getName() const { return this->fname; }
+	/* every node a chain from root reaches, root first. Worked out the
+	 * first time it is asked for
+	 */
+	const vector<int> &reach(int root) const;
+private:
+	JobGraph(const string &fname);
+	~JobGraph();
+	JobGraph(const JobGraph &);
+	JobGraph &operator=(const JobGraph &);
+	bool link(int i);
+	void sort();
+	string fname;
+	vector<Node> nodes;
+	map<string, int> names;
+	mutable map<int, vector<int> > reached;
+	unsigned int refs;
+};
+
+#endif /* JOBGRAPH_HPP_ */
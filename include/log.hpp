@@ -20,9 +20,9 @@
 ** $Rev$
 */
 
-/** @file log.hpp 
- *  @brief 
- */ 
+/** @file log.hpp
+ *  @brief The daemon's log, written by a thread of its own
+ */
 
 
 
@@ -30,22 +30,118 @@
 #ifndef LOG_HPP_
 #define LOG_HPP_
 
-#include <fstream>
+#include <cstdarg>
+#include <cstddef>
+#include <string>
+#include <pthread.h>
+#include <sys/time.h>
 
 using namespace std;
 
-#define DLOG(z, ...) logFacility->Write(__FILE__, __LINE__, z, __VA_ARGS__)
-#define ELOG(z, ...) logFacility->Write(__FILE__, __LINE__, z, __VA_ARGS__)
+/* what was asked for, e.g. the SIGUSR1 reports: under every level, so
+ * it's always written
+ */
+#define LOGLEVEL_REPORT	-1
+#define LOGLEVEL_ERROR	0
+#define LOGLEVEL_DEBUG	1
+/* the most detailed level compiled in; build with -DLOGLEVEL=LOGLEVEL_ERROR
+ * and every DLOG is gone, arguments and all
+ */
+#ifndef LOGLEVEL
+# define LOGLEVEL	LOGLEVEL_DEBUG
+#endif
 
+/* the longest line, as it was formatted */
+#define LOG_LINE_MAX	1024
+/* lines the ring holds before they are dropped; a power of two */
+#define LOG_RING_SLOTS	1024
+
+#define LOG_AT(level, z, ...) do { \
+		if (LOGLEVEL >= (level) && logFacility->enabled(level)) \
+			logFacility->Write(level, __FILE__, __LINE__, z, __VA_ARGS__); \
+	} while (0)
+#define DLOG(z, ...) LOG_AT(LOGLEVEL_DEBUG, z, __VA_ARGS__)
+#define ELOG(z, ...) LOG_AT(LOGLEVEL_ERROR, z, __VA_ARGS__)
+#define RLOG(z, ...) LOG_AT(LOGLEVEL_REPORT, z, __VA_ARGS__)
+
+/** @brief Where DLOG, ELOG and RLOG go
+ *
+ * Until start() a line is formatted and written straight out, as it
+ * always was. After it, Write() only formats the message into the next
+ * free slot of a ring and returns; a thread of the log's own takes the
+ * lines off the ring in order and writes them out in batches, so the
+ * scheduler never waits on the disk. Any thread can log: a slot is
+ * claimed with a compare and swap on the ring's head, and published by
+ * its sequence number (Vyukov's bounded MPMC queue, with one consumer).
+ * The writer sleeps on a pipe when the ring is empty, and is only
+ * poked when it is asleep.
+ *
+ * A full ring drops the line rather than hold up the caller; the writer
+ * says how many were lost. stop() waits for the threads that are part
+ * way through putting a line on the ring before it takes the ring away. A process forked after start() doesn't have
+ * the thread, and writes its own lines straight out. Only one Log is
+ * started at a time.
+ *
+ * Lines are "file:line: message" by default. KEYVALUE and JSON add the
+ * time and level, for log collectors:
+ *	time=2021-01-04T00:00:00.123Z level=debug file=main.cpp line=10 msg="..."
+ *	{"time":"2021-01-04T00:00:00.123Z","level":"debug","file":"main.cpp","line":10,"msg":"..."}
+ */
 class Log {
-  public:
-    Log(char* filename);
-    Log();
-    ~Log();
-    void Write(char *file, int LineNo, char* logline);
-    void Write(char *file, int LineNo, const char* logline, ...);
-  private:
-    ofstream m_stream;
+public:
+	enum Format { TEXT, KEYVALUE, JSON };
+	struct Stats {
+		unsigned long written;
+		unsigned long dropped;
+	};
+	Log(const char *filename, size_t slots = LOG_RING_SLOTS);
+	Log();
+	~Log();
+	void Write(int level, const char *file, int LineNo, const char *logline, ...)
+		__attribute__((format(printf, 5, 6)));
+	bool enabled(int level) const { return (level <= this->level); }
+	void setLevel(int level) { this->level = level; }
+	void setFormat(Format format) { this->format = format; }
+	/* "text", "kv" or "json"; false if it's none of them */
+	bool setFormat(const char *name);
+	/* hand writing over to a thread. False if there can't be one */
+	bool start();
+	/* write out what is on the ring, and go back to writing directly */
+	void stop();
+	/* only settled once stop() has returned */
+	Stats getStats() const;
+private:
+	struct Slot {
+		size_t seq;
+		int level;
+		const char *file;
+		int line;
+		struct timeval tv;
+		char text[LOG_LINE_MAX];
+	};
+	Log(const Log &);
+	Log &operator=(const Log &);
+	void init(size_t slots);
+	bool push(int level, const char *file, int line, const char *logline, va_list ap);
+	void format_line(string &out, const Slot &s) const;
+	void output(const string &lines);
+	static void *writer(void *arg);
+	static void forked();
+	void drain();
+	int fd;
+	bool ownfd;
+	int level;
+	Format format;
+	Slot *ring;
+	size_t slots;
+	size_t head;		/* the next slot to claim */
+	size_t tail;		/* the next slot for the writer */
+	pthread_t thread;
+	int wake[2];
+	volatile int sleeping;	/* the writer is waiting on wake[0] */
+	int running;		/* atomic: set by start(), cleared by stop() */
+	int producers;		/* atomic: threads in Write() with the ring */
+	unsigned long written, dropped, reported;
 };
 
 extern Log *logFacility;
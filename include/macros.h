@@ -97,6 +97,7 @@
 
 #define	SECONDS_PER_MINUTE	60
 #define	SECONDS_PER_HOUR	3600
+#define	SECONDS_PER_DAY		(24 * SECONDS_PER_HOUR)
 
 #define	FIRST_MINUTE	0
 #define	LAST_MINUTE	59
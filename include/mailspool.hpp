@@ -0,0 +1,162 @@
+/* Tinjac - mailspool.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file mailspool.hpp
+ *  @brief Spools job output, and mails it out as one digest per recipient
+ */
+
+
+#ifndef MAILSPOOL_HPP_
+#define MAILSPOOL_HPP_
+
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+#include "macros.h"
+#include "mailtransport.hpp"
+
+using namespace std;
+
+class Scheduler;
+
+/* where the daemon spools mail, and where it is moved to be sent */
+#define MAIL_SPOOL_FILE		"/var/spool/tinjac.mail"
+/* how often the spool is sent, unless TINJAC_MAIL_INTERVAL says */
+#define MAIL_INTERVAL		(15 * SECONDS_PER_MINUTE)
+/* the most of the spool that goes into one message */
+#define MAIL_DIGEST_MAX		(4 * 1024 * 1024)
+/* how long a record that couldn't be sent waits before it is tried
+ * again, doubling with each attempt up to MAIL_RETRY_MAX
+ */
+#define MAIL_RETRY		(5 * SECONDS_PER_MINUTE)
+#define MAIL_RETRY_MAX		(4 * SECONDS_PER_HOUR)
+/* after this many attempts, or this long, it goes to the dead letters */
+#define MAIL_ATTEMPTS_MAX	10
+#define MAIL_AGE_MAX		(5 * SECONDS_PER_DAY)
+
+/** @brief Collects job output on disk, and sends it in digests
+ *
+ * cron forks sendmail for every job that prints anything; a host with
+ * hundreds of chatty jobs a minute sends hundreds of mails a minute.
+ * Here add() appends the output to a spool file, a record at a time
+ * with a single write() to a file opened O_APPEND, and nothing else
+ * happens until the interval is up. flush() then renames the spool out
+ * of the way (new output goes to a fresh one), reads it back and sends
+ * each recipient one message with everything that was spooled for them,
+ * a section for each job, through the MailTransport.
+ *
+ * Once start()ed the sending is done on a thread of its own, so a
+ * sendmail or an SMTP server that takes its time never holds up the
+ * scheduler; flush() only asks for it.
+ *
+ * Records a recipient's transport wouldn't take go back on the spool,
+ * to be tried again after MAIL_RETRY, then twice that and so on. One
+ * that has been tried MAIL_ATTEMPTS_MAX times, or is MAIL_AGE_MAX old,
+ * is moved to the dead letter file (the spool's name with ".dead"),
+ * records as they were spooled, for someone to look at. A spool left
+ * part way through a flush by a crash is sent the next time round, and
+ * a record cut short by one is dropped.
+ */
+class MailSpool {
+public:
+	struct Stats {
+		unsigned long queued;		/* records added */
+		unsigned long messages;		/* digests sent */
+		unsigned long failed;		/* and not */
+		unsigned long dead;		/* records given up on */
+		unsigned long long bytes;	/* of output spooled */
+	};
+	MailSpool(const string &fname = MAIL_SPOOL_FILE);
+	~MailSpool();
+	/* open (or create) the spool. False if it can't be written */
+	bool open();
+	/* send on a thread, which tells sched when it is done. Without it
+	 * flush() sends the digests itself
+	 */
+	bool start(Scheduler *sched);
+	/* not owned, NULL to only spool */
+	void setTransport(MailTransport *transport) { this->transport = transport; }
+	void setInterval(time_t interval) { this->interval = interval; }
+	/* spool a job's output for to. False if it can't be, or either
+	 * address isn't safe to hand to sendmail or an SMTP server
+	 */
+	bool add(const string &to, const string &from, const string &subject, const string &body, time_t when);
+	/* send the digests if the interval is up, or now (records waiting
+	 * to be retried and all) if forced. The number of messages sent, 0
+	 * if it is left to the thread
+	 */
+	size_t flush(time_t now, bool force = false);
+	/* when flush() next has something to do, -1 if nothing is spooled
+	 * or the thread is still sending
+	 */
+	time_t nextFlush() const;
+	Stats getStats() const;
+	const string &getName() const { return this->fname; }
+	/* an address of only letters, digits and @._+-%, not starting with
+	 * a '-' (as cron's safe_p())
+	 */
+	static bool safeAddress(const string &address);
+private:
+	struct Record {
+		char magic[4];
+		uint32_t length;	/* of the strings that follow */
+		int64_t when;
+		int64_t retry;		/* not to be sent before */
+		uint32_t attempts;	/* that failed */
+		uint32_t tolen, fromlen, subjectlen, bodylen;
+		/* then to, from, subject and body, without terminators */
+	};
+	MailSpool(const MailSpool &);
+	MailSpool &operator=(const MailSpool &);
+	bool reopen();
+	bool append(const Record &r, const char *strings);
+	bool bury(const Record &r, const char *strings);
+	size_t deliver(time_t now, bool force);
+	size_t send(const string &fname, time_t now, bool force);
+	static void *loop(void *arg);
+	/* runs in the thread */
+	void work();
+	/* and this in the Scheduler's */
+	void processDone();
+	string fname;
+	MailTransport *transport;
+	time_t interval;
+	time_t last;		/* when it was last flushed */
+	Scheduler *sched;
+	pthread_t worker;
+	bool started;
+	bool sending;		/* the thread has a flush to do */
+	/* the rest is shared, under lock */
+	mutable pthread_mutex_t lock;
+	pthread_cond_t ready;
+	bool stopping;
+	bool wanted;		/* a flush for the thread */
+	time_t wantnow;
+	bool wantforce;
+	int fd;
+	bool pending;		/* something has been spooled since */
+	Stats stats;
+	int wake[2];
+};
+
+#endif /* MAILSPOOL_HPP_ */
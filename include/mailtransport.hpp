@@ -0,0 +1,98 @@
+/* Tinjac - mailtransport.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file mailtransport.hpp
+ *  @brief Ways of handing a finished mail message on for delivery
+ */
+
+
+#ifndef MAILTRANSPORT_HPP_
+#define MAILTRANSPORT_HPP_
+
+#include <string>
+
+using namespace std;
+
+#ifndef _PATH_SENDMAIL
+# define _PATH_SENDMAIL	"/usr/sbin/sendmail"
+#endif
+/* how long an SMTP server gets to answer each command */
+#define SMTP_TIMEOUT	30
+
+/** @brief Delivers a message the MailSpool has put together
+ *
+ * The message is complete, headers and body, with \n line ends; the
+ * transport does whatever its protocol needs to it. send() may well
+ * block, which is why a started MailSpool calls it from its own thread.
+ */
+class MailTransport {
+public:
+	virtual ~MailTransport() {}
+	/* false if it wasn't accepted, and should be tried again later */
+	virtual bool send(const string &from, const string &to, const string &message) = 0;
+	/* for the log */
+	virtual string describe() const = 0;
+};
+
+/** @brief Hands messages to sendmail(8), as cron does
+ *
+ * One sendmail for each message, which with digests is one for each
+ * recipient each time the spool is flushed rather than one for each job.
+ */
+class SendmailTransport : public MailTransport {
+public:
+	SendmailTransport(const string &path = _PATH_SENDMAIL) : path(path) {}
+	bool send(const string &from, const string &to, const string &message);
+	string describe() const { return this->path; }
+private:
+	string path;
+};
+
+/** @brief Speaks SMTP to a mail server, without starting any process
+ *
+ * A connection for each message: EHLO (or HELO), MAIL FROM, RCPT TO and
+ * DATA, with the message dot-stuffed and sent with \r\n line ends, then
+ * QUIT. Each reply has SMTP_TIMEOUT seconds to arrive. Point it at the
+ * local MTA, a smarthost, or a stand-in for testing.
+ */
+class SmtpTransport : public MailTransport {
+public:
+	SmtpTransport(const string &host = "localhost", int port = 25);
+	bool send(const string &from, const string &to, const string &message);
+	string describe() const;
+	/* host or host:port, as TINJAC_SMTP has it */
+	static SmtpTransport *parse(const char *spec);
+private:
+	bool connect();
+	bool command(const string &line, int expect);
+	bool reply(int expect);
+	bool writeAll(const string &data);
+	void disconnect();
+	string host;
+	int port;
+	int fd;
+	string buf;	/* read and not yet looked at */
+	string last;	/* the last reply, for the log */
+};
+
+#endif /* MAILTRANSPORT_HPP_ */
@@ -0,0 +1,68 @@
+/* Tinjac - mappedfile.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file mappedfile.hpp
+ *  @brief Read only view of a whole file, mmap'd where possible
+ */
+
+
+#ifndef MAPPEDFILE_HPP_
+#define MAPPEDFILE_HPP_
+
+#include <string>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+/** @brief A read only, contiguous view of a files contents
+ *
+ * The file is mmap'd when it is a regular, non-empty file. Anything that
+ * can't be mapped (pipes, /proc files, empty files) is read in one go
+ * into a heap buffer instead, so callers always get a single buffer to
+ * tokenize and never go through stdio.
+ *
+ * A mapping only stays good while the file is at least as long as it
+ * was: touching a page past a truncation is a SIGBUS. So a file that
+ * someone else may truncate under us, as crontab -e or an editor does
+ * to a crontab, is opened with map false, and read in whatever it is.
+ */
+class MappedFile {
+public:
+	MappedFile();
+	~MappedFile();
+	bool open(const string &fname, int flags = 0, bool map = true);
+	void close();
+	const char *data() const { return this->buffer; }
+	size_t size() const { return this->length; }
+	const struct stat &getStat() const { return this->sb; }
+private:
+	MappedFile(const MappedFile &);
+	MappedFile &operator=(const MappedFile &);
+	bool readAll(int fd);
+	char *buffer;
+	size_t length;
+	bool mapped;
+	struct stat sb;
+};
+
+#endif /* MAPPEDFILE_HPP_ */
@@ -0,0 +1,50 @@
+/* Tinjac - misc.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+** Portions Copyright:
+** Copyright 1988,1990,1993,1994 by Paul Vixie
+**
+** Copyright (c) 2004 by Internet Systems Consortium, Inc. ("ISC")
+** Copyright (c) 1997,2000 by Internet Software Consortium, Inc.
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file misc.hpp
+ *  @brief Assorted string and passwd helpers shared by the crontab code
+ */
+
+
+#ifndef MISC_HPP_
+#define MISC_HPP_
+
+#include <cstddef>
+#include <pwd.h>
+
+/* pw_dup() copies are reference counted so entries can share them;
+ * take another reference with pw_hold() and drop one with pw_release()
+ */
+struct passwd *pw_dup(const struct passwd *pw);
+struct passwd *pw_hold(struct passwd *pw);
+void pw_release(struct passwd *pw);
+unsigned int pw_refs(const struct passwd *pw);
+int glue_strings(char *buffer, size_t buffer_size, const char *a, const char *b, char separator);
+int strcmp_until(const char *left, const char *right, char until);
+
+#endif /* MISC_HPP_ */
@@ -0,0 +1,90 @@
+/* Tinjac - nextfire.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file nextfire.hpp
+ *  @brief Work out when a crontab entry is next due
+ */
+
+
+#ifndef NEXTFIRE_HPP_
+#define NEXTFIRE_HPP_
+
+#include <string>
+#include <ctime>
+#include <stdint.h>
+#include "crontabs.hpp"
+#include "timezone.hpp"
+
+using namespace std;
+
+/* how far ahead next() looks before giving up on an entry that can
+ * never fire (eg, 0 0 30 2 *). Feb 29th on a given weekday is the
+ * rarest thing that can still match, and that comes round well inside
+ * this.
+ */
+#define NEXTFIRE_MAX_YEARS	30
+
+/** @brief Next fire time for one crontab entry
+ *
+ * The entries bitsets are flattened into one integer mask per field when
+ * the calculator is built, so finding the next matching minute, hour,
+ * day or month is a single count-trailing-zeros instead of a walk over
+ * the bits. Day of month and day of week are combined per month with the
+ * Vixie rule: if either field was a '*' both have to match, otherwise
+ * either one will do.
+ *
+ * Times are worked out on the wall clock of the entries CRON_TZ (or the
+ * local zone if it has none). A wall time that falls in a DST gap fires
+ * once, at the end of the gap. A wall time that happens twice when the
+ * clocks go back only fires the first time around.
+ */
+class NextFireCalculator {
+public:
+	NextFireCalculator(const entry *e);
+	~NextFireCalculator();
+	/* next time the entry fires strictly after 'after', or -1 if never */
+	time_t next(time_t after) const;
+	/* for @period, when the period begun by a run at last is up */
+	time_t periodEnd(time_t last) const;
+	/* does the entry fire at this wall clock time? */
+	bool matches(const struct tm *tm) const;
+	const string &getTimeZone() const { return this->zone->getName(); }
+private:
+	struct wallclock {
+		int year, mon, mday, hour, min;
+	};
+	bool nextWall(wallclock *wc) const;
+	int wallToTime(const wallclock *wc, time_t notbefore, time_t *t) const;
+	time_t skipRepeated(time_t t) const;
+	uint64_t dayMask(int year, int mon) const;
+	uint64_t minutes;	/* bit n = minute n */
+	uint64_t hours;		/* bit n = hour n */
+	uint64_t months;	/* bit n = month n, 1 - 12 */
+	uint64_t doms;		/* bit n = day n, 1 - 31 */
+	uint64_t dows;		/* bit n = weekday n, Sunday is 0 */
+	uint64_t dowdays[7];	/* days of a month matching dow, by weekday of the 1st */
+	int flags;
+	int period;
+	TimeZone *zone;		/* shared by every entry with the same CRON_TZ */
+};
+
+#endif /* NEXTFIRE_HPP_ */
@@ -0,0 +1,111 @@
+/* Tinjac - outputcapture.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file outputcapture.hpp
+ *  @brief Keeps a bounded, filtered copy of a job's output
+ */
+
+
+#ifndef OUTPUTCAPTURE_HPP_
+#define OUTPUTCAPTURE_HPP_
+
+#include <string>
+#include <vector>
+#include <regex.h>
+
+using namespace std;
+
+/* what we keep of a job's output by default: its first and last bytes */
+#define CAPTURE_HEAD		(16 * 1024)
+#define CAPTURE_TAIL		(16 * 1024)
+/* the most a crontab can ask for with OUTPUT_HEAD or OUTPUT_TAIL */
+#define CAPTURE_MAX		(1024 * 1024)
+/* longer lines are filtered in pieces this long */
+#define CAPTURE_LINE_MAX	4096
+
+/** @brief A pipeline of regular expressions that output lines go through
+ *
+ * Each rule either keeps only the lines that match it, or drops the ones
+ * that do; a line has to get past every rule, in order. The expressions
+ * are POSIX extended ones, compiled once when they are added.
+ */
+class OutputFilter {
+public:
+	enum Action { KEEP, DROP };
+	OutputFilter();
+	~OutputFilter();
+	/* false (with the error in err) if pattern doesn't compile */
+	bool add(const char *pattern, Action action, string *err = NULL);
+	/* does this (\0 terminated) line get through */
+	bool pass(const char *line) const;
+	bool empty() const { return this->rules.empty(); }
+private:
+	struct Rule {
+		regex_t re;
+		Action action;
+	};
+	OutputFilter(const OutputFilter &);
+	OutputFilter &operator=(const OutputFilter &);
+	vector<Rule *> rules;
+};
+
+/** @brief The part of a job's output worth keeping, in bounded memory
+ *
+ * Output is fed in as it is read, split into lines and put through the
+ * filter, if there is one. Of what gets through, the first head bytes are
+ * kept as they are and after that the last tail bytes are kept in a ring,
+ * so a job writing gigabytes costs no more than head + tail bytes (plus a
+ * line) and nothing goes to disk. Neither buffer is allocated until there
+ * is something to put in it.
+ */
+class OutputCapture {
+public:
+	struct Stats {
+		unsigned long lines;		/* lines seen, filtered or not */
+		unsigned long dropped;		/* and those the filter threw away */
+		unsigned long long kept;	/* bytes that got through */
+		unsigned long long omitted;	/* of those, bytes lost between head and tail */
+	};
+	OutputCapture(size_t head = CAPTURE_HEAD, size_t tail = CAPTURE_TAIL, const OutputFilter *filter = NULL);
+	void feed(const char *buf, size_t len);
+	/* the job is done, so is any line it didn't finish */
+	void finish();
+	/* what was kept: the head, a note of how much was left out, and the
+	 * tail
+	 */
+	string text() const;
+	bool empty() const { return (this->stats.kept == 0); }
+	const Stats &getStats() const { return this->stats; }
+private:
+	void line();
+	void keep(const char *buf, size_t len);
+	size_t headmax, tailmax;
+	const OutputFilter *filter;
+	string head;
+	vector<char> tail;		/* a ring, once the head is full */
+	size_t tailpos;			/* where the next byte goes */
+	size_t tailfill;		/* bytes in it, up to tailmax */
+	vector<char> partial;		/* the line being read, when filtering */
+	Stats stats;
+};
+
+#endif /* OUTPUTCAPTURE_HPP_ */
@@ -0,0 +1,224 @@
+/* Tinjac - runhistory.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file runhistory.hpp
+ *  @brief Keeps a record of every run, on disk and indexed in memory
+ */
+
+
+#ifndef RUNHISTORY_HPP_
+#define RUNHISTORY_HPP_
+
+#include <string>
+#include <deque>
+#include <map>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include "macros.h"
+
+using namespace std;
+
+/* where the daemon keeps the history, a directory of segments */
+#define HISTORY_DIR		"/var/spool/tinjac.history"
+/* the runs of each job that are kept, unless TINJAC_HISTORY_KEEP says */
+#define HISTORY_KEEP		100
+/* how often what was added is written and synced */
+#define HISTORY_INTERVAL	1
+/* and the most that is held back until then */
+#define HISTORY_BUFFER_MAX	(256 * 1024)
+/* a segment is closed, and the next one started, past this size */
+#define HISTORY_SEGMENT_MAX	(4 * 1024 * 1024)
+/* the closed segments there can be before they are compacted */
+#define HISTORY_SEGMENTS	8
+/* the longest a job's name can be */
+#define HISTORY_NAME_MAX	(64 * 1024)
+
+/* fills in the jobs that are still in a crontab, false if it can't say */
+typedef boost::function<bool (boost::unordered_set<string> &)> LiveJobsCallback;
+
+/** @brief A history of the runs of every job
+ *
+ * cron forgets a job as soon as it has exited, and anacron keeps no more
+ * than the day each job last ran. Here every run is recorded: when it
+ * started and finished, how it ended, the CPU and memory it used, and a
+ * digest of its output, so that a change in what a job prints shows up
+ * without keeping all of it.
+ *
+ * On disk the history is a directory of segments, each a run of
+ * records appended to the end. add() only puts a record in a buffer;
+ * commit() writes everything buffered with one write() and syncs it
+ * with one fdatasync(), once a second, or sooner if the buffer fills, so
+ * thousands of runs a second cost a sync a second. A crash loses at most
+ * the last interval (and what the writer hadn't got to), and a record
+ * it cut short is dropped when the history is next opened.
+ *
+ * A segment is closed when it reaches HISTORY_SEGMENT_MAX, and once
+ * there are HISTORY_SEGMENTS of them (and they hold at least as much as
+ * the base) they are compacted: the runs still kept are written to a new
+ * base segment, which replaces them and the base before it. Compaction
+ * so never writes more than twice what was added. The runs of jobs that
+ * are no longer in any crontab, by the LiveJobsCallback, are dropped
+ * then, so jobs that come and go don't pile up.
+ *
+ * Once start()ed the writing, syncing and compacting is done on a
+ * thread of its own, so a slow disk never holds up the scheduler:
+ * commit() hands the thread what was buffered, and the records of a
+ * compaction, in order. Which segment is closed, and when it's time to
+ * compact, is still worked out here, so that a base holds exactly what
+ * the segments it replaces did.
+ *
+ * In memory the last keep runs of each job are indexed by the job, and
+ * every run kept is indexed by when it finished, so last() and between()
+ * only copy out what they return.
+ */
+class RunHistory {
+public:
+	/* one run of a job. Fixed size, as it is written as it is */
+	struct Run {
+		enum Flags {
+			UNSTARTED = 0x1,	/* status is the errno it failed with */
+			URL = 0x2,		/* a request, with no process */
+			DATABASE = 0x4		/* SQL, with no process either */
+		};
+		int64_t started, finished;	/* in microseconds since the epoch */
+		int64_t utime, stime;		/* microseconds of CPU */
+		uint64_t outbytes;		/* written, whether they were kept or not */
+		uint64_t digest;		/* of the output kept, 0 for none */
+		int32_t status;			/* as from waitpid() */
+		uint32_t flags;
+		uint32_t maxrss;		/* kilobytes */
+		uint32_t majflt;
+	};
+	struct Stats {
+		unsigned long added;		/* runs */
+		unsigned long commits;		/* writes, and syncs */
+		unsigned long lost;		/* runs that couldn't be written */
+		unsigned long segments;		/* closed */
+		unsigned long compactions;
+		unsigned long long bytes;	/* written */
+	};
+	RunHistory(const string &dir = HISTORY_DIR);
+	~RunHistory();
+	/* read (or create) the history, and open a segment to add to. False
+	 * if it can't be written, when runs are only kept in memory
+	 */
+	bool open();
+	/* write on a thread of its own from now on, after open(). Without
+	 * it commit() writes and syncs itself
+	 */
+	bool start();
+	void setKeep(size_t keep) { this->keep = keep > 0 ? keep : 1; }
+	void setInterval(time_t interval) { this->interval = interval; }
+	/* asked at each compaction; without it every job is kept */
+	void setLiveJobs(LiveJobsCallback cb) { this->livejobs = cb; }
+	/* a run of job, written out at the next commit() */
+	void add(const string &job, const Run &run);
+	/* write and sync what has been added, if the interval is up or now if
+	 * forced. The number of runs written, or handed to the thread
+	 */
+	size_t commit(time_t now, bool force = false);
+	/* when commit() next has something to do, -1 if nothing is waiting */
+	time_t nextCommit() const;
+	/* the last n runs of job, the latest first */
+	size_t last(const string &job, size_t n, vector<Run> &out) const;
+	/* when job last started, -1 if it never has (as far as we know) */
+	time_t lastRun(const string &job) const;
+	/* the runs kept that finished in [from, to), in order, with their jobs */
+	size_t between(int64_t from, int64_t to, vector<pair<string, Run> > &out) const;
+	/* the jobs, and the runs kept in all */
+	size_t jobs() const { return this->byjob.size(); }
+	size_t size() const { return this->bytime.size(); }
+	Stats getStats() const;
+	void logStats() const;
+	/* what a job is known by: its crontab, user and command */
+	static string jobId(const string &fname, const string &user, const string &cmd) { return (fname + ":" + user + ":" + cmd); }
+	/* a digest of a job's output, FNV-1a, never 0 for some output */
+	static uint64_t digest(const string &output);
+private:
+	struct Record {
+		char magic[4];
+		uint32_t length;	/* of the job's name, which follows */
+		Run run;
+	};
+	/* what commit() hands the writer */
+	struct Batch {
+		string records;
+		size_t runs;
+		bool close;		/* the segment is full after them */
+		bool compact;		/* and base replaces every segment so far */
+		string base;
+	};
+	typedef deque<Run> Runs;
+	typedef boost::unordered_map<string, Runs> Jobs;
+	/* the job and run for each time; runs don't move in a deque when
+	 * others are added to or taken off its ends, or jobs in the map
+	 */
+	typedef multimap<int64_t, pair<const string *, const Run *> > Times;
+	RunHistory(const RunHistory &);
+	RunHistory &operator=(const RunHistory &);
+	void index(const string &job, const Run &run);
+	void unindex(const Run *run);
+	size_t prune();
+	void append(string &buf, const string &job, const Run &run) const;
+	bool load(const string &path, bool base, bool last);
+	bool openSegment();
+	bool writeAll(int fd, const string &buf, const string &path);
+	static void *loop(void *arg);
+	/* runs in the thread, or in commit() without one */
+	void work();
+	void write(const Batch &batch);
+	void compact(const string &buf);
+	string segment(unsigned long seq, const char *kind) const;
+	string dir;
+	bool opened;		/* there is somewhere to write to */
+	size_t basesize;	/* of the base segment, as handed to the writer */
+	unsigned long closed;	/* segments since it */
+	size_t written;		/* to the segment being added to */
+	string buffer;		/* what is waiting for commit() */
+	size_t waiting;		/* runs in it */
+	size_t keep;
+	time_t interval;
+	time_t committed;	/* when it was last committed */
+	LiveJobsCallback livejobs;
+	Jobs byjob;
+	Times bytime;
+	/* the writer's */
+	int fd;			/* the segment being added to */
+	unsigned long seq;	/* its number */
+	unsigned long base;	/* the base segment's, 0 for none */
+	size_t ondisk;		/* what the segment holds, should a write fail */
+	pthread_t writer;
+	bool started;
+	/* the rest is shared, under lock */
+	mutable pthread_mutex_t lock;
+	pthread_cond_t ready;
+	deque<Batch *> queue;
+	bool stopping;
+	Stats stats;
+};
+
+#endif /* RUNHISTORY_HPP_ */
@@ -0,0 +1,184 @@
+/* Tinjac - scheduler.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file scheduler.hpp
+ *  @brief Deadline ordered queue of crontab entries
+ */
+
+
+#ifndef SCHEDULER_HPP_
+#define SCHEDULER_HPP_
+
+#include <ctime>
+#include <vector>
+#include <map>
+#include <boost/function.hpp>
+#include "crontabs.hpp"
+#include "nextfire.hpp"
+
+using namespace std;
+
+/* how long before an @period run that hasn't happened is tried again,
+ * as cronie's hourly 0anacron would
+ */
+#define PERIOD_RETRY	SECONDS_PER_HOUR
+/* which boot the @reboot jobs last ran for, and this boot */
+#define REBOOT_MARKER	"/var/run/tinjac.reboot"
+#define BOOT_ID_FILE	"/proc/sys/kernel/random/boot_id"
+
+/** @brief One entry on the schedule
+ *
+ * Owned by the Scheduler. The entry and file it points at are owned by
+ * the crontabs database.
+ *
+ * An entry with a spread window (@hourly~15m, or SPREAD=15m in the
+ * crontab) fires that far into the window every time. The offset is a
+ * hash of the host, the crontab, the user and the command, so it stays
+ * put across reloads and restarts, while a crowd of "0 * * * *" jobs, or
+ * the same job on every host in a fleet, is spread over the window
+ * rather than all starting in the same second.
+ *
+ * An @period job is due a period after it last ran, as anacron's are;
+ * when that was comes from the Scheduler's LastRunCallback, so a run
+ * that fell due while the daemon was down is caught up on as soon as it
+ * is back. Each run is put off by a random part of its ~delay, so that a
+ * host coming up doesn't start all of them in the same second.
+ *
+ * A run handed out isn't taken as having happened: the job is asked
+ * about again PERIOD_RETRY later (or a period, if that is shorter), and
+ * runs again then unless the callback says it has started since. A run
+ * that was skipped or couldn't start is so tried again.
+ */
+class ScheduledJob {
+public:
+	ScheduledJob(entry *e, CrontabFile *file);
+	~ScheduledJob();
+	/* next fire time strictly after 'after', offset included, or -1 */
+	time_t next(time_t after) const;
+	/* how far into its spread window e fires on host (this one if NULL) */
+	static time_t spreadOffset(const entry *e, const string &fname, const char *host = NULL);
+	entry *e;
+	CrontabFile *file;
+	NextFireCalculator calc;
+	time_t offset;		/* into its spread window */
+	time_t when;		/* next fire time, -1 if it's not on the queue */
+	time_t last;		/* for @period, when it last ran, -1 if it never has */
+	bool cancelled;		/* file was removed, drop it when it's popped */
+private:
+	ScheduledJob(const ScheduledJob &);
+	ScheduledJob &operator=(const ScheduledJob &);
+};
+
+typedef boost::function<void (ScheduledJob *, time_t)> JobCallback;
+typedef boost::function<void (time_t)> IdleCallback;
+/* when an @period job last ran, -1 if it never has */
+typedef boost::function<time_t (const entry *e, const string &fname)> LastRunCallback;
+typedef boost::function<void ()> FdCallback;
+
+/** @brief Min-heap of entries keyed on their next fire time
+ *
+ * Every entry's next fire time is worked out once, when it is added, and
+ * again each time it fires, so a tick only touches the entries that are
+ * due (O(due * log n)) instead of scanning the whole database every
+ * minute the way cron's find_jobs() does. run() sleeps until the
+ * earliest deadline rather than waking up every minute.
+ *
+ * Removing a file only marks its jobs cancelled; they are freed as they
+ * come off the top of the heap, or all at once when enough of them pile
+ * up. Replacing a file (on reload) keeps the jobs whose entries haven't
+ * changed, along with their place on the heap.
+ *
+ * run() also waits on any file descriptors registered with watchFd(),
+ * and calls their callbacks when they become readable. On Linux they are
+ * kept in an epoll set, so a wakeup costs the same with thousands of job
+ * pipes watched as with one; elsewhere they are poll()ed.
+ */
+class Scheduler {
+public:
+	Scheduler();
+	~Scheduler();
+	/* called for each @period job as it is added */
+	void setLastRun(LastRunCallback cb) { this->lastrun = cb; }
+	void addFile(CrontabFile *file, time_t now);
+	void removeFile(CrontabFile *file);
+	/* file is a reload of old: jobs for entries that are the same in
+	 * both carry on as they were, the rest are dropped or added.
+	 * Returns how many were kept.
+	 */
+	size_t replaceFile(CrontabFile *old, CrontabFile *file, time_t now);
+	/* earliest deadline on the queue, -1 if there is nothing to run */
+	time_t nextDeadline();
+	/* pop every job due at now, reschedule it and add it to due */
+	size_t runDue(time_t now, vector<ScheduledJob *> &due);
+	/* the @reboot jobs that have been added so far */
+	size_t rebootJobs(vector<ScheduledJob *> &jobs) const;
+	/* whether this is the first start since the machine booted, so the
+	 * @reboot jobs are due, rather than a restart. The boot is marked as
+	 * seen in marker; without a boot id that is just the marker being
+	 * there, as with cronie, which relies on /var/run being emptied at
+	 * boot.
+	 */
+	static bool firstSinceBoot(const char *marker = REBOOT_MARKER, const char *bootid = BOOT_ID_FILE);
+	/* sleep until each deadline and hand the due jobs to cb, until stop() */
+	void run(JobCallback cb);
+	void stop() { this->running = false; }
+	/* called by run() with the time whenever it is about to sleep, and
+	 * at least every interval seconds if that isn't 0
+	 */
+	void setIdle(IdleCallback cb, time_t interval = 0) { this->idle = cb; this->idleinterval = interval; }
+	/* and by when, if that is sooner than the next job or interval */
+	void wakeAt(time_t when) { if (this->wake == -1 || when < this->wake) this->wake = when; }
+	/* have run() call cb whenever fd is readable */
+	void watchFd(int fd, FdCallback cb);
+	void unwatchFd(int fd);
+	size_t watchCount() const { return this->fds.size(); }
+	size_t size() const { return this->live; }
+private:
+	struct HeapNode {
+		time_t when;
+		ScheduledJob *job;
+	};
+	struct Later {
+		bool operator()(const HeapNode &a, const HeapNode &b) const { return a.when > b.when; }
+	};
+	Scheduler(const Scheduler &);
+	Scheduler &operator=(const Scheduler &);
+	void push(ScheduledJob *job);
+	ScheduledJob *create(entry *e, CrontabFile *file, time_t now);
+	bool period(ScheduledJob *job, time_t now);
+	void cancel(ScheduledJob *job);
+	void compact();
+	bool wait(time_t deadline);
+	vector<HeapNode> heap;
+	map<CrontabFile *, vector<ScheduledJob *> > byfile;
+	size_t live;		/* jobs belonging to a loaded file */
+	size_t dead;		/* cancelled jobs still on the heap */
+	IdleCallback idle;
+	LastRunCallback lastrun;
+	time_t idleinterval;
+	time_t wake;		/* when the idle callback asked for, or -1 */
+	map<int, FdCallback> fds;
+	int epfd;		/* epoll set of the fds, -1 to poll() them */
+	volatile bool running;
+};
+
+#endif /* SCHEDULER_HPP_ */
@@ -0,0 +1,155 @@
+/* Tinjac - spawner.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file spawner.hpp
+ *  @brief Launches jobs from a small helper process
+ */
+
+
+#ifndef SPAWNER_HPP_
+#define SPAWNER_HPP_
+
+#include <map>
+#include <vector>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdint.h>
+#include <boost/function.hpp>
+#include "crontabs.hpp"
+
+using namespace std;
+
+class Scheduler;
+
+/* largest spawn request (command and environment) we will send */
+#define SPAWN_MAX_REQUEST	(64 * 1024)
+/* descriptors a job can be given: stdin, stdout and stderr, and the
+ * cgroup.procs of a cgroup it joins
+ */
+#define SPAWN_FDS		4
+#define SPAWN_CGROUP		3
+
+/** @brief Runs jobs for the daemon, from a process that stays small
+ *
+ * cron's do_command() fork()s the whole daemon for every job, and the
+ * child fork()s again for the job itself; copying the page tables of a
+ * daemon with a large crontab database costs more the more it has
+ * loaded. Instead start() forks a helper once, before the crontabs are
+ * loaded, and jobs are sent to it over a socketpair. The helper vfork()s
+ * each job (which copies nothing) and sets up its user, groups, directory
+ * and stdio before the exec. It reaps its children as a signalfd (a
+ * SIGCHLD handler elsewhere) says they exit, and sends back when each job
+ * started and how it exited, with its rusage.
+ *
+ * Replies come in on getFd(), which the Scheduler watches; processReplies()
+ * reads them and calls the callbacks. A helper that goes away isn't
+ * replaced: by then the daemon has threads, and a child forked from it
+ * could block forever on a lock one of them held. The GoneCallback is
+ * told instead, and the daemon exits to be started again.
+ */
+class Spawner {
+public:
+	typedef unsigned long JobId;
+	/* pid is -1 if the job couldn't be started, with errno in status */
+	typedef boost::function<void (JobId id, pid_t pid, int status)> StartCallback;
+	/* status as from waitpid(), with the job's resource usage. status is
+	 * -1 and usage NULL if the helper died and we'll never know
+	 */
+	typedef boost::function<void (JobId id, pid_t pid, int status, const struct rusage *usage)> ExitCallback;
+	/* the helper has gone, and nothing more can be spawned */
+	typedef boost::function<void ()> GoneCallback;
+	struct Stats {
+		unsigned long spawned;		/* requests sent */
+		unsigned long started;		/* jobs the helper started */
+		unsigned long failed;		/* and those it couldn't */
+		unsigned long exited;
+	};
+	Spawner();
+	~Spawner();
+	/* fork the helper. Do this early, while the daemon is small and
+	 * before it has any threads; it is only done the once
+	 */
+	bool start();
+	/* watch for replies from the Scheduler's loop */
+	void setScheduler(Scheduler *sched) { this->sched = sched; }
+	void stop();
+	/* run e's command as its user. The job's stdout and stderr go to
+	 * outfd if there is one, /dev/null otherwise, and its stdin comes from
+	 * infd or /dev/null. With an errfd, stderr goes there instead. With a
+	 * cgroupfd, the job writes itself into that cgroup.procs before it
+	 * execs. 0 if it can't be sent, or the helper has gone.
+	 */
+	JobId spawn(const entry *e, int outfd = -1, int infd = -1, int errfd = -1, int cgroupfd = -1);
+	int getFd() const { return this->fd; }
+	/* the id the next spawn() will have */
+	JobId nextId() const { return this->nextid; }
+	/* an id for a job that runs without a process, from the same sequence */
+	JobId takeId() { return this->nextid++; }
+	void processReplies();
+	void setStarted(StartCallback cb) { this->started = cb; }
+	void setExited(ExitCallback cb) { this->exited = cb; }
+	void setGone(GoneCallback cb) { this->gone = cb; }
+	/* jobs sent that haven't exited yet */
+	size_t running() const { return this->jobs.size(); }
+	const Stats &getStats() const { return this->stats; }
+	pid_t getHelperPid() const { return this->helper; }
+private:
+	struct Request {
+		uint64_t id;
+		uint32_t uid, gid;
+		uint32_t nenv;
+		int32_t fds;	/* bit i set if descriptor i was sent */
+		/* then the user, home directory, shell, command and nenv
+		 * environment strings, each \0 terminated
+		 */
+	};
+	struct Reply {
+		uint64_t id;
+		int32_t type;
+#define SPAWN_STARTED	1
+#define SPAWN_FAILED	2
+#define SPAWN_EXITED	3
+		int32_t pid;
+		int32_t status;
+		struct rusage usage;	/* of a job that has exited */
+	};
+	Spawner(const Spawner &);
+	Spawner &operator=(const Spawner &);
+	static void helperMain(int fd);
+	static void reply(int fd, uint64_t id, int type, pid_t pid, int status, const struct rusage *usage = NULL);
+	static bool runJob(int fd, const char *msg, size_t len, const int *passed, int npassed,
+		map<pid_t, uint64_t> &children, int devnull, vector<gid_t> &groups);
+	bool send(const entry *e, JobId id, const int *fds);
+	void helperGone();
+	Scheduler *sched;
+	int fd;			/* our end of the socketpair */
+	pid_t helper;
+	JobId nextid;
+	map<JobId, pid_t> jobs;	/* sent and not yet exited, 0 until started */
+	StartCallback started;
+	ExitCallback exited;
+	GoneCallback gone;
+	Stats stats;
+};
+
+#endif /* SPAWNER_HPP_ */
@@ -0,0 +1,178 @@
+/* Tinjac - supervisor.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file supervisor.hpp
+ *  @brief Follows each running job until it exits and its output ends
+ */
+
+
+#ifndef SUPERVISOR_HPP_
+#define SUPERVISOR_HPP_
+
+#include <string>
+#include <map>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <boost/function.hpp>
+#include "crontabs.hpp"
+#include "spawner.hpp"
+#include "outputcapture.hpp"
+#include "cgroups.hpp"
+#include "webcron.hpp"
+#include "dbcron.hpp"
+
+using namespace std;
+
+class Scheduler;
+
+/** @brief Watches every job the daemon runs, from the Scheduler's loop
+ *
+ * cron forks a process per job that sits in wait() and reads the job's
+ * output, so a thousand running jobs cost a thousand extra processes.
+ * Here run() gives each job a pipe for its stdout and stderr and the read
+ * end is watched by the Scheduler along with everything else (one epoll
+ * set), while the Spawner's helper reaps the job and sends back its exit
+ * status and rusage. Once both the exit and the end of the output have
+ * been seen the run is complete and the done callback gets its JobRun.
+ *
+ * The output is kept in an OutputCapture as it is read. A crontab can set
+ * OUTPUT_KEEP and OUTPUT_DROP to regular expressions for the lines to keep
+ * or throw away, and OUTPUT_HEAD and OUTPUT_TAIL to how many bytes of the
+ * start and end of it to keep. Each distinct pair of expressions is
+ * compiled once, and shared by every job that uses it.
+ *
+ * With Cgroups set up each job runs in a cgroup of its own, and what the
+ * cgroup used (which counts everything the job started, not only what it
+ * waited for) is read back into the JobRun when the job exits.
+ *
+ * With a WebCron, a job whose command is an http:// or https:// URL is
+ * a request made by it instead of a process, and finishes with its
+ * response: the body is the output, and a 2xx status exits 0. HTTP_METHOD
+ * and HTTP_TIMEOUT set the method and how long it may take.
+ *
+ * Likewise with a DbCron, a job whose command starts with a database
+ * (sqlite:/path, postgresql://...) has the rest of it run as SQL on a
+ * pooled connection, and exits 0 if it all ran. DB_TIMEOUT says how long
+ * it may take. The connection isn't the job's user's, so only the
+ * daemon's own user's entries can be database jobs.
+ *
+ * A JobRun copies what it needs from the entry, which may be gone (the
+ * crontab reloaded) by the time the job finishes.
+ */
+class Supervisor {
+public:
+	struct JobRun {
+		Spawner::JobId id;
+		string fname;		/* the crontab */
+		int lineno;
+		string user;
+		string cmd;
+		/* who its output is mailed to (MAILTO, or the user), empty
+		 * for nobody, and who from (MAILFROM, or root)
+		 */
+		string mailto, mailfrom;
+		pid_t pid;		/* -1 if it couldn't be started */
+		struct timeval started, finished;
+		/* as from waitpid(), or the errno if it couldn't be started,
+		 * or -1 if we never found out
+		 */
+		int status;
+		struct rusage usage;
+		bool contained;		/* in a cgroup, with its cgusage */
+		Cgroups::Usage cgusage;
+		unsigned long long outbytes;
+		OutputCapture output;
+		/* a URL job has no process; its response's status, 0 if there
+		 * wasn't one, and why not
+		 */
+		bool url;
+		int httpstatus;
+		string httperror;
+		/* a database job has no process either; the rows it returned
+		 * and changed, and its error if it had one
+		 */
+		bool database;
+		unsigned long dbrows, dbchanges;
+		string dberror;
+		int outfd;		/* the read end of its output, until EOF */
+		bool exited;
+	};
+	typedef boost::function<void (const JobRun &run)> DoneCallback;
+	struct Stats {
+		unsigned long started;
+		unsigned long finished;
+		unsigned long long outbytes;
+	};
+	/* takes over spawner's callbacks */
+	Supervisor(Spawner *spawner, Scheduler *sched);
+	~Supervisor();
+	/* run e's command, 0 if it couldn't be. Its stdin comes from infd,
+	 * if there is one. With a stdoutfd its stdout goes there and only
+	 * stderr is captured.
+	 */
+	Spawner::JobId run(const entry *e, const string &fname, int infd = -1, int stdoutfd = -1);
+	void setDone(DoneCallback cb) { this->done = cb; }
+	/* signal a running job's process group, false if it hasn't started
+	 * or has exited
+	 */
+	bool kill(Spawner::JobId id, int sig);
+	/* contain jobs in cgroups, if it is enabled() */
+	void setCgroups(Cgroups *cgroups) { this->cgroups = cgroups; }
+	/* make the requests of URL jobs, once it is started */
+	void setWebCron(WebCron *webcron);
+	/* and the SQL of database jobs */
+	void setDbCron(DbCron *dbcron);
+	/* how much output to keep of jobs that don't say */
+	void setCapture(size_t head, size_t tail) { this->headmax = head; this->tailmax = tail; }
+	/* runs that aren't complete yet */
+	size_t running() const { return this->runs.size(); }
+	const Stats &getStats() const { return this->stats; }
+private:
+	Supervisor(const Supervisor &);
+	Supervisor &operator=(const Supervisor &);
+	void jobStarted(Spawner::JobId id, pid_t pid, int err);
+	void jobExited(Spawner::JobId id, pid_t pid, int status, const struct rusage *usage);
+	void readOutput(Spawner::JobId id);
+	void closeOutput(JobRun &run);
+	void leaveCgroup(JobRun &run);
+	void finish(map<Spawner::JobId, JobRun>::iterator it);
+	JobRun &newRun(Spawner::JobId id, const entry *e, const string &fname);
+	Spawner::JobId fetch(const entry *e, const string &fname);
+	void fetched(const WebCron::Response &response);
+	Spawner::JobId query(const entry *e, const string &fname);
+	void queried(const DbCron::Response &response);
+	const OutputFilter *getFilter(const char *keep, const char *drop);
+	Spawner *spawner;
+	Scheduler *sched;
+	Cgroups *cgroups;
+	WebCron *webcron;
+	DbCron *dbcron;
+	map<Spawner::JobId, JobRun> runs;
+	size_t headmax, tailmax;
+	/* by OUTPUT_KEEP and OUTPUT_DROP, NULL if they didn't compile */
+	map<string, OutputFilter *> filters;
+	DoneCallback done;
+	Stats stats;
+};
+
+#endif /* SUPERVISOR_HPP_ */
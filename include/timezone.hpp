@@ -0,0 +1,127 @@
+/* Tinjac - timezone.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file timezone.hpp
+ *  @brief Cached UTC offset tables for the zones crontabs ask for
+ */
+
+
+#ifndef TIMEZONE_HPP_
+#define TIMEZONE_HPP_
+
+#include <string>
+#include <vector>
+#include <map>
+#include <ctime>
+
+using namespace std;
+
+/* where the tzfiles are, unless TZDIR says */
+#define ZONEINFO_DIR	"/usr/share/zoneinfo"
+/* the zone when TZ isn't set */
+#define ZONEINFO_LOCAL	"/etc/localtime"
+/* bigger than any real tzfile */
+#define ZONEINFO_MAX	(1024 * 1024)
+
+/** @brief A time zone as a table of UTC offset transitions
+ *
+ * cron's maketime() does a setenv("TZ") and localtime() for every entry
+ * on every tick, writing libc's global zone state each time. Instead
+ * each distinct CRON_TZ gets one TimeZone, shared by every entry that
+ * names it. Its tzfile is read once, when it is first named, and its
+ * offsets are worked out from that alone, with the POSIX TZ rule at the
+ * end of the file for times after its last transition. The process TZ
+ * is never touched, so the threads that read the environment or call
+ * localtime() never see it change. A name that isn't a tzfile is taken
+ * as a POSIX TZ string, and one that is neither as UTC.
+ *
+ * The table is the tzfile's transitions, with the rule's changes added
+ * a year at a time as later times are asked for (or earlier ones, for a
+ * zone that is nothing but a rule). Converting a time is a binary
+ * search of it and some arithmetic.
+ */
+class TimeZone {
+public:
+	/* the shared zone for name, "" being the daemons own TZ */
+	static TimeZone *get(const string &name);
+	const string &getName() const { return this->name; }
+	/* seconds east of UTC at t */
+	long offset(time_t t) const;
+	/* like localtime_r(), sets the tm_year to tm_isdst fields */
+	struct tm *toWall(time_t t, struct tm *tm) const;
+	/* the first offset change after t, -1 if none is known */
+	time_t nextTransition(time_t t) const;
+	/* the last offset change at or before t, -1 if none is known */
+	time_t lastTransition(time_t t) const;
+	/* seconds since the epoch of a wall clock time, as if it were UTC */
+	static time_t civilSeconds(int year, int mon, int mday, int hour, int min);
+	/* and back again, sets tm_year to tm_yday */
+	static void civilFromSeconds(time_t secs, struct tm *tm);
+private:
+	TimeZone(const string &name);
+	~TimeZone();
+	TimeZone(const TimeZone &);
+	TimeZone &operator=(const TimeZone &);
+	struct Transition {
+		time_t at;	/* first second with the new offset */
+		long off;
+		int isdst;
+	};
+	/* a POSIX TZ string, as ends a tzfile */
+	struct Rule {
+		struct Date {
+			char kind;	/* 'J' (Julian, no leap day), 'D' (from 0) or 'M' */
+			int mon, week, day;	/* day alone for 'J' and 'D' */
+			long time;	/* seconds after local midnight */
+		};
+		long stdoff, dstoff;	/* seconds east of UTC */
+		bool dst;		/* false if it is stdoff all year */
+		Date start, end;	/* of summer time */
+	};
+	size_t find(time_t t) const;
+	void cover(time_t t) const;
+	void ruleYear(int year, vector<Transition> &found) const;
+	bool readFile(const string &path);
+	static bool parseRule(const char *s, Rule *rule);
+	static const char *parseDate(const char *s, Rule::Date *date);
+	static time_t ruleTime(const Rule::Date &date, int year, long off);
+	string name;		/* what TZ is set to, "" for the local zone */
+	/* what the tzfile says: the offset before its first transition,
+	 * then each transition, then the rule if it has one
+	 */
+	long dataoff;
+	int datadst;
+	vector<Transition> data;
+	Rule rule;
+	bool hasrule;
+	/* offsets in force from the start of the table, then after each
+	 * transition. Filled in lazily, hence mutable.
+	 */
+	mutable long firstoff;
+	mutable int firstdst;
+	mutable vector<Transition> table;
+	mutable bool loaded;
+	mutable int from, until;	/* years of the rule in the table, until not included */
+	static map<string, TimeZone *> zones;
+};
+
+#endif /* TIMEZONE_HPP_ */
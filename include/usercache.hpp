@@ -0,0 +1,155 @@
+/* Tinjac - usercache.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file usercache.hpp
+ *  @brief Shared, refreshed passwd records for the users crontabs run as
+ */
+
+
+#ifndef USERCACHE_HPP_
+#define USERCACHE_HPP_
+
+#include <string>
+#include <map>
+#include <deque>
+#include <ctime>
+#include <pwd.h>
+#include <pthread.h>
+#include <boost/function.hpp>
+#include "macros.h"
+
+using namespace std;
+
+class Scheduler;
+
+/* how long a user is trusted before it is looked up again */
+#define USERCACHE_TTL		(10 * SECONDS_PER_MINUTE)
+/* and how long a user that doesn't exist is remembered */
+#define USERCACHE_NEG_TTL	SECONDS_PER_MINUTE
+/* most stale users refresh() looks up itself, without the thread */
+#define USERCACHE_REFRESH_MAX	16
+/* how often refresh() looks at /etc/passwd and for stale users */
+#define USERCACHE_CHECK		30
+
+/** @brief Cache of passwd lookups, one shared record per user
+ *
+ * cron calls getpwnam() for every line of a system crontab, then copies
+ * the result into each entry. With NSS backed by LDAP or SSSD that is a
+ * network round trip per line. Here each user is looked up once, and
+ * every entry that runs as them holds a reference to the same pw_dup()
+ * record, which is never modified once it has been handed out.
+ *
+ * A record that has outlived its TTL is still handed out as it is;
+ * refresh() has it looked up again later, off the job path (the
+ * scheduler calls it before it goes to sleep, and it does anything at
+ * most every USERCACHE_CHECK seconds). Once start()ed the lookups are
+ * made on a thread of its own, so a slow directory server never holds
+ * up the scheduler, and the answers come back on the scheduler's
+ * thread. Then every stale user is asked about at once, and so is a
+ * user get() hasn't seen before: it returns NULL, looking() says why,
+ * and the ChangedCallback is told when the answer is in. If a user
+ * changed, a new record replaces it in the cache, and the callback is
+ * told too, so the entries holding the old one can be loaded again.
+ * Users that don't exist are remembered too, for a shorter time. A
+ * change to /etc/passwd expires everything.
+ */
+class UserCache {
+public:
+	struct Stats {
+		unsigned long hits;		/* answered from the cache */
+		unsigned long misses;		/* had to ask NSS */
+		unsigned long negative;		/* hits on users that don't exist */
+		unsigned long refreshes;	/* stale users looked up again */
+		unsigned long changed;		/* refreshes that found a change */
+		unsigned long errors;		/* NSS lookups that failed */
+	};
+	/* a user's record has changed, the user has gone, or get() has its
+	 * first answer about them
+	 */
+	typedef boost::function<void (const string &name)> ChangedCallback;
+	UserCache(time_t ttl = USERCACHE_TTL, time_t negttl = USERCACHE_NEG_TTL);
+	~UserCache();
+	/* make refresh()'s lookups on a thread, the answers coming back
+	 * through sched. Without it refresh() makes them itself.
+	 */
+	bool start(Scheduler *sched);
+	void setChanged(ChangedCallback cb) { this->changed = cb; }
+	/* a reference to the record for name, NULL if there is no such user
+	 * (or, once started, they are still being looked up). Drop it with
+	 * pw_release().
+	 */
+	struct passwd *get(const string &name);
+	/* whether get() gave NULL for name because it doesn't know yet */
+	bool looking(const string &name) const;
+	/* look up again the users that have gone stale, at most max of them
+	 * unless it is on the thread
+	 */
+	size_t refresh(time_t now, size_t max);
+	/* expire every user, they are looked up again as they are asked for */
+	void invalidate();
+	/* lookups that are still out */
+	size_t pending() const { return this->npending; }
+	const Stats &getStats() const { return this->stats; }
+	size_t size() const { return this->users.size(); }
+private:
+	struct User {
+		struct passwd *pw;	/* NULL for a user that doesn't exist */
+		time_t expires;
+		bool pending;		/* being looked up again */
+		bool first;		/* or for the first time, for get() */
+	};
+	struct Answer {
+		string name;
+		int found;		/* as lookup() returns */
+		struct passwd *pw;
+	};
+	UserCache(const UserCache &);
+	UserCache &operator=(const UserCache &);
+	static int lookup(const string &name, struct passwd **pw);
+	void ask(const deque<string> &names);
+	bool apply(const Answer &answer, time_t now);
+	static void *loop(void *arg);
+	/* runs in the thread */
+	void work();
+	/* and this in the Scheduler's */
+	void processDone();
+	map<string, User> users;
+	time_t ttl, negttl;
+	time_t passwdmtime;
+	time_t nextcheck;	/* when refresh() next does anything */
+	Stats stats;
+	ChangedCallback changed;
+	Scheduler *sched;
+	pthread_t worker;
+	bool started;
+	size_t npending;
+	/* the rest is shared, under lock */
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	bool stopping;
+	deque<string> queue;
+	deque<Answer> answers;
+	int wake[2];
+};
+
+#endif /* USERCACHE_HPP_ */
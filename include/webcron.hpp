@@ -0,0 +1,209 @@
+/* Tinjac - webcron.hpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file webcron.hpp
+ *  @brief Runs URL jobs as HTTP requests, from a shared Asio loop
+ */
+
+
+#ifndef WEBCRON_HPP_
+#define WEBCRON_HPP_
+
+#include <string>
+#include <map>
+#include <deque>
+#include <list>
+#include <pthread.h>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include "spawner.hpp"
+#include "outputcapture.hpp"
+
+using namespace std;
+
+class Scheduler;
+
+/* how long a request gets, connecting and all, unless HTTP_TIMEOUT says */
+#define WEBCRON_TIMEOUT		30
+/* requests in flight to one host at a time, unless TINJAC_HTTP_HOST_MAX says */
+#define WEBCRON_HOST_MAX	8
+/* how long an idle connection is kept for the next request to the host */
+#define WEBCRON_KEEPALIVE	30
+/* the most of a response's status line and headers we'll read */
+#define WEBCRON_HEADER_MAX	(64 * 1024)
+
+/** @brief Makes the HTTP(S) requests of jobs whose command is a URL
+ *
+ * "@hourly https://example.com/hook" has nothing to fork: it's one
+ * request. Every URL job goes through one Boost.Asio io_service, run by
+ * a thread of its own, so a thousand webhooks a minute cost sockets and
+ * not processes. fetch() hands a request to that thread and returns;
+ * when it is done the Response goes on a queue and a byte down a pipe
+ * the Scheduler watches, so the done callback is called from the
+ * Scheduler's loop like everything else.
+ *
+ * Connections are HTTP/1.1 and kept alive, pooled by scheme, host and
+ * port: a request takes an idle connection to its host if there is one
+ * and hands it back afterwards, where it is kept for WEBCRON_KEEPALIVE
+ * seconds. No more than hostmax requests to a host are in flight at
+ * once; the rest wait their turn, in order. A request that fails on a
+ * kept connection before any of the response arrived (the server had
+ * closed it) is tried once more on a new one. Each request has a
+ * deadline for the whole exchange, after which its connection is closed.
+ *
+ * The body goes into the OutputCapture the request came with, so only
+ * its head and tail are kept however big it is. Redirects aren't
+ * followed. https:// URLs are verified against the system's CAs and the
+ * host name.
+ */
+class WebCron {
+public:
+	struct Request {
+		Spawner::JobId id;
+		string method;		/* GET unless HTTP_METHOD says */
+		string url;
+		int timeout;		/* seconds */
+		OutputCapture output;	/* where the body goes */
+	};
+	struct Response {
+		Spawner::JobId id;
+		int status;		/* HTTP, 0 if there wasn't a response */
+		string error;		/* why there wasn't */
+		unsigned long long bytes;	/* of body */
+		OutputCapture output;
+		struct timeval finished;
+	};
+	typedef boost::function<void (const Response &response)> DoneCallback;
+	struct Stats {
+		unsigned long requests;
+		unsigned long failed;		/* without a response */
+		unsigned long connections;	/* opened */
+		unsigned long reused;		/* requests on a kept connection */
+		unsigned long queued;		/* behind a host's limit */
+	};
+	/* the parts of an http:// or https:// URL */
+	struct Url {
+		bool tls;
+		string host, port, target;
+	};
+	WebCron(Scheduler *sched, size_t hostmax = WEBCRON_HOST_MAX);
+	~WebCron();
+	/* start the thread. False if it couldn't be */
+	bool start();
+	void setDone(DoneCallback cb) { this->done = cb; }
+	/* before start() */
+	void setHostMax(size_t hostmax) { this->hostmax = hostmax ? hostmax : 1; }
+	/* make the request. False if its URL won't do */
+	bool fetch(const Request &request);
+	/* give up on a request, which finishes with an error */
+	void cancel(Spawner::JobId id);
+	/* requests not yet done */
+	size_t running() const { return this->pending; }
+	Stats getStats();
+	/* is this command a URL for us */
+	static bool isUrl(const char *cmd);
+	static bool parseUrl(const string &url, Url &out);
+private:
+	typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket> Stream;
+	struct Host;
+	/* a connection to a host, busy with a Fetch or kept for the next */
+	struct Connection {
+		Connection(boost::asio::io_service &io, boost::asio::ssl::context &ctx, Host *host);
+		Stream stream;
+		boost::asio::deadline_timer idle;
+		Host *host;
+		bool busy;
+		boost::asio::streambuf in;
+	};
+	typedef boost::shared_ptr<Connection> ConnectionPtr;
+	/* a request, from fetch() until its Response is queued */
+	struct Fetch {
+		Fetch(boost::asio::io_service &io, const Request &request, const Url &url);
+		Request request;
+		Url url;
+		Host *host;
+		ConnectionPtr conn;
+		bool active;		/* counted against its host's limit */
+		bool reused;		/* conn was kept from an earlier request */
+		bool started;		/* some of the response has arrived */
+		bool done;
+		boost::asio::deadline_timer deadline;
+		boost::asio::ip::tcp::resolver resolver;
+		string head;		/* the request */
+		Response response;
+		/* what's left of the response */
+		enum { LENGTH, CLOSE, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILER } state;
+		unsigned long long remaining;
+		bool keepalive;
+	};
+	typedef boost::shared_ptr<Fetch> FetchPtr;
+	struct Host {
+		string key;		/* scheme://host:port */
+		size_t active;
+		list<ConnectionPtr> idle;	/* the most recently used first */
+		deque<FetchPtr> waiting;
+	};
+	WebCron(const WebCron &);
+	WebCron &operator=(const WebCron &);
+	static void *loop(void *arg);
+	/* the rest run in the io_service's thread */
+	void begin(FetchPtr f);
+	void dispatch(FetchPtr f);
+	void connect(FetchPtr f);
+	void resolved(FetchPtr f, const boost::system::error_code &ec, boost::asio::ip::tcp::resolver::iterator it);
+	void connected(FetchPtr f, const boost::system::error_code &ec);
+	void handshaken(FetchPtr f, const boost::system::error_code &ec);
+	void send(FetchPtr f);
+	void sent(FetchPtr f, const boost::system::error_code &ec);
+	void gotHead(FetchPtr f, const boost::system::error_code &ec, size_t n);
+	void gotData(FetchPtr f, const boost::system::error_code &ec, size_t n);
+	void pump(FetchPtr f);
+	void timedOut(FetchPtr f, const boost::system::error_code &ec);
+	void idleOut(ConnectionPtr conn, const boost::system::error_code &ec);
+	void doCancel(Spawner::JobId id);
+	void fail(FetchPtr f, const string &error, const boost::system::error_code &ec = boost::system::error_code());
+	void finish(FetchPtr f, bool keep);
+	void close(ConnectionPtr conn);
+	/* and this in the Scheduler's */
+	void processDone();
+	Scheduler *sched;
+	size_t hostmax;
+	boost::asio::io_service io;
+	boost::asio::io_service::work *work;
+	boost::asio::ssl::context ctx;
+	pthread_t thread;
+	bool threaded;		/* the thread has been started */
+	map<string, Host> hosts;
+	map<Spawner::JobId, FetchPtr> fetches;
+	/* between the threads */
+	pthread_mutex_t lock;
+	deque<Response> finished;
+	Stats stats;
+	int wake[2];
+	size_t pending;
+	DoneCallback done;
+};
+
+#endif /* WEBCRON_HPP_ */
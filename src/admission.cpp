@@ -0,0 +1,279 @@
+/* Tinjac - admission.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file admission.cpp
+ *  @brief Holds job launches back while the system is too busy
+ */
+
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "log.hpp"
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "jobgraph.hpp"
+#include "scheduler.hpp"
+#include "admission.hpp"
+
+
+/* a number from e's environment, dflt if it isn't set or isn't one */
+static double env_number(const entry *e, const char *name, double dflt) {
+	char *value = env_get((char *)name, e->envp), *end;
+	double n;
+
+	if (value == NULL)
+		return (dflt);
+	n = strtod(value, &end);
+	if (end == value || *end != '\0' || n < 0)
+		return (dflt);
+	return (n);
+}
+
+Admission::Admission(Scheduler *sched, const string &proc) : sched(sched) {
+	static const char *names[PROBES] = { "loadavg", "pressure/cpu", "pressure/io", "pressure/memory" };
+	int i;
+
+	for (i = 0; i < PROBES; i++) {
+		this->fds[i] = -1;
+#ifdef __linux
+		this->fds[i] = open((proc + "/" + names[i]).c_str(), O_RDONLY | O_CLOEXEC);
+#endif
+	}
+	if (this->fds[CPU] == -1)
+		DLOG("No pressure stall information in %s, only the load average limits jobs", proc.c_str());
+	if ((this->ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+		this->ncpu = 1;
+	this->last.when = -1;
+}
+
+Admission::~Admission() {
+	int i;
+
+	if (!this->queue.empty())
+		ELOG("%d held back jobs won't run", (int)this->queue.size());
+	for (multimap<time_t, Deferred *>::iterator it = this->queue.begin(); it != this->queue.end(); ++it) {
+		free_entry(it->second->e);
+		if (it->second->graph)
+			it->second->graph->release();
+		delete it->second;
+	}
+	for (i = 0; i < PROBES; i++)
+		if (this->fds[i] != -1)
+			::close(this->fds[i]);
+}
+
+bool Admission::parseLoad(const char *buf, double *load) {
+	char *end;
+
+	*load = strtod(buf, &end);
+	return (end != buf);
+}
+
+bool Admission::parsePressure(const char *buf, double *avg10) {
+	const char *s;
+	char *end;
+
+	if (strncmp(buf, "some ", 5) != 0 || (s = strstr(buf, "avg10=")) == NULL)
+		return (false);
+	*avg10 = strtod(s + 6, &end);
+	return (end != s + 6);
+}
+
+double Admission::readProbe(int probe) {
+	char buf[256];
+	ssize_t len;
+	double value;
+
+	if (this->fds[probe] == -1 || (len = pread(this->fds[probe], buf, sizeof(buf) - 1, 0)) <= 0)
+		return (-1);
+	buf[len] = '\0';
+	if (!(probe == LOADAVG ? parseLoad(buf, &value) : parsePressure(buf, &value)))
+		return (-1);
+	return (value);
+}
+
+const Admission::Sample &Admission::sample(time_t now) {
+	double load[1];
+
+	if (this->last.when == now)
+		return (this->last);
+	this->last.when = now;
+	if ((this->last.load = this->readProbe(LOADAVG)) == -1 && getloadavg(load, 1) == 1)
+		this->last.load = load[0];
+	this->last.cpu = this->readProbe(CPU);
+	this->last.io = this->readProbe(IO);
+	this->last.memory = this->readProbe(MEMORY);
+	return (this->last);
+}
+
+/* what e is limited by, false if nothing */
+bool Admission::getLimits(const entry *e, Limits &limits) const {
+	char *value;
+
+	limits.load = env_number(e, "LOAD_MAX", (e->flags & LOAD_LIMITED) ? this->ncpu : 0);
+	limits.cpu = env_number(e, "CPU_PRESSURE_MAX", 0);
+	limits.io = env_number(e, "IO_PRESSURE_MAX", 0);
+	limits.memory = env_number(e, "MEMORY_PRESSURE_MAX", 0);
+	if (limits.load == 0 && limits.cpu == 0 && limits.io == 0 && limits.memory == 0)
+		return (false);
+	value = env_get((char *)"JOB_CLASS", e->envp);
+	limits.cls = value && *value ? value : "default";
+	value = env_get((char *)"DEFER", e->envp);
+	if (value && !strcmp(value, "delay"))
+		limits.policy = DELAY;
+	else if (value && !strcmp(value, "jitter"))
+		limits.policy = JITTER;
+	else
+		limits.policy = HOLD;
+	limits.delay = (time_t)env_number(e, "DEFER_DELAY", ADMIT_DELAY);
+	if (limits.delay < 1)
+		limits.delay = 1;
+	limits.maxdefer = (time_t)env_number(e, "DEFER_MAX", ADMIT_DEFER_MAX);
+	return (true);
+}
+
+/* the first limit the system is over, NULL if it isn't */
+const char *Admission::over(const Limits &limits, time_t now) {
+	const Sample &s = this->sample(now);
+
+	if (limits.load > 0 && s.load > limits.load)
+		return ("load");
+	if (limits.cpu > 0 && s.cpu > limits.cpu)
+		return ("cpu pressure");
+	if (limits.io > 0 && s.io > limits.io)
+		return ("io pressure");
+	if (limits.memory > 0 && s.memory > limits.memory)
+		return ("memory pressure");
+	return (NULL);
+}
+
+/* when a job due at due should be looked at again */
+time_t Admission::next(const Limits &limits, time_t due, time_t now) {
+	time_t when;
+
+	switch (limits.policy) {
+		case DELAY:
+			when = now + limits.delay;
+			break;
+		case JITTER:
+			when = now + 1 + random() % limits.delay;
+			break;
+		default:
+			when = now + ADMIT_RECHECK;
+			break;
+	}
+	return (min(when, due + limits.maxdefer));
+}
+
+bool Admission::admit(const entry *e, const CrontabFile *file, time_t now) {
+	const char *why;
+	Deferred *d;
+	Limits limits;
+
+	if (!this->getLimits(e, limits))
+		return (true);
+	ClassStats &stats = this->stats[limits.cls];
+	if ((why = this->over(limits, now)) == NULL || limits.maxdefer == 0) {
+		stats.admitted++;
+		return (true);
+	}
+	/* the one that is held already will do for this one too */
+	if (this->held.count(make_pair(file->fname, e->lineno)) != 0) {
+		stats.skipped++;
+		DLOG("Skipping %s:%d, it is still held back from before", file->fname.c_str(), e->lineno);
+		return (false);
+	}
+	d = new Deferred;
+	/* if we can't keep it, it's better run now than not at all */
+	if ((d->e = copy_entry(e)) == NULL) {
+		delete d;
+		stats.admitted++;
+		return (true);
+	}
+	d->fname = file->fname;
+	if ((d->graph = file->graph) != NULL)
+		d->graph->hold();
+	d->limits = limits;
+	d->due = now;
+	stats.deferred++;
+	this->held.insert(make_pair(d->fname, d->e->lineno));
+	DLOG("Holding back %s:%d, %s is too high", file->fname.c_str(), e->lineno, why);
+	this->queue.insert(make_pair(this->next(limits, now, now), d));
+	this->sched->wakeAt(this->queue.begin()->first);
+	return (false);
+}
+
+void Admission::retry(time_t now) {
+	multimap<time_t, Deferred *>::iterator it;
+	Deferred *d;
+
+	while (!this->queue.empty() && (it = this->queue.begin())->first <= now) {
+		d = it->second;
+		this->queue.erase(it);
+		if (this->over(d->limits, now) == NULL)
+			this->release(d, now, false);
+		else if (now - d->due >= d->limits.maxdefer)
+			this->release(d, now, true);
+		else
+			this->queue.insert(make_pair(this->next(d->limits, d->due, now), d));
+	}
+	if (!this->queue.empty())
+		this->sched->wakeAt(this->queue.begin()->first);
+}
+
+void Admission::release(Deferred *d, time_t now, bool forced) {
+	ClassStats &stats = this->stats[d->limits.cls];
+	time_t waited = now - d->due;
+
+	if (forced) {
+		stats.forced++;
+		ELOG("Running %s:%d after holding it back %ld seconds, the system is still busy", d->fname.c_str(), d->e->lineno, (long)waited);
+	} else {
+		stats.released++;
+	}
+	stats.waited += waited;
+	stats.maxwait = max(stats.maxwait, waited);
+	this->held.erase(make_pair(d->fname, d->e->lineno));
+	if (this->launch)
+		this->launch(d->e, d->fname, d->graph);
+	free_entry(d->e);
+	if (d->graph)
+		d->graph->release();
+	delete d;
+}
+
+time_t Admission::nextCheck() const {
+	if (this->queue.empty())
+		return (-1);
+	return (this->queue.begin()->first);
+}
+
+void Admission::logStats() const {
+	for (map<string, ClassStats>::const_iterator it = this->stats.begin(); it != this->stats.end(); ++it)
+		RLOG("Job class %s: %lu started when due, %lu held back (%lu later, %lu at DEFER_MAX), %lu skipped while held, waited %lus, longest %lds",
+			it->first.c_str(), it->second.admitted, it->second.deferred, it->second.released,
+			it->second.forced, it->second.skipped, it->second.waited, (long)it->second.maxwait);
+	RLOG("%d jobs held back now", (int)this->queue.size());
+}
@@ -0,0 +1,129 @@
+/* Tinjac - arena.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file arena.cpp
+ *  @brief Region allocator for everything loaded from one crontab
+ */
+
+
+#include <cstdlib>
+#include <cstring>
+#include "arena.hpp"
+
+/* everything handed out is a multiple of this, so it's aligned for any type */
+#define ARENA_ALIGN		(2 * sizeof(void *))
+#define ARENA_ROUND(n)		(((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+/* bigger requests than this get a chunk to themselves */
+#define ARENA_BIG		(ARENA_MAX_CHUNK / 4)
+
+
+Arena::Arena() :
+	chunks(NULL), pos(NULL), end(NULL), next(ARENA_MIN_CHUNK),
+	total(0), inuse(0), nchunks(0), cleanups(NULL) {
+}
+
+Arena::~Arena() {
+	Chunk *chunk;
+	Cleanup *c;
+
+	/* the cleanups live in the chunks, so run them first */
+	for (c = this->cleanups; c != NULL; c = c->next)
+		c->release(c->p);
+	while ((chunk = this->chunks) != NULL) {
+		this->chunks = chunk->next;
+		free(chunk);
+	}
+}
+
+void *Arena::alloc(size_t size) {
+	const size_t header = ARENA_ROUND(sizeof(Chunk));
+	Chunk *chunk;
+	size_t csize;
+	char *p;
+
+	size = ARENA_ROUND(size ? size : 1);
+	if ((size_t)(this->end - this->pos) < size) {
+		if (size > ARENA_BIG) {
+			/* a chunk of its own, behind the current one so the
+			 * space left in that isn't lost
+			 */
+			if ((chunk = (Chunk *)malloc(header + size)) == NULL)
+				return (NULL);
+			chunk->size = header + size;
+			if (this->chunks) {
+				chunk->next = this->chunks->next;
+				this->chunks->next = chunk;
+			} else {
+				chunk->next = NULL;
+				this->chunks = chunk;
+			}
+			this->total += chunk->size;
+			this->inuse += size;
+			this->nchunks++;
+			p = (char *)chunk + header;
+			memset(p, 0, size);
+			return (p);
+		}
+		csize = this->next;
+		while (csize < header + size)
+			csize *= 2;
+		if ((chunk = (Chunk *)malloc(csize)) == NULL)
+			return (NULL);
+		chunk->size = csize;
+		chunk->next = this->chunks;
+		this->chunks = chunk;
+		this->pos = (char *)chunk + header;
+		this->end = (char *)chunk + csize;
+		this->total += csize;
+		this->nchunks++;
+		if (this->next < ARENA_MAX_CHUNK)
+			this->next *= 2;
+	}
+	p = this->pos;
+	this->pos += size;
+	this->inuse += size;
+	memset(p, 0, size);
+	return (p);
+}
+
+char *Arena::strndup(const char *s, size_t len) {
+	char *p;
+
+	if ((p = (char *)this->alloc(len + 1)) == NULL)
+		return (NULL);
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return (p);
+}
+
+bool Arena::keep(void *p, void (*release)(void *)) {
+	Cleanup *c;
+
+	if ((c = (Cleanup *)this->alloc(sizeof(Cleanup))) == NULL)
+		return (false);
+	c->p = p;
+	c->release = release;
+	c->next = this->cleanups;
+	this->cleanups = c;
+	return (true);
+}
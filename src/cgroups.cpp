@@ -0,0 +1,309 @@
+/* Tinjac - cgroups.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file cgroups.cpp
+ *  @brief Puts each job in a cgroup of its own, to limit and account for it
+ */
+
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "log.hpp"
+#include "env.hpp"
+#include "cgroups.hpp"
+
+
+/* the whole of a small file, false if it can't be read */
+static bool read_file(const string &path, string &text) {
+	char buf[4096];
+	ssize_t n;
+	int fd;
+
+	text.clear();
+	if ((fd = open(path.c_str(), O_RDONLY | O_CLOEXEC)) == -1)
+		return (false);
+	while ((n = ::read(fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+		if (n > 0)
+			text.append(buf, n);
+	::close(fd);
+	return (n == 0);
+}
+
+/* as "echo value > path" would, in one write() the way cgroupfs wants it */
+static bool write_file(const string &path, const string &value) {
+	ssize_t n;
+	int fd, save;
+
+	if ((fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+		return (false);
+	n = ::write(fd, value.data(), value.size());
+	save = errno;
+	::close(fd);
+	errno = save;
+	return (n == (ssize_t)value.size());
+}
+
+static bool make_dir(const string &path) {
+	return (mkdir(path.c_str(), 0755) == 0 || errno == EEXIST);
+}
+
+Cgroups::Cgroups(const string &root, const string &self) : root(root), self(self) {
+}
+
+string Cgroups::parseSelf(const char *buf) {
+	const char *p, *end;
+
+	for (p = buf; *p != '\0'; p = *end ? end + 1 : end) {
+		if ((end = strchr(p, '\n')) == NULL)
+			end = p + strlen(p);
+		if (strncmp(p, "0::/", 4) == 0)
+			return (string(p + 3, end - p - 3));
+	}
+	return ("");
+}
+
+bool Cgroups::parseCpuStat(const char *buf, unsigned long long *usec) {
+	const char *p;
+	char *end;
+
+	for (p = buf; p != NULL && *p != '\0'; p = strchr(p, '\n'), p = p ? p + 1 : p)
+		if (strncmp(p, "usage_usec ", 11) == 0) {
+			*usec = strtoull(p + 11, &end, 10);
+			return (end != p + 11);
+		}
+	return (false);
+}
+
+void Cgroups::parseIoStat(const char *buf, unsigned long long *rbytes, unsigned long long *wbytes) {
+	const char *p;
+
+	*rbytes = *wbytes = 0;
+	/* "8:0 rbytes=1024 wbytes=0 rios=1 wios=0 dbytes=0 dios=0", a line
+	 * for each device
+	 */
+	for (p = buf; (p = strstr(p, " rbytes=")) != NULL; p++)
+		*rbytes += strtoull(p + 8, NULL, 10);
+	for (p = buf; (p = strstr(p, " wbytes=")) != NULL; p++)
+		*wbytes += strtoull(p + 8, NULL, 10);
+}
+
+bool Cgroups::cpuMax(const char *value, string &out) {
+	char buf[64], *end;
+	double percent;
+	unsigned long quota;
+
+	if (!strcmp(value, "max")) {
+		out = value;
+		return (true);
+	}
+	percent = strtod(value, &end);
+	if (end == value || percent <= 0)
+		return (false);
+	if (!strcmp(end, "%")) {
+		/* the kernel won't take a quota under a millisecond */
+		quota = max((unsigned long)(percent * CGROUP_CPU_PERIOD / 100), 1000UL);
+		snprintf(buf, sizeof(buf), "%lu %d", quota, CGROUP_CPU_PERIOD);
+		out = buf;
+		return (true);
+	}
+	/* "quota" or "quota period", as it is */
+	if (*end != '\0' && *end != ' ')
+		return (false);
+	out = value;
+	return (true);
+}
+
+/* let dir's children have the controllers we use */
+bool Cgroups::enable(const string &dir) {
+	if (this->controllers.empty())
+		return (true);
+	if (!write_file(dir + "/cgroup.subtree_control", this->controllers)) {
+		ELOG("Can't enable %s in %s: %s", this->controllers.c_str(), dir.c_str(), strerror(errno));
+		return (false);
+	}
+	return (true);
+}
+
+bool Cgroups::setLimit(const string &dir, const char *file, const char *value) {
+	if (write_file(dir + "/" + file, value))
+		return (true);
+	ELOG("Can't set %s of %s to \"%s\": %s", file, dir.c_str(), value, strerror(errno));
+	return (false);
+}
+
+bool Cgroups::setup() {
+#ifdef __linux
+	string text, path, base, procs, avail;
+	const char *p, *end;
+	char want[] = CGROUP_CONTROLLERS, *name, *last;
+	int fd = -1;
+
+	if (!read_file(this->self, text) || (path = parseSelf(text.c_str())).empty()) {
+		DLOG("Not in a cgroup v2 hierarchy (%s), jobs won't be contained", this->self.c_str());
+		return (false);
+	}
+	base = this->root + (path == "/" ? "" : path);
+	if (!read_file(base + "/cgroup.controllers", avail)) {
+		DLOG("No cgroup v2 at %s, jobs won't be contained", base.c_str());
+		return (false);
+	}
+	/* the ones we want that the kernel has, as words in a line */
+	avail = " " + avail.substr(0, avail.find('\n')) + " ";
+	for (name = strtok_r(want, " ", &last); name != NULL; name = strtok_r(NULL, " ", &last))
+		if (avail.find(string(" ") + name + " ") != string::npos)
+			this->controllers += (this->controllers.empty() ? "+" : " +") + string(name);
+	if (path != "/") {
+		/* a cgroup with children can't have processes of its own, so
+		 * the daemon and the spawner move down a level
+		 */
+		if (!read_file(base + "/cgroup.procs", procs) || !make_dir(base + "/daemon") ||
+				(fd = open((base + "/daemon/cgroup.procs").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+			DLOG("Can't take over cgroup %s, jobs won't be contained: %s", base.c_str(), strerror(errno));
+			return (false);
+		}
+		for (p = procs.c_str(); *p != '\0'; p = *end ? end + 1 : end) {
+			if ((end = strchr(p, '\n')) == NULL)
+				end = p + strlen(p);
+			if (end > p && ::write(fd, p, end - p + (*end ? 1 : 0)) < 0 && errno != ESRCH) {
+				DLOG("Can't take over cgroup %s, jobs won't be contained: %s", base.c_str(), strerror(errno));
+				::close(fd);
+				return (false);
+			}
+		}
+		::close(fd);
+	} else {
+		/* in the root we can stay where we are, but keep the jobs
+		 * in a subtree of our own
+		 */
+		if (!this->enable(base) || !make_dir(base + "/tinjac")) {
+			DLOG("Can't make our cgroup in %s, jobs won't be contained", base.c_str());
+			return (false);
+		}
+		base += "/tinjac";
+	}
+	if (!this->enable(base) || !make_dir(base + "/jobs") || !this->enable(base + "/jobs")) {
+		DLOG("Can't make %s/jobs, jobs won't be contained: %s", base.c_str(), strerror(errno));
+		return (false);
+	}
+	this->jobs = base + "/jobs";
+	DLOG("Running jobs in cgroups under %s, with %s", this->jobs.c_str(),
+		this->controllers.empty() ? "no controllers" : this->controllers.c_str());
+	return (true);
+#else
+	return (false);
+#endif
+}
+
+int Cgroups::create(Spawner::JobId id, const entry *e) {
+	char *cls, *value, name[32];
+	string dir, leaf, cpu;
+	bool shared;
+	int fd;
+
+	if (!this->enabled())
+		return (-1);
+	/* a class name is a directory name, and mustn't be mistaken for one
+	 * of the cgroup's files (which all have a '.' in them)
+	 */
+	cls = env_get((char *)"JOB_CLASS", e->envp);
+	if (cls == NULL || *cls == '\0' || strchr(cls, '/') != NULL || strchr(cls, '.') != NULL)
+		cls = (char *)"default";
+	shared = strcmp(cls, "default") != 0;
+	dir = this->jobs + "/default";
+	if (shared) {
+		/* each user's classes are their own, so nobody else's crontab
+		 * can change the limits their jobs share
+		 */
+		snprintf(name, sizeof(name), "/%lu", (unsigned long)(e->pwd ? e->pwd->pw_uid : getuid()));
+		dir = this->jobs + name;
+		if (!make_dir(dir) || !this->enable(dir)) {
+			ELOG("Can't make cgroup %s: %s", dir.c_str(), strerror(errno));
+			return (-1);
+		}
+		dir = dir + "/" + cls;
+	}
+	if (!make_dir(dir) || !this->enable(dir)) {
+		ELOG("Can't make cgroup %s: %s", dir.c_str(), strerror(errno));
+		return (-1);
+	}
+	snprintf(name, sizeof(name), "/%lu", id);
+	leaf = dir + name;
+	if (mkdir(leaf.c_str(), 0755) != 0) {
+		ELOG("Can't make cgroup %s: %s", leaf.c_str(), strerror(errno));
+		return (-1);
+	}
+	/* a class's jobs share its limits, the rest have their own */
+	if ((value = env_get((char *)"CPU_MAX", e->envp)) != NULL) {
+		if (cpuMax(value, cpu))
+			this->setLimit(shared ? dir : leaf, "cpu.max", cpu.c_str());
+		else
+			ELOG("Bad CPU_MAX \"%s\", it isn't a percentage or a quota", value);
+	}
+	if ((value = env_get((char *)"MEMORY_MAX", e->envp)) != NULL)
+		this->setLimit(shared ? dir : leaf, "memory.max", value);
+	if ((value = env_get((char *)"IO_MAX", e->envp)) != NULL)
+		this->setLimit(shared ? dir : leaf, "io.max", value);
+	if ((fd = open((leaf + "/cgroup.procs").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644)) == -1) {
+		ELOG("Can't open %s/cgroup.procs: %s", leaf.c_str(), strerror(errno));
+		rmdir(leaf.c_str());
+		return (-1);
+	}
+	this->leaves[id] = leaf;
+	return (fd);
+}
+
+bool Cgroups::finish(Spawner::JobId id, Usage *usage) {
+	map<Spawner::JobId, string>::iterator it = this->leaves.find(id);
+	string text;
+
+	memset(usage, 0, sizeof(*usage));
+	if (it == this->leaves.end())
+		return (false);
+	if (read_file(it->second + "/cpu.stat", text))
+		parseCpuStat(text.c_str(), &usage->cpu);
+	if (read_file(it->second + "/memory.peak", text))
+		usage->memory = strtoull(text.c_str(), NULL, 10);
+	if (read_file(it->second + "/io.stat", text))
+		parseIoStat(text.c_str(), &usage->rbytes, &usage->wbytes);
+	/* whatever the job left running keeps the leaf busy */
+	if (rmdir(it->second.c_str()) != 0 && errno == EBUSY)
+		this->busy.push_back(it->second);
+	this->leaves.erase(it);
+	return (true);
+}
+
+void Cgroups::sweep() {
+	vector<string> still;
+
+	for (vector<string>::iterator it = this->busy.begin(); it != this->busy.end(); ++it)
+		if (rmdir(it->c_str()) != 0 && errno == EBUSY)
+			still.push_back(*it);
+	if (still.size() < this->busy.size())
+		DLOG("Removed %d cgroups, %d still busy", (int)(this->busy.size() - still.size()), (int)still.size());
+	this->busy.swap(still);
+}
@@ -0,0 +1,222 @@
+/* Tinjac - chains.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file chains.cpp
+ *  @brief Runs chains of dependent jobs as their jobs finish
+ */
+
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "log.hpp"
+#include "env.hpp"
+#include "chains.hpp"
+
+
+Chains::Chains(Supervisor *supervisor) : supervisor(supervisor), parallel(CHAIN_PARALLEL) {
+	memset(&this->stats, 0, sizeof(this->stats));
+}
+
+Chains::~Chains() {
+	for (set<Run *>::iterator it = this->runs.begin(); it != this->runs.end(); ++it) {
+		(*it)->graph->release();
+		delete *it;
+	}
+}
+
+bool Chains::start(const entry *e, JobGraph *graph, int infd) {
+	const JobGraph::Node *node;
+	char *limit;
+	Run *run;
+	int root, n;
+
+	if (!graph || !e->name || (root = graph->find(e->name)) == -1)
+		return (false);
+	node = &graph->node(root);
+	/* a second entry with the label isn't the one the chain follows */
+	if (node->e->lineno != e->lineno || (node->children.empty() && node->pipe == -1))
+		return (false);
+
+	const vector<int> &reach = graph->reach(root);
+	run = new Run;
+	run->graph = graph;
+	run->graph->hold();
+	run->root = root;
+	run->pending.assign(run->graph->size(), -1);
+	run->results.assign(run->graph->size(), PENDING);
+	run->running = 0;
+	run->left = reach.size();
+	memset(run->counts, 0, sizeof(run->counts));
+	if ((limit = env_get((char *)"CHAIN_PARALLEL", node->e->envp)) == NULL || (n = atoi(limit)) < 1)
+		run->parallel = this->parallel;
+	else
+		run->parallel = n;
+	/* how many of its parents each job in the chain waits for; the
+	 * first job and @pipes don't wait, they start with their parent
+	 */
+	for (vector<int>::const_iterator it = reach.begin(); it != reach.end(); ++it)
+		run->pending[*it] = 0;
+	for (vector<int>::const_iterator it = reach.begin(); it != reach.end(); ++it) {
+		const vector<int> &parents = run->graph->node(*it).parents;
+		for (vector<int>::const_iterator p = parents.begin(); p != parents.end(); ++p)
+			if (run->pending[*p] != -1)
+				run->pending[*it]++;
+	}
+	this->runs.insert(run);
+	this->stats.started++;
+	DLOG("Starting the chain of %d jobs from %s:%d", (int)reach.size(), graph->getName().c_str(), e->lineno);
+	this->launch(run, root, infd);
+	this->pump(run);
+	if (run->left == 0 && run->running == 0)
+		this->end(run);
+	return (true);
+}
+
+bool Chains::jobDone(const Supervisor::JobRun &job) {
+	map<Spawner::JobId, pair<Run *, int> >::iterator it = this->jobs.find(job.id);
+	Run *run;
+	int n;
+
+	if (it == this->jobs.end())
+		return (false);
+	run = it->second.first;
+	n = it->second.second;
+	this->jobs.erase(it);
+	run->running--;
+	if (job.pid != -1 && job.status != -1 && WIFEXITED(job.status) && WEXITSTATUS(job.status) == 0)
+		this->complete(run, n, SUCCEEDED);
+	else
+		this->complete(run, n, FAILED);
+	this->pump(run);
+	if (run->left == 0 && run->running == 0)
+		this->end(run);
+	return (true);
+}
+
+/* start job n, reading from infd if it's a @pipe, along with its own
+ * @pipe if it has one
+ */
+void Chains::launch(Run *run, int n, int infd) {
+	const JobGraph::Node &node = run->graph->node(n);
+	int fds[2] = { -1, -1 };
+	Spawner::JobId id;
+
+	if (node.pipe != -1 && run->pending[node.pipe] != -1) {
+		if (pipe(fds) != 0) {
+			ELOG("Can't make a pipe for %s line %d: %s", run->graph->getName().c_str(), node.e->lineno, strerror(errno));
+			fds[0] = fds[1] = -1;
+		} else {
+			fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+			fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+		}
+	}
+	if (n != run->root && !(node.e->flags & DONT_LOG))
+		DLOG("(%s) CMD (%s)", node.e->pwd->pw_name, node.e->cmd);
+	id = this->supervisor->run(node.e, run->graph->getName(), infd, fds[1]);
+	if (fds[1] != -1)
+		::close(fds[1]);
+	if (id != 0) {
+		this->jobs[id] = make_pair(run, n);
+		run->running++;
+		this->stats.jobs++;
+	} else {
+		this->complete(run, n, FAILED);
+	}
+	if (node.pipe != -1 && run->pending[node.pipe] != -1) {
+		/* the other end has to be there from the start */
+		if (id != 0 && fds[0] != -1)
+			this->launch(run, node.pipe, fds[0]);
+		else
+			this->complete(run, node.pipe, SKIPPED);
+	}
+	if (fds[0] != -1)
+		::close(fds[0]);
+}
+
+/* job n is done with; see which of its children that makes ready */
+void Chains::complete(Run *run, int n, Result result) {
+	const JobGraph::Node &node = run->graph->node(n);
+
+	run->results[n] = result;
+	run->counts[result]++;
+	run->left--;
+	if (result == SKIPPED) {
+		this->stats.skipped++;
+		/* a @pipe of a job that never ran doesn't either */
+		if (node.pipe != -1 && run->pending[node.pipe] != -1 && run->results[node.pipe] == PENDING)
+			this->complete(run, node.pipe, SKIPPED);
+	}
+	for (vector<int>::const_iterator c = node.children.begin(); c != node.children.end(); ++c) {
+		if (run->pending[*c] <= 0 || --run->pending[*c] > 0)
+			continue;
+		if (this->runnable(run, *c))
+			run->ready.push_back(*c);
+		else
+			this->complete(run, *c, SKIPPED);
+	}
+}
+
+/* the jobs n follows have all finished, should it run */
+bool Chains::runnable(Run *run, int n) const {
+	const JobGraph::Node &node = run->graph->node(n);
+	bool failed = false;
+
+	for (vector<int>::const_iterator p = node.parents.begin(); p != node.parents.end(); ++p) {
+		if (run->pending[*p] == -1)
+			continue;
+		if (run->results[*p] == SKIPPED)
+			return (false);
+		if (run->results[*p] == FAILED)
+			failed = true;
+	}
+	if (node.e->flags & AFTER_SUCCESS)
+		return (!failed);
+	if (node.e->flags & AFTER_FAILURE)
+		return (failed);
+	return (true);
+}
+
+void Chains::pump(Run *run) {
+	int n;
+
+	while (!run->ready.empty() && run->running < run->parallel) {
+		n = run->ready.front();
+		run->ready.pop_front();
+		this->launch(run, n, -1);
+	}
+}
+
+void Chains::end(Run *run) {
+	const JobGraph::Node &root = run->graph->node(run->root);
+
+	DLOG("Chain from %s:%d finished, %lu succeeded, %lu failed, %lu skipped",
+		run->graph->getName().c_str(), root.e->lineno,
+		run->counts[SUCCEEDED], run->counts[FAILED], run->counts[SKIPPED]);
+	this->runs.erase(run);
+	this->stats.finished++;
+	run->graph->release();
+	delete run;
+}
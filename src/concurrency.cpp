@@ -0,0 +1,345 @@
+/* Tinjac - concurrency.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file concurrency.cpp
+ *  @brief Limits how many copies of a job, and how many jobs, run at once
+ */
+
+
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "log.hpp"
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "concurrency.hpp"
+
+
+Concurrency::Concurrency(Supervisor *supervisor) :
+	supervisor(supervisor), max(0), nwaiting(0), periodmax(PERIOD_JOBS_MAX), periodic(0) {
+	memset(&this->stats, 0, sizeof(this->stats));
+}
+
+Concurrency::~Concurrency() {
+	boost::unordered_map<string, Slot>::iterator slot;
+	boost::unordered_map<string, User>::iterator user;
+	deque<Waiting *>::iterator w;
+
+	if (this->nwaiting > 0)
+		ELOG("%d waiting jobs won't run", (int)this->nwaiting);
+	for (slot = this->slots.begin(); slot != this->slots.end(); ++slot)
+		if (slot->second.queued)
+			this->drop(slot->second.queued);
+	for (user = this->users.begin(); user != this->users.end(); ++user)
+		for (w = user->second.waiting.begin(); w != user->second.waiting.end(); ++w)
+			this->drop(*w);
+	for (w = this->periods.begin(); w != this->periods.end(); ++w)
+		this->drop(*w);
+}
+
+Concurrency::Policy Concurrency::getPolicy(const entry *e, size_t *instances) {
+	char *overlap = env_get((char *)"OVERLAP", e->envp);
+	char *value = env_get((char *)"MAX_INSTANCES", e->envp);
+	Policy policy = ALLOW;
+	int n;
+
+	if (overlap && !strcmp(overlap, "skip"))
+		policy = SKIP;
+	else if (overlap && !strcmp(overlap, "queue"))
+		policy = QUEUE;
+	else if (overlap && !strcmp(overlap, "kill"))
+		policy = KILL;
+	if (value == NULL || (n = atoi(value)) < 0)
+		n = 0;
+	/* either one on its own says there's a limit */
+	if (overlap == NULL && n > 0)
+		policy = SKIP;
+	/* and an @period job is tried again while it may still be running,
+	 * so it's one at a time, as anacron's lock on each job makes it
+	 */
+	if (overlap == NULL && value == NULL && (e->flags & WHEN_PERIOD))
+		policy = SKIP;
+	if (policy != ALLOW && n == 0)
+		n = 1;
+	*instances = (policy == ALLOW) ? 0 : n;
+	return (policy);
+}
+
+/* a copy of e to run later, NULL if we're out of memory */
+Concurrency::Waiting *Concurrency::hold(const entry *e, const string &fname, int infd, Slot *slot) {
+	Waiting *w = new Waiting;
+
+	if ((w->e = copy_entry(e)) == NULL) {
+		delete w;
+		return (NULL);
+	}
+	/* the caller closes its own as soon as we return */
+	if (infd == -1)
+		w->infd = -1;
+	else if ((w->infd = fcntl(infd, F_DUPFD_CLOEXEC, 0)) == -1) {
+		free_entry(w->e);
+		delete w;
+		return (NULL);
+	}
+	w->fname = fname;
+	w->slot = slot;
+	this->nwaiting++;
+	return (w);
+}
+
+/* a waiting run, once it has started or won't */
+void Concurrency::drop(Waiting *w) {
+	if (w->infd != -1)
+		::close(w->infd);
+	free_entry(w->e);
+	delete w;
+}
+
+bool Concurrency::launch(const entry *e, const string &fname, int infd) {
+	string key = fname + '\0' + e->pwd->pw_name + '\0' + e->cmd;
+	Slot *slot = &this->slots[key];
+	size_t instances;
+	Policy policy = getPolicy(e, &instances);
+	bool running = false;
+
+	if (slot->key.empty())
+		slot->key = key;
+	/* a run waiting for a cap is as good as running */
+	if (instances > 0 && slot->ids.size() + slot->capped >= instances) {
+		switch (policy) {
+			case QUEUE:
+				if (slot->queued == NULL && (slot->queued = this->hold(e, fname, infd, slot)) != NULL) {
+					this->stats.queued++;
+					DLOG("Queueing %s:%d behind the %d copies running", fname.c_str(), e->lineno, (int)slot->ids.size());
+					return (true);
+				}
+				/* FALLTHROUGH */
+			case SKIP:
+				this->stats.skipped++;
+				DLOG("Skipping %s:%d, %d copies are still running", fname.c_str(), e->lineno, (int)slot->ids.size());
+				this->tidy(slot);
+				return (false);
+			case KILL:
+				if (!slot->ids.empty() && this->supervisor->kill(slot->ids.front(), SIGTERM)) {
+					this->stats.killed++;
+					DLOG("Killed job %lu for a new run of %s:%d", slot->ids.front(), fname.c_str(), e->lineno);
+				}
+				break;
+			default:
+				break;
+		}
+	}
+	running = this->admit(e, fname, infd, slot);
+	this->tidy(slot);
+	return (running);
+}
+
+/* start e now if the caps allow, or have it wait its turn */
+bool Concurrency::admit(const entry *e, const string &fname, int infd, Slot *slot) {
+	User *user = &this->users[e->pwd->pw_name];
+	char *value;
+	Waiting *w;
+	bool admitted;
+
+	if (user->name.empty())
+		user->name = e->pwd->pw_name;
+	if ((value = env_get((char *)"USER_JOBS_MAX", e->envp)) == NULL || atoi(value) < 0)
+		user->max = 0;
+	else
+		user->max = atoi(value);
+	if (e->flags & WHEN_PERIOD) {
+		if (this->periodmax > 0 && this->periodic >= this->periodmax) {
+			if (slot->capped) {
+				this->stats.skipped++;
+				DLOG("Skipping %s:%d, a run of it is already waiting", fname.c_str(), e->lineno);
+				this->tidy(user);
+				return (false);
+			}
+			/* it waits on the @period cap, not as one of the user's */
+			if ((w = this->hold(e, fname, infd, slot)) != NULL) {
+				this->periods.push_back(w);
+				slot->capped = true;
+				this->stats.capped++;
+				DLOG("%s:%d waits its turn, %d @period jobs are running", fname.c_str(), e->lineno, (int)this->periodic);
+				this->tidy(user);
+				return (true);
+			}
+		}
+		/* from here it counts, whether it starts or waits for a cap */
+		this->periodic++;
+	}
+	/* behind the user's jobs that are already waiting, if any are */
+	if ((this->max == 0 || this->jobs.size() < this->max) && (user->max == 0 || user->running < user->max) &&
+			user->waiting.empty()) {
+		admitted = this->start(e, fname, infd, slot, user);
+		this->tidy(user);
+		return (admitted);
+	}
+	if (slot->capped) {
+		if (e->flags & WHEN_PERIOD)
+			this->periodic--;
+		this->stats.skipped++;
+		DLOG("Skipping %s:%d, a run of it is already waiting", fname.c_str(), e->lineno);
+		this->tidy(user);
+		return (false);
+	}
+	/* if we can't keep it, it's better run now than not at all */
+	if ((w = this->hold(e, fname, infd, slot)) == NULL) {
+		admitted = this->start(e, fname, infd, slot, user);
+		this->tidy(user);
+		return (admitted);
+	}
+	user->waiting.push_back(w);
+	slot->capped = true;
+	this->stats.capped++;
+	DLOG("%s:%d waits, %d jobs are running, %d of them %s's", fname.c_str(), e->lineno,
+		(int)this->jobs.size(), (int)user->running, user->name.c_str());
+	this->release(user);
+	return (true);
+}
+
+bool Concurrency::start(const entry *e, const string &fname, int infd, Slot *slot, User *user) {
+	Spawner::JobId id;
+
+	if ((id = this->supervisor->run(e, fname, infd)) == 0) {
+		ELOG("Couldn't run %s:%d", fname.c_str(), e->lineno);
+		if (e->flags & WHEN_PERIOD)
+			this->periodic--;
+		return (false);
+	}
+	Job &job = this->jobs[id];
+	job.slot = slot;
+	job.user = user;
+	job.periodic = (e->flags & WHEN_PERIOD) != 0;
+	job.pos = slot->ids.insert(slot->ids.end(), id);
+	user->running++;
+	this->stats.started++;
+	return (true);
+}
+
+/* if the user's next job is held up only by the overall cap, it takes
+ * its turn with the others that are
+ */
+void Concurrency::release(User *user) {
+	if (user->ready || user->waiting.empty() || (user->max > 0 && user->running >= user->max))
+		return;
+	user->ready = true;
+	this->ready.push_back(user);
+}
+
+/* start waiting jobs while there's room, a user at a time */
+void Concurrency::pump() {
+	User *user;
+	Waiting *w;
+
+	while (!this->ready.empty() && (this->max == 0 || this->jobs.size() < this->max)) {
+		user = this->ready.front();
+		this->ready.pop_front();
+		user->ready = false;
+		if (!user->waiting.empty() && (user->max == 0 || user->running < user->max)) {
+			w = user->waiting.front();
+			user->waiting.pop_front();
+			this->nwaiting--;
+			w->slot->capped = false;
+			this->start(w->e, w->fname, w->infd, w->slot, user);
+			this->tidy(w->slot);
+			this->drop(w);
+			this->release(user);
+		}
+		this->tidy(user);
+	}
+}
+
+bool Concurrency::jobDone(const Supervisor::JobRun &run) {
+	boost::unordered_map<Spawner::JobId, Job>::iterator it = this->jobs.find(run.id);
+	Slot *slot;
+	User *user;
+	Waiting *w;
+
+	if (it == this->jobs.end())
+		return (false);
+	slot = it->second.slot;
+	user = it->second.user;
+	slot->ids.erase(it->second.pos);
+	user->running--;
+	if (it->second.periodic)
+		this->periodic--;
+	this->jobs.erase(it);
+	/* before the queued run, which is the same user's and may forget them */
+	this->release(user);
+	this->tidy(user);
+	/* a copy has finished, so the run queued behind it can go */
+	if ((w = slot->queued) != NULL) {
+		slot->queued = NULL;
+		this->nwaiting--;
+		this->admit(w->e, w->fname, w->infd, slot);
+		this->drop(w);
+	}
+	this->tidy(slot);
+	this->pump();
+	this->catchUp();
+	return (true);
+}
+
+/* start the @period jobs that waited for their cap, while it allows */
+void Concurrency::catchUp() {
+	Waiting *w;
+
+	while (!this->periods.empty() && (this->periodmax == 0 || this->periodic < this->periodmax)) {
+		w = this->periods.front();
+		this->periods.pop_front();
+		this->nwaiting--;
+		w->slot->capped = false;
+		this->admit(w->e, w->fname, w->infd, w->slot);
+		this->tidy(w->slot);
+		this->drop(w);
+	}
+}
+
+/* forget jobs and users with nothing running or waiting */
+void Concurrency::tidy(Slot *slot) {
+	string key;
+
+	if (slot->ids.empty() && slot->queued == NULL && !slot->capped) {
+		key.swap(slot->key);
+		this->slots.erase(key);
+	}
+}
+
+void Concurrency::tidy(User *user) {
+	string name;
+
+	if (user->running == 0 && user->waiting.empty() && !user->ready) {
+		name.swap(user->name);
+		this->users.erase(name);
+	}
+}
+
+void Concurrency::logStats() const {
+	RLOG("Concurrency: %lu started, %lu skipped, %lu queued, %lu killed, %lu waited for a cap",
+		this->stats.started, this->stats.skipped, this->stats.queued, this->stats.killed, this->stats.capped);
+	RLOG("%d jobs running, %d waiting, for %d users; %d @period jobs running, %d waiting their turn", (int)this->jobs.size(),
+		(int)this->nwaiting, (int)this->users.size(), (int)this->periodic, (int)this->periods.size());
+}
@@ -0,0 +1,406 @@
+/* Tinjac - crontabcache.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file crontabcache.cpp
+ *  @brief Precompiled crontabs, so startup doesn't have to parse them
+ */
+
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "log.hpp"
+#include "env.hpp"
+#include "misc.hpp"
+#include "usercache.hpp"
+#include "arena.hpp"
+#include "crontabcache.hpp"
+
+static const char cache_magic[4] = { 'T', 'J', 'C', 'C' };
+
+
+/* for the Arena, which only knows about void pointers */
+static void release_pw(void *p) {
+	pw_release((struct passwd *)p);
+}
+
+static void release_env(void *p) {
+	env_release((char **)p);
+}
+
+#ifdef __linux
+# define MTIME_NSEC(st)	((st).st_mtim.tv_nsec)
+#else
+# define MTIME_NSEC(st)	0
+#endif
+
+
+CrontabCache::CrontabCache(const string &fname) :
+	fname(fname), header(NULL), files(NULL), users(NULL), entries(NULL),
+	envs(NULL), envstrs(NULL), strings(NULL) {
+	memset(&this->stats, 0, sizeof(this->stats));
+}
+
+CrontabCache::~CrontabCache() {
+	this->close();
+}
+
+bool CrontabCache::open() {
+	struct stat st;
+
+	this->close();
+	if (stat(this->fname.c_str(), &st) != 0) {
+		DLOG("No crontab cache at %s", this->fname.c_str());
+		return (false);
+	}
+	if (!this->file.open(this->fname))
+		return (false);
+	if (!this->validate()) {
+		ELOG("Ignoring crontab cache %s, it isn't valid", this->fname.c_str());
+		this->close();
+		return (false);
+	}
+	for (uint32_t i = 0; i < this->header->nfiles; i++)
+		this->index[this->str(this->files[i].name)] = &this->files[i];
+	DLOG("Mapped crontab cache %s, %d crontabs and %d entries", this->fname.c_str(), (int)this->header->nfiles, (int)this->header->nentries);
+	return (true);
+}
+
+void CrontabCache::close() {
+	this->index.clear();
+	this->file.close();
+	this->header = NULL;
+}
+
+/* check everything we will use is inside the file, so load() doesn't
+ * have to
+ */
+bool CrontabCache::validate() {
+	const char *base = this->file.data();
+	size_t size = this->file.size(), off;
+	const Header *h = (const Header *)base;
+	uint32_t i;
+
+	if (size < sizeof(Header) || memcmp(h->magic, cache_magic, sizeof(cache_magic)) != 0 ||
+			h->version != CRONTAB_CACHE_VERSION || h->entrysize != sizeof(Entry))
+		return (false);
+	/* each table follows the last, and the strings come at the end */
+	off = sizeof(Header);
+	this->files = (const File *)(base + off);
+	off += (uint64_t)h->nfiles * sizeof(File);
+	this->users = (const User *)(base + off);
+	off += (uint64_t)h->nusers * sizeof(User);
+	this->entries = (const Entry *)(base + off);
+	off += (uint64_t)h->nentries * sizeof(Entry);
+	this->envs = (const Env *)(base + off);
+	off += (uint64_t)h->nenvs * sizeof(Env);
+	this->envstrs = (const uint32_t *)(base + off);
+	off += (uint64_t)h->nenvstrs * sizeof(uint32_t);
+	this->strings = base + off;
+	if (off > size || h->strsize != size - off || h->strsize == 0 || this->strings[h->strsize - 1] != '\0')
+		return (false);
+
+	for (i = 0; i < h->nfiles; i++)
+		if (this->files[i].name >= h->strsize || this->files[i].first > h->nentries ||
+				this->files[i].count > h->nentries - this->files[i].first)
+			return (false);
+	for (i = 0; i < h->nusers; i++)
+		if (this->users[i].name >= h->strsize || this->users[i].dir >= h->strsize)
+			return (false);
+	for (i = 0; i < h->nentries; i++)
+		if (this->entries[i].cmd >= h->strsize || this->entries[i].name >= h->strsize ||
+				this->entries[i].after >= h->strsize || this->entries[i].watch >= h->strsize ||
+				this->entries[i].user >= h->nusers ||
+				this->entries[i].env >= h->nenvs)
+			return (false);
+	for (i = 0; i < h->nenvs; i++)
+		if (this->envs[i].first > h->nenvstrs || this->envs[i].count > h->nenvstrs - this->envs[i].first)
+			return (false);
+	for (i = 0; i < h->nenvstrs; i++)
+		if (this->envstrs[i] >= h->strsize)
+			return (false);
+	this->header = h;
+	return (true);
+}
+
+bool CrontabCache::load(CrontabFile *ct, UserCache *userCache) {
+	map<string, const File *>::iterator it;
+	map<uint32_t, struct passwd *> pws;
+	map<uint32_t, struct passwd *>::iterator pw;
+	map<uint32_t, char **> jobenvs;
+	map<uint32_t, char **>::iterator env;
+	vector<char *> strs;
+	const File *f;
+	const Entry *ce;
+	const User *cu;
+	entry *e;
+	uint32_t i, j;
+
+	if (this->header == NULL || (it = this->index.find(ct->fname)) == this->index.end()) {
+		this->stats.misses++;
+		return (false);
+	}
+	f = it->second;
+	if (f->dev != (uint64_t)ct->sb.st_dev || f->ino != (uint64_t)ct->sb.st_ino ||
+			f->size != (uint64_t)ct->sb.st_size || f->mtime != (int64_t)ct->sb.st_mtime ||
+			f->mtimensec != (int64_t)MTIME_NSEC(ct->sb)) {
+		this->stats.misses++;
+		return (false);
+	}
+
+	/* the users first: if any of them has changed, the job environments
+	 * we have are wrong and the crontab needs parsing again
+	 */
+	for (i = f->first; i < f->first + f->count; i++) {
+		if (pws.count(this->entries[i].user))
+			continue;
+		cu = &this->users[this->entries[i].user];
+		struct passwd *upw = NULL;
+		if (userCache) {
+			upw = userCache->get(this->str(cu->name));
+		} else {
+			struct passwd *npw = getpwnam(this->str(cu->name));
+			if (npw != NULL)
+				upw = pw_dup(npw);
+		}
+		if (upw == NULL || upw->pw_uid != cu->uid || upw->pw_gid != cu->gid ||
+				strcmp(upw->pw_dir, this->str(cu->dir)) != 0) {
+			DLOG("%s runs as %s, who has changed since it was cached", ct->fname.c_str(), this->str(cu->name));
+			pw_release(upw);
+			goto miss;
+		}
+		pws[this->entries[i].user] = upw;
+	}
+
+	/* the arena holds one reference to each user and environment */
+	for (pw = pws.begin(); pw != pws.end(); ++pw)
+		if (!ct->arena.keep(pw->second, release_pw)) {
+			/* the ones before this are the arena's now */
+			pws.erase(pws.begin(), pw);
+			goto oom;
+		}
+	for (i = f->first; i < f->first + f->count; i++) {
+		ce = &this->entries[i];
+		if ((env = jobenvs.find(ce->env)) == jobenvs.end()) {
+			const Env *ve = &this->envs[ce->env];
+			char **job;
+			strs.clear();
+			for (j = ve->first; j < ve->first + ve->count; j++)
+				strs.push_back((char *)this->str(this->envstrs[j]));
+			strs.push_back(NULL);
+			if ((job = env_intern(&strs[0])) == NULL)
+				goto nomem;
+			if (!ct->arena.keep(job, release_env)) {
+				env_release(job);
+				goto nomem;
+			}
+			env = jobenvs.insert(make_pair(ce->env, job)).first;
+		}
+		if ((e = (entry *)ct->arena.alloc(sizeof(entry))) == NULL ||
+				(e->cmd = ct->arena.strndup(this->str(ce->cmd), strlen(this->str(ce->cmd)))) == NULL)
+			goto nomem;
+		if (ce->name && (e->name = ct->arena.strndup(this->str(ce->name), strlen(this->str(ce->name)))) == NULL)
+			goto nomem;
+		if (ce->after && (e->after = ct->arena.strndup(this->str(ce->after), strlen(this->str(ce->after)))) == NULL)
+			goto nomem;
+		if (ce->watch && (e->watch = ct->arena.strndup(this->str(ce->watch), strlen(this->str(ce->watch)))) == NULL)
+			goto nomem;
+		e->pwd = pws[ce->user];
+		e->envp = env->second;
+		e->lineno = ce->lineno;
+		e->spread = ce->spread;
+		e->period = ce->period;
+		e->flags = ce->flags;
+		memcpy(e->minute, ce->minute, sizeof(e->minute));
+		memcpy(e->hour, ce->hour, sizeof(e->hour));
+		memcpy(e->dom, ce->dom, sizeof(e->dom));
+		memcpy(e->month, ce->month, sizeof(e->month));
+		memcpy(e->dow, ce->dow, sizeof(e->dow));
+		ct->entries.push_back(e);
+	}
+	this->stats.hits++;
+	return (true);
+  nomem:
+	/* whatever we got is the arena's to let go of */
+	pws.clear();
+  oom:
+	ELOG("Out of memory loading %s from the cache", ct->fname.c_str());
+	ct->entries.clear();
+  miss:
+	for (pw = pws.begin(); pw != pws.end(); ++pw)
+		pw_release(pw->second);
+	this->stats.misses++;
+	return (false);
+}
+
+/* the string table, each distinct string stored once */
+class StringTable {
+public:
+	StringTable() : data(1, '\0') { }
+	uint32_t add(const char *s) {
+		map<string, uint32_t>::iterator it = this->offsets.find(s);
+		uint32_t off;
+
+		if (it != this->offsets.end())
+			return (it->second);
+		off = this->data.size();
+		this->data.insert(this->data.end(), s, s + strlen(s) + 1);
+		this->offsets[s] = off;
+		return (off);
+	}
+	vector<char> data;
+private:
+	map<string, uint32_t> offsets;
+};
+
+static bool write_all(int fd, const void *p, size_t len) {
+	const char *c = (const char *)p;
+	ssize_t wr;
+
+	while (len > 0) {
+		if ((wr = ::write(fd, c, len)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return (false);
+		}
+		c += wr;
+		len -= wr;
+	}
+	return (true);
+}
+
+bool CrontabCache::save(const CrontabFileMap &ctfiles) {
+	vector<File> vfiles;
+	vector<User> vusers;
+	vector<Entry> ventries;
+	vector<Env> venvs;
+	vector<uint32_t> venvstrs;
+	map<struct passwd *, uint32_t> userids;
+	map<char **, uint32_t> envids;
+	map<struct passwd *, uint32_t>::iterator uid;
+	map<char **, uint32_t>::iterator eid;
+	StringTable strs;
+	Header h;
+	string tmp = this->fname + ".tmp";
+	bool ok;
+	int fd;
+
+	for (CrontabFileMap::const_iterator it = ctfiles.begin(); it != ctfiles.end(); ++it) {
+		const CrontabFile *ct = it->second;
+		File f;
+
+		/* a crontab with errors is parsed each time, so they are logged,
+		 * and one still missing lines is parsed again once it has them
+		 */
+		if (ct->errors != 0 || ct->partial)
+			continue;
+		memset(&f, 0, sizeof(f));
+		f.dev = ct->sb.st_dev;
+		f.ino = ct->sb.st_ino;
+		f.size = ct->sb.st_size;
+		f.mtime = ct->sb.st_mtime;
+		f.mtimensec = MTIME_NSEC(ct->sb);
+		f.name = strs.add(ct->fname.c_str());
+		f.first = ventries.size();
+		f.count = ct->entries.size();
+		for (vector<entry *>::const_iterator e = ct->entries.begin(); e != ct->entries.end(); ++e) {
+			Entry ce;
+			memset(&ce, 0, sizeof(ce));
+			if ((uid = userids.find((*e)->pwd)) == userids.end()) {
+				User u;
+				u.name = strs.add((*e)->pwd->pw_name);
+				u.dir = strs.add((*e)->pwd->pw_dir);
+				u.uid = (*e)->pwd->pw_uid;
+				u.gid = (*e)->pwd->pw_gid;
+				uid = userids.insert(make_pair((*e)->pwd, (uint32_t)vusers.size())).first;
+				vusers.push_back(u);
+			}
+			if ((eid = envids.find((*e)->envp)) == envids.end()) {
+				Env env;
+				env.first = venvstrs.size();
+				for (char **p = (*e)->envp; *p != NULL; p++)
+					venvstrs.push_back(strs.add(*p));
+				env.count = venvstrs.size() - env.first;
+				eid = envids.insert(make_pair((*e)->envp, (uint32_t)venvs.size())).first;
+				venvs.push_back(env);
+			}
+			ce.cmd = strs.add((*e)->cmd);
+			/* never 0, that's the empty string we start with */
+			ce.name = (*e)->name ? strs.add((*e)->name) : 0;
+			ce.after = (*e)->after ? strs.add((*e)->after) : 0;
+			ce.watch = (*e)->watch ? strs.add((*e)->watch) : 0;
+			ce.user = uid->second;
+			ce.env = eid->second;
+			ce.lineno = (*e)->lineno;
+			ce.spread = (*e)->spread;
+			ce.period = (*e)->period;
+			ce.flags = (*e)->flags;
+			memcpy(ce.minute, (*e)->minute, sizeof(ce.minute));
+			memcpy(ce.hour, (*e)->hour, sizeof(ce.hour));
+			memcpy(ce.dom, (*e)->dom, sizeof(ce.dom));
+			memcpy(ce.month, (*e)->month, sizeof(ce.month));
+			memcpy(ce.dow, (*e)->dow, sizeof(ce.dow));
+			ventries.push_back(ce);
+		}
+		vfiles.push_back(f);
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, cache_magic, sizeof(cache_magic));
+	h.version = CRONTAB_CACHE_VERSION;
+	h.entrysize = sizeof(Entry);
+	h.nfiles = vfiles.size();
+	h.nusers = vusers.size();
+	h.nentries = ventries.size();
+	h.nenvs = venvs.size();
+	h.nenvstrs = venvstrs.size();
+	h.strsize = strs.data.size();
+
+	/* write it out on the side and rename it into place, so a crash (or
+	 * a full disk) never leaves half a cache behind
+	 */
+	if ((fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+		ELOG("Can't write crontab cache %s: %s", tmp.c_str(), strerror(errno));
+		return (false);
+	}
+	ok = write_all(fd, &h, sizeof(h)) &&
+		(vfiles.empty() || write_all(fd, &vfiles[0], vfiles.size() * sizeof(File))) &&
+		(vusers.empty() || write_all(fd, &vusers[0], vusers.size() * sizeof(User))) &&
+		(ventries.empty() || write_all(fd, &ventries[0], ventries.size() * sizeof(Entry))) &&
+		(venvs.empty() || write_all(fd, &venvs[0], venvs.size() * sizeof(Env))) &&
+		(venvstrs.empty() || write_all(fd, &venvstrs[0], venvstrs.size() * sizeof(uint32_t))) &&
+		write_all(fd, &strs.data[0], strs.data.size()) &&
+		fsync(fd) == 0;
+	if (::close(fd) != 0)
+		ok = false;
+	if (!ok || rename(tmp.c_str(), this->fname.c_str()) != 0) {
+		ELOG("Can't write crontab cache %s: %s", this->fname.c_str(), strerror(errno));
+		unlink(tmp.c_str());
+		return (false);
+	}
+	DLOG("Saved %d crontabs, %d entries to %s", (int)vfiles.size(), (int)ventries.size(), this->fname.c_str());
+	return (true);
+}
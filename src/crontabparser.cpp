@@ -0,0 +1,1213 @@
+/* Tinjac - crontabparser.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+** Portions Copyright:
+** Copyright 1988,1990,1993,1994 by Paul Vixie
+**
+** Copyright (c) 2004 by Internet Systems Consortium, Inc. ("ISC")
+** Copyright (c) 1997,2000 by Internet Software Consortium, Inc.
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file crontabparser.cpp
+ *  @brief Single pass tokenizer for Vixie/cronie formated crontabs
+ */
+
+
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <cerrno>
+#include "log.hpp"
+#include "env.hpp"
+#include "misc.hpp"
+#include "usercache.hpp"
+#include "arena.hpp"
+#include "crontabparser.hpp"
+
+
+typedef enum ecode {
+	e_none, e_minute, e_hour, e_dom, e_month, e_dow,
+	e_cmd, e_timespec, e_username, e_option, e_memory, e_label,
+	e_spread, e_period, e_pipe
+} ecode_e;
+
+static const char *ecodes[] = {
+	"no error",
+	"bad minute",
+	"bad hour",
+	"bad day-of-month",
+	"bad month",
+	"bad day-of-week",
+	"bad command",
+	"bad time specifier",
+	"bad username",
+	"bad option",
+	"out of memory",
+	"bad job label",
+	"bad spread window",
+	"bad period",
+	"@pipe from more than one job"
+};
+
+const char *MonthNames[]
+	= {
+		"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+		"Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+		NULL
+	};
+
+const char *DowNames[]
+	= {
+		"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat", "Sun",
+		NULL
+	};
+
+
+enum env_state {
+	NAMEI,		/* First char of NAME, may be quote */
+	NAME,		/* Subsequent chars of NAME */
+	EQ1,		/* After end of name, looking for '=' sign */
+	EQ2,		/* After '=', skipping whitespace */
+	VALUEI,		/* First char of VALUE, may be quote */
+	VALUE,		/* Subsequent chars of VALUE */
+	FINI,		/* All done, skipping trailing whitespace */
+	ERROR		/* Error */
+};
+
+
+/* for the Arena, which only knows about void pointers */
+static void release_pw(void *p) {
+	pw_release((struct passwd *)p);
+}
+
+static void release_env(void *p) {
+	env_release((char **)p);
+}
+
+CrontabParser::CrontabParser(const char *data, size_t len, string fname) :
+	begin(data), pos(data), end(data + len), fname(fname), users(NULL), arena(NULL), LineNumber(1), Errors(0) {
+}
+
+CrontabParser::~CrontabParser() {
+	for (map<pair<char **, struct passwd *>, char **>::iterator it = this->envs.begin(); it != this->envs.end(); ++it) {
+		env_release(it->first.first);
+		pw_release(it->first.second);
+		env_release(it->second);
+	}
+}
+
+/* return ERR = end of file
+ *	  FALSE = not an env setting (file was repositioned)
+ *	  TRUE = was an env setting
+ */
+int CrontabParser::load_env(char *envstr) {
+	const char *savepos;
+	int saveline;
+	enum env_state state;
+	char name[MAX_ENVSTR], val[MAX_ENVSTR];
+	char quotechar, *str;
+	const char *c, *line;
+	size_t linelen;
+	int ch;
+
+	savepos = this->pos;
+	saveline = this->LineNumber;
+	skip_comments();
+	ch = get_token(&line, &linelen, "\n");
+	if (ch == EOF && linelen == 0)
+		return (ERR);
+	if (linelen >= MAX_ENVSTR)
+		linelen = MAX_ENVSTR - 1;
+
+	/* no bzero() of the buffers, this runs for every line of the
+	 * file; the strings are terminated as we switch between them.
+	 */
+	name[0] = val[0] = '\0';
+	str = name;
+	state = NAMEI;
+	quotechar = '\0';
+	c = line;
+	while (state != ERROR && c < line + linelen) {
+		switch (state) {
+		case NAMEI:
+		case VALUEI:
+			if (*c == '\'' || *c == '"')
+				quotechar = *c++;
+			state = (enum env_state)(state + 1);
+			/* FALLTHROUGH */
+		case NAME:
+		case VALUE:
+			if (quotechar) {
+				if (*c == quotechar) {
+					state = (enum env_state)(state + 1);
+					c++;
+					break;
+				}
+				if (state == NAME && *c == '=') {
+					state = ERROR;
+					break;
+				}
+			}
+			else {
+				if (state == NAME) {
+					if (isspace((unsigned char) *c)) {
+						c++;
+						state = (enum env_state)(state + 1);
+						break;
+					}
+					if (*c == '=') {
+						state = (enum env_state)(state + 1);
+						break;
+					}
+				}
+			}
+			*str++ = *c++;
+			break;
+
+		case EQ1:
+			if (*c == '=') {
+				state = (enum env_state)(state + 1);
+				*str = '\0';
+				str = val;
+				quotechar = '\0';
+			}
+			else {
+				if (!isspace((unsigned char) *c))
+					state = ERROR;
+			}
+			c++;
+			break;
+
+		case EQ2:
+		case FINI:
+			if (isspace((unsigned char) *c))
+				c++;
+			else
+				state = (enum env_state)(state + 1);
+			break;
+
+		default:
+			abort();
+		}
+	}
+	*str = '\0';
+	if (state != FINI && !(state == VALUE && !quotechar)) {
+		/* not an env var, rewind so load_entry() sees the line */
+		this->pos = savepos;
+		this->LineNumber = saveline;
+		return (FALSE);
+	}
+	if (state == VALUE) {
+		/* End of unquoted value: trim trailing whitespace */
+		str = val + strlen(val);
+		while (str > val && isspace((unsigned char) str[-1]))
+			*(--str) = '\0';
+	}
+
+	/* 2 fields from parser; looks like an env setting */
+
+	if (!glue_strings(envstr, MAX_ENVSTR, name, val, '='))
+		return (FALSE);
+	return (TRUE);
+}
+
+/* return NULL if eof or syntax error occurs;
+ * otherwise return a pointer to a new entry.
+ */
+entry *CrontabParser::load_entry(struct passwd *pw, char **envp) {
+	/* this function reads one crontab entry -- the next -- from the buffer.
+	 * it skips any leading blank lines, ignores comments, and returns
+	 * NULL if for any reason the entry can't be read and parsed.
+	 *
+	 * the entry is also parsed here.
+	 *
+	 * syntax:
+	 *   user crontab:
+	 *  minutes hours doms months dows cmd\n
+	 *   system crontab (/etc/crontab):
+	 *  minutes hours doms months dows USERNAME cmd\n
+	 *   either can label an entry for others to chain to:
+	 *  label: minutes hours doms months dows ...\n
+	 *  label: @after|@success|@failure|@pipe label[,label...] ...\n
+	 *   or run as files change:
+	 *  @watch[~window] /path[,/path...] ...\n
+	 *   (where a path may end in ** for the tree under it)
+	 *   or once a period, as anacron would:
+	 *  @period[~delay] daily|weekly|monthly|N[d|h|m] ...\n
+	 */
+
+	ecode_e ecode = e_none;
+	entry *e;
+	int ch;
+	int line;
+	const char *tok, *tilde;
+	size_t toklen;
+
+	skip_comments();
+
+	ch = get_char();
+	if (ch == EOF)
+		return (NULL);
+
+	/* entries never span lines, so errors are reported against the
+	 * line we start on, whatever we have consumed by then.
+	 */
+	line = this->LineNumber;
+
+	/* ch is now the first useful character of a useful line.
+	 * it may be an @special or it may be the first character
+	 * of a list of minutes.
+	 */
+
+	if (this->arena)
+		e = (entry *) this->arena->alloc(sizeof (entry));
+	else
+		e = (entry *) calloc(sizeof (entry), sizeof (char));
+	if (e == NULL) {
+		ELOG("Out of memory loading %s line %d", this->fname.c_str(), line);
+		this->Errors++;
+		return (NULL);
+	}
+	e->lineno = line;
+
+	/* a label, for other entries to run @after */
+	if (isalpha(ch) || ch == '_') {
+		unget_char(ch);
+		ch = get_token(&tok, &toklen, ": \t\n");
+		if (ch != ':' || !valid_label(tok, toklen)) {
+			ecode = e_label;
+			goto eof;
+		}
+		if ((e->name = this->dup_token(tok, toklen)) == NULL) {
+			ecode = e_memory;
+			goto eof;
+		}
+		do {
+			ch = get_char();
+		} while (ch == ' ' || ch == '\t');
+		if (ch == EOF || ch == '\n') {
+			ecode = e_cmd;
+			goto eof;
+		}
+	}
+
+	/* check for '-' as a first character, this option will disable
+	* writing a syslog message about command getting executed
+	*/
+	if (ch == '-') {
+	/* if we are editing system crontab or user uid is 0 (root)
+	* we are allowed to disable logging
+	*/
+		if (pw == NULL || pw->pw_uid == 0)
+			e->flags |= DONT_LOG;
+		else {
+			ELOG("Only Privileged Users can disable Logging in %s line %d", this->fname.c_str(), line);
+			ecode = e_option;
+			goto eof;
+		}
+		ch = get_char();
+		if (ch == EOF) {
+			this->discard(e);
+			return NULL;
+		}
+	}
+
+	if (ch == '@') {
+		/* all of these should be flagged and load-limited; i.e.,
+		 * instead of @hourly meaning "0 * * * *" it should mean
+		 * "close to the front of every hour but not 'til the
+		 * system load is low".  Problems are: how do you know
+		 * what "low" means? (save me from /etc/cron.conf!) and:
+		 * how to guarantee low variance (how low is low?), which
+		 * means how to we run roughly every hour -- seems like
+		 * we need to keep a history or let the first hour set
+		 * the schedule, which means we aren't load-limited
+		 * anymore.  too much for my overloaded brain. (vix, jan90)
+		 * HINT
+		 *
+		 * The periodic ones are flagged LOAD_LIMITED; Admission
+		 * holds them while the load is above the number of CPUs,
+		 * and DEFER_MAX bounds how far that lets them drift.
+		 *
+		 * "Close to the front of every hour" is @hourly~15m: each
+		 * job fires at its own fixed point in the first 15 minutes
+		 * (see Scheduler), rather than all of them at once on :00.
+		 */
+		ch = get_token(&tok, &toklen, " \t\n");
+		if ((tilde = (const char *)memchr(tok, '~', toklen)) != NULL) {
+			if ((e->spread = parse_window(tilde + 1, tok + toklen - tilde - 1)) <= 0) {
+				ecode = e_spread;
+				goto eof;
+			}
+			toklen = tilde - tok;
+		}
+#define TOKEN_IS(s) (toklen == sizeof(s) - 1 && !strncmp(s, tok, toklen))
+		if (TOKEN_IS("reboot")) {
+			e->flags |= WHEN_REBOOT;
+		}
+		else if (TOKEN_IS("yearly") || TOKEN_IS("annually")) {
+			bit_set(e->minute, 0);
+			bit_set(e->hour, 0);
+			bit_set(e->dom, 0);
+			bit_set(e->month, 0);
+			bit_nset(e->dow, 0, (LAST_DOW - FIRST_DOW));
+			e->flags |= DOW_STAR;
+		}
+		else if (TOKEN_IS("monthly")) {
+			bit_set(e->minute, 0);
+			bit_set(e->hour, 0);
+			bit_set(e->dom, 0);
+			bit_nset(e->month, 0, (LAST_MONTH - FIRST_MONTH));
+			bit_nset(e->dow, 0, (LAST_DOW - FIRST_DOW));
+			e->flags |= DOW_STAR;
+		}
+		else if (TOKEN_IS("weekly")) {
+			bit_set(e->minute, 0);
+			bit_set(e->hour, 0);
+			bit_nset(e->dom, 0, (LAST_DOM - FIRST_DOM));
+			bit_nset(e->month, 0, (LAST_MONTH - FIRST_MONTH));
+			bit_set(e->dow, 0);
+			e->flags |= DOW_STAR;
+		}
+		else if (TOKEN_IS("daily") || TOKEN_IS("midnight")) {
+			bit_set(e->minute, 0);
+			bit_set(e->hour, 0);
+			bit_nset(e->dom, 0, (LAST_DOM - FIRST_DOM));
+			bit_nset(e->month, 0, (LAST_MONTH - FIRST_MONTH));
+			bit_nset(e->dow, 0, (LAST_DOW - FIRST_DOW));
+		}
+		else if (TOKEN_IS("hourly")) {
+			bit_set(e->minute, 0);
+			bit_nset(e->hour, 0, (LAST_HOUR - FIRST_HOUR));
+			bit_nset(e->dom, 0, (LAST_DOM - FIRST_DOM));
+			bit_nset(e->month, 0, (LAST_MONTH - FIRST_MONTH));
+			bit_nset(e->dow, 0, (LAST_DOW - FIRST_DOW));
+			e->flags |= HR_STAR;
+		}
+		else if (TOKEN_IS("after") || TOKEN_IS("success") || TOKEN_IS("failure") || TOKEN_IS("pipe")) {
+			/* no schedule, these run when the jobs they follow finish
+			 * (or for @pipe, start)
+			 */
+			e->flags |= WHEN_AFTER;
+			if (TOKEN_IS("success"))
+				e->flags |= AFTER_SUCCESS;
+			else if (TOKEN_IS("failure"))
+				e->flags |= AFTER_FAILURE;
+			else if (TOKEN_IS("pipe"))
+				e->flags |= AFTER_PIPE;
+			while (ch == '\t' || ch == ' ')
+				ch = get_char();
+			unget_char(ch);
+			ch = get_token(&tok, &toklen, " \t\n");
+			if (toklen == 0 || !valid_labels(tok, toklen)) {
+				ecode = e_timespec;
+				goto eof;
+			}
+			/* a job's stdin can only come from the one job */
+			if ((e->flags & AFTER_PIPE) && memchr(tok, ',', toklen)) {
+				ecode = e_pipe;
+				goto eof;
+			}
+			if ((e->after = this->dup_token(tok, toklen)) == NULL) {
+				ecode = e_memory;
+				goto eof;
+			}
+		}
+		else if (TOKEN_IS("watch")) {
+			/* runs when files change under the paths, gathered up
+			 * over the ~window (see FileWatch)
+			 */
+			e->flags |= WHEN_WATCH;
+			while (ch == '\t' || ch == ' ')
+				ch = get_char();
+			unget_char(ch);
+			ch = get_token(&tok, &toklen, " \t\n");
+			if (toklen == 0 || !valid_paths(tok, toklen)) {
+				ecode = e_timespec;
+				goto eof;
+			}
+			if ((e->watch = this->dup_token(tok, toklen)) == NULL) {
+				ecode = e_memory;
+				goto eof;
+			}
+		}
+		else if (TOKEN_IS("period")) {
+			/* runs once a period from its last run, which may have
+			 * been before we were last started, and put off by up to
+			 * ~delay (see Scheduler)
+			 */
+			e->flags |= WHEN_PERIOD;
+			while (ch == '\t' || ch == ' ')
+				ch = get_char();
+			unget_char(ch);
+			ch = get_token(&tok, &toklen, " \t\n");
+			if ((e->period = parse_period(tok, toklen)) == 0) {
+				ecode = e_period;
+				goto eof;
+			}
+		}
+		else {
+			ecode = e_timespec;
+			goto eof;
+		}
+		if (!(e->flags & (WHEN_REBOOT | WHEN_AFTER | WHEN_WATCH)))
+			e->flags |= LOAD_LIMITED;
+		else if (e->spread && !(e->flags & WHEN_WATCH)) {
+			/* nothing to spread, they don't run on the clock */
+			ecode = e_spread;
+			goto eof;
+		}
+#undef TOKEN_IS
+		/* Advance past whitespace between shortcut and
+		 * username/command.
+		 */
+		while (ch == '\t' || ch == ' ')
+			ch = get_char();
+		if (ch == EOF || ch == '\n') {
+			ecode = e_cmd;
+			goto eof;
+		}
+	}
+	else {
+		if (ch == '*')
+			e->flags |= MIN_STAR;
+		ch = get_list(e->minute, FIRST_MINUTE, LAST_MINUTE, PPC_NULL, ch);
+		if (ch == EOF) {
+			ecode = e_minute;
+			goto eof;
+		}
+
+		/* hours
+		 */
+
+		if (ch == '*')
+			e->flags |= HR_STAR;
+		ch = get_list(e->hour, FIRST_HOUR, LAST_HOUR, PPC_NULL, ch);
+		if (ch == EOF) {
+			ecode = e_hour;
+			goto eof;
+		}
+
+		/* DOM (days of month)
+		 */
+
+		if (ch == '*')
+			e->flags |= DOM_STAR;
+		ch = get_list(e->dom, FIRST_DOM, LAST_DOM, PPC_NULL, ch);
+		if (ch == EOF) {
+			ecode = e_dom;
+			goto eof;
+		}
+
+		/* month
+		 */
+		if (ch == '*')
+			e->flags |= MON_STAR;
+		ch = get_list(e->month, FIRST_MONTH, LAST_MONTH, MonthNames, ch);
+		if (ch == EOF) {
+			ecode = e_month;
+			goto eof;
+		}
+
+		/* DOW (days of week)
+		 */
+
+		if (ch == '*')
+			e->flags |= DOW_STAR;
+		ch = get_list(e->dow, FIRST_DOW, LAST_DOW, DowNames, ch);
+		if (ch == EOF) {
+			ecode = e_dow;
+			goto eof;
+		}
+	}
+
+	/* make sundays equivalent */
+	if (bit_test(e->dow, 0) || bit_test(e->dow, 7)) {
+		bit_set(e->dow, 0);
+		bit_set(e->dow, 7);
+	}
+
+	/* check for permature EOL and catch a common typo */
+	if (ch == '\n' || ch == '*') {
+		ecode = e_cmd;
+		goto eof;
+	}
+
+	/* ch is the first character of a command, or a username */
+	unget_char(ch);
+
+	if (!pw) {
+		char username[MAX_UNAME];
+
+		ch = get_token(&tok, &toklen, " \t\n");
+		if (ch == EOF || ch == '\n' || ch == '*') {
+			ecode = e_cmd;
+			goto eof;
+		}
+		if (toklen >= sizeof(username)) {
+			ecode = e_username;
+			goto eof;
+		}
+		memcpy(username, tok, toklen);
+		username[toklen] = '\0';
+
+		if (this->users) {
+			/* not an error, the line is loaded once we know */
+			if ((e->pwd = this->users->get(username)) == NULL && this->users->looking(username)) {
+				this->waiting.insert(username);
+				goto eof;
+			}
+		} else if ((pw = getpwnam(username)) != NULL && (e->pwd = pw_dup(pw)) == NULL) {
+			ecode = e_memory;
+			goto eof;
+		}
+	} else if (this->users) {
+		/* the owner of a user crontab comes from the cache too, so this
+		 * is the record that was passed in
+		 */
+		e->pwd = this->users->get(pw->pw_name);
+	} else if ((e->pwd = pw_dup(pw)) == NULL) {
+		ecode = e_memory;
+		goto eof;
+	}
+	if (e->pwd == NULL) {
+		ecode = e_username;
+		goto eof;
+	}
+	pw = e->pwd;
+
+	/* entries with the same settings and user share one environment */
+	if ((e->envp = this->job_env(envp, pw, line)) == NULL) {
+		ecode = e_memory;
+		goto eof;
+	}
+
+	/* Everything up to the next \n or EOF is part of the command.
+	 * The command is sliced straight out of the buffer, we still
+	 * cap it at MAX_COMMAND to match what the shell will accept.
+	 */
+	ch = get_token(&tok, &toklen, "\n");
+
+	/* a file without a \n before the EOF is rude, so we'll complain...
+	 */
+	if (ch == EOF) {
+		ecode = e_cmd;
+		goto eof;
+	}
+
+	/* got the command; save it in *e.
+	 */
+	if (toklen >= MAX_COMMAND)
+		toklen = MAX_COMMAND - 1;
+	if ((e->cmd = this->dup_token(tok, toklen)) == NULL) {
+		ecode = e_memory;
+		goto eof;
+	}
+	/* the arena holds the references for the whole file */
+	if (this->arena) {
+		/* adopt() lets go of what it can't keep, so when pwd fails envp
+		 * is still ours for discard() to release
+		 */
+		if (!this->adopt(e->pwd, release_pw)) {
+			e->pwd = NULL;
+			ecode = e_memory;
+			goto eof;
+		}
+		/* and when envp fails pwd already belongs to the arena */
+		if (!this->adopt(e->envp, release_env)) {
+			e->pwd = NULL;
+			e->envp = NULL;
+			ecode = e_memory;
+			goto eof;
+		}
+	}
+
+	DLOG("load_entry()...parsed %s line %d", this->fname.c_str(), line);
+
+		/* success, fini, return pointer to the entry we just created...
+		 */
+		return (e);
+
+  eof:
+	this->discard(e);
+	while (ch != '\n' && !eof())
+		ch = get_char();
+	if (ecode != e_none) {
+		this->Errors++;
+		ELOG("Error: %s in %s line %d", ecodes[(int) ecode], this->fname.c_str(), line);
+	}
+	return (NULL);
+}
+
+/* the environment a job runs with: envp from the crontab plus defaults
+ * and the user's details. Each distinct pair of settings and user is
+ * only worked out once per file, and the result is interned, so there is
+ * one copy however many entries use it.
+ */
+char **CrontabParser::job_env(char **envp, struct passwd *pw, int line) {
+	map<pair<char **, struct passwd *>, char **>::iterator it;
+	char envstr[MAX_ENVSTR];
+	char **base, **jenvp, **tenvp, **job;
+
+	if ((base = env_intern(envp)) == NULL)
+		return (NULL);
+	if ((it = this->envs.find(make_pair(base, pw))) != this->envs.end()) {
+		env_release(base);
+		return (env_hold(it->second));
+	}
+
+	/* copy and fix up environment.  some variables are just defaults and
+	 * others are overrides.
+	 */
+	if ((jenvp = env_copy(envp)) == NULL) {
+		env_release(base);
+		return (NULL);
+	}
+	if (!env_get((char *)"SHELL", jenvp)) {
+		if (glue_strings(envstr, sizeof envstr, "SHELL", _PATH_BSHELL, '=')) {
+			if ((tenvp = env_set(jenvp, envstr)) == NULL)
+				goto oom;
+			jenvp = tenvp;
+		}
+		else
+			ELOG("ERROR: can't set SHELL in %s line %d", this->fname.c_str(), line);
+	}
+	if (!env_get((char *)"HOME", jenvp)) {
+		if (glue_strings(envstr, sizeof envstr, "HOME", pw->pw_dir, '=')) {
+			if ((tenvp = env_set(jenvp, envstr)) == NULL)
+				goto oom;
+			jenvp = tenvp;
+		}
+		else
+			ELOG("ERROR: can't set HOME in %s line %d", this->fname.c_str(), line);
+	}
+#ifndef LOGIN_CAP
+	/* If login.conf is in used we will get the default PATH later. */
+	if (!env_get((char *)"PATH", jenvp)) {
+		if (glue_strings(envstr, sizeof envstr, "PATH", _PATH_DEFPATH, '=')) {
+			if ((tenvp = env_set(jenvp, envstr)) == NULL)
+				goto oom;
+			jenvp = tenvp;
+		}
+		else
+			ELOG("ERROR can't set PATH in %s line %d", this->fname.c_str(), line);
+	}
+#endif /* LOGIN_CAP */
+	if (glue_strings(envstr, sizeof envstr, "LOGNAME", pw->pw_name, '=')) {
+		if ((tenvp = env_set(jenvp, envstr)) == NULL)
+			goto oom;
+		jenvp = tenvp;
+	}
+	else
+		ELOG("ERROR can't set LOGNAME in %s line %d", this->fname.c_str(), line);
+#if defined(BSD) || defined(__linux)
+	if (glue_strings(envstr, sizeof envstr, "USER", pw->pw_name, '=')) {
+		if ((tenvp = env_set(jenvp, envstr)) == NULL)
+			goto oom;
+		jenvp = tenvp;
+	}
+	else
+		ELOG("ERROR can't set USER in %s line %d", this->fname.c_str(), line);
+#endif
+
+	job = env_intern(jenvp);
+	env_free(jenvp);
+	if (job == NULL) {
+		env_release(base);
+		return (NULL);
+	}
+	/* we keep a reference to the key too, so neither can be freed and
+	 * reused while it's in here
+	 */
+	this->envs[make_pair(base, pw_hold(pw))] = job;
+	return (env_hold(job));
+  oom:
+	env_free(jenvp);
+	env_release(base);
+	return (NULL);
+}
+
+/* hand our reference to p over to the arena, which only keeps one
+ * reference to each thing however many entries use it
+ */
+bool CrontabParser::adopt(void *p, void (*release)(void *)) {
+	if (!this->kept.insert(p).second) {
+		release(p);
+		return (true);
+	}
+	if (!this->arena->keep(p, release)) {
+		this->kept.erase(p);
+		release(p);
+		return (false);
+	}
+	return (true);
+}
+
+/* a copy of a token, from the arena if there is one */
+char *CrontabParser::dup_token(const char *tok, size_t len) {
+	if (this->arena)
+		return (this->arena->strndup(tok, len));
+	return (strndup(tok, len));
+}
+
+/* let go of an entry that didn't load */
+void CrontabParser::discard(entry *e) {
+	if (!this->arena) {
+		free_entry(e);
+		return;
+	}
+	/* the memory goes with the arena, the references are still ours */
+	if (e->envp)
+		env_release(e->envp);
+	if (e->pwd)
+		pw_release(e->pwd);
+}
+
+void free_entry(entry *e) {
+	if (e->envp)
+		env_release(e->envp);
+	if (e->pwd)
+		pw_release(e->pwd);
+	if (e->cmd)
+		free(e->cmd);
+	if (e->name)
+		free(e->name);
+	if (e->after)
+		free(e->after);
+	if (e->watch)
+		free(e->watch);
+	free(e);
+}
+
+entry *copy_entry(const entry *e) {
+	entry *copy;
+
+	if ((copy = (entry *)calloc(1, sizeof(entry))) == NULL)
+		return (NULL);
+	*copy = *e;
+	copy->cmd = copy->name = copy->after = copy->watch = NULL;
+	copy->pwd = pw_hold(e->pwd);
+	copy->envp = env_hold(e->envp);
+	if ((copy->cmd = strdup(e->cmd)) == NULL ||
+			(e->name && (copy->name = strdup(e->name)) == NULL) ||
+			(e->after && (copy->after = strdup(e->after)) == NULL) ||
+			(e->watch && (copy->watch = strdup(e->watch)) == NULL)) {
+		free_entry(copy);
+		return (NULL);
+	}
+	return (copy);
+}
+
+int CrontabParser::get_list(bitstr_t * bits, int low, int high, const char *names[], int ch) {
+	int done;
+
+	/* we know that we point to a non-blank character here;
+	 * must do a Skip_Blanks before we exit, so that the
+	 * next call (or the code that picks up the cmd) can
+	 * assume the same thing.
+	 */
+
+	/* list = range {"," range}
+	 */
+	/* clear the bit string, since the default is 'off'.
+	 */
+	bit_nclear(bits, 0, (high - low));
+
+	/* process all ranges
+	 */
+	done = FALSE;
+	while (!done) {
+		if (EOF == (ch = get_range(bits, low, high, names, ch)))
+			return (EOF);
+		if (ch == ',')
+			ch = get_char();
+		else
+			done = TRUE;
+	}
+
+	/* exiting.  skip to some blanks, then skip over the blanks.
+	 */
+	while (ch != '\t' && ch != ' ' && ch != '\n' && ch != EOF)
+		ch = get_char();
+	while (ch == '\t' || ch == ' ')
+		ch = get_char();
+
+	return (ch);
+}
+
+int CrontabParser::get_range(bitstr_t * bits, int low, int high, const char *names[], int ch) {
+	/* range = number | number "-" number [ "/" number ]
+	 */
+
+	int i, num1, num2, num3;
+
+	if (ch == '*') {
+		/* '*' means "first-last" but can still be modified by /step
+		 */
+		num1 = low;
+		num2 = high;
+		ch = get_char();
+		if (ch == EOF)
+			return (EOF);
+	}
+	else {
+		ch = get_number(&num1, low, names, ch, ",- \t\n");
+		if (ch == EOF)
+			return (EOF);
+
+		if (ch != '-') {
+			/* not a range, it's a single number.
+			 */
+			if (EOF == set_element(bits, low, high, num1)) {
+				unget_char(ch);
+				return (EOF);
+			}
+			return (ch);
+		}
+		else {
+			/* eat the dash
+			 */
+			ch = get_char();
+			if (ch == EOF)
+				return (EOF);
+
+			/* get the number following the dash
+			 */
+			ch = get_number(&num2, low, names, ch, "/, \t\n");
+			if (ch == EOF || num1 > num2)
+				return (EOF);
+		}
+	}
+
+	/* check for step size
+	 */
+	if (ch == '/') {
+		/* eat the slash
+		 */
+		ch = get_char();
+		if (ch == EOF)
+			return (EOF);
+
+		/* get the step size -- note: we don't pass the
+		 * names here, because the number is not an
+		 * element id, it's a step size.  'low' is
+		 * sent as a 0 since there is no offset either.
+		 */
+		ch = get_number(&num3, 0, PPC_NULL, ch, ", \t\n");
+		if (ch == EOF || num3 == 0)
+			return (EOF);
+	}
+	else {
+		/* no step.  default==1.
+		 */
+		num3 = 1;
+	}
+
+	/* range. set all elements from num1 to num2, stepping
+	 * by num3.  (the step is a downward-compatible extension
+	 * proposed conceptually by bob@acornrc, syntactically
+	 * designed then implemented by paul vixie).
+	 */
+	for (i = num1; i <= num2; i += num3)
+		if (EOF == set_element(bits, low, high, i)) {
+			unget_char(ch);
+			return (EOF);
+		}
+
+	return (ch);
+}
+
+int CrontabParser::get_number(int *numptr, int low, const char *names[], int ch, const char *terms) {
+	const char *start;
+	int len, i, num;
+
+	/* we are sitting one past ch, the first character of the number */
+	start = this->pos - 1;
+	len = 0;
+	num = 0;
+
+	/* first look for a number */
+	while (isdigit((unsigned char) ch)) {
+		if (++len >= MAX_TEMPSTR)
+			goto bad;
+		/* anything this long is out of range for every field */
+		if (num < 100000)
+			num = num * 10 + (ch - '0');
+		ch = get_char();
+	}
+	if (len != 0) {
+		/* got a number, check for valid terminator */
+		if (ch == EOF || !strchr(terms, ch))
+			goto bad;
+		*numptr = num;
+		return (ch);
+	}
+
+	/* no numbers, look for a string if we have any */
+	if (names) {
+		while (isalpha((unsigned char) ch)) {
+			if (++len >= MAX_TEMPSTR)
+				goto bad;
+			ch = get_char();
+		}
+		if (len != 0 && ch != EOF && strchr(terms, ch)) {
+			for (i = 0; names[i] != NULL; i++) {
+				if (strlen(names[i]) == (size_t)len && !strncasecmp(names[i], start, len)) {
+					*numptr = i + low;
+					return (ch);
+				}
+			}
+		}
+	}
+
+  bad:
+	unget_char(ch);
+	return (EOF);
+}
+
+int CrontabParser::set_element(bitstr_t * bits, int low, int high, int number) {
+	if (number < low || number > high)
+		return (EOF);
+
+	bit_set(bits, (number - low));
+	return (OK);
+}
+
+/* get_token(start, len, termstr) : the zero copy version of get_string()
+ *      (1) has terminator string which should include \n
+ *      (2) points *start into the buffer, *len chars long; the token
+ *          is not nul terminated
+ *      (3) uses get_char() so LineNumber will be accurate
+ *      (4) returns EOF or terminating character, whichever
+ */
+int CrontabParser::get_token(const char **start, size_t *len, const char *terms) {
+	int ch;
+
+	*start = this->pos;
+	while (EOF != (ch = get_char()) && !strchr(terms, ch))
+		;
+	*len = this->pos - *start;
+	if (ch != EOF)
+		(*len)--;
+	return (ch);
+}
+
+/* skip_comments() : read past comment (if any)
+ */
+void CrontabParser::skip_comments() {
+	int ch;
+
+	while (EOF != (ch = get_char())) {
+		/* ch is now the first character of a line.
+		 */
+		while (ch == ' ' || ch == '\t')
+			ch = get_char();
+
+		if (ch == EOF)
+			break;
+
+		/* ch is now the first non-blank character of a line.
+		 */
+
+		if (ch != '\n' && ch != '#')
+			break;
+
+		/* ch must be a newline or comment as first non-blank
+		 * character on a line.
+		 */
+
+		if (ch == '#') {
+			const char *nl = (const char *)memchr(this->pos, '\n', this->end - this->pos);
+			this->pos = nl ? nl : this->end;
+			ch = get_char();
+		}
+
+		/* ch is now the newline of a line which we're going to
+		 * ignore.
+		 */
+	}
+	if (ch != EOF)
+		unget_char(ch);
+}
+
+static inline size_t hash_bytes(size_t hash, const void *p, size_t len) {
+	const unsigned char *c = (const unsigned char *)p;
+
+	while (len--)
+		hash = (hash ^ *c++) * 16777619u;
+	return (hash);
+}
+
+/* either may be NULL */
+static bool same_string(const char *a, const char *b) {
+	if (a == NULL || b == NULL)
+		return (a == b);
+	return (!strcmp(a, b));
+}
+
+/* a label is a letter or _ and then letters, digits, _, - and . */
+bool valid_label(const char *s, size_t len) {
+	size_t i;
+
+	if (len == 0 || !(isalpha((unsigned char)s[0]) || s[0] == '_'))
+		return (false);
+	for (i = 1; i < len; i++)
+		if (!isalnum((unsigned char)s[i]) && !strchr("_-.", s[i]))
+			return (false);
+	return (true);
+}
+
+/* a comma separated list of them */
+bool valid_labels(const char *s, size_t len) {
+	const char *comma, *end = s + len;
+
+	for (;;) {
+		comma = (const char *)memchr(s, ',', end - s);
+		if (!valid_label(s, (comma ? comma : end) - s))
+			return (false);
+		if (comma == NULL)
+			return (true);
+		s = comma + 1;
+	}
+}
+
+/* a comma separated list of absolute paths, any of which may have **
+ * as its last part, for everything under it
+ */
+bool valid_paths(const char *s, size_t len) {
+	const char *comma, *end = s + len, *stars;
+	size_t n;
+
+	for (;;) {
+		comma = (const char *)memchr(s, ',', end - s);
+		n = (comma ? comma : end) - s;
+		if (n == 0 || *s != '/')
+			return (false);
+		/* ** is only a whole last component, and not the root's */
+		if ((stars = (const char *)memmem(s, n, "**", 2)) != NULL &&
+				(stars != s + n - 2 || stars[-1] != '/' || n < 4))
+			return (false);
+		if (comma == NULL)
+			return (true);
+		s = comma + 1;
+	}
+}
+
+int parse_window(const char *s, size_t len) {
+	const char *end = s + len;
+	long n = 0;
+
+	if (s == end || !isdigit((unsigned char)*s))
+		return (-1);
+	for (; s < end && isdigit((unsigned char)*s); s++)
+		if ((n = n * 10 + (*s - '0')) > SECONDS_PER_DAY)
+			return (-1);
+	if (s < end) {
+		switch (*s++) {
+			case 'h':
+				n *= SECONDS_PER_HOUR;
+				break;
+			case 'm':
+				n *= SECONDS_PER_MINUTE;
+				break;
+			case 's':
+				break;
+			default:
+				return (-1);
+		}
+	}
+	if (s != end || n > SECONDS_PER_DAY)
+		return (-1);
+	return ((int)n);
+}
+
+int parse_period(const char *s, size_t len) {
+	const char *end = s + len;
+	long n = 0, unit = SECONDS_PER_DAY;
+
+	if (len == 5 && !strncmp(s, "daily", len))
+		return (SECONDS_PER_DAY);
+	if (len == 6 && !strncmp(s, "weekly", len))
+		return (7 * SECONDS_PER_DAY);
+	if (len == 7 && !strncmp(s, "monthly", len))
+		return (PERIOD_MONTHLY);
+	if (s == end || !isdigit((unsigned char)*s))
+		return (0);
+	for (; s < end && isdigit((unsigned char)*s); s++)
+		if ((n = n * 10 + (*s - '0')) > PERIOD_MAX)
+			return (0);
+	/* days, unless it says otherwise */
+	if (s < end) {
+		switch (*s++) {
+			case 'd':
+				break;
+			case 'h':
+				unit = SECONDS_PER_HOUR;
+				break;
+			case 'm':
+				unit = SECONDS_PER_MINUTE;
+				break;
+			default:
+				return (0);
+		}
+	}
+	if (s != end || n == 0 || n * unit > PERIOD_MAX)
+		return (0);
+	return ((int)(n * unit));
+}
+
+size_t entry_hash(const entry *e) {
+	size_t hash = 2166136261u;
+
+	hash = hash_bytes(hash, e->minute, sizeof(e->minute));
+	hash = hash_bytes(hash, e->hour, sizeof(e->hour));
+	hash = hash_bytes(hash, e->dom, sizeof(e->dom));
+	hash = hash_bytes(hash, e->month, sizeof(e->month));
+	hash = hash_bytes(hash, e->dow, sizeof(e->dow));
+	hash = hash_bytes(hash, &e->flags, sizeof(e->flags));
+	hash = hash_bytes(hash, &e->spread, sizeof(e->spread));
+	hash = hash_bytes(hash, &e->period, sizeof(e->period));
+	hash = hash_bytes(hash, e->cmd, strlen(e->cmd));
+	if (e->name)
+		hash = hash_bytes(hash, e->name, strlen(e->name));
+	if (e->after)
+		hash = hash_bytes(hash, e->after, strlen(e->after));
+	if (e->watch)
+		hash = hash_bytes(hash, e->watch, strlen(e->watch));
+	/* interned, so the same settings are the same pointer */
+	hash = hash_bytes(hash, &e->envp, sizeof(e->envp));
+	hash = hash_bytes(hash, &e->pwd->pw_uid, sizeof(e->pwd->pw_uid));
+	return (hash);
+}
+
+bool entry_same(const entry *a, const entry *b) {
+	return (!memcmp(a->minute, b->minute, sizeof(a->minute)) &&
+		!memcmp(a->hour, b->hour, sizeof(a->hour)) &&
+		!memcmp(a->dom, b->dom, sizeof(a->dom)) &&
+		!memcmp(a->month, b->month, sizeof(a->month)) &&
+		!memcmp(a->dow, b->dow, sizeof(a->dow)) &&
+		a->flags == b->flags && a->spread == b->spread && a->period == b->period &&
+		!strcmp(a->cmd, b->cmd) && a->envp == b->envp &&
+		same_string(a->name, b->name) && same_string(a->after, b->after) &&
+		same_string(a->watch, b->watch) &&
+		a->pwd->pw_uid == b->pwd->pw_uid && a->pwd->pw_gid == b->pwd->pw_gid &&
+		!strcmp(a->pwd->pw_name, b->pwd->pw_name));
+}
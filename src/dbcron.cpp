@@ -0,0 +1,875 @@
+/* Tinjac - dbcron.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+
+/** @file dbcron.cpp
+ *  @brief Runs database jobs' SQL on pooled connections, from threads of its own
+ */
+
+
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include "config.h"
+#ifdef HAVE_SQLITE3
+#include <sqlite3.h>
+#endif
+#ifdef HAVE_LIBPQ
+#include <libpq-fe.h>
+#endif
+#include "log.hpp"
+#include "scheduler.hpp"
+#include "dbcron.hpp"
+
+/* rows are handed to the OutputCapture this much at a time */
+#define DBCRON_BATCH	8192
+/* how often an idle worker looks for connections kept too long */
+#define DBCRON_REAP	30
+/* how long a server gets to answer a cancel before its connection is dropped */
+#define DBCRON_GRACE	5
+
+/** @brief A connection to a database, used by one worker at a time
+ *
+ * Between jobs it sits in the DbCron's pool. Only interrupt() is called
+ * from another thread.
+ */
+class DbCron::Connection {
+public:
+	Connection(const string &database) : database(database), used(0) { }
+	virtual ~Connection() { }
+	virtual bool open(Job &job, string &error) = 0;
+	/* is a kept connection still there */
+	virtual bool alive() = 0;
+	/* run the job's SQL, its rows into its output. False if the
+	 * connection is no good any more; error says if the SQL failed
+	 */
+	virtual bool run(Job &job, string &error) = 0;
+	/* ready for the next job, with any transaction rolled back. False
+	 * if it can't be
+	 */
+	virtual bool reset() = 0;
+	/* make what it's running give up, from another thread */
+	virtual void interrupt() = 0;
+	string database;
+	time_t used;		/* when it went back in the pool */
+private:
+	Connection(const Connection &);
+	Connection &operator=(const Connection &);
+};
+
+/* a connection's prepared commands, the most recently run first */
+template <class T> class StatementCache {
+public:
+	typedef list<pair<string, T> > Entries;
+	T *find(const string &sql) {
+		typename Entries::iterator it;
+
+		for (it = this->entries.begin(); it != this->entries.end(); ++it)
+			if (it->first == sql) {
+				this->entries.splice(this->entries.begin(), this->entries, it);
+				return (&this->entries.front().second);
+			}
+		return (NULL);
+	}
+	T *add(const string &sql, const T &t) {
+		this->entries.push_front(make_pair(sql, t));
+		return (&this->entries.front().second);
+	}
+	bool full() const { return (this->entries.size() >= DBCRON_STATEMENTS); }
+	/* the least recently run, to be finalized */
+	T evict() {
+		T t = this->entries.back().second;
+
+		this->entries.pop_back();
+		return (t);
+	}
+	Entries entries;
+};
+
+#ifdef HAVE_SQLITE3
+/* a command's statements, each prepared when it is first reached, as
+ * it may need what an earlier one creates
+ */
+struct SqliteCommand {
+	SqliteCommand() : next(0) { }
+	vector<sqlite3_stmt *> stmts;
+	size_t next;		/* where the SQL not yet prepared starts */
+};
+#endif
+
+#ifdef HAVE_LIBPQ
+struct PostgresCommand {
+	vector<string> parts;	/* the statements */
+	vector<string> names;	/* of those prepared so far */
+};
+#endif
+
+#if defined(HAVE_SQLITE3) || defined(HAVE_LIBPQ)
+/* a row as psql -A prints it */
+static void add_column(string &out, int col, const char *value, size_t len) {
+	if (col > 0)
+		out += '|';
+	if (value != NULL)
+		out.append(value, len);
+}
+
+static void flush_rows(DbCron::Job &job, string &rows) {
+	job.response.output.feed(rows.data(), rows.size());
+	job.response.bytes += rows.size();
+	rows.clear();
+}
+#endif
+
+#ifdef HAVE_SQLITE3
+/** @brief A database file, through SQLite
+ *
+ * "sqlite:/path" or "sqlite:///path". The file has to be there already;
+ * a typo doesn't make a new, empty database. SQLite finds where each of
+ * a command's statements ends as it prepares it.
+ */
+class SqliteConnection : public DbCron::Connection {
+public:
+	SqliteConnection(const string &database) : DbCron::Connection(database), db(NULL), job(NULL) { }
+	~SqliteConnection() {
+		while (!this->cache.entries.empty())
+			finalize(this->cache.evict());
+		sqlite3_close(this->db);
+	}
+	bool open(DbCron::Job &, string &error) {
+		string path = this->database.substr(7);
+
+		if (path.compare(0, 3, "///") == 0)
+			path.erase(0, 2);
+		if (sqlite3_open_v2(path.c_str(), &this->db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+			error = this->db ? sqlite3_errmsg(this->db) : "out of memory";
+			return (false);
+		}
+		sqlite3_progress_handler(this->db, 1000, SqliteConnection::progress, this);
+		return (true);
+	}
+	bool alive() {
+		return (true);
+	}
+	bool run(DbCron::Job &job, string &error) {
+		const string &sql = job.request.sql;
+		SqliteCommand *cmd;
+		const char *tail;
+		sqlite3_stmt *stmt;
+		int before, rc, col, cols;
+		string rows;
+		size_t i;
+
+		if ((cmd = this->cache.find(sql)) != NULL)
+			job.cached++;
+		else {
+			if (this->cache.full())
+				finalize(this->cache.evict());
+			cmd = this->cache.add(sql, SqliteCommand());
+			job.prepared++;
+		}
+		/* a locked database is waited for, up to the deadline */
+		sqlite3_busy_timeout(this->db, (int)max((time_t)1, job.deadline - time(NULL)) * 1000);
+		before = sqlite3_total_changes(this->db);
+		this->job = &job;
+		for (i = 0; error.empty(); i++) {
+			if (job.cancelled) {
+				error = "cancelled";
+				break;
+			}
+			if (i == cmd->stmts.size()) {
+				/* the next statement, now the ones before it have run */
+				if (cmd->next >= sql.size())
+					break;
+				if (sqlite3_prepare_v2(this->db, sql.c_str() + cmd->next, sql.size() - cmd->next, &stmt, &tail) != SQLITE_OK) {
+					error = sqlite3_errmsg(this->db);
+					break;
+				}
+				cmd->next = tail - sql.c_str();
+				/* NULL for a comment or a stray ';' */
+				if (stmt == NULL) {
+					i--;
+					continue;
+				}
+				cmd->stmts.push_back(stmt);
+			}
+			stmt = cmd->stmts[i];
+			cols = sqlite3_column_count(stmt);
+			while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+				for (col = 0; col < cols; col++)
+					add_column(rows, col, (const char *)sqlite3_column_text(stmt, col), sqlite3_column_bytes(stmt, col));
+				rows += '\n';
+				job.response.rows++;
+				if (rows.size() >= DBCRON_BATCH)
+					flush_rows(job, rows);
+			}
+			if (rc != SQLITE_DONE)
+				error = rc == SQLITE_INTERRUPT ? "timed out" : sqlite3_errmsg(this->db);
+			sqlite3_reset(stmt);
+		}
+		this->job = NULL;
+		flush_rows(job, rows);
+		job.response.changes = sqlite3_total_changes(this->db) - before;
+		return (true);
+	}
+	bool reset() {
+		return (sqlite3_get_autocommit(this->db) || sqlite3_exec(this->db, "ROLLBACK", NULL, NULL, NULL) == SQLITE_OK);
+	}
+	void interrupt() {
+		sqlite3_interrupt(this->db);
+	}
+private:
+	static void finalize(const SqliteCommand &cmd) {
+		for (size_t i = 0; i < cmd.stmts.size(); i++)
+			sqlite3_finalize(cmd.stmts[i]);
+	}
+	/* every thousand instructions: give up if the job has */
+	static int progress(void *arg) {
+		DbCron::Job *job = ((SqliteConnection *)arg)->job;
+
+		return (job != NULL && (job->cancelled || time(NULL) >= job->deadline));
+	}
+	sqlite3 *db;
+	StatementCache<SqliteCommand> cache;
+	DbCron::Job *job;	/* being run */
+};
+#endif
+
+#ifdef HAVE_LIBPQ
+/** @brief A PostgreSQL server, through libpq
+ *
+ * A postgresql:// or postgres:// URI, as libpq takes it. Everything is
+ * sent asynchronously and waited for with poll(), so the job's deadline
+ * holds however the server behaves: past it the query is cancelled, and
+ * if the server doesn't answer that either the connection is dropped.
+ * The server prepares a statement at a time, so a command is split at
+ * its ';'s first. Rows are read one at a time, so a big result costs no
+ * more memory than its head and tail.
+ */
+class PostgresConnection : public DbCron::Connection {
+public:
+	PostgresConnection(const string &database) : DbCron::Connection(database), pg(NULL), cancel(NULL), names(0), stale(false) { }
+	~PostgresConnection() {
+		if (this->cancel != NULL)
+			PQfreeCancel(this->cancel);
+		PQfinish(this->pg);
+	}
+	bool open(DbCron::Job &job, string &error) {
+		PostgresPollingStatusType state = PGRES_POLLING_WRITING;
+
+		if ((this->pg = PQconnectStart(this->database.c_str())) == NULL) {
+			error = "out of memory";
+			return (false);
+		}
+		while (state != PGRES_POLLING_OK) {
+			if (state == PGRES_POLLING_FAILED || PQstatus(this->pg) == CONNECTION_BAD) {
+				error = message(PQerrorMessage(this->pg));
+				return (false);
+			}
+			if (!this->wait(job, state == PGRES_POLLING_READING ? POLLIN : POLLOUT, job.deadline)) {
+				error = job.cancelled ? "cancelled" : "timed out connecting";
+				return (false);
+			}
+			state = PQconnectPoll(this->pg);
+		}
+		this->cancel = PQgetCancel(this->pg);
+		return (true);
+	}
+	/* a kept connection has nothing to say; if it has, the server
+	 * probably closed it
+	 */
+	bool alive() {
+		struct pollfd pfd;
+
+		pfd.fd = PQsocket(this->pg);
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) == 1 && !PQconsumeInput(this->pg))
+			return (false);
+		return (PQstatus(this->pg) == CONNECTION_OK);
+	}
+	bool run(DbCron::Job &job, string &error) {
+		const string &sql = job.request.sql;
+		PostgresCommand *cmd, fresh;
+		char name[32];
+		size_t i;
+
+		if ((cmd = this->cache.find(sql)) != NULL)
+			job.cached++;
+		else {
+			if (this->cache.full())
+				this->stale = !this->deallocate(this->cache.evict()) || this->stale;
+			DbCron::splitStatements(sql, fresh.parts);
+			cmd = this->cache.add(sql, fresh);
+			job.prepared++;
+		}
+		for (i = 0; i < cmd->parts.size() && error.empty(); i++) {
+			if (job.cancelled) {
+				error = "cancelled";
+				break;
+			}
+			if (i == cmd->names.size()) {
+				snprintf(name, sizeof(name), "tinjac_%lu", ++this->names);
+				if (!PQsendPrepare(this->pg, name, cmd->parts[i].c_str(), 0, NULL)) {
+					error = message(PQerrorMessage(this->pg));
+					return (false);
+				}
+				if (!this->results(job, error))
+					return (false);
+				if (!error.empty())
+					break;
+				cmd->names.push_back(name);
+			}
+			if (!PQsendQueryPrepared(this->pg, cmd->names[i].c_str(), 0, NULL, NULL, NULL, 0)) {
+				error = message(PQerrorMessage(this->pg));
+				return (false);
+			}
+			PQsetSingleRowMode(this->pg);
+			if (!this->results(job, error))
+				return (false);
+		}
+		/* a plan that went bad, a table changed under it, has to be made again */
+		if (!error.empty())
+			this->stale = true;
+		return (true);
+	}
+	bool reset() {
+		PGresult *res;
+		bool ok = true;
+
+		if (PQstatus(this->pg) != CONNECTION_OK)
+			return (false);
+		if (PQtransactionStatus(this->pg) != PQTRANS_IDLE) {
+			res = PQexec(this->pg, "ROLLBACK");
+			PQclear(res);
+		}
+		if (this->stale) {
+			res = PQexec(this->pg, "DEALLOCATE ALL");
+			ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+			PQclear(res);
+			this->cache.entries.clear();
+			this->stale = false;
+		}
+		return (ok && PQtransactionStatus(this->pg) == PQTRANS_IDLE);
+	}
+	void interrupt() {
+		char buf[256];
+
+		if (this->cancel != NULL)
+			PQcancel(this->cancel, buf, sizeof(buf));
+	}
+private:
+	/* libpq's messages end in a newline */
+	static string message(const char *msg) {
+		string s = msg ? msg : "";
+
+		while (!s.empty() && (s[s.size() - 1] == '\n' || s[s.size() - 1] == ' '))
+			s.erase(s.size() - 1);
+		return (s);
+	}
+	/* wait for the socket, until the deadline or the job is cancelled */
+	bool wait(DbCron::Job &job, short events, time_t deadline) {
+		struct pollfd pfd;
+		time_t now;
+		int n;
+
+		pfd.fd = PQsocket(this->pg);
+		pfd.events = events;
+		for (;;) {
+			now = time(NULL);
+			if (now >= deadline || job.cancelled)
+				return (false);
+			/* a second at a time, to see a cancel before there's a query to cancel */
+			if ((n = poll(&pfd, 1, 1000)) > 0)
+				return (true);
+			if (n < 0 && errno != EINTR)
+				return (false);
+		}
+	}
+	/* the results of what was sent, until there are no more. False if the
+	 * connection is no good any more
+	 */
+	bool results(DbCron::Job &job, string &error) {
+		time_t deadline = job.deadline;
+		bool cancelled = false;
+		PGresult *res;
+		string rows;
+		int row, col;
+
+		for (;;) {
+			while (PQisBusy(this->pg)) {
+				if (!this->wait(job, POLLIN, deadline)) {
+					if (cancelled) {
+						error = "the server didn't answer a cancel";
+						return (false);
+					}
+					/* the server says so when it has stopped */
+					this->interrupt();
+					cancelled = true;
+					deadline = time(NULL) + DBCRON_GRACE;
+					continue;
+				}
+				if (!PQconsumeInput(this->pg)) {
+					error = message(PQerrorMessage(this->pg));
+					return (false);
+				}
+			}
+			if ((res = PQgetResult(this->pg)) == NULL)
+				break;
+			switch (PQresultStatus(res)) {
+			case PGRES_SINGLE_TUPLE:
+			case PGRES_TUPLES_OK:
+				for (row = 0; row < PQntuples(res); row++) {
+					for (col = 0; col < PQnfields(res); col++)
+						add_column(rows, col, PQgetisnull(res, row, col) ? NULL : PQgetvalue(res, row, col),
+							PQgetlength(res, row, col));
+					rows += '\n';
+					job.response.rows++;
+				}
+				if (rows.size() >= DBCRON_BATCH)
+					flush_rows(job, rows);
+				break;
+			case PGRES_COMMAND_OK:
+				job.response.changes += strtoul(PQcmdTuples(res), NULL, 10);
+				break;
+			case PGRES_EMPTY_QUERY:
+				break;
+			default:
+				if (error.empty())
+					error = cancelled && !job.cancelled ? "timed out" : message(PQresultErrorMessage(res));
+			}
+			PQclear(res);
+		}
+		flush_rows(job, rows);
+		return (PQstatus(this->pg) == CONNECTION_OK);
+	}
+	bool deallocate(const PostgresCommand &cmd) {
+		PGresult *res;
+		bool ok = true;
+		size_t i;
+
+		for (i = 0; i < cmd.names.size() && ok; i++) {
+			res = PQexec(this->pg, ("DEALLOCATE " + cmd.names[i]).c_str());
+			ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+			PQclear(res);
+		}
+		return (ok);
+	}
+	PGconn *pg;
+	PGcancel *cancel;
+	StatementCache<PostgresCommand> cache;
+	unsigned long names;	/* for the next prepared statement */
+	bool stale;		/* DEALLOCATE ALL at reset() */
+};
+#endif
+
+/* a new connection for database, or NULL if that kind wasn't built in */
+static DbCron::Connection *new_connection(const string &database, string &error) {
+	bool sqlite = database.compare(0, 7, "sqlite:") == 0;
+
+#ifdef HAVE_SQLITE3
+	if (sqlite)
+		return (new SqliteConnection(database));
+#endif
+#ifdef HAVE_LIBPQ
+	if (!sqlite)
+		return (new PostgresConnection(database));
+#endif
+	error = string("built without ") + (sqlite ? "SQLite" : "PostgreSQL") + " support";
+	return (NULL);
+}
+
+DbCron::DbCron(Scheduler *sched, size_t workers) :
+	sched(sched), nworkers(workers ? workers : 1), stopping(false), pending(0) {
+	memset(&this->stats, 0, sizeof(this->stats));
+	pthread_mutex_init(&this->lock, NULL);
+	pthread_cond_init(&this->ready, NULL);
+	this->wake[0] = this->wake[1] = -1;
+}
+
+DbCron::~DbCron() {
+	map<string, list<Connection *> >::iterator it;
+	size_t i;
+
+	pthread_mutex_lock(&this->lock);
+	this->stopping = true;
+	/* what is running gives up, what is queued is dropped */
+	for (map<Spawner::JobId, Job *>::iterator job = this->jobs.begin(); job != this->jobs.end(); ++job) {
+		job->second->cancelled = 1;
+		if (job->second->conn != NULL)
+			job->second->conn->interrupt();
+	}
+	pthread_cond_broadcast(&this->ready);
+	pthread_mutex_unlock(&this->lock);
+	for (i = 0; i < this->workers.size(); i++)
+		pthread_join(this->workers[i], NULL);
+	if (!this->workers.empty())
+		this->sched->unwatchFd(this->wake[0]);
+	for (it = this->idle.begin(); it != this->idle.end(); ++it)
+		while (!it->second.empty()) {
+			delete it->second.front();
+			it->second.pop_front();
+		}
+	if (this->wake[0] != -1) {
+		::close(this->wake[0]);
+		::close(this->wake[1]);
+	}
+	pthread_cond_destroy(&this->ready);
+	pthread_mutex_destroy(&this->lock);
+}
+
+bool DbCron::isDatabase(const char *cmd) {
+	return (strncmp(cmd, "sqlite:", 7) == 0 || strncmp(cmd, "postgresql://", 13) == 0 || strncmp(cmd, "postgres://", 11) == 0);
+}
+
+bool DbCron::parseCommand(const string &cmd, string &database, string &sql) {
+	size_t end, start;
+
+	if (!isDatabase(cmd.c_str()))
+		return (false);
+	if ((end = cmd.find_first_of(" \t\n")) == string::npos)
+		return (false);
+	database = cmd.substr(0, end);
+	if ((start = cmd.find_first_not_of(" \t\n", end)) == string::npos)
+		return (false);
+	sql = cmd.substr(start);
+	/* "sqlite:" and "sqlite://" name no file */
+	return (database != "sqlite:" && database != "sqlite://");
+}
+
+/* is c part of an identifier, so "$" after it isn't a dollar quote */
+static bool ident(char c) {
+	return (isalnum((unsigned char)c) || c == '_' || c == '$');
+}
+
+void DbCron::splitStatements(const string &sql, vector<string> &out) {
+	size_t i, start = 0, end, depth;
+	string tag, stmt;
+	bool escapes;
+
+	out.clear();
+	for (i = 0; i <= sql.size(); i++) {
+		if (i == sql.size() || sql[i] == ';') {
+			stmt = sql.substr(start, i - start);
+			if (stmt.find_first_not_of(" \t\r\n") != string::npos)
+				out.push_back(stmt.substr(stmt.find_first_not_of(" \t\r\n")));
+			start = i + 1;
+			continue;
+		}
+		switch (sql[i]) {
+		case '\'':
+			/* E'it\'s' has backslash escapes; 'it''s' doesn't need them */
+			escapes = i > 0 && (sql[i - 1] == 'E' || sql[i - 1] == 'e') && (i < 2 || !ident(sql[i - 2]));
+			for (i++; i < sql.size() && sql[i] != '\''; i++)
+				if (escapes && sql[i] == '\\')
+					i++;
+			break;
+		case '"':
+			if ((end = sql.find('"', i + 1)) == string::npos)
+				i = sql.size() - 1;
+			else
+				i = end;
+			break;
+		case '-':
+			if (i + 1 < sql.size() && sql[i + 1] == '-')
+				i = (end = sql.find('\n', i)) == string::npos ? sql.size() - 1 : end;
+			break;
+		case '/':
+			if (i + 1 >= sql.size() || sql[i + 1] != '*')
+				break;
+			/* they nest */
+			for (depth = 1, i += 2; i < sql.size() && depth > 0; i++) {
+				if (sql.compare(i, 2, "/*") == 0) {
+					depth++;
+					i++;
+				} else if (sql.compare(i, 2, "*/") == 0) {
+					depth--;
+					i++;
+				}
+			}
+			i--;
+			break;
+		case '$':
+			/* $$...$$ or $tag$...$tag$, but not $1 or a$b */
+			if (i > 0 && ident(sql[i - 1]))
+				break;
+			for (end = i + 1; end < sql.size() && (isalpha((unsigned char)sql[end]) || sql[end] == '_' ||
+				(end > i + 1 && isdigit((unsigned char)sql[end]))); end++)
+				;
+			if (end >= sql.size() || sql[end] != '$')
+				break;
+			tag = sql.substr(i, end - i + 1);
+			i = (end = sql.find(tag, end + 1)) == string::npos ? sql.size() - 1 : end + tag.size() - 1;
+			break;
+		}
+	}
+}
+
+bool DbCron::start() {
+	sigset_t all, old;
+	pthread_t thread;
+	size_t i;
+	int err = 0;
+
+	if (!this->workers.empty())
+		return (true);
+	if (pipe(this->wake) != 0) {
+		ELOG("Can't make a pipe for database jobs: %s", strerror(errno));
+		return (false);
+	}
+	fcntl(this->wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(this->wake[1], F_SETFD, FD_CLOEXEC);
+	fcntl(this->wake[0], F_SETFL, O_NONBLOCK);
+	/* signals are for the scheduler's thread, not these */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (i = 0; i < this->nworkers; i++) {
+		if ((err = pthread_create(&thread, NULL, DbCron::loop, this)) != 0)
+			break;
+		this->workers.push_back(thread);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (this->workers.empty()) {
+		ELOG("Can't start the threads for database jobs: %s", strerror(err));
+		return (false);
+	}
+	if (err != 0)
+		ELOG("Only %lu threads for database jobs: %s", (unsigned long)this->workers.size(), strerror(err));
+	this->sched->watchFd(this->wake[0], boost::bind(&DbCron::processDone, this));
+	return (true);
+}
+
+void *DbCron::loop(void *arg) {
+	((DbCron *)arg)->work();
+	return (NULL);
+}
+
+bool DbCron::query(const Request &request) {
+	if (this->workers.empty() || !isDatabase(request.database.c_str()) || request.sql.empty())
+		return (false);
+	pthread_mutex_lock(&this->lock);
+	this->queue.push_back(request);
+	this->stats.requests++;
+	pthread_cond_signal(&this->ready);
+	pthread_mutex_unlock(&this->lock);
+	this->pending++;
+	return (true);
+}
+
+void DbCron::cancel(Spawner::JobId id) {
+	map<Spawner::JobId, Job *>::iterator it;
+	deque<Request>::iterator q;
+	Response response;
+
+	pthread_mutex_lock(&this->lock);
+	if ((it = this->jobs.find(id)) != this->jobs.end()) {
+		it->second->cancelled = 1;
+		if (it->second->conn != NULL)
+			it->second->conn->interrupt();
+	} else
+		for (q = this->queue.begin(); q != this->queue.end(); ++q)
+			if (q->id == id) {
+				/* it never got a worker */
+				response.id = id;
+				response.ok = false;
+				response.error = "cancelled";
+				response.rows = response.changes = response.bytes = 0;
+				response.output = q->output;
+				response.output.finish();
+				gettimeofday(&response.finished, NULL);
+				this->queue.erase(q);
+				this->stats.failed++;
+				this->post(response);
+				break;
+			}
+	pthread_mutex_unlock(&this->lock);
+}
+
+DbCron::Stats DbCron::getStats() {
+	Stats stats;
+
+	pthread_mutex_lock(&this->lock);
+	stats = this->stats;
+	pthread_mutex_unlock(&this->lock);
+	return (stats);
+}
+
+void DbCron::post(const Response &response) {
+	char c = 0;
+
+	this->finished.push_back(response);
+	while (::write(this->wake[1], &c, 1) < 0 && errno == EINTR)
+		;
+}
+
+/* take requests off the queue until the DbCron goes */
+void DbCron::work() {
+	vector<Connection *> stale;
+	struct timespec until;
+	Job *job;
+	size_t i;
+
+	pthread_mutex_lock(&this->lock);
+	while (!this->stopping) {
+		if (this->queue.empty()) {
+			until.tv_sec = time(NULL) + DBCRON_REAP;
+			until.tv_nsec = 0;
+			pthread_cond_timedwait(&this->ready, &this->lock, &until);
+			this->reap(time(NULL), stale);
+			if (stale.empty())
+				continue;
+			pthread_mutex_unlock(&this->lock);
+			for (i = 0; i < stale.size(); i++)
+				delete stale[i];
+			stale.clear();
+			pthread_mutex_lock(&this->lock);
+			continue;
+		}
+		job = new Job;
+		job->request = this->queue.front();
+		this->queue.pop_front();
+		job->deadline = time(NULL) + job->request.timeout;
+		job->cancelled = 0;
+		job->conn = NULL;
+		job->prepared = job->cached = 0;
+		this->jobs[job->request.id] = job;
+		pthread_mutex_unlock(&this->lock);
+		this->run(*job);
+		delete job;
+		pthread_mutex_lock(&this->lock);
+	}
+	pthread_mutex_unlock(&this->lock);
+}
+
+/* the connections nobody has wanted for DBCRON_KEEPALIVE, under lock */
+void DbCron::reap(time_t now, vector<Connection *> &stale) {
+	map<string, list<Connection *> >::iterator it;
+
+	for (it = this->idle.begin(); it != this->idle.end(); ++it)
+		while (!it->second.empty() && it->second.back()->used + DBCRON_KEEPALIVE <= now) {
+			stale.push_back(it->second.back());
+			it->second.pop_back();
+		}
+}
+
+/* a kept connection to database, if there's one still there */
+DbCron::Connection *DbCron::take(const string &database) {
+	map<string, list<Connection *> >::iterator it;
+	Connection *conn = NULL;
+
+	for (;;) {
+		pthread_mutex_lock(&this->lock);
+		if ((it = this->idle.find(database)) != this->idle.end() && !it->second.empty()) {
+			conn = it->second.front();
+			it->second.pop_front();
+		}
+		pthread_mutex_unlock(&this->lock);
+		if (conn == NULL || conn->alive())
+			return (conn);
+		delete conn;
+		conn = NULL;
+	}
+}
+
+void DbCron::run(Job &job) {
+	Response &response = job.response;
+	const string &database = job.request.database;
+	Connection *conn;
+	bool reused, opened = false, good = false;
+	string error;
+
+	response.id = job.request.id;
+	response.rows = response.changes = response.bytes = 0;
+	response.output = job.request.output;
+	if ((conn = this->take(database)) != NULL)
+		reused = true;
+	else {
+		reused = false;
+		if ((conn = new_connection(database, error)) != NULL && conn->open(job, error))
+			opened = true;
+		else {
+			delete conn;
+			conn = NULL;
+		}
+	}
+	if (conn != NULL) {
+		pthread_mutex_lock(&this->lock);
+		job.conn = conn;
+		pthread_mutex_unlock(&this->lock);
+		good = conn->run(job, error);
+		pthread_mutex_lock(&this->lock);
+		job.conn = NULL;
+		pthread_mutex_unlock(&this->lock);
+	}
+	/* rather than what the database said about being interrupted */
+	if (job.cancelled && !error.empty())
+		error = "cancelled";
+	response.ok = error.empty();
+	response.error = error;
+	if (!response.ok)
+		response.output.feed(("ERROR: " + error + "\n").data(), error.size() + 8);
+	response.output.finish();
+	gettimeofday(&response.finished, NULL);
+	if (conn != NULL && good && conn->reset())
+		conn->used = time(NULL);
+	else if (conn != NULL) {
+		delete conn;
+		conn = NULL;
+	}
+
+	pthread_mutex_lock(&this->lock);
+	if (conn != NULL)
+		this->idle[database].push_front(conn);
+	if (opened)
+		this->stats.connections++;
+	if (reused)
+		this->stats.reused++;
+	if (!response.ok)
+		this->stats.failed++;
+	this->stats.prepared += job.prepared;
+	this->stats.cached += job.cached;
+	this->jobs.erase(response.id);
+	this->post(response);
+	pthread_mutex_unlock(&this->lock);
+}
+
+void DbCron::processDone() {
+	deque<Response> ready;
+	char buf[256];
+
+	while (::read(this->wake[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&this->lock);
+	ready.swap(this->finished);
+	pthread_mutex_unlock(&this->lock);
+	for (deque<Response>::iterator it = ready.begin(); it != ready.end(); ++it) {
+		this->pending--;
+		if (this->done)
+			this->done(*it);
+	}
+}
@@ -0,0 +1,224 @@
+/* Tinjac - env.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+** Portions Copyright:
+** Copyright 1988,1990,1993,1994 by Paul Vixie
+**
+** Copyright (c) 2004 by Internet Systems Consortium, Inc. ("ISC")
+** Copyright (c) 1997,2000 by Internet Software Consortium, Inc.
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file env.cpp
+ *  @brief Vixie style environment array helpers
+ */
+
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <map>
+#include "env.hpp"
+#include "misc.hpp"
+
+using namespace std;
+
+
+/* an interned environment: the array and its strings live in one block
+ * straight after this header
+ */
+struct env_block {
+	unsigned int	refs;
+	size_t		hash;
+	size_t		size;		/* bytes, including the header */
+};
+
+/* every live interned environment, by the hash of its contents */
+static multimap<size_t, env_block *> interned;
+
+static inline env_block *env_header(char **envp) {
+	return ((env_block *)envp - 1);
+}
+
+
+char **env_init(void) {
+	char **p = (char **) malloc(sizeof (char **));
+
+	if (p != NULL)
+		p[0] = NULL;
+	return (p);
+}
+
+void env_free(char **envp) {
+	char **p;
+
+	for (p = envp; *p != NULL; p++)
+		free(*p);
+	free(envp);
+}
+
+char **env_copy(char **envp) {
+	int count, i, save_errno;
+	char **p;
+
+	for (count = 0; envp[count] != NULL; count++) ;
+
+	p = (char **) malloc((count + 1) * sizeof (char *));	/* 1 for the NULL */
+	if (p != NULL) {
+		for (i = 0; i < count; i++)
+			if ((p[i] = strdup(envp[i])) == NULL) {
+				save_errno = errno;
+				while (--i >= 0)
+					free(p[i]);
+				free(p);
+				errno = save_errno;
+				return (NULL);
+			}
+		p[count] = NULL;
+	}
+	return (p);
+}
+
+char **env_set(char **envp, char *envstr) {
+	int count, found;
+	char **p, *envtmp;
+
+	/*
+	 * count the number of elements, including the null pointer;
+	 * also set 'found' to -1 or index of entry if already in here.
+	 */
+	found = -1;
+	for (count = 0; envp[count] != NULL; count++) {
+		if (!strcmp_until(envp[count], envstr, '='))
+			found = count;
+	}
+	count++;	/* for the NULL */
+
+	if (found != -1) {
+		/*
+		 * it exists already, so just free the existing setting,
+		 * save our new one there, and return the existing array.
+		 */
+		if ((envtmp = strdup(envstr)) == NULL)
+			return (NULL);
+		free(envp[found]);
+		envp[found] = envtmp;
+		return (envp);
+	}
+
+	/*
+	 * it doesn't exist yet, so resize the array, move null pointer over
+	 * one, save our string over the old null pointer, and return resized
+	 * array.
+	 */
+	if ((envtmp = strdup(envstr)) == NULL)
+		return (NULL);
+	p = (char **) realloc((void *) envp,
+		(size_t) ((count + 1) * sizeof (char **)));
+	if (p == NULL) {
+		free(envtmp);
+		return (NULL);
+	}
+	p[count] = p[count - 1];
+	p[count - 1] = envtmp;
+	return (p);
+}
+
+char *env_get(char *name, char **envp) {
+	int len = strlen(name);
+	char *p, *q;
+
+	while ((p = *envp++) != NULL) {
+		if (!(q = strchr(p, '=')))
+			continue;
+		if ((q - p) == len && !strncmp(p, name, len))
+			return (q + 1);
+	}
+	return (NULL);
+}
+
+char **env_intern(char **envp) {
+	multimap<size_t, env_block *>::iterator it, end;
+	size_t hash = 2166136261u, size, count, i;
+	env_block *block;
+	char **p, *cp;
+	const char *c;
+
+	/* FNV-1a over every string, terminators included */
+	size = sizeof(env_block) + sizeof(char *);
+	for (count = 0; envp[count] != NULL; count++) {
+		for (c = envp[count]; ; c++) {
+			hash = (hash ^ (unsigned char)*c) * 16777619u;
+			if (*c == '\0')
+				break;
+		}
+		size += sizeof(char *) + (c - envp[count]) + 1;
+	}
+	for (it = interned.lower_bound(hash), end = interned.upper_bound(hash); it != end; ++it) {
+		block = it->second;
+		if (block->size != size)
+			continue;
+		p = (char **)(block + 1);
+		for (i = 0; i < count && !strcmp(p[i], envp[i]); i++) ;
+		if (i == count) {
+			block->refs++;
+			return (p);
+		}
+	}
+
+	if ((block = (env_block *)malloc(size)) == NULL)
+		return (NULL);
+	block->refs = 1;
+	block->hash = hash;
+	block->size = size;
+	p = (char **)(block + 1);
+	cp = (char *)(p + count + 1);
+	for (i = 0; i < count; i++) {
+		p[i] = cp;
+		cp = stpcpy(cp, envp[i]) + 1;
+	}
+	p[count] = NULL;
+	interned.insert(make_pair(hash, block));
+	return (p);
+}
+
+char **env_hold(char **envp) {
+	if (envp)
+		env_header(envp)->refs++;
+	return (envp);
+}
+
+void env_release(char **envp) {
+	multimap<size_t, env_block *>::iterator it, end;
+	env_block *block;
+
+	if (envp == NULL || --(block = env_header(envp))->refs > 0)
+		return;
+	for (it = interned.lower_bound(block->hash), end = interned.upper_bound(block->hash); it != end; ++it)
+		if (it->second == block) {
+			interned.erase(it);
+			break;
+		}
+	free(block);
+}
+
+size_t env_interned(void) {
+	return (interned.size());
+}
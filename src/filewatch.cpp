@@ -0,0 +1,640 @@
+/* Tinjac - filewatch.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file filewatch.cpp
+ *  @brief Runs @watch jobs as the files under their paths change
+ */
+
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <boost/bind.hpp>
+#include "log.hpp"
+#include "crontabparser.hpp"
+#include "scheduler.hpp"
+#include "filewatch.hpp"
+
+/* what every directory is watched for: files finished with or moved in,
+ * directories made or moved (for the trees), and itself going away
+ */
+#define WATCH_MASK	(IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | \
+			 IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_EXCL_UNLINK)
+/* events read at a time, and reads before the loop gets a turn */
+#define WATCH_BUFFER	65536
+#define WATCH_READS	16
+/* the most groups a user's are looked up to */
+#define WATCH_GROUPS_MAX	65536
+
+/* the groups pw is in, its own among them */
+static vector<gid_t> groups_of(const struct passwd *pw) {
+	vector<gid_t> groups(16);
+	int n;
+
+	if (pw == NULL)
+		return (vector<gid_t>());
+	for (;;) {
+		n = groups.size();
+		if (getgrouplist(pw->pw_name, pw->pw_gid, &groups[0], &n) != -1)
+			break;
+		/* too small, n is how many it needs */
+		if (groups.size() >= WATCH_GROUPS_MAX) {
+			ELOG("User %s is in too many groups, only counting their own", pw->pw_name);
+			groups.assign(1, pw->pw_gid);
+			return (groups);
+		}
+		groups.resize(max((size_t)n, groups.size() * 2));
+	}
+	groups.resize(n);
+	return (groups);
+}
+
+/* whether pw could do want (R_OK, X_OK) to what st is, by its mode */
+static bool allowed(const struct stat &st, const struct passwd *pw, const vector<gid_t> &groups, int want) {
+	int mode;
+
+	if (pw == NULL || pw->pw_uid == 0)
+		return (true);
+	if (st.st_uid == pw->pw_uid)
+		mode = st.st_mode >> 6;
+	else if (find(groups.begin(), groups.end(), st.st_gid) != groups.end())
+		mode = st.st_mode >> 3;
+	else
+		mode = st.st_mode;
+	return ((mode & want) == want);
+}
+
+/* whether pw could get as far as path: into every directory above it,
+ * as it is written and where its symlinks lead
+ */
+static bool reachable(const string &path, const struct passwd *pw, const vector<gid_t> &groups) {
+	char real[PATH_MAX];
+	string paths[2];
+	struct stat st;
+	size_t slash;
+	int i;
+
+	if (pw == NULL || pw->pw_uid == 0)
+		return (true);
+	if (realpath(path.c_str(), real) == NULL)
+		return (false);
+	paths[0] = path;
+	paths[1] = real;
+	for (i = 0; i < 2; i++)
+		for (slash = 0; (slash = paths[i].find('/', slash)) != string::npos && slash + 1 < paths[i].size(); slash++)
+			if (stat(slash == 0 ? "/" : paths[i].substr(0, slash).c_str(), &st) != 0 ||
+					!allowed(st, pw, groups, X_OK))
+				return (false);
+	return (true);
+}
+
+static string join(const string &dir, const char *name) {
+	if (dir == "/")
+		return (dir + name);
+	return (dir + "/" + name);
+}
+
+
+FileWatch::FileWatch(Scheduler *sched) : sched(sched), fd(-1), count(0), retry(0) {
+	memset(&this->stats, 0, sizeof(this->stats));
+}
+
+FileWatch::~FileWatch() {
+	map<CrontabFile *, vector<Trigger *> >::iterator it;
+
+	for (it = this->byfile.begin(); it != this->byfile.end(); ++it)
+		for (vector<Trigger *>::iterator t = it->second.begin(); t != it->second.end(); ++t)
+			delete *t;
+	/* and the watches go with the descriptor */
+	if (this->fd != -1) {
+		this->sched->unwatchFd(this->fd);
+		::close(this->fd);
+	}
+}
+
+bool FileWatch::start() {
+	map<CrontabFile *, vector<Trigger *> >::iterator it;
+
+	if (this->fd != -1)
+		return (true);
+	if ((this->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1) {
+		ELOG("Can't watch files for @watch jobs: %s", strerror(errno));
+		return (false);
+	}
+	this->sched->watchFd(this->fd, boost::bind(&FileWatch::processEvents, this));
+	/* the ones that were added before */
+	for (it = this->byfile.begin(); it != this->byfile.end(); ++it)
+		for (vector<Trigger *>::iterator t = it->second.begin(); t != it->second.end(); ++t)
+			this->missing.insert(*t);
+	this->retry = 0;
+	return (true);
+}
+
+void FileWatch::addFile(CrontabFile *file) {
+	vector<Trigger *> triggers;
+
+	for (vector<entry *>::iterator e = file->entries.begin(); e != file->entries.end(); ++e)
+		if ((*e)->flags & WHEN_WATCH)
+			triggers.push_back(this->add(*e, file));
+	if (!triggers.empty())
+		this->byfile[file].swap(triggers);
+}
+
+void FileWatch::removeFile(CrontabFile *file) {
+	map<CrontabFile *, vector<Trigger *> >::iterator it = this->byfile.find(file);
+
+	if (it == this->byfile.end())
+		return;
+	for (vector<Trigger *>::iterator t = it->second.begin(); t != it->second.end(); ++t)
+		this->remove(*t);
+	this->byfile.erase(it);
+}
+
+size_t FileWatch::replaceFile(CrontabFile *old, CrontabFile *file) {
+	map<CrontabFile *, vector<Trigger *> >::iterator it = this->byfile.find(old);
+	multimap<size_t, Trigger *> oldtriggers;
+	multimap<size_t, Trigger *>::iterator match, end;
+	vector<Trigger *> triggers;
+	size_t hash, kept = 0;
+
+	if (it != this->byfile.end()) {
+		for (vector<Trigger *>::iterator t = it->second.begin(); t != it->second.end(); ++t)
+			oldtriggers.insert(make_pair(entry_hash((*t)->e), *t));
+		this->byfile.erase(it);
+	}
+	for (vector<entry *>::iterator e = file->entries.begin(); e != file->entries.end(); ++e) {
+		if (!((*e)->flags & WHEN_WATCH))
+			continue;
+		hash = entry_hash(*e);
+		for (match = oldtriggers.lower_bound(hash), end = oldtriggers.upper_bound(hash); match != end; ++match)
+			if (entry_same(match->second->e, *e))
+				break;
+		if (match != end) {
+			/* same paths and job, so the same watches and burst */
+			match->second->e = *e;
+			match->second->file = file;
+			/* who is in which group may have changed */
+			match->second->groups = groups_of((*e)->pwd);
+			triggers.push_back(match->second);
+			oldtriggers.erase(match);
+			kept++;
+		} else
+			triggers.push_back(this->add(*e, file));
+	}
+	for (match = oldtriggers.begin(); match != oldtriggers.end(); ++match)
+		this->remove(match->second);
+	if (!triggers.empty())
+		this->byfile[file].swap(triggers);
+	return (kept);
+}
+
+/* a trigger for e, watching what it can of its paths already */
+FileWatch::Trigger *FileWatch::add(entry *e, CrontabFile *file) {
+	Trigger *t = new Trigger;
+	const char *s = e->watch, *comma;
+	Root root;
+	size_t n;
+
+	t->e = e;
+	t->file = file;
+	t->groups = groups_of(e->pwd);
+	t->window = e->spread > 0 ? e->spread : WATCH_WINDOW;
+	t->first = t->last = -1;
+	t->lost = false;
+	t->changes = 0;
+	/* the parser made sure they're absolute, and where the ** can be */
+	for (;;) {
+		comma = strchr(s, ',');
+		n = comma ? (size_t)(comma - s) : strlen(s);
+		root.path.assign(s, n);
+		if ((root.tree = (n > 3 && root.path.compare(n - 3, 3, "/**") == 0)))
+			root.path.erase(n - 3);
+		root.watched = root.logged = false;
+		t->roots.push_back(root);
+		if (comma == NULL)
+			break;
+		s = comma + 1;
+	}
+	this->count++;
+	if (this->fd != -1) {
+		for (vector<Root>::iterator r = t->roots.begin(); r != t->roots.end(); ++r)
+			if (!this->install(t, *r))
+				this->missing.insert(t);
+	}
+	return (t);
+}
+
+void FileWatch::remove(Trigger *t) {
+	map<int, Watch>::iterator w;
+	map<string, int>::iterator p;
+
+	for (set<int>::iterator wd = t->wds.begin(); wd != t->wds.end(); ++wd) {
+		if ((w = this->watches.find(*wd)) == this->watches.end())
+			continue;
+		for (vector<Use>::iterator u = w->second.uses.begin(); u != w->second.uses.end(); )
+			if (u->trigger == t)
+				u = w->second.uses.erase(u);
+			else
+				++u;
+		if (!w->second.uses.empty())
+			continue;
+		inotify_rm_watch(this->fd, *wd);
+		if ((p = this->wds.find(w->second.path)) != this->wds.end() && p->second == *wd)
+			this->wds.erase(p);
+		this->watches.erase(w);
+	}
+	this->pending.erase(t);
+	this->missing.erase(t);
+	this->count--;
+	delete t;
+}
+
+/* watch one of t's paths, false if it can't be yet */
+bool FileWatch::install(Trigger *t, Root &root) {
+	const char *why = NULL;
+	string dir, name;
+	struct stat st;
+	size_t slash;
+
+	if (stat(root.path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+		if (!reachable(root.path, t->e->pwd, t->groups) || !allowed(st, t->e->pwd, t->groups, R_OK | X_OK))
+			why = "its user can't list it";
+		else if (this->watch(root.path, t, "", root.tree, true) == -1)
+			why = strerror(errno);
+		else if (root.tree)
+			this->walk(t, root.path, false, 0);
+	} else if (root.tree) {
+		why = "it isn't a directory";
+	} else {
+		/* a file, through its directory */
+		slash = root.path.rfind('/');
+		dir = slash == 0 ? "/" : root.path.substr(0, slash);
+		name = root.path.substr(slash + 1);
+		if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+			why = "its directory isn't there";
+		else if (!reachable(dir, t->e->pwd, t->groups) || !allowed(st, t->e->pwd, t->groups, X_OK))
+			why = "its user can't get into its directory";
+		else if (this->watch(dir, t, name, false, true) == -1)
+			why = strerror(errno);
+	}
+	if (why != NULL) {
+		if (!root.logged)
+			ELOG("Can't watch %s for %s line %d yet, %s", root.path.c_str(), t->file->fname.c_str(), t->e->lineno, why);
+		root.logged = true;
+		return (false);
+	}
+	root.watched = true;
+	root.logged = false;
+	return (true);
+}
+
+/* watch the directory at path for t, or add t to the watch it has. The
+ * watch descriptor, -1 if it can't be watched
+ */
+int FileWatch::watch(const string &path, Trigger *t, const string &name, bool tree, bool root) {
+	map<string, int>::iterator p;
+	int wd;
+
+	if ((wd = inotify_add_watch(this->fd, path.c_str(), WATCH_MASK)) == -1) {
+		if (errno == ENOSPC)
+			ELOG("Out of inotify watches at %s, fs.inotify.max_user_watches needs raising", path.c_str());
+		return (-1);
+	}
+	Watch &w = this->watches[wd];
+	/* a directory moved within a tree keeps its watch */
+	if (w.path != path) {
+		if (!w.path.empty() && (p = this->wds.find(w.path)) != this->wds.end() && p->second == wd)
+			this->wds.erase(p);
+		w.path = path;
+		this->wds[path] = wd;
+	}
+	for (vector<Use>::iterator u = w.uses.begin(); u != w.uses.end(); ++u)
+		if (u->trigger == t && u->name == name) {
+			u->tree = u->tree || tree;
+			u->root = u->root || root;
+			return (wd);
+		}
+	Use use = { t, name, tree, root };
+	w.uses.push_back(use);
+	t->wds.insert(wd);
+	return (wd);
+}
+
+/* watch the directories under dir for t. With changed, the files in them
+ * are changes, as they got there before the watches did
+ */
+void FileWatch::walk(Trigger *t, const string &dir, bool changed, time_t now) {
+	struct dirent *de;
+	struct stat st;
+	string path;
+	DIR *d;
+
+	if ((d = opendir(dir.c_str())) == NULL)
+		return;
+	while ((de = readdir(d)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		path = join(dir, de->d_name);
+		if (de->d_type == DT_DIR || de->d_type == DT_UNKNOWN) {
+			/* never through a symlink, so never round in a loop */
+			if (lstat(path.c_str(), &st) != 0)
+				continue;
+			if (S_ISDIR(st.st_mode)) {
+				if (allowed(st, t->e->pwd, t->groups, R_OK | X_OK) && this->watch(path, t, "", true, false) != -1)
+					this->walk(t, path, changed, now);
+				continue;
+			}
+			if (!S_ISREG(st.st_mode))
+				continue;
+		} else if (de->d_type != DT_REG)
+			continue;
+		if (changed)
+			this->note(t, path, now);
+	}
+	closedir(d);
+}
+
+/* a watch has gone, with its directory or by inotify_rm_watch() */
+void FileWatch::forget(int wd) {
+	map<int, Watch>::iterator w = this->watches.find(wd);
+	map<string, int>::iterator p;
+	string path;
+
+	if (w == this->watches.end())
+		return;
+	for (vector<Use>::iterator u = w->second.uses.begin(); u != w->second.uses.end(); ++u) {
+		u->trigger->wds.erase(wd);
+		if (!u->root)
+			continue;
+		/* one of its paths, to be watched again once it's back */
+		path = u->name.empty() ? w->second.path : join(w->second.path, u->name.c_str());
+		for (vector<Root>::iterator r = u->trigger->roots.begin(); r != u->trigger->roots.end(); ++r)
+			if (r->path == path)
+				r->watched = false;
+		this->missing.insert(u->trigger);
+	}
+	if ((p = this->wds.find(w->second.path)) != this->wds.end() && p->second == wd)
+		this->wds.erase(p);
+	this->watches.erase(w);
+}
+
+/* a directory has moved out from under a tree, along with its own */
+void FileWatch::forgetTree(const string &path) {
+	map<string, int>::iterator p;
+	vector<int> gone;
+
+	for (p = this->wds.lower_bound(path); p != this->wds.end() &&
+			p->first.compare(0, path.size(), path) == 0; ++p)
+		if (p->first.size() == path.size() || p->first[path.size()] == '/')
+			gone.push_back(p->second);
+	for (vector<int>::iterator wd = gone.begin(); wd != gone.end(); ++wd) {
+		inotify_rm_watch(this->fd, *wd);
+		this->forget(*wd);
+	}
+}
+
+void FileWatch::processEvents() {
+	char buf[WATCH_BUFFER] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	map<int, Watch>::iterator w;
+	time_t now = time(NULL);
+	ssize_t len;
+	char *p;
+	int reads;
+
+	for (reads = 0; reads < WATCH_READS && (len = ::read(this->fd, buf, sizeof(buf))) > 0; reads++) {
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+			ev = (const struct inotify_event *)p;
+			this->stats.events++;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				this->overflow(now);
+				continue;
+			}
+			/* one we've stopped watching */
+			if ((w = this->watches.find(ev->wd)) == this->watches.end())
+				continue;
+			if (ev->mask & IN_IGNORED)
+				this->forget(ev->wd);
+			else if (ev->mask & IN_MOVE_SELF) {
+				/* a tree's directories are forgotten as they move
+				 * out of it, this is one of the paths themselves
+				 */
+				for (vector<Use>::iterator u = w->second.uses.begin(); u != w->second.uses.end(); ++u)
+					if (u->root && u->name.empty()) {
+						inotify_rm_watch(this->fd, ev->wd);
+						this->forget(ev->wd);
+						break;
+					}
+			} else if (ev->len > 0)
+				this->dispatch(ev->wd, ev, now);
+		}
+	}
+}
+
+/* something happened in a watched directory */
+void FileWatch::dispatch(int wd, const struct inotify_event *ev, time_t now) {
+	Watch &w = this->watches[wd];
+	string path = join(w.path, ev->name);
+	bool dir = ev->mask & IN_ISDIR;
+	struct stat st;
+	Trigger *t;
+	size_t i;
+
+	if (dir && (ev->mask & IN_MOVED_FROM)) {
+		this->forgetTree(path);
+		return;
+	}
+	/* by index, as walking a new directory can add to the uses */
+	for (i = 0; i < w.uses.size(); i++) {
+		if (!w.uses[i].name.empty() && w.uses[i].name != ev->name)
+			continue;
+		t = w.uses[i].trigger;
+		if (dir && w.uses[i].tree) {
+			if (!(ev->mask & (IN_CREATE | IN_MOVED_TO)))
+				continue;
+			if (lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode) && allowed(st, t->e->pwd, t->groups, R_OK | X_OK) &&
+					this->watch(path, t, "", true, false) != -1)
+				this->walk(t, path, true, now);
+		} else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+			this->note(t, path, now);
+	}
+}
+
+/* a file t watches has changed */
+void FileWatch::note(Trigger *t, const string &path, time_t now) {
+	this->stats.changes++;
+	t->changes++;
+	if (t->first == -1) {
+		t->first = now;
+		this->pending.insert(t);
+	}
+	t->last = now;
+	if (t->lost)
+		return;
+	if (t->changed.size() < WATCH_LIST_MAX || t->changed.count(path))
+		t->changed.insert(path);
+	else {
+		t->lost = true;
+		t->changed.clear();
+	}
+}
+
+/* events were lost, so anything may have changed anywhere */
+void FileWatch::overflow(time_t now) {
+	map<CrontabFile *, vector<Trigger *> >::iterator it;
+	vector<int> gone;
+	struct stat st;
+	Trigger *t;
+
+	this->stats.overflows++;
+	ELOG("The inotify queue overflowed, running all %d @watch jobs and walking their paths again", (int)this->count);
+	/* directories that went without a word */
+	for (map<int, Watch>::iterator w = this->watches.begin(); w != this->watches.end(); ++w)
+		if (stat(w->second.path.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+			gone.push_back(w->first);
+	for (vector<int>::iterator wd = gone.begin(); wd != gone.end(); ++wd) {
+		inotify_rm_watch(this->fd, *wd);
+		this->forget(*wd);
+	}
+	for (it = this->byfile.begin(); it != this->byfile.end(); ++it)
+		for (vector<Trigger *>::iterator i = it->second.begin(); i != it->second.end(); ++i) {
+			t = *i;
+			t->lost = true;
+			t->changed.clear();
+			if (t->first == -1) {
+				t->first = now;
+				this->pending.insert(t);
+			}
+			t->last = now;
+			/* and ones that came without a word */
+			for (vector<Root>::iterator r = t->roots.begin(); r != t->roots.end(); ++r)
+				if (r->watched && r->tree) {
+					this->walk(t, r->path, false, now);
+					this->stats.rescans++;
+				}
+		}
+	this->retry = 0;
+}
+
+/* when t's burst is over: quiet for its window, or held long enough */
+time_t FileWatch::deadline(const Trigger *t) const {
+	time_t quiet = t->last + t->window, held = t->first + WATCH_HOLD * t->window;
+
+	return (quiet < held ? quiet : held);
+}
+
+time_t FileWatch::tick(time_t now) {
+	set<Trigger *>::iterator it;
+	vector<Trigger *> retrying;
+	time_t next = -1, when;
+	Trigger *t;
+	bool all;
+
+	for (it = this->pending.begin(); it != this->pending.end(); ) {
+		t = *it++;
+		if ((when = this->deadline(t)) <= now)
+			this->fire(t);
+		else if (next == -1 || when < next)
+			next = when;
+	}
+	if (this->fd != -1 && !this->missing.empty() && now >= this->retry) {
+		this->retry = now + WATCH_RETRY;
+		retrying.assign(this->missing.begin(), this->missing.end());
+		for (vector<Trigger *>::iterator i = retrying.begin(); i != retrying.end(); ++i) {
+			all = true;
+			for (vector<Root>::iterator r = (*i)->roots.begin(); r != (*i)->roots.end(); ++r)
+				if (!r->watched && !this->install(*i, *r))
+					all = false;
+			if (all)
+				this->missing.erase(*i);
+		}
+	}
+	if (this->fd != -1 && !this->missing.empty() && (next == -1 || this->retry < next))
+		next = this->retry;
+	return (next);
+}
+
+/* what changed for t, a path a line in an unlinked file. -1 if it can't
+ * be written
+ */
+int FileWatch::listing(Trigger *t) {
+	char name[] = "/tmp/tinjac-watch.XXXXXX";
+	string text;
+	size_t off = 0;
+	ssize_t n;
+	int fd;
+
+	if (t->lost) {
+		for (vector<Root>::iterator r = t->roots.begin(); r != t->roots.end(); ++r)
+			text += r->path + "\n";
+	} else {
+		for (set<string>::iterator p = t->changed.begin(); p != t->changed.end(); ++p)
+			text += *p + "\n";
+	}
+	if ((fd = mkstemp(name)) == -1) {
+		ELOG("Can't list the changes for %s line %d: %s", t->file->fname.c_str(), t->e->lineno, strerror(errno));
+		return (-1);
+	}
+	unlink(name);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	while (off < text.size() && (n = ::write(fd, text.data() + off, text.size() - off)) > 0)
+		off += n;
+	if (off < text.size() || lseek(fd, 0, SEEK_SET) != 0) {
+		ELOG("Can't list the changes for %s line %d: %s", t->file->fname.c_str(), t->e->lineno, strerror(errno));
+		::close(fd);
+		return (-1);
+	}
+	return (fd);
+}
+
+/* t's burst is over, run its job */
+void FileWatch::fire(Trigger *t) {
+	int fd = this->listing(t);
+
+	DLOG("%lu changes for %s line %d%s", t->changes, t->file->fname.c_str(), t->e->lineno,
+		t->lost ? ", too many to list" : "");
+	this->stats.runs++;
+	t->first = t->last = -1;
+	t->changed.clear();
+	t->lost = false;
+	t->changes = 0;
+	this->pending.erase(t);
+	if (this->launch)
+		this->launch(t->e, t->file, fd);
+	if (fd != -1)
+		::close(fd);
+}
+
+void FileWatch::logStats() const {
+	RLOG("FileWatch: %d @watch jobs on %d directories, %lu events, %lu changes, %lu runs, %lu overflows, %lu trees walked again",
+		(int)this->count, (int)this->watches.size(), this->stats.events, this->stats.changes, this->stats.runs,
+		this->stats.overflows, this->stats.rescans);
+}
@@ -0,0 +1,191 @@
+/* Tinjac - jobgraph.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file jobgraph.cpp
+ *  @brief The chains of dependent jobs in one crontab
+ */
+
+
+#include <cstring>
+#include <deque>
+#include "log.hpp"
+#include "crontabparser.hpp"
+#include "jobgraph.hpp"
+
+
+JobGraph::JobGraph(const string &fname) : fname(fname), refs(1) {
+
+}
+
+JobGraph::~JobGraph() {
+	for (vector<Node>::iterator it = this->nodes.begin(); it != this->nodes.end(); ++it)
+		free_entry(it->e);
+}
+
+JobGraph *JobGraph::build(const CrontabFile *file) {
+	vector<entry *>::const_iterator it;
+	JobGraph *graph;
+	Node node;
+	size_t i;
+
+	for (it = file->entries.begin(); it != file->entries.end(); ++it)
+		if ((*it)->flags & WHEN_AFTER)
+			break;
+	if (it == file->entries.end())
+		return (NULL);
+
+	/* only the labelled entries and the ones that follow them take part */
+	graph = new JobGraph(file->fname);
+	for (it = file->entries.begin(); it != file->entries.end(); ++it) {
+		if (!(*it)->name && !((*it)->flags & WHEN_AFTER))
+			continue;
+		if ((node.e = copy_entry(*it)) == NULL) {
+			ELOG("Out of memory chaining the jobs in %s", file->fname.c_str());
+			graph->release();
+			return (NULL);
+		}
+		node.pipe = node.pipeparent = -1;
+		node.usable = true;
+		if ((*it)->name && !graph->names.insert(make_pair(string((*it)->name), (int)graph->nodes.size())).second)
+			ELOG("Label %s is used again in %s line %d, jobs will follow the first one", (*it)->name, file->fname.c_str(), (*it)->lineno);
+		graph->nodes.push_back(node);
+	}
+	for (i = 0; i < graph->nodes.size(); i++)
+		if ((graph->nodes[i].e->flags & WHEN_AFTER) && !graph->link(i))
+			graph->nodes[i].usable = false;
+	graph->sort();
+	return (graph);
+}
+
+/* join node i to the jobs it follows */
+bool JobGraph::link(int i) {
+	Node &node = this->nodes[i];
+	map<string, int>::iterator it;
+	const char *s = node.e->after, *comma;
+	string label;
+	int p;
+
+	/* the parser won't have it either, stdin only comes from one job */
+	if ((node.e->flags & AFTER_PIPE) && strchr(s, ',') != NULL) {
+		ELOG("%s line %d is a @pipe from more than one job", this->fname.c_str(), node.e->lineno);
+		return (false);
+	}
+	for (;;) {
+		comma = strchr(s, ',');
+		label.assign(s, comma ? comma - s : strlen(s));
+		if ((it = this->names.find(label)) == this->names.end()) {
+			ELOG("%s line %d runs after %s, which isn't in the file", this->fname.c_str(), node.e->lineno, label.c_str());
+			return (false);
+		}
+		p = it->second;
+		if (node.e->flags & AFTER_PIPE) {
+			if (this->nodes[p].pipe != -1) {
+				ELOG("%s line %d is a second @pipe from %s", this->fname.c_str(), node.e->lineno, label.c_str());
+				return (false);
+			}
+			this->nodes[p].pipe = i;
+			node.pipeparent = p;
+		} else {
+			node.parents.push_back(p);
+			this->nodes[p].children.push_back(i);
+		}
+		if (comma == NULL)
+			return (true);
+		s = comma + 1;
+	}
+}
+
+/* put the nodes in order (Kahn), so cycles show up as the ones left
+ * over, and anything after a job that can't run can't run either
+ */
+void JobGraph::sort() {
+	vector<int> indegree(this->nodes.size()), order;
+	deque<int> ready;
+	size_t i;
+	int n;
+
+	for (i = 0; i < this->nodes.size(); i++)
+		if ((indegree[i] = this->nodes[i].parents.size() + (this->nodes[i].pipeparent != -1)) == 0)
+			ready.push_back(i);
+	while (!ready.empty()) {
+		n = ready.front();
+		ready.pop_front();
+		order.push_back(n);
+		for (vector<int>::iterator c = this->nodes[n].children.begin(); c != this->nodes[n].children.end(); ++c)
+			if (--indegree[*c] == 0)
+				ready.push_back(*c);
+		if (this->nodes[n].pipe != -1 && --indegree[this->nodes[n].pipe] == 0)
+			ready.push_back(this->nodes[n].pipe);
+	}
+	for (i = 0; i < this->nodes.size(); i++)
+		if (indegree[i] > 0) {
+			ELOG("%s line %d is in (or after) a cycle of chained jobs and won't run", this->fname.c_str(), this->nodes[i].e->lineno);
+			this->nodes[i].usable = false;
+		}
+	for (vector<int>::iterator it = order.begin(); it != order.end(); ++it) {
+		Node &node = this->nodes[*it];
+		if (!node.usable)
+			continue;
+		for (vector<int>::iterator p = node.parents.begin(); p != node.parents.end(); ++p)
+			if (!this->nodes[*p].usable)
+				node.usable = false;
+		if (node.pipeparent != -1 && !this->nodes[node.pipeparent].usable)
+			node.usable = false;
+		if (!node.usable)
+			ELOG("%s line %d follows a job that can't run, so it won't either", this->fname.c_str(), node.e->lineno);
+	}
+}
+
+int JobGraph::find(const char *name) const {
+	map<string, int>::const_iterator it = this->names.find(name);
+
+	if (it == this->names.end() || !this->nodes[it->second].usable)
+		return (-1);
+	return (it->second);
+}
+
+const vector<int> &JobGraph::reach(int root) const {
+	map<int, vector<int> >::iterator it = this->reached.find(root);
+	vector<char> seen;
+	size_t i;
+
+	if (it != this->reached.end())
+		return (it->second);
+	vector<int> &nodes = this->reached[root];
+	seen.resize(this->nodes.size());
+	nodes.push_back(root);
+	seen[root] = 1;
+	/* breadth first, the vector is the queue */
+	for (i = 0; i < nodes.size(); i++) {
+		const Node &node = this->nodes[nodes[i]];
+		for (vector<int>::const_iterator c = node.children.begin(); c != node.children.end(); ++c)
+			if (!seen[*c] && this->nodes[*c].usable) {
+				seen[*c] = 1;
+				nodes.push_back(*c);
+			}
+		if (node.pipe != -1 && !seen[node.pipe] && this->nodes[node.pipe].usable) {
+			seen[node.pipe] = 1;
+			nodes.push_back(node.pipe);
+		}
+	}
+	return (nodes);
+}
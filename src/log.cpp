@@ -20,49 +20,359 @@
 ** $Rev$
 */
 
-/** @file log.cpp 
- *  @brief 
- */ 
-
-#include <stdarg.h>
-#include <stdio.h>
-#include <iostream>
-#include <fstream>
+/** @file log.cpp
+ *  @brief The daemon's log, written by a thread of its own
+ */
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
 #include "log.hpp"
 
+/* how much the writer puts together before it writes it out */
+#define LOG_BATCH	(64 * 1024)
+
+/* the started Log, which a forked child has to stop using the ring */
+static Log *active;
 
 
-Log::Log(char* filename) {
-  m_stream.open(filename);
+Log::Log(const char *filename, size_t slots) {
+	this->init(slots);
+	if ((this->fd = ::open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644)) != -1)
+		this->ownfd = true;
+	else
+		this->fd = STDERR_FILENO;
 }
 
 Log::Log() {
+	this->init(LOG_RING_SLOTS);
+	this->fd = STDERR_FILENO;
+}
+
+void Log::init(size_t slots) {
+	this->ownfd = false;
+	this->level = LOGLEVEL_DEBUG;
+	this->format = TEXT;
+	this->ring = NULL;
+	/* a power of two, so a position maps to a slot with a mask */
+	for (this->slots = 2; this->slots < slots; this->slots <<= 1)
+		;
+	this->head = this->tail = 0;
+	this->wake[0] = this->wake[1] = -1;
+	this->sleeping = this->running = this->producers = 0;
+	this->written = this->dropped = this->reported = 0;
+}
+
+Log::~Log() {
+	this->stop();
+	if (this->ownfd)
+		::close(this->fd);
 }
 
-void Log::Write(char *file, int LineNo, char* logline){
-	cout << "test" << endl;
-	if (m_stream.is_open())
-		m_stream << file<<":"<<LineNo<< ": " << logline << endl;
+bool Log::setFormat(const char *name) {
+	if (strcmp(name, "text") == 0)
+		this->format = TEXT;
+	else if (strcmp(name, "kv") == 0)
+		this->format = KEYVALUE;
+	else if (strcmp(name, "json") == 0)
+		this->format = JSON;
 	else
-		clog << file<<":"<<LineNo<<": " << logline << endl;
+		return (false);
+	return (true);
+}
+
+/* s as the inside of a JSON string, which does for a quoted value too */
+static void escape(string &out, const char *s) {
+	char hex[8];
+
+	for (; *s != '\0'; s++) {
+		switch (*s) {
+		case '"':
+			out += "\\\"";
+			break;
+		case '\\':
+			out += "\\\\";
+			break;
+		case '\n':
+			out += "\\n";
+			break;
+		case '\r':
+			out += "\\r";
+			break;
+		case '\t':
+			out += "\\t";
+			break;
+		default:
+			if ((unsigned char)*s < 0x20) {
+				snprintf(hex, sizeof(hex), "\\u%04x", (unsigned char)*s);
+				out += hex;
+			} else
+				out += *s;
+		}
+	}
+}
+
+void Log::format_line(string &out, const Slot &s) const {
+	const char *level = s.level == LOGLEVEL_REPORT ? "report" :
+	    s.level == LOGLEVEL_ERROR ? "error" : "debug";
+	char stamp[64], line[16];
+	struct tm tm;
+	size_t n;
+
+	snprintf(line, sizeof(line), "%d", s.line);
+	if (this->format == TEXT) {
+		out += s.file;
+		out += ':';
+		out += line;
+		out += ": ";
+		out += s.text;
+		out += '\n';
+		return;
+	}
+	gmtime_r(&s.tv.tv_sec, &tm);
+	n = strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(stamp + n, sizeof(stamp) - n, ".%03dZ", (int)(s.tv.tv_usec / 1000));
+	if (this->format == KEYVALUE) {
+		out += "time=";
+		out += stamp;
+		out += " level=";
+		out += level;
+		out += " file=";
+		out += s.file;
+		out += " line=";
+		out += line;
+		out += " msg=\"";
+		escape(out, s.text);
+		out += "\"\n";
+		return;
+	}
+	out += "{\"time\":\"";
+	out += stamp;
+	out += "\",\"level\":\"";
+	out += level;
+	out += "\",\"file\":\"";
+	escape(out, s.file);
+	out += "\",\"line\":";
+	out += line;
+	out += ",\"msg\":\"";
+	escape(out, s.text);
+	out += "\"}\n";
+}
+
+/* with O_APPEND each write() lands whole, whoever else is writing */
+void Log::output(const string &lines) {
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < lines.size()) {
+		if ((n = ::write(this->fd, lines.data() + off, lines.size() - off)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+		off += n;
+	}
 }
 
-void Log::Write(char *file, int LineNo, const char* logline, ...){
+/* claim the next slot, fill it and publish it. False if the ring is full */
+bool Log::push(int level, const char *file, int line, const char *logline, va_list ap) {
+	size_t pos = __atomic_load_n(&this->head, __ATOMIC_RELAXED), seq;
+	Slot *s;
+	char c = 0;
+
+	for (;;) {
+		s = &this->ring[pos & (this->slots - 1)];
+		seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&this->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if ((ptrdiff_t)(seq - pos) < 0) {
+			/* the writer hasn't got to the line that was here a lap ago */
+			__atomic_fetch_add(&this->dropped, 1, __ATOMIC_RELAXED);
+			return (false);
+		} else
+			pos = __atomic_load_n(&this->head, __ATOMIC_RELAXED);
+	}
+	s->level = level;
+	s->file = file;
+	s->line = line;
+	gettimeofday(&s->tv, NULL);
+	vsnprintf(s->text, sizeof(s->text), logline, ap);
+	/* seq_cst against the writer's going to sleep, so one of us sees the other */
+	__atomic_store_n(&s->seq, pos + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&this->sleeping, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&this->sleeping, 0, __ATOMIC_SEQ_CST))
+		while (::write(this->wake[1], &c, 1) < 0 && errno == EINTR)
+			;
+	return (true);
+}
+
+void Log::Write(int level, const char *file, int LineNo, const char *logline, ...) {
 	va_list argList;
-	char cbuffer[1024];
+	string out;
+	Slot s;
+
 	va_start(argList, logline);
-	vsnprintf(cbuffer, 1024, logline, argList);
+	if (__atomic_load_n(&this->running, __ATOMIC_ACQUIRE)) {
+		/* seq_cst against stop(), so it either waits for us or we see it */
+		__atomic_fetch_add(&this->producers, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&this->running, __ATOMIC_SEQ_CST)) {
+			this->push(level, file, LineNo, logline, argList);
+			__atomic_fetch_sub(&this->producers, 1, __ATOMIC_RELEASE);
+			va_end(argList);
+			return;
+		}
+		__atomic_fetch_sub(&this->producers, 1, __ATOMIC_RELEASE);
+	}
+	s.level = level;
+	s.file = file;
+	s.line = LineNo;
+	if (this->format != TEXT)
+		gettimeofday(&s.tv, NULL);
+	vsnprintf(s.text, sizeof(s.text), logline, argList);
 	va_end(argList);
-	if (m_stream.is_open())
-		m_stream << file<<":"<<LineNo<< ": " << cbuffer << endl;
-	else
-		clog << file<<":"<<LineNo<<": " << cbuffer << endl;
+	this->format_line(out, s);
+	this->output(out);
+	__atomic_fetch_add(&this->written, 1, __ATOMIC_RELAXED);
+}
+
+/* everything published so far, in order, in as few writes as it takes */
+void Log::drain() {
+	unsigned long dropped;
+	string out;
+	Slot *s, note;
+
+	for (;;) {
+		s = &this->ring[this->tail & (this->slots - 1)];
+		if (__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) != this->tail + 1)
+			break;
+		this->format_line(out, *s);
+		__atomic_store_n(&s->seq, this->tail + this->slots, __ATOMIC_RELEASE);
+		this->tail++;
+		__atomic_fetch_add(&this->written, 1, __ATOMIC_RELAXED);
+		if (out.size() >= LOG_BATCH) {
+			this->output(out);
+			out.clear();
+		}
+	}
+	if ((dropped = __atomic_load_n(&this->dropped, __ATOMIC_RELAXED)) != this->reported) {
+		note.level = LOGLEVEL_ERROR;
+		note.file = __FILE__;
+		note.line = __LINE__;
+		gettimeofday(&note.tv, NULL);
+		snprintf(note.text, sizeof(note.text), "Dropped %lu log lines, the log couldn't keep up", dropped - this->reported);
+		this->format_line(out, note);
+		this->reported = dropped;
+	}
+	if (!out.empty())
+		this->output(out);
+}
+
+void *Log::writer(void *arg) {
+	Log *log = (Log *)arg;
+	Slot *s;
+	char c;
+
+	for (;;) {
+		log->drain();
+		if (!__atomic_load_n(&log->running, __ATOMIC_SEQ_CST))
+			break;
+		__atomic_store_n(&log->sleeping, 1, __ATOMIC_SEQ_CST);
+		/* anything published before a producer could see we're asleep */
+		s = &log->ring[log->tail & (log->slots - 1)];
+		if (__atomic_load_n(&s->seq, __ATOMIC_SEQ_CST) == log->tail + 1 || !__atomic_load_n(&log->running, __ATOMIC_SEQ_CST)) {
+			__atomic_store_n(&log->sleeping, 0, __ATOMIC_SEQ_CST);
+			continue;
+		}
+		while (::read(log->wake[0], &c, 1) < 0 && errno == EINTR)
+			;
+		__atomic_store_n(&log->sleeping, 0, __ATOMIC_SEQ_CST);
+	}
+	/* stop() came after the last line */
+	log->drain();
+	return (NULL);
+}
 
+/* the thread stayed behind with the parent */
+void Log::forked() {
+	if (active != NULL)
+		__atomic_store_n(&active->running, 0, __ATOMIC_RELEASE);
+	active = NULL;
+}
+
+bool Log::start() {
+	static bool registered;
+	sigset_t all, old;
+	size_t i;
+	int err;
 
+	if (__atomic_load_n(&this->running, __ATOMIC_ACQUIRE))
+		return (true);
+	if (active != NULL || pipe(this->wake) != 0)
+		return (false);
+	fcntl(this->wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(this->wake[1], F_SETFD, FD_CLOEXEC);
+	/* a producer never waits for the writer to wake up */
+	fcntl(this->wake[1], F_SETFL, O_NONBLOCK);
+	this->ring = new Slot[this->slots];
+	for (i = 0; i < this->slots; i++)
+		this->ring[i].seq = i;
+	this->head = this->tail = 0;
+	/* the ring is there before anyone can see it is */
+	__atomic_store_n(&this->running, 1, __ATOMIC_RELEASE);
+	if (!registered)
+		registered = pthread_atfork(NULL, NULL, Log::forked) == 0;
+	/* signals are for the scheduler's thread, not this one */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&this->thread, NULL, Log::writer, this);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		__atomic_store_n(&this->running, 0, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&this->producers, __ATOMIC_ACQUIRE) != 0)
+			sched_yield();
+		delete[] this->ring;
+		this->ring = NULL;
+		::close(this->wake[0]);
+		::close(this->wake[1]);
+		this->wake[0] = this->wake[1] = -1;
+		ELOG("Can't start the log writer, logging directly: %s", strerror(err));
+		return (false);
+	}
+	active = this;
+	return (true);
 }
 
-Log::~Log(){
-  m_stream.close();
+void Log::stop() {
+	char c = 0;
+
+	if (!__atomic_load_n(&this->running, __ATOMIC_ACQUIRE))
+		return;
+	__atomic_store_n(&this->running, 0, __ATOMIC_SEQ_CST);
+	/* a line part way onto the ring is finished first */
+	while (__atomic_load_n(&this->producers, __ATOMIC_ACQUIRE) != 0)
+		sched_yield();
+	while (::write(this->wake[1], &c, 1) < 0 && errno == EINTR)
+		;
+	pthread_join(this->thread, NULL);
+	/* which the writer may have gone without */
+	this->drain();
+	::close(this->wake[0]);
+	::close(this->wake[1]);
+	this->wake[0] = this->wake[1] = -1;
+	delete[] this->ring;
+	this->ring = NULL;
+	active = NULL;
 }
 
+Log::Stats Log::getStats() const {
+	Stats stats;
 
+	stats.written = __atomic_load_n(&this->written, __ATOMIC_RELAXED);
+	stats.dropped = __atomic_load_n(&this->dropped, __ATOMIC_RELAXED);
+	return (stats);
+}
@@ -0,0 +1,451 @@
+/* Tinjac - mailspool.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file mailspool.cpp
+ *  @brief Spools job output, and mails it out as one digest per recipient
+ */
+
+
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include "log.hpp"
+#include "mappedfile.hpp"
+#include "scheduler.hpp"
+#include "mailspool.hpp"
+
+#define MAIL_MAGIC	"TJML"
+
+
+MailSpool::MailSpool(const string &fname) :
+	fname(fname), transport(NULL), interval(MAIL_INTERVAL), last(time(NULL)), sched(NULL), started(false),
+	sending(false), stopping(false), wanted(false), wantnow(0), wantforce(false), fd(-1), pending(false) {
+	memset(&this->stats, 0, sizeof(this->stats));
+	pthread_mutex_init(&this->lock, NULL);
+	pthread_cond_init(&this->ready, NULL);
+	this->wake[0] = this->wake[1] = -1;
+}
+
+MailSpool::~MailSpool() {
+	if (this->started) {
+		/* a flush under way is finished, one asked for is dropped */
+		pthread_mutex_lock(&this->lock);
+		this->stopping = true;
+		pthread_cond_broadcast(&this->ready);
+		pthread_mutex_unlock(&this->lock);
+		pthread_join(this->worker, NULL);
+		this->sched->unwatchFd(this->wake[0]);
+	}
+	if (this->wake[0] != -1) {
+		::close(this->wake[0]);
+		::close(this->wake[1]);
+	}
+	if (this->fd != -1)
+		::close(this->fd);
+	pthread_cond_destroy(&this->ready);
+	pthread_mutex_destroy(&this->lock);
+}
+
+bool MailSpool::open() {
+	bool ok;
+
+	pthread_mutex_lock(&this->lock);
+	ok = this->reopen();
+	pthread_mutex_unlock(&this->lock);
+	return (ok);
+}
+
+/* open() with the lock held */
+bool MailSpool::reopen() {
+	struct stat sb;
+
+	if (this->fd != -1)
+		::close(this->fd);
+	if ((this->fd = ::open(this->fname.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+		ELOG("Can't open the mail spool %s: %s", this->fname.c_str(), strerror(errno));
+		return (false);
+	}
+	/* what the last daemon didn't get round to sending */
+	if ((fstat(this->fd, &sb) == 0 && sb.st_size > 0) || access((this->fname + ".sending").c_str(), F_OK) == 0)
+		this->pending = true;
+	return (true);
+}
+
+bool MailSpool::start(Scheduler *sched) {
+	sigset_t all, old;
+	int err;
+
+	if (this->started)
+		return (true);
+	if (pipe(this->wake) != 0) {
+		ELOG("Can't make a pipe for sending mail: %s", strerror(errno));
+		return (false);
+	}
+	fcntl(this->wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(this->wake[1], F_SETFD, FD_CLOEXEC);
+	fcntl(this->wake[0], F_SETFL, O_NONBLOCK);
+	/* signals are for the scheduler's thread, not this one. Which
+	 * also keeps a sendmail that goes away early from SIGPIPEing us
+	 */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&this->worker, NULL, MailSpool::loop, this);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		ELOG("Can't start the thread for sending mail: %s", strerror(err));
+		::close(this->wake[0]);
+		::close(this->wake[1]);
+		this->wake[0] = this->wake[1] = -1;
+		return (false);
+	}
+	this->started = true;
+	this->sched = sched;
+	this->sched->watchFd(this->wake[0], boost::bind(&MailSpool::processDone, this));
+	return (true);
+}
+
+void *MailSpool::loop(void *arg) {
+	((MailSpool *)arg)->work();
+	return (NULL);
+}
+
+/* do the flushes asked for until the MailSpool goes */
+void MailSpool::work() {
+	time_t now;
+	bool force;
+	char c = 0;
+
+	pthread_mutex_lock(&this->lock);
+	while (!this->stopping) {
+		if (!this->wanted) {
+			pthread_cond_wait(&this->ready, &this->lock);
+			continue;
+		}
+		this->wanted = false;
+		now = this->wantnow;
+		force = this->wantforce;
+		pthread_mutex_unlock(&this->lock);
+		this->deliver(now, force);
+		pthread_mutex_lock(&this->lock);
+		while (::write(this->wake[1], &c, 1) < 0 && errno == EINTR)
+			;
+	}
+	pthread_mutex_unlock(&this->lock);
+}
+
+/* the thread has finished a flush, so nextFlush() has an answer again */
+void MailSpool::processDone() {
+	char buf[64];
+
+	while (::read(this->wake[0], buf, sizeof(buf)) > 0)
+		;
+	this->sending = false;
+}
+
+MailSpool::Stats MailSpool::getStats() const {
+	Stats stats;
+
+	pthread_mutex_lock(&this->lock);
+	stats = this->stats;
+	pthread_mutex_unlock(&this->lock);
+	return (stats);
+}
+
+/* one record, in one write() so that it can't be interleaved or torn
+ * by anything but a crash
+ */
+bool MailSpool::append(const Record &r, const char *strings) {
+	string buf((const char *)&r, sizeof(r));
+	ssize_t n;
+
+	buf.append(strings, r.length);
+	pthread_mutex_lock(&this->lock);
+	if (this->fd == -1) {
+		pthread_mutex_unlock(&this->lock);
+		return (false);
+	}
+	while ((n = ::write(this->fd, buf.data(), buf.size())) < 0 && errno == EINTR)
+		;
+	if (n != (ssize_t)buf.size()) {
+		pthread_mutex_unlock(&this->lock);
+		ELOG("Can't write to the mail spool %s: %s", this->fname.c_str(), n < 0 ? strerror(errno) : "short write");
+		return (false);
+	}
+	this->pending = true;
+	pthread_mutex_unlock(&this->lock);
+	return (true);
+}
+
+/* give up on a record, keeping it in the dead letters */
+bool MailSpool::bury(const Record &r, const char *strings) {
+	string dead = this->fname + ".dead";
+	string buf((const char *)&r, sizeof(r));
+	ssize_t n;
+	int fd;
+
+	buf.append(strings, r.length);
+	if ((fd = ::open(dead.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+		ELOG("Can't open the dead letters %s: %s", dead.c_str(), strerror(errno));
+		return (false);
+	}
+	while ((n = ::write(fd, buf.data(), buf.size())) < 0 && errno == EINTR)
+		;
+	::close(fd);
+	if (n != (ssize_t)buf.size()) {
+		ELOG("Can't write to the dead letters %s: %s", dead.c_str(), n < 0 ? strerror(errno) : "short write");
+		return (false);
+	}
+	return (true);
+}
+
+bool MailSpool::safeAddress(const string &address) {
+	string::const_iterator c;
+
+	if (address.empty() || address[0] == '-')
+		return (false);
+	for (c = address.begin(); c != address.end(); ++c)
+		if (!isalnum((unsigned char)*c) && strchr("@._+-%", *c) == NULL)
+			return (false);
+	return (true);
+}
+
+bool MailSpool::add(const string &to, const string &from, const string &subject, const string &body, time_t when) {
+	string oneline = subject, strings;
+	string::iterator c;
+	Record r;
+
+	if (!safeAddress(to) || !safeAddress(from)) {
+		ELOG("Not mailing output to \"%s\" from \"%s\", that isn't a safe address", to.c_str(), from.c_str());
+		return (false);
+	}
+	/* it becomes a header */
+	for (c = oneline.begin(); c != oneline.end(); ++c)
+		if (*c == '\n' || *c == '\r')
+			*c = ' ';
+	strings = to + from + oneline + body;
+	memset(&r, 0, sizeof(r));
+	memcpy(r.magic, MAIL_MAGIC, sizeof(r.magic));
+	r.length = strings.size();
+	r.when = when;
+	r.tolen = to.size();
+	r.fromlen = from.size();
+	r.subjectlen = oneline.size();
+	r.bodylen = body.size();
+	if (!this->append(r, strings.data()))
+		return (false);
+	pthread_mutex_lock(&this->lock);
+	this->stats.queued++;
+	this->stats.bytes += body.size();
+	pthread_mutex_unlock(&this->lock);
+	return (true);
+}
+
+time_t MailSpool::nextFlush() const {
+	bool pending;
+
+	pthread_mutex_lock(&this->lock);
+	pending = this->pending;
+	pthread_mutex_unlock(&this->lock);
+	if (!pending || this->transport == NULL || this->sending)
+		return (-1);
+	return (this->last + this->interval);
+}
+
+size_t MailSpool::flush(time_t now, bool force) {
+	bool pending;
+
+	pthread_mutex_lock(&this->lock);
+	pending = this->pending;
+	pthread_mutex_unlock(&this->lock);
+	if (!pending || this->transport == NULL || this->sending || (!force && now < this->last + this->interval))
+		return (0);
+	this->last = now;
+	if (!this->started)
+		return (this->deliver(now, force));
+	pthread_mutex_lock(&this->lock);
+	this->wanted = true;
+	this->wantnow = now;
+	this->wantforce = force;
+	pthread_cond_signal(&this->ready);
+	pthread_mutex_unlock(&this->lock);
+	this->sending = true;
+	return (0);
+}
+
+/* what flush() does, on the thread if there is one */
+size_t MailSpool::deliver(time_t now, bool force) {
+	string sending = this->fname + ".sending";
+	size_t sent = 0;
+	bool retry;
+
+	pthread_mutex_lock(&this->lock);
+	this->pending = false;
+	pthread_mutex_unlock(&this->lock);
+	/* one left part way through by a crash goes first */
+	if (access(sending.c_str(), F_OK) == 0)
+		sent += this->send(sending, now, force);
+	/* new output goes to a new spool while this one is sent */
+	if (rename(this->fname.c_str(), sending.c_str()) == 0) {
+		/* which isn't left over, whatever reopen() makes of it */
+		pthread_mutex_lock(&this->lock);
+		retry = this->pending;
+		this->reopen();
+		this->pending = retry;
+		pthread_mutex_unlock(&this->lock);
+		sent += this->send(sending, now, force);
+	} else if (errno != ENOENT) {
+		ELOG("Can't move the mail spool %s aside: %s", this->fname.c_str(), strerror(errno));
+		pthread_mutex_lock(&this->lock);
+		this->pending = true;
+		pthread_mutex_unlock(&this->lock);
+	}
+	return (sent);
+}
+
+/* mail everything in a spool file, a digest to each recipient, and
+ * remove it. The records that couldn't be sent, or aren't to be tried
+ * again yet, go back on the spool
+ */
+size_t MailSpool::send(const string &path, time_t now, bool force) {
+	/* the records for each recipient and sender, in the order they came */
+	map<pair<string, string>, vector<size_t> > groups;
+	vector<pair<string, string> > order;
+	MappedFile file;
+	const char *data, *s;
+	size_t off, i, start, sent = 0, records = 0;
+	char host[256], date[64], when[32];
+	struct tm tm;
+	time_t t, wait;
+	uint32_t n;
+	string message, subject;
+	Record r;
+
+	if (!file.open(path)) {
+		unlink(path.c_str());
+		return (0);
+	}
+	data = file.data();
+	for (off = 0; off + sizeof(Record) <= file.size(); off += sizeof(Record) + r.length) {
+		memcpy(&r, data + off, sizeof(r));
+		if (memcmp(r.magic, MAIL_MAGIC, sizeof(r.magic)) != 0 || off + sizeof(Record) + r.length > file.size() ||
+				(uint64_t)r.tolen + r.fromlen + r.subjectlen + r.bodylen != r.length)
+			break;
+		s = data + off + sizeof(Record);
+		if (!force && r.retry > now) {
+			this->append(r, s);
+			continue;
+		}
+		pair<string, string> key(string(s, r.tolen), string(s + r.tolen, r.fromlen));
+		vector<size_t> &group = groups[key];
+		if (group.empty())
+			order.push_back(key);
+		group.push_back(off);
+	}
+	if (off != file.size())
+		ELOG("Dropping %lu bytes at the end of the mail spool %s, it was cut short", (unsigned long)(file.size() - off), path.c_str());
+
+	if (gethostname(host, sizeof(host) - 1) != 0)
+		strcpy(host, "localhost");
+	host[sizeof(host) - 1] = '\0';
+	t = time(NULL);
+	strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %z", localtime_r(&t, &tm));
+	for (vector<pair<string, string> >::iterator it = order.begin(); it != order.end(); ++it) {
+		vector<size_t> &group = groups[*it];
+
+		/* as many messages as it takes to keep each under the limit */
+		for (start = 0; start < group.size(); start = i) {
+			message.clear();
+			for (i = start; i < group.size(); i++) {
+				memcpy(&r, data + group[i], sizeof(r));
+				if (i > start && message.size() + r.bodylen > MAIL_DIGEST_MAX)
+					break;
+				s = data + group[i] + sizeof(Record) + r.tolen + r.fromlen;
+				t = r.when;
+				strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&t, &tm));
+				message += "--- " + string(s, r.subjectlen) + ", " + when + " ---\n";
+				message.append(s + r.subjectlen, r.bodylen);
+				if (r.bodylen > 0 && s[r.subjectlen + r.bodylen - 1] != '\n')
+					message += '\n';
+				message += '\n';
+			}
+			if (i - start == 1) {
+				memcpy(&r, data + group[start], sizeof(r));
+				subject = string(data + group[start] + sizeof(Record) + r.tolen + r.fromlen, r.subjectlen);
+			} else {
+				char count[32];
+				snprintf(count, sizeof(count), "%lu", (unsigned long)(i - start));
+				subject = string("Cron <") + host + "> output of " + count + " jobs";
+			}
+			message = "From: " + it->second + " (Cron Daemon)\nTo: " + it->first + "\nSubject: " + subject +
+				"\nDate: " + date + "\nAuto-Submitted: auto-generated\nPrecedence: bulk\n" +
+				"Content-Type: text/plain; charset=UTF-8\n\n" + message;
+			if (this->transport->send(it->second, it->first, message)) {
+				pthread_mutex_lock(&this->lock);
+				this->stats.messages++;
+				pthread_mutex_unlock(&this->lock);
+				sent++;
+				records += i - start;
+				continue;
+			}
+			pthread_mutex_lock(&this->lock);
+			this->stats.failed++;
+			pthread_mutex_unlock(&this->lock);
+			for (size_t j = start; j < i; j++) {
+				memcpy(&r, data + group[j], sizeof(r));
+				s = data + group[j] + sizeof(Record);
+				if (++r.attempts < MAIL_ATTEMPTS_MAX && now - r.when < MAIL_AGE_MAX) {
+					/* try it again later, and later still after that */
+					for (wait = MAIL_RETRY, n = 1; n < r.attempts && wait < MAIL_RETRY_MAX; n++)
+						wait *= 2;
+					r.retry = now + (wait < MAIL_RETRY_MAX ? wait : MAIL_RETRY_MAX);
+					this->append(r, s);
+					continue;
+				}
+				ELOG("Giving up on mailing \"%s\" to %s after %u attempts, it is in %s.dead",
+					string(s + r.tolen + r.fromlen, r.subjectlen).c_str(), it->first.c_str(), (unsigned)r.attempts,
+					this->fname.c_str());
+				if (this->bury(r, s)) {
+					pthread_mutex_lock(&this->lock);
+					this->stats.dead++;
+					pthread_mutex_unlock(&this->lock);
+				} else
+					/* better it is tried again than lost */
+					this->append(r, s);
+			}
+		}
+	}
+	file.close();
+	unlink(path.c_str());
+	if (sent > 0)
+		DLOG("Mailed %lu jobs' output in %lu messages with %s", (unsigned long)records, (unsigned long)sent,
+			this->transport->describe().c_str());
+	return (sent);
+}
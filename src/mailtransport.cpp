@@ -0,0 +1,289 @@
+/* Tinjac - mailtransport.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file mailtransport.cpp
+ *  @brief Ways of handing a finished mail message on for delivery
+ */
+
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "log.hpp"
+#include "mailtransport.hpp"
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL	0
+#endif
+
+
+/* all of message down fd. Not in send(), so nothing of this is live
+ * across its vfork()
+ */
+static bool feed(int fd, const string &message) {
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < message.size()) {
+		if ((n = ::write(fd, message.data() + off, message.size() - off)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return (false);
+		}
+		off += n;
+	}
+	return (true);
+}
+
+bool SendmailTransport::send(const string &from, const string &to, const string &message) {
+	const char *argv[] = { "sendmail", "-oi", "-f", from.c_str(), "--", to.c_str(), NULL };
+	sigset_t pipemask, saved;
+#ifdef __linux
+	struct timespec zero = { 0, 0 };
+#endif
+	int p[2], status;
+	bool fed;
+	pid_t pid;
+
+	if (pipe(p) != 0) {
+		ELOG("Can't make a pipe to %s: %s", this->path.c_str(), strerror(errno));
+		return (false);
+	}
+	fcntl(p[0], F_SETFD, FD_CLOEXEC);
+	fcntl(p[1], F_SETFD, FD_CLOEXEC);
+	/* vfork(), so it costs the same however big the daemon is */
+	if ((pid = vfork()) == 0) {
+		if (dup2(p[0], STDIN_FILENO) < 0)
+			_exit(127);
+		execv(this->path.c_str(), (char **)argv);
+		_exit(127);
+	}
+	::close(p[0]);
+	if (pid < 0) {
+		ELOG("Can't run %s: %s", this->path.c_str(), strerror(errno));
+		::close(p[1]);
+		return (false);
+	}
+	/* if it goes away early we see EPIPE, not a SIGPIPE. Only this
+	 * thread's mask is ours to change
+	 */
+	sigemptyset(&pipemask);
+	sigaddset(&pipemask, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipemask, &saved);
+	fed = feed(p[1], message);
+	::close(p[1]);
+#ifdef __linux
+	while (sigtimedwait(&pipemask, NULL, &zero) == SIGPIPE)
+		;
+#endif
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	while (waitpid(pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return (false);
+	if (!fed || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		ELOG("%s didn't take the mail for %s (status %d)", this->path.c_str(), to.c_str(), status);
+		return (false);
+	}
+	return (true);
+}
+
+
+SmtpTransport::SmtpTransport(const string &host, int port) : host(host), port(port), fd(-1) {
+}
+
+SmtpTransport *SmtpTransport::parse(const char *spec) {
+	const char *colon = strrchr(spec, ':');
+	char *end;
+	long port = 25;
+
+	if (*spec == '\0' || colon == spec)
+		return (NULL);
+	if (colon != NULL) {
+		port = strtol(colon + 1, &end, 10);
+		if (end == colon + 1 || *end != '\0' || port < 1 || port > 65535)
+			return (NULL);
+		return (new SmtpTransport(string(spec, colon - spec), (int)port));
+	}
+	return (new SmtpTransport(spec, (int)port));
+}
+
+string SmtpTransport::describe() const {
+	char port[16];
+
+	snprintf(port, sizeof(port), ":%d", this->port);
+	return ("smtp://" + this->host + port);
+}
+
+bool SmtpTransport::connect() {
+	struct addrinfo hints, *res, *ai;
+	struct pollfd pfd;
+	socklen_t len;
+	char port[16];
+	int err = 0, rc;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	snprintf(port, sizeof(port), "%d", this->port);
+	if ((rc = getaddrinfo(this->host.c_str(), port, &hints, &res)) != 0) {
+		this->last = gai_strerror(rc);
+		return (false);
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((this->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1)
+			continue;
+		fcntl(this->fd, F_SETFD, FD_CLOEXEC);
+		fcntl(this->fd, F_SETFL, O_NONBLOCK);
+		/* connect without blocking, so a dead server only costs the
+		 * timeout
+		 */
+		if (::connect(this->fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		if (errno == EINPROGRESS) {
+			pfd.fd = this->fd;
+			pfd.events = POLLOUT;
+			len = sizeof(err);
+			if (poll(&pfd, 1, SMTP_TIMEOUT * 1000) == 1 &&
+					getsockopt(this->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err == 0)
+				break;
+			errno = err ? err : ETIMEDOUT;
+		}
+		this->last = strerror(errno);
+		::close(this->fd);
+		this->fd = -1;
+	}
+	freeaddrinfo(res);
+	this->buf.clear();
+	return (this->fd != -1);
+}
+
+void SmtpTransport::disconnect() {
+	if (this->fd != -1)
+		::close(this->fd);
+	this->fd = -1;
+}
+
+bool SmtpTransport::writeAll(const string &data) {
+	struct pollfd pfd;
+	size_t off = 0;
+	ssize_t n;
+
+	pfd.fd = this->fd;
+	pfd.events = POLLOUT;
+	while (off < data.size()) {
+		if ((n = ::send(this->fd, data.data() + off, data.size() - off, MSG_NOSIGNAL)) > 0) {
+			off += n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && poll(&pfd, 1, SMTP_TIMEOUT * 1000) == 1)
+			continue;
+		this->last = n < 0 && errno != EAGAIN ? strerror(errno) : "timed out";
+		return (false);
+	}
+	return (true);
+}
+
+/* read a reply, all its lines, and check it's the kind we expect */
+bool SmtpTransport::reply(int expect) {
+	struct pollfd pfd;
+	char chunk[512];
+	size_t eol;
+	ssize_t n;
+
+	pfd.fd = this->fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		while ((eol = this->buf.find('\n')) != string::npos) {
+			this->last = this->buf.substr(0, eol);
+			this->buf.erase(0, eol + 1);
+			if (!this->last.empty() && this->last[this->last.size() - 1] == '\r')
+				this->last.erase(this->last.size() - 1);
+			/* "250-" says there are more lines to come */
+			if (this->last.size() < 3 || (this->last.size() > 3 && this->last[3] == '-'))
+				continue;
+			return (atoi(this->last.c_str()) / 100 == expect / 100);
+		}
+		if ((n = ::read(this->fd, chunk, sizeof(chunk))) > 0) {
+			this->buf.append(chunk, n);
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && poll(&pfd, 1, SMTP_TIMEOUT * 1000) == 1)
+			continue;
+		this->last = n == 0 ? "connection closed" : (n < 0 && errno != EAGAIN ? strerror(errno) : "timed out");
+		return (false);
+	}
+}
+
+bool SmtpTransport::command(const string &line, int expect) {
+	return (this->writeAll(line + "\r\n") && this->reply(expect));
+}
+
+bool SmtpTransport::send(const string &from, const string &to, const string &message) {
+	char host[256];
+	string data;
+	size_t start, end;
+	bool ok;
+
+	if (gethostname(host, sizeof(host) - 1) != 0)
+		strcpy(host, "localhost");
+	host[sizeof(host) - 1] = '\0';
+	/* \r\n line ends, and a line that starts with a '.' gets another */
+	for (start = 0; start < message.size(); start = end + 1) {
+		if ((end = message.find('\n', start)) == string::npos)
+			end = message.size();
+		if (message[start] == '.')
+			data += '.';
+		data.append(message, start, end - start);
+		data += "\r\n";
+	}
+	data += ".\r\n";
+	if (!this->connect()) {
+		ELOG("Can't connect to %s: %s", this->describe().c_str(), this->last.c_str());
+		return (false);
+	}
+	ok = this->reply(220) &&
+		(this->command(string("EHLO ") + host, 250) || this->command(string("HELO ") + host, 250)) &&
+		this->command("MAIL FROM:<" + from + ">", 250) &&
+		this->command("RCPT TO:<" + to + ">", 250) &&
+		this->command("DATA", 354) &&
+		this->writeAll(data) && this->reply(250);
+	if (ok)
+		this->command("QUIT", 221);
+	else
+		ELOG("%s didn't take the mail for %s: %s", this->describe().c_str(), to.c_str(), this->last.c_str());
+	this->disconnect();
+	return (ok);
+}
@@ -25,21 +25,452 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
 #include <iostream>
 #include <fstream>
+#include <boost/bind.hpp>
 #include "log.hpp"
 #include "crontabs.hpp"
+#include "scheduler.hpp"
+#include "usercache.hpp"
+#include "crontabcache.hpp"
+#include "spawner.hpp"
+#include "supervisor.hpp"
+#include "chains.hpp"
+#include "admission.hpp"
+#include "cgroups.hpp"
+#include "concurrency.hpp"
+#include "mailspool.hpp"
+#include "webcron.hpp"
+#include "dbcron.hpp"
+#include "filewatch.hpp"
+#include "runhistory.hpp"
 
 using namespace std;
 
 Log *logFacility;
+static Scheduler *sched;
+static UserCache *users;
+static crontabs *ct;
+static CrontabCache *cache;
+static Spawner *spawner;
+static Supervisor *supervisor;
+static Chains *chains;
+static Admission *admission;
+static Cgroups *cgroups;
+static Concurrency *concurrency;
+static MailSpool *mail;
+static WebCron *webcron;
+static DbCron *dbcron;
+static FileWatch *filewatch;
+static RunHistory *history;
+static MailTransport *transport;
+static char hostname[256] = "localhost";
+static volatile sig_atomic_t report;
+static time_t nextscan;
+
+static void sigterm_handler(int) {
+	sched->stop();
+}
+
+/* SIGUSR1 logs how much memory each crontab is using */
+static void sigusr1_handler(int) {
+	report = 1;
+}
+
+static void launch_job(const entry *e, const string &fname, JobGraph *graph, int infd) {
+	if (!(e->flags & DONT_LOG))
+		DLOG("(%s) CMD (%s)", e->pwd->pw_name, e->cmd);
+	/* the first job of a chain runs as part of it */
+	if (chains->start(e, graph, infd))
+		return;
+	concurrency->launch(e, fname, infd);
+}
+
+/* a job is due; it starts now unless the system is too busy for it */
+static void run_job(ScheduledJob *job, time_t now) {
+	if (admission->admit(job->e, job->file, now))
+		launch_job(job->e, job->file->fname, job->file->graph, -1);
+}
+
+/* files have changed under the paths a @watch job watches, and infd
+ * lists them
+ */
+static void watch_job(const entry *e, CrontabFile *file, int infd) {
+	launch_job(e, file->fname, file->graph, infd);
+}
+
+/* what the job printed (as much as was kept of it), a line at a time */
+static void log_output(const Supervisor::JobRun &run) {
+	string text = run.output.text();
+	size_t start, end;
+
+	for (start = 0; start < text.size(); start = end + 1) {
+		if ((end = text.find('\n', start)) == string::npos)
+			end = text.size();
+		DLOG("(%s) CMDOUT (%s)", run.user.c_str(), text.substr(start, end - start).c_str());
+	}
+}
+
+/* spool what the job printed for each of its MAILTO addresses */
+static void mail_output(const Supervisor::JobRun &run) {
+	string subject = "Cron <" + run.user + "@" + hostname + "> " + run.cmd;
+	string text = run.output.text();
+	size_t start, end;
+
+	for (start = 0; start < run.mailto.size(); start = end + 1) {
+		if ((end = run.mailto.find_first_of(", ", start)) == string::npos)
+			end = run.mailto.size();
+		if (end > start)
+			mail->add(run.mailto.substr(start, end - start), run.mailfrom, subject, text, run.finished.tv_sec);
+	}
+}
+
+/* how a job's process ended, and what it used */
+static void log_exit(const Supervisor::JobRun &run) {
+	char how[64], contained[160] = "";
+
+	if (run.status == -1)
+		snprintf(how, sizeof(how), "was lost with the spawner");
+	else if (WIFSIGNALED(run.status))
+		snprintf(how, sizeof(how), "killed by signal %d", WTERMSIG(run.status));
+	else
+		snprintf(how, sizeof(how), "exited with status %d", WEXITSTATUS(run.status));
+	/* everything it started, from its cgroup */
+	if (run.contained)
+		snprintf(contained, sizeof(contained), ", cgroup cpu %llu.%03llus peak %llukB read %llu written %llu bytes",
+			run.cgusage.cpu / 1000000, run.cgusage.cpu / 1000 % 1000, run.cgusage.memory / 1024,
+			run.cgusage.rbytes, run.cgusage.wbytes);
+	DLOG("Job %lu (%s:%d pid %d) %s, user %ld.%03lds sys %ld.%03lds maxrss %ldkB, %llu bytes of output%s",
+		run.id, run.fname.c_str(), run.lineno, (int)run.pid, how,
+		(long)run.usage.ru_utime.tv_sec, (long)run.usage.ru_utime.tv_usec / 1000,
+		(long)run.usage.ru_stime.tv_sec, (long)run.usage.ru_stime.tv_usec / 1000,
+		run.usage.ru_maxrss, run.outbytes, contained);
+}
+
+/* how a URL job's request went */
+static void log_request(const Supervisor::JobRun &run) {
+	long ms = (run.finished.tv_sec - run.started.tv_sec) * 1000 + (run.finished.tv_usec - run.started.tv_usec) / 1000;
+
+	if (run.httpstatus != 0)
+		DLOG("Job %lu (%s:%d) got HTTP %d in %ldms, %llu bytes of response", run.id, run.fname.c_str(), run.lineno,
+			run.httpstatus, ms, run.outbytes);
+	else
+		ELOG("Job %lu (%s:%d) failed after %ldms: %s", run.id, run.fname.c_str(), run.lineno, ms, run.httperror.c_str());
+}
+
+/* how a database job's SQL went */
+static void log_query(const Supervisor::JobRun &run) {
+	long ms = (run.finished.tv_sec - run.started.tv_sec) * 1000 + (run.finished.tv_usec - run.started.tv_usec) / 1000;
+
+	if (run.dberror.empty())
+		DLOG("Job %lu (%s:%d) ran its SQL in %ldms, %lu rows returned and %lu changed", run.id, run.fname.c_str(), run.lineno,
+			ms, run.dbrows, run.dbchanges);
+	else
+		ELOG("Job %lu (%s:%d) failed after %ldms: %s", run.id, run.fname.c_str(), run.lineno, ms, run.dberror.c_str());
+}
+
+/* what the history keeps of a run */
+static void record_run(const Supervisor::JobRun &run) {
+	RunHistory::Run r;
+
+	memset(&r, 0, sizeof(r));
+	r.started = (int64_t)run.started.tv_sec * 1000000 + run.started.tv_usec;
+	r.finished = (int64_t)run.finished.tv_sec * 1000000 + run.finished.tv_usec;
+	r.utime = (int64_t)run.usage.ru_utime.tv_sec * 1000000 + run.usage.ru_utime.tv_usec;
+	r.stime = (int64_t)run.usage.ru_stime.tv_sec * 1000000 + run.usage.ru_stime.tv_usec;
+	r.outbytes = run.outbytes;
+	if (!run.output.empty())
+		r.digest = RunHistory::digest(run.output.text());
+	r.status = run.status;
+	if (run.pid == -1)
+		r.flags |= RunHistory::Run::UNSTARTED;
+	if (run.url)
+		r.flags |= RunHistory::Run::URL;
+	if (run.database)
+		r.flags |= RunHistory::Run::DATABASE;
+	r.maxrss = run.usage.ru_maxrss;
+	r.majflt = run.usage.ru_majflt;
+	history->add(RunHistory::jobId(run.fname, run.user, run.cmd), r);
+}
+
+/* when an @period job last ran, by the history, so that what was missed
+ * while we were down is caught up on
+ */
+static time_t last_run(const entry *e, const string &fname) {
+	return (history->lastRun(RunHistory::jobId(fname, e->pwd->pw_name, e->cmd)));
+}
+
+/* the jobs the history keeps runs of when it compacts. Not while a
+ * crontab is waiting for its users, whose jobs aren't there yet
+ */
+static bool live_jobs(boost::unordered_set<string> &live) {
+	CrontabFileMap::const_iterator it;
+	vector<entry *>::const_iterator e;
+
+	if (ct == NULL)
+		return (false);
+	for (it = ct->getCrontabs().begin(); it != ct->getCrontabs().end(); ++it) {
+		if (it->second->partial)
+			return (false);
+		for (e = it->second->entries.begin(); e != it->second->entries.end(); ++e)
+			live.insert(RunHistory::jobId(it->second->fname, (*e)->pwd->pw_name, (*e)->cmd));
+	}
+	return (true);
+}
+
+/* the entries running as a user that changed or went away are loaded
+ * again, so that they pick that up
+ */
+static void user_changed(const string &name) {
+	if (ct)
+		ct->userChanged(name);
+}
+
+static void job_done(const Supervisor::JobRun &run) {
+	record_run(run);
+	if (run.pid == -1) {
+		ELOG("Job %lu (%s:%d) failed to start: %s", run.id, run.fname.c_str(), run.lineno, strerror(run.status));
+		chains->jobDone(run);
+		concurrency->jobDone(run);
+		return;
+	}
+	if (run.url)
+		log_request(run);
+	else if (run.database)
+		log_query(run);
+	else
+		log_exit(run);
+	if (!run.output.empty()) {
+		log_output(run);
+		mail_output(run);
+	}
+	chains->jobDone(run);
+	concurrency->jobDone(run);
+}
+
+/* without the spawner no job can run, and another can't safely be
+ * forked now that there are threads, so we go and are started afresh
+ */
+static void spawner_gone() {
+	ELOG("Exiting, no jobs can run without spawner %d", (int)spawner->getHelperPid());
+	sched->stop();
+}
+
+/* every running job holds a pipe open here, so allow as many as we can */
+static void raise_nofile() {
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur >= rl.rlim_max)
+		return;
+	rl.rlim_cur = rl.rlim_max;
+	if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+		ELOG("Can't raise the open file limit: %s", strerror(errno));
+}
+
+/* start watching the crontab directory if we can */
+static void watch_crontabs() {
+	int fd;
+
+	if ((fd = ct->watch()) != -1)
+		sched->watchFd(fd, boost::bind(&crontabs::processEvents, ct));
+}
+
+/* housekeeping before we sleep: starting jobs that were held back,
+ * and @watch jobs whose files have stopped changing, removing the
+ * cgroups of jobs that left something behind, mailing the spooled
+ * output when the interval is up, writing out the run history, a report
+ * of memory, admission and concurrency if one was asked for, catching up
+ * with any users that have gone stale, without inotify looking for
+ * changed crontabs, and saving what was reloaded to the cache
+ */
+static void idle(time_t now) {
+	size_t done;
+	time_t next;
+
+	admission->retry(now);
+	if ((next = filewatch->tick(now)) != -1)
+		sched->wakeAt(next);
+	if (cgroups->lingering() > 0)
+		cgroups->sweep();
+	mail->flush(now);
+	if ((next = mail->nextFlush()) != -1)
+		sched->wakeAt(next);
+	history->commit(now);
+	if ((next = history->nextCommit()) != -1)
+		sched->wakeAt(next);
+	if (report) {
+		report = 0;
+		ct->logMemory();
+		admission->logStats();
+		concurrency->logStats();
+		filewatch->logStats();
+		history->logStats();
+	}
+	if ((done = users->refresh(now, USERCACHE_REFRESH_MAX)) > 0) {
+		const UserCache::Stats &stats = users->getStats();
+		DLOG("Refreshing %d users, %lu hits %lu misses %lu changed", (int)done, stats.hits, stats.misses, stats.changed);
+	}
+	if (!ct->watching() && now >= nextscan) {
+		nextscan = now + CRONTAB_POLL;
+		/* the directory may be back, if it was what went away */
+		watch_crontabs();
+		if (!ct->watching())
+			ct->rescan();
+	}
+	ct->saveCache();
+}
 
 int main(int argc, char *argv[]) {
+	vector<ScheduledJob *> boot;
+	struct sigaction sa;
+	char *jobsmax, *smtp, *interval, *logformat, *loglevel, *hostmax, *dbworkers, *keep, *periodmax;
+
 	logFacility = new Log();
+	if ((logformat = getenv("TINJAC_LOG_FORMAT")) != NULL && !logFacility->setFormat(logformat))
+		ELOG("TINJAC_LOG_FORMAT=%s isn't text, kv or json", logformat);
+	/* errors only, without the CMD and CMDOUT lines */
+	if ((loglevel = getenv("TINJAC_LOG_LEVEL")) != NULL && strcmp(loglevel, "error") == 0)
+		logFacility->setLevel(LOGLEVEL_ERROR);
+	/* @period delays and DEFER=jitter differ from host to host and boot to boot */
+	srandom(time(NULL) ^ getpid());
+	sched = new Scheduler();
+	/* before anything else, so the spawner stays small */
+	spawner = new Spawner();
+	spawner->setScheduler(sched);
+	spawner->setGone(spawner_gone);
+	if (!spawner->start())
+		return 1;
+	raise_nofile();
+	/* the spawner has been forked, so the writer can have a thread */
+	logFacility->start();
+	/* after the spawner, which moves with us */
+	cgroups = new Cgroups();
+	cgroups->setup();
+	supervisor = new Supervisor(spawner, sched);
+	supervisor->setDone(job_done);
+	supervisor->setCgroups(cgroups);
+	/* URL jobs are requests made from a thread, with no process */
+	webcron = new WebCron(sched);
+	if ((hostmax = getenv("TINJAC_HTTP_HOST_MAX")) != NULL)
+		webcron->setHostMax(atoi(hostmax));
+	if (webcron->start())
+		supervisor->setWebCron(webcron);
+	/* and database jobs are SQL run on connections kept between them */
+	dbcron = new DbCron(sched);
+	if ((dbworkers = getenv("TINJAC_DB_WORKERS")) != NULL)
+		dbcron->setWorkers(atoi(dbworkers));
+	if (dbcron->start())
+		supervisor->setDbCron(dbcron);
+	chains = new Chains(supervisor);
+	concurrency = new Concurrency(supervisor);
+	if ((jobsmax = getenv("TINJAC_JOBS_MAX")) != NULL)
+		concurrency->setMax(atoi(jobsmax));
+	if ((periodmax = getenv("TINJAC_PERIOD_JOBS_MAX")) != NULL)
+		concurrency->setPeriodMax(atoi(periodmax));
+	admission = new Admission(sched);
+	admission->setLaunch(boost::bind(launch_job, _1, _2, _3, -1));
+	/* @watch jobs run as files change, rather than on the clock */
+	filewatch = new FileWatch(sched);
+	filewatch->setLaunch(watch_job);
+	filewatch->start();
+	/* MAILTO output goes to an SMTP server if we're given one */
+	if ((smtp = getenv("TINJAC_SMTP")) != NULL && (transport = SmtpTransport::parse(smtp)) == NULL)
+		ELOG("TINJAC_SMTP=%s isn't host or host:port, using sendmail", smtp);
+	if (transport == NULL)
+		transport = new SendmailTransport();
+	if (gethostname(hostname, sizeof(hostname) - 1) != 0)
+		strcpy(hostname, "localhost");
+	mail = new MailSpool();
+	if (mail->open())
+		mail->setTransport(transport);
+	/* sent on a thread of its own, sendmail and SMTP servers take their time */
+	mail->start(sched);
+	if ((interval = getenv("TINJAC_MAIL_INTERVAL")) != NULL)
+		mail->setInterval(atoi(interval));
+	/* and every run is recorded */
+	history = new RunHistory();
+	if ((keep = getenv("TINJAC_HISTORY_KEEP")) != NULL)
+		history->setKeep(atoi(keep));
+	history->setLiveJobs(live_jobs);
+	/* written and synced on a thread of its own too */
+	if (history->open())
+		history->start();
+	/* which @period jobs are due comes from it */
+	sched->setLastRun(last_run);
+	users = new UserCache();
+	users->setChanged(user_changed);
+	cache = new CrontabCache();
 	try {
-    	crontabs *ct = new crontabs("/etc/cron.d", true);
-    } catch(std::exception &e) {
-    	cerr << e.what() << "\n";
-    }
-    return 1;
+		ct = new crontabs();
+		ct->setScheduler(sched);
+		ct->setFileWatch(filewatch);
+		ct->setUserCache(users);
+		cache->open();
+		ct->setCache(cache);
+		ct->setPath("/etc/cron.d", true);
+		/* the mapping is only any use at startup */
+		cache->close();
+		ct->saveCache();
+		DLOG("Scheduled %d entries, looked up %d users, %lu crontabs from the cache", (int)sched->size(), (int)users->getStats().misses, cache->getStats().hits);
+		/* from now on users are looked up on a thread of their own, before
+		 * this there was nothing to hold up
+		 */
+		users->start(sched);
+
+		sa.sa_handler = sigterm_handler;
+		sigemptyset(&sa.sa_mask);
+		sa.sa_flags = 0;
+		sigaction(SIGTERM, &sa, NULL);
+		sigaction(SIGINT, &sa, NULL);
+		sa.sa_handler = sigusr1_handler;
+		sigaction(SIGUSR1, &sa, NULL);
+
+		/* not on a restart, only once per boot */
+		if (Scheduler::firstSinceBoot())
+			sched->rebootJobs(boot);
+		else if (sched->rebootJobs(boot) > 0) {
+			DLOG("Not the first start since boot, skipping %d @reboot jobs", (int)boot.size());
+			boot.clear();
+		}
+		for (vector<ScheduledJob *>::iterator it = boot.begin(); it != boot.end(); ++it)
+			run_job(*it, time(NULL));
+		watch_crontabs();
+		if (!ct->watching())
+			ELOG("Not watching for crontab changes, rescanning every %d seconds", CRONTAB_POLL);
+		nextscan = time(NULL) + CRONTAB_POLL;
+		sched->setIdle(idle, CRONTAB_POLL);
+		sched->run(run_job);
+		delete ct;
+		ct = NULL;
+	} catch(std::exception &e) {
+		cerr << e.what() << "\n";
+	}
+	delete admission;
+	delete filewatch;
+	delete mail;
+	/* what was added since the last commit */
+	delete history;
+	delete transport;
+	delete chains;
+	delete concurrency;
+	delete supervisor;
+	delete webcron;
+	delete dbcron;
+	delete cgroups;
+	delete spawner;
+	delete users;
+	delete sched;
+	delete cache;
+	/* last, once the threads that log have all been joined, with what
+	 * is still on the ring
+	 */
+	logFacility->stop();
+	return 1;
 }
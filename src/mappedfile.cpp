@@ -0,0 +1,120 @@
+/* Tinjac - mappedfile.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file mappedfile.cpp
+ *  @brief Read only view of a whole file, mmap'd where possible
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "log.hpp"
+#include "mappedfile.hpp"
+
+
+MappedFile::MappedFile() : buffer(NULL), length(0), mapped(false) {
+	memset(&this->sb, 0, sizeof(this->sb));
+}
+
+MappedFile::~MappedFile() {
+	this->close();
+}
+
+bool MappedFile::open(const string &fname, int flags, bool map) {
+	int fd;
+
+	this->close();
+	if ((fd = ::open(fname.c_str(), O_RDONLY | O_NONBLOCK | flags, 0)) == -1) {
+		ELOG("Can't open %s: %s", fname.c_str(), strerror(errno));
+		return false;
+	}
+	if (fstat(fd, &this->sb) == -1) {
+		ELOG("Can't stat %s: %s", fname.c_str(), strerror(errno));
+		::close(fd);
+		return false;
+	}
+	if (map && S_ISREG(this->sb.st_mode) && this->sb.st_size > 0) {
+		void *p = mmap(NULL, this->sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED) {
+			/* we walk the file front to back exactly once */
+			madvise(p, this->sb.st_size, MADV_SEQUENTIAL);
+			this->buffer = (char *)p;
+			this->length = this->sb.st_size;
+			this->mapped = true;
+			::close(fd);
+			return true;
+		}
+		DLOG("mmap of %s failed (%s), reading it instead", fname.c_str(), strerror(errno));
+	}
+	if (!this->readAll(fd)) {
+		ELOG("Can't read %s: %s", fname.c_str(), strerror(errno));
+		::close(fd);
+		this->close();
+		return false;
+	}
+	::close(fd);
+	return true;
+}
+
+bool MappedFile::readAll(int fd) {
+	size_t size = this->sb.st_size > 0 ? this->sb.st_size : 4096;
+	ssize_t rd;
+
+	/* files that can't be mapped are usually small, but may not
+	 * report their real size (procfs, pipes), so grow as we go
+	 */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	this->buffer = (char *)malloc(size);
+	this->length = 0;
+	while (this->buffer != NULL) {
+		if (this->length == size) {
+			char *p = (char *)realloc(this->buffer, size * 2);
+			if (p == NULL)
+				return false;
+			this->buffer = p;
+			size *= 2;
+		}
+		rd = read(fd, this->buffer + this->length, size - this->length);
+		if (rd == 0)
+			return true;
+		if (rd < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		this->length += rd;
+	}
+	return false;
+}
+
+void MappedFile::close() {
+	if (this->mapped)
+		munmap(this->buffer, this->length);
+	else
+		free(this->buffer);
+	this->buffer = NULL;
+	this->length = 0;
+	this->mapped = false;
+}
@@ -0,0 +1,184 @@
+/* Tinjac - misc.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+** Portions Copyright:
+** Copyright 1988,1990,1993,1994 by Paul Vixie
+**
+** Copyright (c) 2004 by Internet Systems Consortium, Inc. ("ISC")
+** Copyright (c) 1997,2000 by Internet Software Consortium, Inc.
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file misc.cpp
+ *  @brief Assorted string and passwd helpers shared by the crontab code
+ */
+
+
+#include <cstdlib>
+#include <cstring>
+#include "misc.hpp"
+
+
+/* the passwd comes first, so a pw_dup() result can be cast back */
+struct shared_passwd {
+	struct passwd	pw;
+	unsigned int	refs;
+};
+
+struct passwd *pw_dup(const struct passwd *pw) {
+	char		*cp;
+	size_t		 nsize=0, psize=0, gsize=0, dsize=0, ssize=0, total=0;
+	struct passwd	*newpw;
+
+	/* Allocate in one big chunk for easy freeing */
+	total = sizeof(struct shared_passwd);
+	if (pw->pw_name) {
+		nsize = strlen(pw->pw_name) + 1;
+		total += nsize;
+	}
+	if (pw->pw_passwd) {
+		psize = strlen(pw->pw_passwd) + 1;
+		total += psize;
+	}
+#ifdef LOGIN_CAP
+	if (pw->pw_class) {
+		csize = strlen(pw->pw_class) + 1;
+		total += csize;
+	}
+#endif /* LOGIN_CAP */
+	if (pw->pw_gecos) {
+		gsize = strlen(pw->pw_gecos) + 1;
+		total += gsize;
+	}
+	if (pw->pw_dir) {
+		dsize = strlen(pw->pw_dir) + 1;
+		total += dsize;
+	}
+	if (pw->pw_shell) {
+		ssize = strlen(pw->pw_shell) + 1;
+		total += ssize;
+	}
+	if ((cp = (char *)malloc(total)) == NULL)
+		return (NULL);
+	newpw = (struct passwd *)cp;
+	((struct shared_passwd *)cp)->refs = 1;
+
+	/*
+	 * Copy in passwd contents and make strings relative to space
+	 * at the end of the buffer.
+	 */
+	(void)memcpy(newpw, pw, sizeof(struct passwd));
+	cp += sizeof(struct shared_passwd);
+	if (pw->pw_name) {
+		(void)memcpy(cp, pw->pw_name, nsize);
+		newpw->pw_name = cp;
+		cp += nsize;
+	}
+	if (pw->pw_passwd) {
+		/* nothing needs the hash, don't keep it in memory */
+		(void)memset(cp, 0, psize);
+		newpw->pw_passwd = cp;
+		cp += psize;
+	}
+#ifdef LOGIN_CAP
+	if (pw->pw_class) {
+		(void)memcpy(cp, pw->pw_class, csize);
+		newpw->pw_class = cp;
+		cp += csize;
+	}
+#endif /* LOGIN_CAP */
+	if (pw->pw_gecos) {
+		(void)memcpy(cp, pw->pw_gecos, gsize);
+		newpw->pw_gecos = cp;
+		cp += gsize;
+	}
+	if (pw->pw_dir) {
+		(void)memcpy(cp, pw->pw_dir, dsize);
+		newpw->pw_dir = cp;
+		cp += dsize;
+	}
+	if (pw->pw_shell) {
+		(void)memcpy(cp, pw->pw_shell, ssize);
+		newpw->pw_shell = cp;
+		cp += ssize;
+	}
+
+	return (newpw);
+}
+
+struct passwd *pw_hold(struct passwd *pw) {
+	if (pw)
+		((struct shared_passwd *)pw)->refs++;
+	return (pw);
+}
+
+void pw_release(struct passwd *pw) {
+	if (pw && --((struct shared_passwd *)pw)->refs == 0)
+		free(pw);
+}
+
+unsigned int pw_refs(const struct passwd *pw) {
+	return (((const struct shared_passwd *)pw)->refs);
+}
+
+/*
+ * glue_strings is the overflow-safe equivalent of
+ *		sprintf(buffer, "%s%c%s", a, separator, b);
+ *
+ * returns 1 on success, 0 on failure.  'buffer' MUST NOT be used if
+ * glue_strings fails.
+ */
+int glue_strings(char *buffer, size_t buffer_size, const char *a, const char *b, char separator) {
+	char *buf;
+	char *buf_end;
+
+	if (buffer_size <= 0)
+		return (0);
+	buf_end = buffer + buffer_size;
+	buf = buffer;
+
+	for ( /* nothing */ ; buf < buf_end && *a != '\0'; buf++, a++)
+		*buf = *a;
+	if (buf == buf_end)
+		return (0);
+	if (separator != '/' || buf == buffer || buf[-1] != '/')
+		*buf++ = separator;
+	if (buf == buf_end)
+		return (0);
+	for ( /* nothing */ ; buf < buf_end && *b != '\0'; buf++, b++)
+		*buf = *b;
+	if (buf == buf_end)
+		return (0);
+	*buf = '\0';
+	return (1);
+}
+
+int strcmp_until(const char *left, const char *right, char until) {
+	while (*left && *left != until && *left == *right) {
+		left++;
+		right++;
+	}
+
+	if ((*left == '\0' || *left == until) && (*right == '\0' ||
+			*right == until)) {
+		return (0);
+	}
+	return (*left - *right);
+}
@@ -0,0 +1,328 @@
+/* Tinjac - nextfire.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file nextfire.cpp
+ *  @brief Work out when a crontab entry is next due
+ */
+
+
+#include <cstdlib>
+#include <cstring>
+#include "env.hpp"
+#include "nextfire.hpp"
+
+/* the longest DST gap we will walk over. Real zones move by an hour,
+ * the odd one by 30 minutes; nothing comes close to 3 hours.
+ */
+#define MAX_GAP_MINUTES		(3 * 60)
+
+
+/* lowest set bit of mask at or above from, or -1 */
+static inline int nextbit(uint64_t mask, int from) {
+	if (from > 63)
+		return (-1);
+	mask &= ~0ULL << from;
+	if (mask == 0)
+		return (-1);
+	return (__builtin_ctzll(mask));
+}
+
+static inline bool isleap(int year) {
+	return ((year % 4 == 0 && year % 100 != 0) || year % 400 == 0);
+}
+
+static int days_in_month(int year, int mon) {
+	static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+
+	if (mon == 2 && isleap(year))
+		return (29);
+	return (days[mon - 1]);
+}
+
+/* weekday (0 = Sunday) of a date, Sakamoto's method */
+static int day_of_week(int year, int mon, int mday) {
+	static const int t[] = { 0, 3, 2, 5, 0, 3, 5, 1, 4, 6, 2, 4 };
+
+	if (mon < 3)
+		year--;
+	return ((year + year / 4 - year / 100 + year / 400 + t[mon - 1] + mday) % 7);
+}
+
+NextFireCalculator::NextFireCalculator(const entry *e) :
+	minutes(0), hours(0), months(0), doms(0), dows(0), flags(e->flags), period(e->period) {
+	char *tzname;
+	int i, w, d;
+
+	for (i = FIRST_MINUTE; i <= LAST_MINUTE; i++)
+		if (bit_test(e->minute, i))
+			this->minutes |= 1ULL << i;
+	for (i = FIRST_HOUR; i <= LAST_HOUR; i++)
+		if (bit_test(e->hour, i))
+			this->hours |= 1ULL << i;
+	for (i = FIRST_DOM; i <= LAST_DOM; i++)
+		if (bit_test(e->dom, i - FIRST_DOM))
+			this->doms |= 1ULL << i;
+	for (i = FIRST_MONTH; i <= LAST_MONTH; i++)
+		if (bit_test(e->month, i - FIRST_MONTH))
+			this->months |= 1ULL << i;
+	/* Sunday is both 0 and 7 */
+	for (i = FIRST_DOW; i <= LAST_DOW; i++)
+		if (bit_test(e->dow, i))
+			this->dows |= 1ULL << (i % 7);
+
+	/* the day of week mask for a month only depends on which weekday the
+	 * 1st falls on, so work out all 7 up front.
+	 */
+	for (w = 0; w < 7; w++) {
+		this->dowdays[w] = 0;
+		for (d = 1; d <= LAST_DOM; d++)
+			if (this->dows & (1ULL << ((w + d - 1) % 7)))
+				this->dowdays[w] |= 1ULL << d;
+	}
+
+	tzname = e->envp ? env_get((char *)"CRON_TZ", e->envp) : NULL;
+	this->zone = TimeZone::get(tzname ? tzname : "");
+}
+
+NextFireCalculator::~NextFireCalculator() {
+
+}
+
+/* days of the month that match both day fields, as a mask of bits 1 - 31 */
+uint64_t NextFireCalculator::dayMask(int year, int mon) const {
+	uint64_t days, dow;
+	int dim = days_in_month(year, mon);
+
+	dow = this->dowdays[day_of_week(year, mon, 1)];
+	if (this->flags & (DOM_STAR | DOW_STAR))
+		days = this->doms & dow;
+	else
+		days = this->doms | dow;
+	return (days & (((1ULL << dim) - 1) << 1));
+}
+
+bool NextFireCalculator::matches(const struct tm *tm) const {
+	bool dom, dow;
+
+	if (!(this->minutes & (1ULL << tm->tm_min)) ||
+			!(this->hours & (1ULL << tm->tm_hour)) ||
+			!(this->months & (1ULL << (tm->tm_mon + 1))))
+		return (false);
+	dom = (this->doms & (1ULL << tm->tm_mday)) != 0;
+	dow = (this->dows & (1ULL << tm->tm_wday)) != 0;
+	if (this->flags & (DOM_STAR | DOW_STAR))
+		return (dom && dow);
+	return (dom || dow);
+}
+
+/* move wc forward to the first wall clock time at or after it that
+ * matches. Each field is a single nextbit(); when a field runs out we
+ * carry into the next one up and reset everything below it.
+ */
+bool NextFireCalculator::nextWall(wallclock *wc) const {
+	int limit = wc->year + NEXTFIRE_MAX_YEARS;
+	int mon, mday, hour, min;
+
+	while (wc->year <= limit) {
+		if ((mon = nextbit(this->months, wc->mon)) < 0) {
+			wc->year++;
+			wc->mon = FIRST_MONTH;
+			wc->mday = FIRST_DOM;
+			wc->hour = wc->min = 0;
+			continue;
+		}
+		if (mon != wc->mon) {
+			wc->mon = mon;
+			wc->mday = FIRST_DOM;
+			wc->hour = wc->min = 0;
+		}
+		if ((mday = nextbit(this->dayMask(wc->year, wc->mon), wc->mday)) < 0) {
+			if (++wc->mon > LAST_MONTH) {
+				wc->year++;
+				wc->mon = FIRST_MONTH;
+			}
+			wc->mday = FIRST_DOM;
+			wc->hour = wc->min = 0;
+			continue;
+		}
+		if (mday != wc->mday) {
+			wc->mday = mday;
+			wc->hour = wc->min = 0;
+		}
+		if ((hour = nextbit(this->hours, wc->hour)) < 0) {
+			/* a day past the end of the month just fails dayMask() */
+			wc->mday++;
+			wc->hour = wc->min = 0;
+			continue;
+		}
+		if (hour != wc->hour) {
+			wc->hour = hour;
+			wc->min = 0;
+		}
+		if ((min = nextbit(this->minutes, wc->min)) < 0) {
+			wc->hour++;
+			wc->min = 0;
+			continue;
+		}
+		wc->min = min;
+		return (true);
+	}
+	return (false);
+}
+
+static void add_minute(int *year, int *mon, int *mday, int *hour, int *min) {
+	if (++*min <= LAST_MINUTE)
+		return;
+	*min = 0;
+	if (++*hour <= LAST_HOUR)
+		return;
+	*hour = 0;
+	if (++*mday <= days_in_month(*year, *mon))
+		return;
+	*mday = 1;
+	if (++*mon <= LAST_MONTH)
+		return;
+	*mon = 1;
+	++*year;
+}
+
+/* return 1 and set *t if the wall clock time exists at or after notbefore,
+ * 0 if it doesn't exist at all (a DST gap) and -1 if it only exists
+ * before notbefore. Where the time happens twice the earlier one wins.
+ */
+int NextFireCalculator::wallToTime(const wallclock *wc, time_t notbefore, time_t *t) const {
+	time_t c, r;
+	long offs[2];
+	bool found = false, past = false;
+	int i;
+
+	/* an instant r is this wall clock time if r + offset(r) == c. No
+	 * offset is a day or more, so r is within a day of c, and the only
+	 * offsets in force then are the ones a day either side.
+	 */
+	c = TimeZone::civilSeconds(wc->year, wc->mon, wc->mday, wc->hour, wc->min);
+	offs[0] = this->zone->offset(c - SECONDS_PER_DAY);
+	offs[1] = this->zone->offset(c + SECONDS_PER_DAY);
+	for (i = 0; i < 2; i++) {
+		if (i == 1 && offs[1] == offs[0])
+			break;
+		r = c - offs[i];
+		if (this->zone->offset(r) != offs[i])
+			continue;
+		if (r < notbefore) {
+			past = true;
+			continue;
+		}
+		if (!found || r < *t) {
+			*t = r;
+			found = true;
+		}
+	}
+	if (found)
+		return (1);
+	return (past ? -1 : 0);
+}
+
+/* if t falls in the stretch after the clocks went back where the wall
+ * clock is repeating times it has already shown, move it on to the end
+ * of that stretch so those times don't fire a second time.
+ */
+time_t NextFireCalculator::skipRepeated(time_t t) const {
+	time_t last;
+	long drop;
+
+	if ((last = this->zone->lastTransition(t)) == -1)
+		return (t);
+	drop = this->zone->offset(last - 1) - this->zone->offset(last);
+	if (drop > 0 && t < last + drop)
+		return (last + drop);
+	return (t);
+}
+
+time_t NextFireCalculator::next(time_t after) const {
+	wallclock wc;
+	struct tm tm;
+	time_t start, t, tr;
+	long off;
+	int gap, rc;
+
+	if (this->flags & (WHEN_REBOOT | WHEN_AFTER | WHEN_WATCH | WHEN_PERIOD))
+		return (-1);
+
+	after -= after % SECONDS_PER_MINUTE;
+	start = this->skipRepeated(after + SECONDS_PER_MINUTE);
+	this->zone->toWall(start, &tm);
+	off = this->zone->offset(start);
+	wc.year = tm.tm_year + 1900;
+	wc.mon = tm.tm_mon + 1;
+	wc.mday = tm.tm_mday;
+	wc.hour = tm.tm_hour;
+	wc.min = tm.tm_min;
+
+	while (this->nextWall(&wc)) {
+		/* if there is no offset change between start and t, t is just
+		 * the wall clock time less the offset at start.
+		 */
+		t = TimeZone::civilSeconds(wc.year, wc.mon, wc.mday, wc.hour, wc.min) - off;
+		if (t >= start && ((tr = this->zone->nextTransition(start)) == -1 || tr > t))
+			return (t);
+		rc = this->wallToTime(&wc, start, &t);
+		/* in a DST gap, fire at the first minute that exists after it */
+		for (gap = 0; rc == 0 && gap < MAX_GAP_MINUTES; gap++) {
+			add_minute(&wc.year, &wc.mon, &wc.mday, &wc.hour, &wc.min);
+			rc = this->wallToTime(&wc, start, &t);
+		}
+		if (rc == 1)
+			return (t);
+		add_minute(&wc.year, &wc.mon, &wc.mday, &wc.hour, &wc.min);
+	}
+	return (-1);
+}
+
+/* anacron counts in days: a daily job that ran at any time on the 1st
+ * is due again at midnight on the 2nd, however late on the 1st that was.
+ * A period of hours or minutes is just that long after the last run.
+ */
+time_t NextFireCalculator::periodEnd(time_t last) const {
+	struct tm tm;
+	time_t c, t;
+	int year, mon;
+
+	if (this->period > 0 && this->period % SECONDS_PER_DAY != 0)
+		return (last + this->period);
+	this->zone->toWall(last, &tm);
+	year = tm.tm_year + 1900;
+	mon = tm.tm_mon + 1;
+	if (this->period == PERIOD_MONTHLY) {
+		if (++mon > LAST_MONTH) {
+			mon = FIRST_MONTH;
+			year++;
+		}
+		c = TimeZone::civilSeconds(year, mon, 1, 0, 0);
+	} else
+		c = TimeZone::civilSeconds(year, mon, tm.tm_mday, 0, 0) + this->period;
+	/* midnight on the wall clock then; the offset at c itself is
+	 * only out if it changed in the hours between the two
+	 */
+	t = c - this->zone->offset(c);
+	return (c - this->zone->offset(t));
+}
@@ -0,0 +1,186 @@
+/* Tinjac - outputcapture.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file outputcapture.cpp
+ *  @brief Keeps a bounded, filtered copy of a job's output
+ */
+
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "outputcapture.hpp"
+
+
+OutputFilter::OutputFilter() {
+
+}
+
+OutputFilter::~OutputFilter() {
+	for (vector<Rule *>::iterator it = this->rules.begin(); it != this->rules.end(); ++it) {
+		regfree(&(*it)->re);
+		delete *it;
+	}
+}
+
+bool OutputFilter::add(const char *pattern, Action action, string *err) {
+	Rule *rule = new Rule;
+	char buf[256];
+	int rc;
+
+	/* we only want to know if it matched, not where */
+	if ((rc = regcomp(&rule->re, pattern, REG_EXTENDED | REG_NOSUB)) != 0) {
+		if (err) {
+			regerror(rc, &rule->re, buf, sizeof(buf));
+			*err = buf;
+		}
+		delete rule;
+		return (false);
+	}
+	rule->action = action;
+	this->rules.push_back(rule);
+	return (true);
+}
+
+bool OutputFilter::pass(const char *line) const {
+	bool match;
+
+	for (vector<Rule *>::const_iterator it = this->rules.begin(); it != this->rules.end(); ++it) {
+		match = (regexec(&(*it)->re, line, 0, NULL, 0) == 0);
+		if (match != ((*it)->action == KEEP))
+			return (false);
+	}
+	return (true);
+}
+
+
+OutputCapture::OutputCapture(size_t head, size_t tail, const OutputFilter *filter) :
+	headmax(head), tailmax(tail), filter(filter), tailpos(0), tailfill(0) {
+	memset(&this->stats, 0, sizeof(this->stats));
+}
+
+void OutputCapture::feed(const char *buf, size_t len) {
+	const char *p, *nl, *end = buf + len;
+	size_t n;
+
+	if (!this->filter || this->filter->empty()) {
+		/* nothing to look at lines for but counting them */
+		for (p = buf; (nl = (const char *)memchr(p, '\n', end - p)) != NULL; p = nl + 1)
+			this->stats.lines++;
+		this->keep(buf, len);
+		return;
+	}
+	while (buf < end) {
+		nl = (const char *)memchr(buf, '\n', end - buf);
+		n = (nl ? nl + 1 : end) - buf;
+		if (n > CAPTURE_LINE_MAX - this->partial.size())
+			n = CAPTURE_LINE_MAX - this->partial.size();
+		this->partial.insert(this->partial.end(), buf, buf + n);
+		buf += n;
+		if (this->partial.back() == '\n' || this->partial.size() >= CAPTURE_LINE_MAX)
+			this->line();
+	}
+}
+
+void OutputCapture::finish() {
+	if (!this->partial.empty())
+		this->line();
+}
+
+/* put the line we have been collecting through the filter */
+void OutputCapture::line() {
+	size_t n = this->partial.size();
+	bool nl = (this->partial[n - 1] == '\n');
+	bool pass;
+
+	/* match it without its newline, so $ works */
+	this->partial.push_back('\0');
+	if (nl)
+		this->partial[n - 1] = '\0';
+	pass = this->filter->pass(&this->partial[0]);
+	if (nl)
+		this->partial[n - 1] = '\n';
+	this->stats.lines++;
+	if (pass)
+		this->keep(&this->partial[0], n);
+	else
+		this->stats.dropped++;
+	this->partial.clear();
+}
+
+void OutputCapture::keep(const char *buf, size_t len) {
+	size_t n;
+
+	this->stats.kept += len;
+	if (this->head.size() < this->headmax) {
+		n = min(len, this->headmax - this->head.size());
+		this->head.append(buf, n);
+		buf += n;
+		len -= n;
+	}
+	if (len == 0)
+		return;
+	if (this->tailmax == 0) {
+		this->stats.omitted += len;
+		return;
+	}
+	if (this->tail.empty())
+		this->tail.resize(this->tailmax);
+	if (len >= this->tailmax) {
+		/* all that was in the ring goes, and the start of this too */
+		this->stats.omitted += this->tailfill + len - this->tailmax;
+		memcpy(&this->tail[0], buf + len - this->tailmax, this->tailmax);
+		this->tailpos = 0;
+		this->tailfill = this->tailmax;
+		return;
+	}
+	if (this->tailfill + len > this->tailmax) {
+		this->stats.omitted += this->tailfill + len - this->tailmax;
+		this->tailfill = this->tailmax;
+	} else {
+		this->tailfill += len;
+	}
+	n = min(len, this->tailmax - this->tailpos);
+	memcpy(&this->tail[this->tailpos], buf, n);
+	memcpy(&this->tail[0], buf + n, len - n);
+	this->tailpos = (this->tailpos + len) % this->tailmax;
+}
+
+string OutputCapture::text() const {
+	string s(this->head);
+	char note[64];
+
+	if (this->stats.omitted > 0) {
+		if (!s.empty() && s[s.size() - 1] != '\n')
+			s += '\n';
+		snprintf(note, sizeof(note), "[... %llu bytes omitted ...]\n", this->stats.omitted);
+		s += note;
+	}
+	if (this->tailfill < this->tailmax) {
+		/* it hasn't wrapped yet */
+		s.append(this->tail.begin(), this->tail.begin() + this->tailfill);
+	} else if (this->tailfill > 0) {
+		s.append(this->tail.begin() + this->tailpos, this->tail.end());
+		s.append(this->tail.begin(), this->tail.begin() + this->tailpos);
+	}
+	return (s);
+}
@@ -0,0 +1,502 @@
+/* Tinjac - runhistory.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file runhistory.cpp
+ *  @brief Keeps a record of every run, on disk and indexed in memory
+ */
+
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <ctime>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "log.hpp"
+#include "mappedfile.hpp"
+#include "runhistory.hpp"
+
+#define HISTORY_MAGIC	"TJRH"
+
+
+RunHistory::RunHistory(const string &dir) :
+	dir(dir), opened(false), basesize(0), closed(0), written(0), waiting(0), keep(HISTORY_KEEP),
+	interval(HISTORY_INTERVAL), committed(time(NULL)), fd(-1), seq(0), base(0), ondisk(0), started(false),
+	stopping(false) {
+	memset(&this->stats, 0, sizeof(this->stats));
+	pthread_mutex_init(&this->lock, NULL);
+	pthread_cond_init(&this->ready, NULL);
+}
+
+RunHistory::~RunHistory() {
+	this->commit(time(NULL), true);
+	if (this->started) {
+		/* what was handed to it is written first */
+		pthread_mutex_lock(&this->lock);
+		this->stopping = true;
+		pthread_cond_broadcast(&this->ready);
+		pthread_mutex_unlock(&this->lock);
+		pthread_join(this->writer, NULL);
+	}
+	if (this->fd != -1)
+		::close(this->fd);
+	pthread_cond_destroy(&this->ready);
+	pthread_mutex_destroy(&this->lock);
+}
+
+string RunHistory::segment(unsigned long seq, const char *kind) const {
+	char name[32];
+
+	snprintf(name, sizeof(name), "/%010lu.%s", seq, kind);
+	return (this->dir + name);
+}
+
+bool RunHistory::open() {
+	/* the segments there are, and what each is */
+	map<unsigned long, string> found;
+	map<unsigned long, string>::iterator it;
+	struct dirent *de;
+	unsigned long n;
+	char *end;
+	DIR *d;
+
+	if (this->fd != -1)
+		::close(this->fd);
+	this->fd = -1;
+	this->opened = false;
+	if (mkdir(this->dir.c_str(), 0700) != 0 && errno != EEXIST) {
+		ELOG("Can't create the run history %s: %s", this->dir.c_str(), strerror(errno));
+		return (false);
+	}
+	if ((d = opendir(this->dir.c_str())) == NULL) {
+		ELOG("Can't read the run history %s: %s", this->dir.c_str(), strerror(errno));
+		return (false);
+	}
+	while ((de = readdir(d)) != NULL) {
+		n = strtoul(de->d_name, &end, 10);
+		if (end == de->d_name || n == 0 || *end != '.')
+			continue;
+		/* a compaction that a crash cut short */
+		if (strcmp(end, ".tmp") == 0)
+			unlink(this->segment(n, "tmp").c_str());
+		else if (strcmp(end, ".log") == 0 || strcmp(end, ".base") == 0)
+			found[n] = end + 1;
+	}
+	closedir(d);
+
+	/* the last base replaces everything before it, which a crash may
+	 * have left behind
+	 */
+	for (it = found.begin(); it != found.end(); ++it)
+		if (it->second == "base")
+			this->base = it->first;
+	while (!found.empty() && found.begin()->first < this->base) {
+		unlink(this->segment(found.begin()->first, found.begin()->second.c_str()).c_str());
+		found.erase(found.begin());
+	}
+	for (it = found.begin(); it != found.end(); ++it)
+		this->load(this->segment(it->first, it->second.c_str()), it->first == this->base, it->first == found.rbegin()->first);
+	this->closed = found.size() - (this->base != 0 ? 1 : 0);
+	/* the last segment is added to, unless it is the base */
+	if (!found.empty()) {
+		this->seq = found.rbegin()->first;
+		if (this->seq == this->base)
+			this->seq++;
+		else
+			this->closed--;
+	} else
+		this->seq = 1;
+	if (!this->openSegment())
+		return (false);
+	this->written = this->ondisk;
+	this->opened = true;
+	return (true);
+}
+
+bool RunHistory::start() {
+	sigset_t all, old;
+	int err;
+
+	if (this->started)
+		return (true);
+	/* signals are for the scheduler's thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&this->writer, NULL, RunHistory::loop, this);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		ELOG("Can't start the run history writer, writing directly: %s", strerror(err));
+		return (false);
+	}
+	this->started = true;
+	return (true);
+}
+
+void *RunHistory::loop(void *arg) {
+	((RunHistory *)arg)->work();
+	return (NULL);
+}
+
+/* write what commit() hands over, until the RunHistory goes and there's
+ * nothing left
+ */
+void RunHistory::work() {
+	Batch *batch;
+
+	pthread_mutex_lock(&this->lock);
+	for (;;) {
+		if (this->queue.empty()) {
+			if (this->stopping)
+				break;
+			pthread_cond_wait(&this->ready, &this->lock);
+			continue;
+		}
+		batch = this->queue.front();
+		this->queue.pop_front();
+		pthread_mutex_unlock(&this->lock);
+		this->write(*batch);
+		delete batch;
+		pthread_mutex_lock(&this->lock);
+	}
+	pthread_mutex_unlock(&this->lock);
+}
+
+RunHistory::Stats RunHistory::getStats() const {
+	Stats stats;
+
+	pthread_mutex_lock(&this->lock);
+	stats = this->stats;
+	pthread_mutex_unlock(&this->lock);
+	return (stats);
+}
+
+bool RunHistory::openSegment() {
+	string path = this->segment(this->seq, "log");
+	struct stat sb;
+
+	if ((this->fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1) {
+		ELOG("Can't open the run history segment %s: %s", path.c_str(), strerror(errno));
+		return (false);
+	}
+	this->ondisk = fstat(this->fd, &sb) == 0 ? sb.st_size : 0;
+	return (true);
+}
+
+/* index what is in a segment. A record cut short by a crash ends it,
+ * and comes off the last segment so that what is added after it can be
+ * read back
+ */
+bool RunHistory::load(const string &path, bool base, bool last) {
+	MappedFile file;
+	const char *data;
+	size_t off;
+	Record r;
+
+	if (!file.open(path))
+		return (false);
+	data = file.data();
+	for (off = 0; off + sizeof(Record) <= file.size(); off += sizeof(Record) + r.length) {
+		memcpy(&r, data + off, sizeof(r));
+		if (memcmp(r.magic, HISTORY_MAGIC, sizeof(r.magic)) != 0 || r.length > HISTORY_NAME_MAX ||
+				off + sizeof(Record) + r.length > file.size())
+			break;
+		this->index(string(data + off + sizeof(Record), r.length), r.run);
+	}
+	if (off != file.size()) {
+		ELOG("Dropping %lu bytes at the end of the run history segment %s, it was cut short", (unsigned long)(file.size() - off), path.c_str());
+		if (last && !base && truncate(path.c_str(), off) != 0)
+			ELOG("Can't truncate the run history segment %s: %s", path.c_str(), strerror(errno));
+	}
+	if (base)
+		this->basesize = off;
+	return (true);
+}
+
+void RunHistory::index(const string &job, const Run &run) {
+	Jobs::iterator it = this->byjob.find(job);
+
+	if (it == this->byjob.end())
+		it = this->byjob.insert(make_pair(job, Runs())).first;
+	Runs &runs = it->second;
+	runs.push_back(run);
+	this->bytime.insert(make_pair(run.finished, make_pair(&it->first, &runs.back())));
+	if (runs.size() <= this->keep)
+		return;
+	this->unindex(&runs.front());
+	runs.pop_front();
+}
+
+/* take a run that is about to go out of bytime */
+void RunHistory::unindex(const Run *run) {
+	pair<Times::iterator, Times::iterator> range = this->bytime.equal_range(run->finished);
+	Times::iterator t;
+
+	for (t = range.first; t != range.second; ++t)
+		if (t->second.second == run) {
+			this->bytime.erase(t);
+			break;
+		}
+}
+
+/* forget the jobs that have left every crontab. How many there were */
+size_t RunHistory::prune() {
+	boost::unordered_set<string> live;
+	vector<string> gone;
+	Jobs::iterator it;
+	Runs::const_iterator r;
+	size_t i;
+
+	if (this->livejobs.empty() || !this->livejobs(live))
+		return (0);
+	for (it = this->byjob.begin(); it != this->byjob.end(); ++it)
+		if (live.find(it->first) == live.end())
+			gone.push_back(it->first);
+	for (i = 0; i < gone.size(); i++) {
+		it = this->byjob.find(gone[i]);
+		for (r = it->second.begin(); r != it->second.end(); ++r)
+			this->unindex(&*r);
+		this->byjob.erase(it);
+	}
+	return (gone.size());
+}
+
+void RunHistory::append(string &buf, const string &job, const Run &run) const {
+	Record r;
+
+	memcpy(r.magic, HISTORY_MAGIC, sizeof(r.magic));
+	r.length = job.size();
+	r.run = run;
+	buf.append((const char *)&r, sizeof(r));
+	buf.append(job);
+}
+
+void RunHistory::add(const string &job, const Run &run) {
+	if (job.size() > HISTORY_NAME_MAX) {
+		this->add(job.substr(0, HISTORY_NAME_MAX), run);
+		return;
+	}
+	this->index(job, run);
+	pthread_mutex_lock(&this->lock);
+	this->stats.added++;
+	pthread_mutex_unlock(&this->lock);
+	if (!this->opened)
+		return;
+	this->append(this->buffer, job, run);
+	this->waiting++;
+	if (this->buffer.size() >= HISTORY_BUFFER_MAX)
+		this->commit(time(NULL), true);
+}
+
+bool RunHistory::writeAll(int fd, const string &buf, const string &path) {
+	size_t off = 0;
+	ssize_t n;
+
+	while (off < buf.size()) {
+		if ((n = ::write(fd, buf.data() + off, buf.size() - off)) < 0) {
+			if (errno == EINTR)
+				continue;
+			ELOG("Can't write to the run history segment %s: %s", path.c_str(), strerror(errno));
+			return (false);
+		}
+		off += n;
+	}
+	return (true);
+}
+
+time_t RunHistory::nextCommit() const {
+	if (this->waiting == 0)
+		return (-1);
+	return (this->committed + this->interval);
+}
+
+/* everything waiting, in one write and one sync, and whether that
+ * closes the segment and it's time to compact
+ */
+size_t RunHistory::commit(time_t now, bool force) {
+	size_t n = this->waiting, dropped;
+	Times::const_iterator it;
+	Batch *batch;
+
+	if (n == 0 || (!force && now < this->committed + this->interval))
+		return (0);
+	this->committed = now;
+	this->waiting = 0;
+	batch = new Batch();
+	batch->records.swap(this->buffer);
+	batch->runs = n;
+	batch->close = batch->compact = false;
+	this->written += batch->records.size();
+	if (this->written >= HISTORY_SEGMENT_MAX) {
+		batch->close = true;
+		this->written = 0;
+		if (++this->closed >= HISTORY_SEGMENTS && this->closed * HISTORY_SEGMENT_MAX >= this->basesize) {
+			if ((dropped = this->prune()) > 0)
+				DLOG("Dropping the run history of %d jobs that are in no crontab", (int)dropped);
+			for (it = this->bytime.begin(); it != this->bytime.end(); ++it)
+				this->append(batch->base, *it->second.first, *it->second.second);
+			batch->compact = true;
+			this->basesize = batch->base.size();
+			this->closed = 0;
+		}
+	}
+	if (!this->started) {
+		this->write(*batch);
+		delete batch;
+		return (n);
+	}
+	pthread_mutex_lock(&this->lock);
+	this->queue.push_back(batch);
+	pthread_cond_signal(&this->ready);
+	pthread_mutex_unlock(&this->lock);
+	return (n);
+}
+
+/* what commit() worked out, on the thread if there is one */
+void RunHistory::write(const Batch &batch) {
+	string path = this->segment(this->seq, "log");
+	bool ok;
+
+	/* a segment that couldn't be opened is tried again */
+	ok = this->fd != -1 || this->openSegment();
+	ok = ok && this->writeAll(this->fd, batch.records, path);
+	if (ok && fdatasync(this->fd) != 0) {
+		ELOG("Can't sync the run history segment %s: %s", path.c_str(), strerror(errno));
+		ok = false;
+	}
+	pthread_mutex_lock(&this->lock);
+	if (ok) {
+		this->stats.bytes += batch.records.size();
+		this->stats.commits++;
+	} else
+		this->stats.lost += batch.runs;
+	pthread_mutex_unlock(&this->lock);
+	if (ok)
+		this->ondisk += batch.records.size();
+	else {
+		ELOG("Lost %d runs from the run history", (int)batch.runs);
+		/* what did get written would end the segment early */
+		if (this->fd != -1 && ftruncate(this->fd, this->ondisk) != 0)
+			ELOG("Can't truncate the run history segment %s: %s", path.c_str(), strerror(errno));
+	}
+	if (!batch.close)
+		return;
+	if (this->fd != -1)
+		::close(this->fd);
+	this->fd = -1;
+	pthread_mutex_lock(&this->lock);
+	this->stats.segments++;
+	pthread_mutex_unlock(&this->lock);
+	if (batch.compact)
+		this->compact(batch.base);
+	this->seq++;
+	this->openSegment();
+}
+
+/* the runs still kept, in place of the segments they came from */
+void RunHistory::compact(const string &buf) {
+	unsigned long seq = this->seq + 1, s;
+	string tmp = this->segment(seq, "tmp");
+	int fd;
+
+	if ((fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1) {
+		ELOG("Can't create the run history segment %s: %s", tmp.c_str(), strerror(errno));
+		return;
+	}
+	if (!this->writeAll(fd, buf, tmp) || fdatasync(fd) != 0 || rename(tmp.c_str(), this->segment(seq, "base").c_str()) != 0) {
+		ELOG("Not compacting the run history %s: %s", this->dir.c_str(), strerror(errno));
+		::close(fd);
+		unlink(tmp.c_str());
+		return;
+	}
+	::close(fd);
+	/* the new base has to be there before what it replaces goes */
+	if ((fd = ::open(this->dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC)) != -1) {
+		fsync(fd);
+		::close(fd);
+	}
+	for (s = this->base > 0 ? this->base : 1; s < seq; s++) {
+		unlink(this->segment(s, "log").c_str());
+		unlink(this->segment(s, "base").c_str());
+	}
+	this->seq = seq;
+	this->base = seq;
+	pthread_mutex_lock(&this->lock);
+	this->stats.compactions++;
+	pthread_mutex_unlock(&this->lock);
+}
+
+size_t RunHistory::last(const string &job, size_t n, vector<Run> &out) const {
+	Jobs::const_iterator it = this->byjob.find(job);
+	Runs::const_reverse_iterator r;
+
+	out.clear();
+	if (it == this->byjob.end())
+		return (0);
+	for (r = it->second.rbegin(); r != it->second.rend() && out.size() < n; ++r)
+		out.push_back(*r);
+	return (out.size());
+}
+
+time_t RunHistory::lastRun(const string &job) const {
+	Jobs::const_iterator it = this->byjob.find(job);
+	Runs::const_reverse_iterator r;
+
+	if (it == this->byjob.end())
+		return (-1);
+	for (r = it->second.rbegin(); r != it->second.rend(); ++r)
+		if (!(r->flags & Run::UNSTARTED))
+			return (r->started / 1000000);
+	return (-1);
+}
+
+size_t RunHistory::between(int64_t from, int64_t to, vector<pair<string, Run> > &out) const {
+	Times::const_iterator it, end = this->bytime.lower_bound(to);
+
+	out.clear();
+	for (it = this->bytime.lower_bound(from); it != end; ++it)
+		out.push_back(make_pair(*it->second.first, *it->second.second));
+	return (out.size());
+}
+
+void RunHistory::logStats() const {
+	Stats stats = this->getStats();
+
+	RLOG("Run history of %d jobs, %d runs kept: %lu added, %lu commits, %llu bytes, %lu lost, %lu segments, %lu compactions",
+		(int)this->byjob.size(), (int)this->bytime.size(), stats.added, stats.commits, stats.bytes,
+		stats.lost, stats.segments, stats.compactions);
+}
+
+uint64_t RunHistory::digest(const string &output) {
+	uint64_t hash = 14695981039346656037ULL;
+	string::const_iterator c;
+
+	if (output.empty())
+		return (0);
+	for (c = output.begin(); c != output.end(); ++c)
+		hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+	return (hash != 0 ? hash : 1);
+}
@@ -0,0 +1,493 @@
+/* Tinjac - scheduler.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file scheduler.cpp
+ *  @brief Deadline ordered queue of crontab entries
+ */
+
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux
+#include <sys/epoll.h>
+#endif
+#include "log.hpp"
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "scheduler.hpp"
+
+/* don't bother compacting the heap for fewer cancelled jobs than this */
+#define COMPACT_MIN	1024
+/* with nothing scheduled, check back this often */
+#define IDLE_SLEEP	SECONDS_PER_HOUR
+/* poll() only has a relative timeout, so with descriptors to watch we
+ * wake up this often (ms) in case the clock has been set
+ */
+#define POLL_MAX	(SECONDS_PER_MINUTE * 1000)
+/* most descriptors handled per epoll_wait() */
+#define EPOLL_EVENTS	64
+
+
+/* FNV-1a, 64 bits */
+static uint64_t hash_string(uint64_t hash, const char *s) {
+	/* the \0 too, so "ab" "c" and "a" "bc" come out different */
+	do {
+		hash ^= (unsigned char)*s;
+		hash *= 1099511628211ULL;
+	} while (*s++);
+	return (hash);
+}
+
+/* this host's name, looked up the first time */
+static const char *host_name() {
+	static char name[256];
+
+	if (name[0] == '\0' && gethostname(name, sizeof(name) - 1) != 0)
+		name[0] = '\0';
+	return (name);
+}
+
+ScheduledJob::ScheduledJob(entry *e, CrontabFile *file) :
+	e(e), file(file), calc(e), offset(spreadOffset(e, file->fname)), when(-1), last(-1), cancelled(false) {
+}
+
+time_t ScheduledJob::spreadOffset(const entry *e, const string &fname, const char *host) {
+	uint64_t hash = 14695981039346656037ULL;
+	char *value;
+	int window;
+
+	if ((window = e->spread) == 0 && (value = env_get((char *)"SPREAD", e->envp)) != NULL)
+		window = parse_window(value, strlen(value));
+	if (window <= 0 || (e->flags & (WHEN_REBOOT | WHEN_AFTER | WHEN_WATCH | WHEN_PERIOD)))
+		return (0);
+	hash = hash_string(hash, host ? host : host_name());
+	hash = hash_string(hash, fname.c_str());
+	hash = hash_string(hash, e->pwd ? e->pwd->pw_name : "");
+	hash = hash_string(hash, e->cmd);
+	/* FNV's low bits hardly change between "job1" and "job2", so mix
+	 * the high ones down (murmur3's finaliser) before taking them
+	 */
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return ((time_t)(hash % window));
+}
+
+time_t ScheduledJob::next(time_t after) const {
+	time_t t;
+
+	/* one that has never run, or should have while we were down, is
+	 * due now
+	 */
+	if (this->e->flags & WHEN_PERIOD) {
+		if (this->last == -1 || (t = this->calc.periodEnd(this->last)) <= after)
+			t = after + 1;
+		return (t + (this->e->spread > 0 ? random() % (this->e->spread + 1) : 0));
+	}
+	/* the slot it's in is the one that started offset seconds ago */
+	if ((t = this->calc.next(after - this->offset)) == -1)
+		return (-1);
+	return (t + this->offset);
+}
+
+ScheduledJob::~ScheduledJob() {
+
+}
+
+
+Scheduler::Scheduler() : live(0), dead(0), idleinterval(0), wake(-1), epfd(-1), running(false) {
+#ifdef __linux
+	if ((this->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+		ELOG("No epoll (%s), will poll() instead", strerror(errno));
+#endif
+}
+
+Scheduler::~Scheduler() {
+	if (this->epfd != -1)
+		close(this->epfd);
+	for (vector<HeapNode>::iterator it = this->heap.begin(); it != this->heap.end(); ++it)
+		if (it->job->cancelled)
+			delete it->job;
+	for (map<CrontabFile *, vector<ScheduledJob *> >::iterator it = this->byfile.begin(); it != this->byfile.end(); ++it)
+		for (vector<ScheduledJob *>::iterator job = it->second.begin(); job != it->second.end(); ++job)
+			delete *job;
+}
+
+void Scheduler::push(ScheduledJob *job) {
+	HeapNode node;
+
+	node.when = job->when;
+	node.job = job;
+	this->heap.push_back(node);
+	push_heap(this->heap.begin(), this->heap.end(), Later());
+}
+
+/* a job for a new entry, on the queue if it's ever due */
+ScheduledJob *Scheduler::create(entry *e, CrontabFile *file, time_t now) {
+	ScheduledJob *job = new ScheduledJob(e, file);
+
+	if ((e->flags & WHEN_PERIOD) && this->lastrun)
+		job->last = this->lastrun(e, file->fname);
+	this->live++;
+	if ((job->when = job->next(now)) != -1)
+		this->push(job);
+	return (job);
+}
+
+void Scheduler::addFile(CrontabFile *file, time_t now) {
+	vector<ScheduledJob *> &jobs = this->byfile[file];
+
+	jobs.reserve(jobs.size() + file->entries.size());
+	for (vector<entry *>::iterator it = file->entries.begin(); it != file->entries.end(); ++it)
+		jobs.push_back(this->create(*it, file, now));
+}
+
+void Scheduler::removeFile(CrontabFile *file) {
+	map<CrontabFile *, vector<ScheduledJob *> >::iterator it = this->byfile.find(file);
+
+	if (it == this->byfile.end())
+		return;
+	for (vector<ScheduledJob *>::iterator job = it->second.begin(); job != it->second.end(); ++job)
+		this->cancel(*job);
+	this->byfile.erase(it);
+	if (this->dead > COMPACT_MIN && this->dead > this->live)
+		this->compact();
+}
+
+size_t Scheduler::replaceFile(CrontabFile *old, CrontabFile *file, time_t now) {
+	map<CrontabFile *, vector<ScheduledJob *> >::iterator it = this->byfile.find(old);
+	multimap<size_t, ScheduledJob *> oldjobs;
+	multimap<size_t, ScheduledJob *>::iterator match, end;
+	vector<ScheduledJob *> jobs;
+	ScheduledJob *job;
+	size_t hash, kept = 0;
+
+	if (it == this->byfile.end()) {
+		this->addFile(file, now);
+		return (0);
+	}
+	for (vector<ScheduledJob *>::iterator j = it->second.begin(); j != it->second.end(); ++j)
+		oldjobs.insert(make_pair(entry_hash((*j)->e), *j));
+	this->byfile.erase(it);
+
+	jobs.reserve(file->entries.size());
+	for (vector<entry *>::iterator e = file->entries.begin(); e != file->entries.end(); ++e) {
+		hash = entry_hash(*e);
+		for (match = oldjobs.lower_bound(hash), end = oldjobs.upper_bound(hash); match != end; ++match)
+			if (entry_same(match->second->e, *e))
+				break;
+		if (match != end) {
+			/* same job, it just belongs to the new file now */
+			job = match->second;
+			oldjobs.erase(match);
+			job->e = *e;
+			job->file = file;
+			kept++;
+		} else
+			job = this->create(*e, file, now);
+		jobs.push_back(job);
+	}
+	for (match = oldjobs.begin(); match != oldjobs.end(); ++match)
+		this->cancel(match->second);
+	this->byfile[file].swap(jobs);
+	if (this->dead > COMPACT_MIN && this->dead > this->live)
+		this->compact();
+	return (kept);
+}
+
+/* a job whose file has gone */
+void Scheduler::cancel(ScheduledJob *job) {
+	if (job->when == -1) {
+		delete job;
+	} else {
+		job->cancelled = true;
+		this->dead++;
+	}
+	this->live--;
+}
+
+/* drop every cancelled job and rebuild the heap from what is left */
+void Scheduler::compact() {
+	vector<HeapNode>::iterator out = this->heap.begin();
+
+	for (vector<HeapNode>::iterator it = this->heap.begin(); it != this->heap.end(); ++it) {
+		if (it->job->cancelled)
+			delete it->job;
+		else
+			*out++ = *it;
+	}
+	this->heap.erase(out, this->heap.end());
+	make_heap(this->heap.begin(), this->heap.end(), Later());
+	this->dead = 0;
+}
+
+time_t Scheduler::nextDeadline() {
+	ScheduledJob *job;
+
+	while (!this->heap.empty() && this->heap.front().job->cancelled) {
+		job = this->heap.front().job;
+		pop_heap(this->heap.begin(), this->heap.end(), Later());
+		this->heap.pop_back();
+		delete job;
+		this->dead--;
+	}
+	if (this->heap.empty())
+		return (-1);
+	return (this->heap.front().when);
+}
+
+size_t Scheduler::runDue(time_t now, vector<ScheduledJob *> &due) {
+	ScheduledJob *job;
+	size_t count = 0;
+	bool run;
+
+	while (!this->heap.empty() && this->heap.front().when <= now) {
+		job = this->heap.front().job;
+		pop_heap(this->heap.begin(), this->heap.end(), Later());
+		this->heap.pop_back();
+		if (job->cancelled) {
+			delete job;
+			this->dead--;
+			continue;
+		}
+		run = true;
+		/* work out the next run from now rather than from when it was
+		 * due, so if we were held up (or the clock jumped) we run it
+		 * once and carry on, instead of once for every missed slot.
+		 */
+		if (job->e->flags & WHEN_PERIOD)
+			run = this->period(job, now);
+		else
+			job->when = job->next(now);
+		if (job->when != -1)
+			this->push(job);
+		if (run) {
+			due.push_back(job);
+			count++;
+		}
+	}
+	return (count);
+}
+
+/* whether an @period job popped at now is to run, and when to look at
+ * it again: if it is to run, soon enough to try again should that run
+ * not happen, and if it has run since it was last asked about, at its
+ * next period
+ */
+bool Scheduler::period(ScheduledJob *job, time_t now) {
+	time_t retry = PERIOD_RETRY;
+
+	/* with nothing to ask, it's taken to run when it's due */
+	if (!this->lastrun) {
+		job->last = now;
+		job->when = job->next(now);
+		return (true);
+	}
+	job->last = this->lastrun(job->e, job->file->fname);
+	if (job->last != -1 && job->calc.periodEnd(job->last) > now) {
+		job->when = job->next(now);
+		return (false);
+	}
+	if (job->e->period > 0 && job->e->period < retry)
+		retry = job->e->period;
+	job->when = now + retry;
+	return (true);
+}
+
+size_t Scheduler::rebootJobs(vector<ScheduledJob *> &jobs) const {
+	size_t count = 0;
+
+	for (map<CrontabFile *, vector<ScheduledJob *> >::const_iterator it = this->byfile.begin(); it != this->byfile.end(); ++it)
+		for (vector<ScheduledJob *>::const_iterator job = it->second.begin(); job != it->second.end(); ++job)
+			if ((*job)->e->flags & WHEN_REBOOT) {
+				jobs.push_back(*job);
+				count++;
+			}
+	return (count);
+}
+
+/* the first line of path, up to size - 1 bytes, "" if there isn't one */
+static bool read_line(const char *path, char *buf, size_t size) {
+	FILE *fp;
+	bool ok;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return (false);
+	ok = fgets(buf, size, fp) != NULL;
+	fclose(fp);
+	if (!ok)
+		buf[0] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return (true);
+}
+
+bool Scheduler::firstSinceBoot(const char *marker, const char *bootid) {
+	char boot[64], seen[64];
+	FILE *fp;
+
+	if (!read_line(bootid, boot, sizeof(boot)) || boot[0] == '\0') {
+		if (access(marker, F_OK) == 0)
+			return (false);
+		boot[0] = '\0';
+	} else if (read_line(marker, seen, sizeof(seen)) && !strcmp(boot, seen)) {
+		return (false);
+	}
+	/* if the mark can't be made the jobs still run, as the boot is new */
+	if ((fp = fopen(marker, "w")) == NULL) {
+		ELOG("Can't mark the @reboot jobs as run in %s: %s", marker, strerror(errno));
+		return (true);
+	}
+	fprintf(fp, "%s\n", boot);
+	if (fclose(fp) != 0)
+		ELOG("Can't mark the @reboot jobs as run in %s: %s", marker, strerror(errno));
+	return (true);
+}
+
+void Scheduler::watchFd(int fd, FdCallback cb) {
+#ifdef __linux
+	struct epoll_event ev;
+
+	if (this->epfd != -1 && !this->fds.count(fd)) {
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (epoll_ctl(this->epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+			ELOG("Can't watch descriptor %d: %s", fd, strerror(errno));
+	}
+#endif
+	this->fds[fd] = cb;
+}
+
+void Scheduler::unwatchFd(int fd) {
+	if (!this->fds.erase(fd))
+		return;
+#ifdef __linux
+	/* the fd may already be closed, which takes it out of the set */
+	if (this->epfd != -1)
+		epoll_ctl(this->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+}
+
+/* sleep until the deadline, or until one of the watched descriptors
+ * has something for us. True if we got as far as the deadline.
+ */
+bool Scheduler::wait(time_t deadline) {
+	vector<struct pollfd> pfds;
+	struct pollfd pfd;
+	struct timespec ts;
+	long long ms;
+	int n, i;
+
+	if (this->fds.empty()) {
+		/* an absolute CLOCK_REALTIME sleep follows the clock if
+		 * it's set, so we still wake up on the deadline.
+		 */
+		ts.tv_sec = deadline;
+		ts.tv_nsec = 0;
+		return (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &ts, NULL) == 0);
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ms = (long long)(deadline - ts.tv_sec) * 1000 - ts.tv_nsec / 1000000;
+	if (ms > POLL_MAX)
+		ms = POLL_MAX;
+#ifdef __linux
+	if (this->epfd != -1) {
+		struct epoll_event events[EPOLL_EVENTS];
+
+		if ((n = epoll_wait(this->epfd, events, EPOLL_EVENTS, ms > 0 ? (int)ms : 0)) <= 0)
+			return (n == 0 && time(NULL) >= deadline);
+		for (i = 0; i < n; i++) {
+			/* an earlier callback may have stopped watching it */
+			map<int, FdCallback>::iterator cb = this->fds.find(events[i].data.fd);
+			if (cb != this->fds.end()) {
+				/* a copy, the callback may unwatch itself */
+				FdCallback f = cb->second;
+				f();
+			}
+		}
+		return (false);
+	}
+#endif
+	for (map<int, FdCallback>::iterator it = this->fds.begin(); it != this->fds.end(); ++it) {
+		pfd.fd = it->first;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		pfds.push_back(pfd);
+	}
+	if ((n = poll(&pfds[0], pfds.size(), ms > 0 ? (int)ms : 0)) <= 0)
+		return (n == 0 && time(NULL) >= deadline);
+	for (vector<struct pollfd>::iterator it = pfds.begin(); it != pfds.end(); ++it) {
+		/* an earlier callback may have stopped watching it */
+		map<int, FdCallback>::iterator cb = this->fds.find(it->fd);
+		if (it->revents != 0 && cb != this->fds.end()) {
+			FdCallback f = cb->second;
+			f();
+		}
+	}
+	return (false);
+}
+
+void Scheduler::run(JobCallback cb) {
+	vector<ScheduledJob *> due;
+	time_t deadline, now;
+	bool woken;
+
+	this->running = true;
+	while (this->running) {
+		now = time(NULL);
+		if ((deadline = this->nextDeadline()) == -1)
+			deadline = now + IDLE_SLEEP;
+		if (this->idleinterval > 0 && deadline > now + this->idleinterval)
+			deadline = now + this->idleinterval;
+		/* or sooner, if it asked to be called back by then */
+		if ((woken = (this->wake != -1 && this->wake <= now)))
+			this->wake = -1;
+		else if (this->wake != -1 && deadline > this->wake)
+			deadline = this->wake;
+		if ((deadline > now || woken) && this->idle) {
+			/* housekeeping gets the time we would spend asleep */
+			this->idle(now);
+			now = time(NULL);
+			if (this->wake != -1 && deadline > this->wake)
+				deadline = this->wake;
+		}
+		if (deadline > now) {
+			/* if we are interrupted, or woken up by a descriptor, go
+			 * round again; the schedule may have changed, or a
+			 * signal asked us to stop.
+			 */
+			if (!this->wait(deadline))
+				continue;
+			now = time(NULL);
+		}
+		due.clear();
+		this->runDue(now, due);
+		for (vector<ScheduledJob *>::iterator it = due.begin(); it != due.end(); ++it)
+			cb(*it, now);
+	}
+}
@@ -0,0 +1,543 @@
+/* Tinjac - spawner.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file spawner.cpp
+ *  @brief Launches jobs from a small helper process
+ */
+
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#ifdef __linux
+#include <sys/signalfd.h>
+#endif
+#include <boost/bind.hpp>
+#include "config.h"
+#include "log.hpp"
+#include "env.hpp"
+#include "scheduler.hpp"
+#include "spawner.hpp"
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL	0
+#endif
+
+
+/* the signal mask the helper started with, which its jobs get */
+static sigset_t helper_mask;
+
+#ifndef __linux
+/* without a signalfd, the helper's SIGCHLD handler pokes its poll() loop */
+static int sigchld_fd = -1;
+
+static void helper_sigchld(int sig) {
+	int save = errno;
+
+	if (::write(sigchld_fd, "", 1) < 0)
+		;	/* the pipe is full, there's a wakeup pending anyway */
+	errno = save;
+}
+#endif
+
+/* close every descriptor above stderr but keep. The daemon raises its
+ * open file limit, so rather than trying them all, look at what's open
+ */
+static void close_fds(int keep) {
+	int i;
+#ifdef __linux
+	vector<int> fds;
+	struct dirent *de;
+	DIR *dir;
+
+	if ((dir = opendir("/proc/self/fd")) != NULL) {
+		while ((de = readdir(dir)) != NULL)
+			if ((i = atoi(de->d_name)) > 2 && i != keep && i != dirfd(dir))
+				fds.push_back(i);
+		closedir(dir);
+		for (vector<int>::iterator it = fds.begin(); it != fds.end(); ++it)
+			::close(*it);
+		return;
+	}
+#endif
+	for (i = sysconf(_SC_OPEN_MAX) - 1; i > 2; i--)
+		if (i != keep)
+			::close(i);
+}
+
+static void set_cloexec(int fd) {
+	fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) | FD_CLOEXEC);
+}
+
+Spawner::Spawner() : sched(NULL), fd(-1), helper(-1), nextid(1) {
+	memset(&this->stats, 0, sizeof(this->stats));
+}
+
+Spawner::~Spawner() {
+	this->stop();
+}
+
+bool Spawner::start() {
+	int sv[2];
+	pid_t pid;
+
+	if (this->fd != -1)
+		return (true);
+	/* not again, the daemon may well have threads by now */
+	if (this->helper != -1) {
+		ELOG("Not forking another spawner after %d", (int)this->helper);
+		return (false);
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0) {
+		ELOG("Can't create the spawner socket: %s", strerror(errno));
+		return (false);
+	}
+	set_cloexec(sv[0]);
+	set_cloexec(sv[1]);
+	if ((pid = fork()) == -1) {
+		ELOG("Can't fork the spawner: %s", strerror(errno));
+		::close(sv[0]);
+		::close(sv[1]);
+		return (false);
+	}
+	if (pid == 0) {
+		::close(sv[0]);
+		helperMain(sv[1]);
+		_exit(0);
+	}
+	::close(sv[1]);
+	this->fd = sv[0];
+	this->helper = pid;
+	DLOG("Started spawner %d", (int)pid);
+	if (this->sched)
+		this->sched->watchFd(this->fd, boost::bind(&Spawner::processReplies, this));
+	return (true);
+}
+
+void Spawner::stop() {
+	if (this->fd == -1)
+		return;
+	if (this->sched)
+		this->sched->unwatchFd(this->fd);
+	/* the helper exits when it sees the socket close, jobs it started
+	 * carry on
+	 */
+	::close(this->fd);
+	this->fd = -1;
+	while (waitpid(this->helper, NULL, 0) < 0 && errno == EINTR)
+		;
+	this->jobs.clear();
+}
+
+/* the helper died, or stopped talking to us. Whatever it was running
+ * is on its own now; we won't hear how those jobs exit, and there won't
+ * be any more.
+ */
+void Spawner::helperGone() {
+	map<JobId, pid_t> lost;
+
+	ELOG("Spawner %d has gone away with %d jobs running", (int)this->helper, (int)this->jobs.size());
+	lost.swap(this->jobs);
+	this->stop();
+	for (map<JobId, pid_t>::iterator it = lost.begin(); it != lost.end(); ++it)
+		if (this->exited)
+			this->exited(it->first, it->second, -1, NULL);
+	if (this->gone)
+		this->gone();
+}
+
+Spawner::JobId Spawner::spawn(const entry *e, int outfd, int infd, int errfd, int cgroupfd) {
+	int fds[SPAWN_FDS] = { infd, outfd, errfd, cgroupfd };
+
+	JobId id = this->nextid;
+
+	if (this->fd == -1)
+		return (0);
+	if (!this->send(e, id, fds)) {
+		if (errno == EPIPE || errno == ECONNRESET || errno == ENOTCONN)
+			this->helperGone();
+		return (0);
+	}
+	this->nextid++;
+	this->jobs[id] = 0;
+	this->stats.spawned++;
+	return (id);
+}
+
+bool Spawner::send(const entry *e, JobId id, const int *fds) {
+	char buf[SPAWN_MAX_REQUEST];
+	char cbuf[CMSG_SPACE(SPAWN_FDS * sizeof(int))];
+	int passed[SPAWN_FDS], npassed = 0;
+	Request *req = (Request *)buf;
+	const char *strs[4];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char *shell, *home;
+	size_t len = sizeof(Request), l;
+	char **p;
+	int i;
+	ssize_t n;
+
+	if ((shell = env_get((char *)"SHELL", e->envp)) == NULL)
+		shell = (char *)_PATH_BSHELL;
+	if ((home = env_get((char *)"HOME", e->envp)) == NULL)
+		home = e->pwd->pw_dir;
+	memset(req, 0, sizeof(Request));
+	req->id = id;
+	req->uid = e->pwd->pw_uid;
+	req->gid = e->pwd->pw_gid;
+	/* whichever of stdin, stdout, stderr and the cgroup we have go along
+	 * in that order, the bits say which they are
+	 */
+	for (i = 0; i < SPAWN_FDS; i++)
+		if (fds[i] != -1) {
+			req->fds |= 1 << i;
+			passed[npassed++] = fds[i];
+		}
+	strs[0] = e->pwd->pw_name;
+	strs[1] = home;
+	strs[2] = shell;
+	strs[3] = e->cmd;
+	for (i = 0; i < 4; i++) {
+		if ((l = strlen(strs[i]) + 1) > sizeof(buf) - len)
+			goto toobig;
+		memcpy(buf + len, strs[i], l);
+		len += l;
+	}
+	for (p = e->envp; *p != NULL; p++) {
+		if ((l = strlen(*p) + 1) > sizeof(buf) - len)
+			goto toobig;
+		memcpy(buf + len, *p, l);
+		len += l;
+		req->nenv++;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (npassed > 0) {
+		msg.msg_control = cbuf;
+		msg.msg_controllen = CMSG_SPACE(npassed * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(npassed * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), passed, npassed * sizeof(int));
+	}
+	while ((n = sendmsg(this->fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+		;
+	if (n < 0) {
+		ELOG("Can't send %s to the spawner: %s", e->cmd, strerror(errno));
+		return (false);
+	}
+	return (true);
+  toobig:
+	ELOG("Can't run %s, its command and environment are over %d bytes", e->cmd, SPAWN_MAX_REQUEST);
+	errno = E2BIG;
+	return (false);
+}
+
+void Spawner::processReplies() {
+	map<JobId, pid_t>::iterator it;
+	Reply r;
+	ssize_t n;
+
+	while (this->fd != -1) {
+		if ((n = recv(this->fd, &r, sizeof(r), MSG_DONTWAIT)) < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				this->helperGone();
+			return;
+		}
+		if (n == 0) {
+			this->helperGone();
+			return;
+		}
+		if (n != sizeof(r) || (it = this->jobs.find(r.id)) == this->jobs.end())
+			continue;
+		switch (r.type) {
+			case SPAWN_STARTED:
+				it->second = r.pid;
+				this->stats.started++;
+				if (this->started)
+					this->started(r.id, r.pid, 0);
+				break;
+			case SPAWN_FAILED:
+				this->jobs.erase(it);
+				this->stats.failed++;
+				if (this->started)
+					this->started(r.id, -1, r.status);
+				break;
+			case SPAWN_EXITED:
+				this->jobs.erase(it);
+				this->stats.exited++;
+				if (this->exited)
+					this->exited(r.id, r.pid, r.status, &r.usage);
+				break;
+		}
+	}
+}
+
+
+/* the helper: wait for requests and children, until the daemon goes */
+void Spawner::helperMain(int fd) {
+	static char buf[SPAWN_MAX_REQUEST];
+	char cbuf[CMSG_SPACE(SPAWN_FDS * sizeof(int))];
+	int passed[SPAWN_FDS], npassed;
+	map<pid_t, uint64_t> children;
+	map<pid_t, uint64_t>::iterator child;
+	vector<gid_t> groups;
+	long ngroups;
+	struct pollfd pfds[2];
+	struct sigaction sa;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	struct rusage usage;
+	int wake[2], devnull, status, i;
+	ssize_t n;
+	pid_t pid;
+#ifdef __linux
+	struct signalfd_siginfo si;
+	sigset_t mask;
+#else
+	char c;
+#endif
+
+	/* keep nothing of the daemon's but the socket */
+	close_fds(fd);
+	if ((devnull = open(_PATH_DEVNULL, O_RDWR)) == -1)
+		_exit(1);
+	set_cloexec(devnull);
+	/* room for any user's groups, once rather than on the stack of
+	 * every job
+	 */
+	if ((ngroups = sysconf(_SC_NGROUPS_MAX)) < 1)
+		ngroups = NGROUPS_MAX;
+	groups.resize(ngroups + 1);
+
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+#ifdef __linux
+	/* children exiting show up as reads on a signalfd. SIGCHLD itself
+	 * stays blocked, except in the jobs (see runJob()), and mustn't be
+	 * ignored or there would be nothing to reap.
+	 */
+	sigaction(SIGCHLD, &sa, NULL);
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &mask, &helper_mask) != 0 ||
+			(wake[0] = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+		_exit(1);
+#else
+	/* the handler pokes a pipe */
+	sigprocmask(SIG_BLOCK, NULL, &helper_mask);
+	if (pipe(wake) != 0)
+		_exit(1);
+	set_cloexec(wake[0]);
+	set_cloexec(wake[1]);
+	fcntl(wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(wake[1], F_SETFL, O_NONBLOCK);
+	sigchld_fd = wake[1];
+	sa.sa_handler = helper_sigchld;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
+#endif
+
+	pfds[0].fd = fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = wake[0];
+	pfds[1].events = POLLIN;
+	for (;;) {
+		if (poll(pfds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			_exit(1);
+		}
+		if (pfds[1].revents) {
+			/* signals don't queue, so one wakeup may be any number of
+			 * children; reap until there are no more
+			 */
+#ifdef __linux
+			while (::read(wake[0], &si, sizeof(si)) > 0)
+				;
+#else
+			while (::read(wake[0], &c, 1) > 0)
+				;
+#endif
+			while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+				if ((child = children.find(pid)) == children.end())
+					continue;
+				reply(fd, child->second, SPAWN_EXITED, pid, status, &usage);
+				children.erase(child);
+			}
+		}
+		if (pfds[0].revents) {
+			memset(&msg, 0, sizeof(msg));
+			iov.iov_base = buf;
+			iov.iov_len = sizeof(buf);
+			msg.msg_iov = &iov;
+			msg.msg_iovlen = 1;
+			msg.msg_control = cbuf;
+			msg.msg_controllen = sizeof(cbuf);
+			if ((n = recvmsg(fd, &msg, 0)) < 0) {
+				if (errno == EINTR || errno == EAGAIN)
+					continue;
+				_exit(1);
+			}
+			/* the daemon has gone, and so do we */
+			if (n == 0)
+				_exit(0);
+			npassed = 0;
+			for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+				if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+					npassed = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+					if (npassed > SPAWN_FDS)
+						npassed = SPAWN_FDS;
+					memcpy(passed, CMSG_DATA(cmsg), npassed * sizeof(int));
+				}
+			/* the job gets the ones it needs with dup2(), not the rest */
+			for (i = 0; i < npassed; i++)
+				set_cloexec(passed[i]);
+			runJob(fd, buf, n, passed, npassed, children, devnull, groups);
+			for (i = 0; i < npassed; i++)
+				::close(passed[i]);
+		}
+	}
+}
+
+/* send a reply to the daemon. If it has gone there's nobody to tell */
+void Spawner::reply(int fd, uint64_t id, int type, pid_t pid, int status, const struct rusage *usage) {
+	Reply r;
+
+	memset(&r, 0, sizeof(r));
+	r.id = id;
+	r.type = type;
+	r.pid = pid;
+	r.status = status;
+	if (usage)
+		r.usage = *usage;
+	while (::send(fd, &r, sizeof(r), MSG_NOSIGNAL) < 0 && errno == EINTR)
+		;
+}
+
+/* start one job, and tell the daemon how it went */
+bool Spawner::runJob(int fd, const char *msg, size_t len, const int *passed, int npassed,
+		map<pid_t, uint64_t> &children, int devnull, vector<gid_t> &groups) {
+	const Request *req = (const Request *)msg;
+	const char *strs[4], *p = msg + sizeof(Request), *end = msg + len;
+	vector<char *> envp;
+	char *argv[4];
+	int stdio[SPAWN_FDS] = { devnull, devnull, -1, -1 };
+	int ngroups = 0, err, i, n = 0;
+	bool setids = (getuid() == 0);
+	pid_t pid;
+
+	if (len < sizeof(Request))
+		return (false);
+	for (i = 0; i < 4 + (int)req->nenv; i++) {
+		if (p >= end || end[-1] != '\0') {
+			reply(fd, req->id, SPAWN_FAILED, -1, EINVAL);
+			return (false);
+		}
+		if (i < 4)
+			strs[i] = p;
+		else
+			envp.push_back((char *)p);
+		p += strlen(p) + 1;
+	}
+	envp.push_back(NULL);
+	argv[0] = (char *)strs[2];
+	argv[1] = (char *)"-c";
+	argv[2] = (char *)strs[3];
+	argv[3] = NULL;
+	for (i = 0; i < SPAWN_FDS; i++)
+		if (req->fds & (1 << i)) {
+			if (n >= npassed) {
+				reply(fd, req->id, SPAWN_FAILED, -1, EBADF);
+				return (false);
+			}
+			stdio[i] = passed[n++];
+		}
+	/* stderr goes with stdout unless it has somewhere of its own */
+	if (stdio[2] == -1)
+		stdio[2] = stdio[1];
+	/* everything that might touch NSS or allocate is done out here, the
+	 * vfork()ed child only makes system calls
+	 */
+	if (setids) {
+		ngroups = groups.size();
+		if (getgrouplist(strs[0], req->gid, &groups[0], &ngroups) < 0) {
+			groups[0] = req->gid;
+			ngroups = 1;
+		}
+	}
+
+	if ((pid = vfork()) == 0) {
+		sigprocmask(SIG_SETMASK, &helper_mask, NULL);
+		/* while we're still root. If the cgroup won't have us the job
+		 * runs uncontained, which is better than not at all
+		 */
+		if (stdio[SPAWN_CGROUP] != -1 && ::write(stdio[SPAWN_CGROUP], "0", 1) < 0) {
+			/* nothing to do but carry on */
+		}
+		setsid();
+		if (dup2(stdio[0], STDIN_FILENO) < 0 || dup2(stdio[1], STDOUT_FILENO) < 0 ||
+				dup2(stdio[2], STDERR_FILENO) < 0)
+			_exit(127);
+		if (setids && (setgid(req->gid) != 0 || setgroups(ngroups, &groups[0]) != 0 ||
+				setuid(req->uid) != 0))
+			_exit(127);
+		if (chdir(strs[1]) != 0)
+			_exit(127);
+		execve(argv[0], argv, &envp[0]);
+		_exit(127);
+	}
+	if (pid < 0) {
+		err = errno;
+		reply(fd, req->id, SPAWN_FAILED, -1, err);
+		return (false);
+	}
+	children[pid] = req->id;
+	reply(fd, req->id, SPAWN_STARTED, pid, 0);
+	return (true);
+}
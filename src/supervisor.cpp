@@ -0,0 +1,390 @@
+/* Tinjac - supervisor.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file supervisor.cpp
+ *  @brief Follows each running job until it exits and its output ends
+ */
+
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include "log.hpp"
+#include "env.hpp"
+#include "scheduler.hpp"
+#include "supervisor.hpp"
+
+/* how much of a job's output we read at a time */
+#define OUTPUT_CHUNK	8192
+/* reads of a job's output before the loop gets a turn; the pipe stays
+ * readable, so what is left is picked up next time round
+ */
+#define OUTPUT_READS	16
+
+
+/* OUTPUT_HEAD or OUTPUT_TAIL from e's environment */
+static size_t capture_size(const entry *e, const char *name, size_t dflt) {
+	char *value = env_get((char *)name, e->envp), *end;
+	unsigned long n;
+
+	if (value == NULL)
+		return (dflt);
+	n = strtoul(value, &end, 10);
+	if (end == value || *end != '\0')
+		return (dflt);
+	return (min(n, (unsigned long)CAPTURE_MAX));
+}
+
+Supervisor::Supervisor(Spawner *spawner, Scheduler *sched) :
+	spawner(spawner), sched(sched), cgroups(NULL), webcron(NULL), dbcron(NULL), headmax(CAPTURE_HEAD), tailmax(CAPTURE_TAIL) {
+	memset(&this->stats, 0, sizeof(this->stats));
+	this->spawner->setStarted(boost::bind(&Supervisor::jobStarted, this, _1, _2, _3));
+	this->spawner->setExited(boost::bind(&Supervisor::jobExited, this, _1, _2, _3, _4));
+}
+
+Supervisor::~Supervisor() {
+	this->spawner->setStarted(Spawner::StartCallback());
+	this->spawner->setExited(Spawner::ExitCallback());
+	for (map<Spawner::JobId, JobRun>::iterator it = this->runs.begin(); it != this->runs.end(); ++it)
+		this->closeOutput(it->second);
+	for (map<string, OutputFilter *>::iterator it = this->filters.begin(); it != this->filters.end(); ++it)
+		delete it->second;
+}
+
+/* the compiled filter for this pair of expressions, either may be NULL */
+const OutputFilter *Supervisor::getFilter(const char *keep, const char *drop) {
+	map<string, OutputFilter *>::iterator it;
+	OutputFilter *filter;
+	string key, err;
+
+	/* an empty expression matches everything, which is no filter at all */
+	if (keep && *keep == '\0')
+		keep = NULL;
+	if (drop && *drop == '\0')
+		drop = NULL;
+	if (keep == NULL && drop == NULL)
+		return (NULL);
+	/* neither can have a \0 in it, so that keeps them apart */
+	key = string(keep ? keep : "") + '\0' + (drop ? drop : "");
+	if ((it = this->filters.find(key)) != this->filters.end())
+		return (it->second);
+	filter = new OutputFilter();
+	if (keep && !filter->add(keep, OutputFilter::KEEP, &err)) {
+		ELOG("Bad OUTPUT_KEEP expression \"%s\": %s", keep, err.c_str());
+		delete filter;
+		filter = NULL;
+	} else if (drop && !filter->add(drop, OutputFilter::DROP, &err)) {
+		ELOG("Bad OUTPUT_DROP expression \"%s\": %s", drop, err.c_str());
+		delete filter;
+		filter = NULL;
+	}
+	this->filters[key] = filter;
+	return (filter);
+}
+
+void Supervisor::setWebCron(WebCron *webcron) {
+	this->webcron = webcron;
+	if (webcron)
+		webcron->setDone(boost::bind(&Supervisor::fetched, this, _1));
+}
+
+void Supervisor::setDbCron(DbCron *dbcron) {
+	this->dbcron = dbcron;
+	if (dbcron)
+		dbcron->setDone(boost::bind(&Supervisor::queried, this, _1));
+}
+
+/* a run of e, as far as can be said before it starts */
+Supervisor::JobRun &Supervisor::newRun(Spawner::JobId id, const entry *e, const string &fname) {
+	JobRun &run = this->runs[id];
+	char *value;
+
+	run.id = id;
+	run.fname = fname;
+	run.lineno = e->lineno;
+	run.user = e->pwd->pw_name;
+	run.cmd = e->cmd;
+	value = env_get((char *)"MAILTO", e->envp);
+	run.mailto = value ? value : e->pwd->pw_name;
+	value = env_get((char *)"MAILFROM", e->envp);
+	run.mailfrom = value && *value ? value : ROOT_USER;
+	run.pid = 0;
+	gettimeofday(&run.started, NULL);
+	memset(&run.finished, 0, sizeof(run.finished));
+	run.status = -1;
+	memset(&run.usage, 0, sizeof(run.usage));
+	run.contained = false;
+	memset(&run.cgusage, 0, sizeof(run.cgusage));
+	run.outbytes = 0;
+	run.output = OutputCapture(capture_size(e, "OUTPUT_HEAD", this->headmax),
+		capture_size(e, "OUTPUT_TAIL", this->tailmax),
+		this->getFilter(env_get((char *)"OUTPUT_KEEP", e->envp), env_get((char *)"OUTPUT_DROP", e->envp)));
+	run.outfd = -1;
+	run.exited = false;
+	run.url = false;
+	run.httpstatus = 0;
+	run.database = false;
+	run.dbrows = run.dbchanges = 0;
+	return (run);
+}
+
+Spawner::JobId Supervisor::run(const entry *e, const string &fname, int infd, int stdoutfd) {
+	Spawner::JobId id, cgid = 0;
+	int fds[2], cgroupfd = -1;
+
+	if (this->webcron && WebCron::isUrl(e->cmd))
+		return (this->fetch(e, fname));
+	if (this->dbcron && DbCron::isDatabase(e->cmd))
+		return (this->query(e, fname));
+	if (pipe(fds) != 0) {
+		ELOG("Can't make an output pipe for %s:%d: %s", fname.c_str(), e->lineno, strerror(errno));
+		return (0);
+	}
+	fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	fcntl(fds[0], F_SETFL, O_NONBLOCK);
+	/* the cgroup is named after the id the spawner is about to give it */
+	if (this->cgroups && (cgroupfd = this->cgroups->create(cgid = this->spawner->nextId(), e)) == -1)
+		cgid = 0;
+	/* the helper gets its own copy of the write end, so once the job
+	 * (and anything it left behind) has finished with it we see EOF
+	 */
+	if (stdoutfd == -1)
+		id = this->spawner->spawn(e, fds[1], infd, -1, cgroupfd);
+	else
+		id = this->spawner->spawn(e, stdoutfd, infd, fds[1], cgroupfd);
+	::close(fds[1]);
+	if (cgroupfd != -1)
+		::close(cgroupfd);
+	if (id == 0) {
+		Cgroups::Usage unused;
+		if (cgid != 0)
+			this->cgroups->finish(cgid, &unused);
+		::close(fds[0]);
+		return (0);
+	}
+
+	JobRun &run = this->newRun(id, e, fname);
+	run.contained = (cgid != 0);
+	run.outfd = fds[0];
+	this->sched->watchFd(run.outfd, boost::bind(&Supervisor::readOutput, this, id));
+	this->stats.started++;
+	return (id);
+}
+
+/* a URL job: the request goes to the WebCron, and no process is started */
+Spawner::JobId Supervisor::fetch(const entry *e, const string &fname) {
+	Spawner::JobId id = this->spawner->takeId();
+	WebCron::Request request;
+	char *value;
+
+	JobRun &run = this->newRun(id, e, fname);
+	run.url = true;
+	request.id = id;
+	value = env_get((char *)"HTTP_METHOD", e->envp);
+	request.method = value && *value ? value : "GET";
+	value = env_get((char *)"HTTP_TIMEOUT", e->envp);
+	request.timeout = value && atoi(value) > 0 ? atoi(value) : WEBCRON_TIMEOUT;
+	request.url = e->cmd;
+	request.output = run.output;
+	/* a method is a token, it mustn't be able to add to the request */
+	if (request.method.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZ") != string::npos || !this->webcron->fetch(request)) {
+		ELOG("Can't request %s (%s:%d), a bad URL or HTTP_METHOD", e->cmd, fname.c_str(), e->lineno);
+		this->runs.erase(id);
+		return (0);
+	}
+	this->stats.started++;
+	return (id);
+}
+
+void Supervisor::fetched(const WebCron::Response &response) {
+	map<Spawner::JobId, JobRun>::iterator it = this->runs.find(response.id);
+
+	if (it == this->runs.end())
+		return;
+	JobRun &run = it->second;
+	run.httpstatus = response.status;
+	run.httperror = response.error;
+	/* as if it exited, 0 for a 2xx */
+	run.status = (response.status >= 200 && response.status < 300 ? 0 : 1) << 8;
+	run.exited = true;
+	run.finished = response.finished;
+	run.output = response.output;
+	run.outbytes = response.bytes;
+	this->stats.outbytes += response.bytes;
+	this->finish(it);
+}
+
+/* a database job: its SQL goes to the DbCron, and no process is started */
+Spawner::JobId Supervisor::query(const entry *e, const string &fname) {
+	Spawner::JobId id;
+	DbCron::Request request;
+	char *value;
+
+	if (e->pwd->pw_uid != getuid()) {
+		ELOG("Won't run SQL for %s (%s:%d) on the daemon's connections", e->pwd->pw_name, fname.c_str(), e->lineno);
+		return (0);
+	}
+	if (!DbCron::parseCommand(e->cmd, request.database, request.sql)) {
+		ELOG("Can't run %s (%s:%d), there's no SQL", e->cmd, fname.c_str(), e->lineno);
+		return (0);
+	}
+	id = this->spawner->takeId();
+	JobRun &run = this->newRun(id, e, fname);
+	run.database = true;
+	request.id = id;
+	value = env_get((char *)"DB_TIMEOUT", e->envp);
+	request.timeout = value && atoi(value) > 0 ? atoi(value) : DBCRON_TIMEOUT;
+	request.output = run.output;
+	if (!this->dbcron->query(request)) {
+		ELOG("Can't run %s (%s:%d)", e->cmd, fname.c_str(), e->lineno);
+		this->runs.erase(id);
+		return (0);
+	}
+	this->stats.started++;
+	return (id);
+}
+
+void Supervisor::queried(const DbCron::Response &response) {
+	map<Spawner::JobId, JobRun>::iterator it = this->runs.find(response.id);
+
+	if (it == this->runs.end())
+		return;
+	JobRun &run = it->second;
+	run.dbrows = response.rows;
+	run.dbchanges = response.changes;
+	run.dberror = response.error;
+	run.status = (response.ok ? 0 : 1) << 8;
+	run.exited = true;
+	run.finished = response.finished;
+	run.output = response.output;
+	run.outbytes = response.bytes;
+	this->stats.outbytes += response.bytes;
+	this->finish(it);
+}
+
+void Supervisor::jobStarted(Spawner::JobId id, pid_t pid, int err) {
+	map<Spawner::JobId, JobRun>::iterator it = this->runs.find(id);
+
+	if (it == this->runs.end())
+		return;
+	if (pid != -1) {
+		it->second.pid = pid;
+		return;
+	}
+	/* it never ran, so there's no output to wait for */
+	it->second.pid = -1;
+	it->second.status = err;
+	it->second.exited = true;
+	gettimeofday(&it->second.finished, NULL);
+	this->leaveCgroup(it->second);
+	this->closeOutput(it->second);
+	this->finish(it);
+}
+
+void Supervisor::jobExited(Spawner::JobId id, pid_t pid, int status, const struct rusage *usage) {
+	map<Spawner::JobId, JobRun>::iterator it = this->runs.find(id);
+
+	if (it == this->runs.end())
+		return;
+	it->second.pid = pid;
+	it->second.status = status;
+	if (usage)
+		it->second.usage = *usage;
+	it->second.exited = true;
+	gettimeofday(&it->second.finished, NULL);
+	this->leaveCgroup(it->second);
+	if (it->second.outfd == -1)
+		this->finish(it);
+}
+
+bool Supervisor::kill(Spawner::JobId id, int sig) {
+	map<Spawner::JobId, JobRun>::iterator it = this->runs.find(id);
+
+	if (it != this->runs.end() && it->second.url && !it->second.exited) {
+		this->webcron->cancel(id);
+		return (true);
+	}
+	if (it != this->runs.end() && it->second.database && !it->second.exited) {
+		this->dbcron->cancel(id);
+		return (true);
+	}
+	if (it == this->runs.end() || it->second.pid <= 0 || it->second.exited)
+		return (false);
+	/* the job has a session, and so a process group, of its own */
+	return (::kill(-it->second.pid, sig) == 0);
+}
+
+void Supervisor::readOutput(Spawner::JobId id) {
+	map<Spawner::JobId, JobRun>::iterator it = this->runs.find(id);
+	char buf[OUTPUT_CHUNK];
+	ssize_t n;
+	int reads = 0;
+
+	if (it == this->runs.end())
+		return;
+	for (;;) {
+		if (reads++ == OUTPUT_READS)
+			return;
+		if ((n = ::read(it->second.outfd, buf, sizeof(buf))) > 0) {
+			it->second.outbytes += n;
+			this->stats.outbytes += n;
+			it->second.output.feed(buf, n);
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		break;
+	}
+	/* EOF (or an error, which we treat the same) */
+	it->second.output.finish();
+	this->closeOutput(it->second);
+	if (it->second.exited)
+		this->finish(it);
+}
+
+void Supervisor::closeOutput(JobRun &run) {
+	if (run.outfd == -1)
+		return;
+	this->sched->unwatchFd(run.outfd);
+	::close(run.outfd);
+	run.outfd = -1;
+}
+
+/* what the job's cgroup used, now that it's done with it */
+void Supervisor::leaveCgroup(JobRun &run) {
+	if (run.contained)
+		run.contained = this->cgroups->finish(run.id, &run.cgusage);
+}
+
+void Supervisor::finish(map<Spawner::JobId, JobRun>::iterator it) {
+	this->stats.finished++;
+	if (this->done)
+		this->done(it->second);
+	this->runs.erase(it);
+}
@@ -0,0 +1,465 @@
+/* Tinjac - timezone.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+/** @file timezone.cpp
+ *  @brief Cached UTC offset tables for the zones crontabs ask for
+ */
+
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "macros.h"
+#include "log.hpp"
+#include "timezone.hpp"
+
+/* the size of a tzfile header */
+#define TZIF_HEADER		44
+
+
+map<string, TimeZone *> TimeZone::zones;
+
+
+static inline uint32_t be32(const unsigned char *p) {
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3]);
+}
+
+static inline int64_t be64(const unsigned char *p) {
+	return ((int64_t)((uint64_t)be32(p) << 32 | be32(p + 4)));
+}
+
+/* past a zone abbreviation, plain or <quoted>, NULL if there isn't one */
+static const char *skip_name(const char *s) {
+	const char *p = s;
+
+	if (*p == '<') {
+		while (*p != '\0' && *p != '>')
+			p++;
+		return ((*p == '>' && p - s > 1) ? p + 1 : NULL);
+	}
+	while (isalpha((unsigned char)*p))
+		p++;
+	return ((p - s >= 3) ? p : NULL);
+}
+
+/* [+-]hh[:mm[:ss]] into secs, NULL if it isn't one */
+static const char *parse_hms(const char *s, long *secs) {
+	long sign = 1, part[3] = { 0, 0, 0 };
+	int i;
+
+	if (*s == '+' || *s == '-')
+		sign = (*s++ == '-') ? -1 : 1;
+	for (i = 0; i < 3; i++) {
+		if (i > 0)
+			s++;
+		if (!isdigit((unsigned char)*s))
+			return (NULL);
+		for (; isdigit((unsigned char)*s) && part[i] < 1000; s++)
+			part[i] = part[i] * 10 + (*s - '0');
+		if (*s != ':')
+			break;
+	}
+	if (part[0] > 167 || part[1] > 59 || part[2] > 59)
+		return (NULL);
+	*secs = sign * (part[0] * SECONDS_PER_HOUR + part[1] * SECONDS_PER_MINUTE + part[2]);
+	return (s);
+}
+
+/* a number from lo to hi, NULL if it isn't one */
+static const char *parse_num(const char *s, int lo, int hi, int *n) {
+	if (!isdigit((unsigned char)*s))
+		return (NULL);
+	for (*n = 0; isdigit((unsigned char)*s) && *n <= hi; s++)
+		*n = *n * 10 + (*s - '0');
+	return ((*n >= lo && *n <= hi) ? s : NULL);
+}
+
+
+TimeZone::TimeZone(const string &name) :
+	name(name), dataoff(0), datadst(0), hasrule(false), firstoff(0), firstdst(0), loaded(false), from(0), until(0) {
+	const char *dir;
+	string tz = name;
+
+	if (name.empty()) {
+		if (!this->readFile(ZONEINFO_LOCAL))
+			this->hasrule = this->parseRule("UTC0", &this->rule);
+		return;
+	}
+	if (!tz.empty() && tz[0] == ':')
+		tz.erase(0, 1);
+	if (tz.empty() || tz[0] != '/') {
+		if ((dir = getenv("TZDIR")) == NULL || *dir == '\0')
+			dir = ZONEINFO_DIR;
+		tz = string(dir) + "/" + tz;
+	}
+	/* nothing outside the zones, by going up from them */
+	if (tz.find("..") == string::npos && this->readFile(tz))
+		return;
+	if (this->parseRule(name.c_str(), &this->rule)) {
+		this->hasrule = true;
+		return;
+	}
+	ELOG("Unknown time zone %s, using UTC", name.c_str());
+	this->hasrule = this->parseRule("UTC0", &this->rule);
+}
+
+TimeZone::~TimeZone() {
+
+}
+
+/* the transitions and rule of a tzfile (RFC 8536), the 64-bit ones if
+ * it has them. False if it can't be read or isn't one.
+ */
+bool TimeZone::readFile(const string &path) {
+	const unsigned char *p, *end, *times, *idx, *types;
+	vector<unsigned char> buf;
+	uint32_t isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt, i;
+	size_t tsize = 4, size;
+	struct stat st;
+	Transition tr;
+	ssize_t n;
+	int fd;
+
+	if ((fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC)) == -1)
+		return (false);
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size < TZIF_HEADER || st.st_size > ZONEINFO_MAX) {
+		::close(fd);
+		return (false);
+	}
+	buf.resize(st.st_size);
+	for (size = 0; size < buf.size(); size += n)
+		if ((n = ::read(fd, &buf[size], buf.size() - size)) <= 0)
+			break;
+	::close(fd);
+	if (size < buf.size())
+		return (false);
+	p = &buf[0];
+	end = p + size;
+	for (;;) {
+		if (end - p < TZIF_HEADER || memcmp(p, "TZif", 4) != 0)
+			return (false);
+		isutcnt = be32(p + 20);
+		isstdcnt = be32(p + 24);
+		leapcnt = be32(p + 28);
+		timecnt = be32(p + 32);
+		typecnt = be32(p + 36);
+		charcnt = be32(p + 40);
+		size = (size_t)timecnt * (tsize + 1) + (size_t)typecnt * 6 + charcnt + (size_t)leapcnt * (tsize + 4) +
+			isstdcnt + isutcnt;
+		if (typecnt == 0 || (size_t)(end - p - TZIF_HEADER) < size)
+			return (false);
+		/* version 2 and on repeat it all with 64-bit times */
+		if (tsize == 8 || p[4] < '2')
+			break;
+		p += TZIF_HEADER + size;
+		tsize = 8;
+	}
+	times = p + TZIF_HEADER;
+	idx = times + (size_t)timecnt * tsize;
+	types = idx + timecnt;
+	for (i = 0; i < timecnt; i++)
+		if (idx[i] >= typecnt)
+			return (false);
+	this->dataoff = (int32_t)be32(types);
+	this->datadst = types[4] != 0;
+	this->data.clear();
+	for (i = 0; i < timecnt; i++) {
+		tr.at = (tsize == 8) ? (time_t)be64(times + i * 8) : (time_t)(int32_t)be32(times + i * 4);
+		tr.off = (int32_t)be32(types + idx[i] * 6);
+		tr.isdst = types[idx[i] * 6 + 4] != 0;
+		this->data.push_back(tr);
+	}
+	/* and after the last of them, the rule in the footer */
+	p += TZIF_HEADER + size;
+	if (tsize == 8 && p < end && *p == '\n') {
+		const unsigned char *nl = (const unsigned char *)memchr(p + 1, '\n', end - p - 1);
+
+		if (nl != NULL && nl > p + 1)
+			this->hasrule = this->parseRule(string((const char *)p + 1, nl - p - 1).c_str(), &this->rule);
+	}
+	return (true);
+}
+
+/* std offset [dst [offset] [,start[/time],end[/time]]], as in tzset(3) */
+bool TimeZone::parseRule(const char *s, Rule *rule) {
+	long off;
+
+	if ((s = skip_name(s)) == NULL || (s = parse_hms(s, &off)) == NULL)
+		return (false);
+	/* POSIX counts west of UTC */
+	rule->stdoff = rule->dstoff = -off;
+	rule->dst = false;
+	if (*s == '\0')
+		return (true);
+	if ((s = skip_name(s)) == NULL)
+		return (false);
+	rule->dst = true;
+	rule->dstoff = rule->stdoff + SECONDS_PER_HOUR;
+	if (*s != '\0' && *s != ',') {
+		if ((s = parse_hms(s, &off)) == NULL)
+			return (false);
+		rule->dstoff = -off;
+	}
+	/* with no dates, the US ones, as glibc has it */
+	if (*s == '\0')
+		s = ",M3.2.0,M11.1.0";
+	if (*s++ != ',' || (s = parseDate(s, &rule->start)) == NULL || *s++ != ',' ||
+			(s = parseDate(s, &rule->end)) == NULL)
+		return (false);
+	return (*s == '\0');
+}
+
+/* Jn, n or Mm.w.d, then an optional /time */
+const char *TimeZone::parseDate(const char *s, Rule::Date *date) {
+	date->kind = *s;
+	date->mon = date->week = date->day = 0;
+	if (*s == 'J')
+		s = parse_num(s + 1, 1, 365, &date->day);
+	else if (*s == 'M') {
+		if ((s = parse_num(s + 1, 1, 12, &date->mon)) == NULL || *s != '.' ||
+				(s = parse_num(s + 1, 1, 5, &date->week)) == NULL || *s != '.')
+			return (NULL);
+		s = parse_num(s + 1, 0, 6, &date->day);
+	} else {
+		date->kind = 'D';
+		s = parse_num(s, 0, 365, &date->day);
+	}
+	if (s == NULL)
+		return (NULL);
+	date->time = 2 * SECONDS_PER_HOUR;
+	if (*s == '/')
+		s = parse_hms(s + 1, &date->time);
+	return (s);
+}
+
+/* when date comes in year, with off the offset until then */
+time_t TimeZone::ruleTime(const Rule::Date &date, int year, long off) {
+	time_t day = civilSeconds(year, 1, 1, 0, 0) / SECONDS_PER_DAY, first, last;
+	bool leap = (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+	int wday;
+
+	if (date.kind == 'J')
+		day += date.day - 1 + (leap && date.day >= 60);
+	else if (date.kind == 'D')
+		day += date.day;
+	else {
+		first = civilSeconds(year, date.mon, 1, 0, 0) / SECONDS_PER_DAY;
+		if (date.mon == 12)
+			last = civilSeconds(year + 1, 1, 1, 0, 0) / SECONDS_PER_DAY;
+		else
+			last = civilSeconds(year, date.mon + 1, 1, 0, 0) / SECONDS_PER_DAY;
+		/* 1970-01-01 was a Thursday */
+		wday = (first % 7 + 11) % 7;
+		day = first + (date.day - wday + 7) % 7 + 7 * (date.week - 1);
+		/* the fifth is the last, whether there are five or not */
+		while (day >= last)
+			day -= 7;
+	}
+	return (day * SECONDS_PER_DAY + date.time - off);
+}
+
+/* the rule's changes in year, in order, leaving out any the tzfile's
+ * own transitions already cover
+ */
+void TimeZone::ruleYear(int year, vector<Transition> &found) const {
+	Transition tr[2];
+	int i;
+
+	tr[0].at = ruleTime(this->rule.start, year, this->rule.stdoff);
+	tr[0].off = this->rule.dstoff;
+	tr[0].isdst = 1;
+	tr[1].at = ruleTime(this->rule.end, year, this->rule.dstoff);
+	tr[1].off = this->rule.stdoff;
+	tr[1].isdst = 0;
+	/* south of the equator summer goes over the new year */
+	if (tr[1].at < tr[0].at)
+		std::swap(tr[0], tr[1]);
+	for (i = 0; i < 2; i++)
+		if (this->data.empty() || tr[i].at > this->data.back().at)
+			found.push_back(tr[i]);
+}
+
+TimeZone *TimeZone::get(const string &name) {
+	map<string, TimeZone *>::iterator it;
+	const char *cur;
+	string zonename, key;
+
+	/* an entry without CRON_TZ runs in whatever the daemon's TZ is, which
+	 * may well be a zone some other entry named. With TZ unset it is the
+	 * system default, keyed so no real zone name can clash with it.
+	 */
+	if (!name.empty())
+		zonename = name;
+	else if ((cur = getenv("TZ")) != NULL)
+		zonename = *cur != '\0' ? cur : "UTC0";	/* as libc takes TZ= */
+	key = zonename.empty() ? "\001local" : zonename;
+	if ((it = zones.find(key)) != zones.end())
+		return (it->second);
+	TimeZone *zone = new TimeZone(zonename);
+	zones[key] = zone;
+	return (zone);
+}
+
+/* make sure the table reaches a change either side of t, if the zone
+ * has one
+ */
+void TimeZone::cover(time_t t) const {
+	vector<Transition> found;
+	struct tm tm;
+	size_t i;
+	int year;
+
+	if (!this->loaded) {
+		this->table = this->data;
+		this->firstoff = this->dataoff;
+		this->firstdst = this->datadst;
+		if (this->data.empty() && this->hasrule && !this->rule.dst)
+			this->firstoff = this->rule.stdoff;
+		civilFromSeconds(this->data.empty() ? t : this->data.back().at, &tm);
+		this->from = this->until = tm.tm_year + 1900;
+		this->loaded = true;
+		DLOG("Loaded zone %s, %d transitions", this->name.empty() ? "(local)" : this->name.c_str(), (int)this->table.size());
+	}
+	if (!this->hasrule || !this->rule.dst)
+		return;
+	/* a year either way, the next or last change may be in it */
+	civilFromSeconds(t, &tm);
+	year = tm.tm_year + 1900;
+	while (this->until <= year + 1) {
+		found.clear();
+		this->ruleYear(this->until++, found);
+		for (i = 0; i < found.size(); i++) {
+			/* the rule's first change may be the tzfile's last one */
+			if (!this->table.empty() && this->table.back().off == found[i].off &&
+					this->table.back().isdst == found[i].isdst)
+				continue;
+			this->table.push_back(found[i]);
+		}
+	}
+	/* with nothing but a rule it goes back for ever */
+	while (this->data.empty() && this->from >= year) {
+		found.clear();
+		this->ruleYear(--this->from, found);
+		this->table.insert(this->table.begin(), found.begin(), found.end());
+		this->firstoff = found[0].isdst ? this->rule.stdoff : this->rule.dstoff;
+		this->firstdst = !found[0].isdst;
+	}
+}
+
+/* index of the first transition after t */
+size_t TimeZone::find(time_t t) const {
+	size_t lo = 0, hi, mid;
+
+	this->cover(t);
+	hi = this->table.size();
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (this->table[mid].at <= t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+long TimeZone::offset(time_t t) const {
+	size_t i = this->find(t);
+
+	return (i == 0 ? this->firstoff : this->table[i - 1].off);
+}
+
+struct tm *TimeZone::toWall(time_t t, struct tm *tm) const {
+	size_t i = this->find(t);
+	long off = (i == 0 ? this->firstoff : this->table[i - 1].off);
+
+	civilFromSeconds(t + off, tm);
+	tm->tm_isdst = (i == 0 ? this->firstdst : this->table[i - 1].isdst);
+	return (tm);
+}
+
+time_t TimeZone::nextTransition(time_t t) const {
+	size_t i = this->find(t);
+
+	if (i == this->table.size())
+		return (-1);
+	return (this->table[i].at);
+}
+
+time_t TimeZone::lastTransition(time_t t) const {
+	size_t i = this->find(t);
+
+	if (i == 0)
+		return (-1);
+	return (this->table[i - 1].at);
+}
+
+time_t TimeZone::civilSeconds(int year, int mon, int mday, int hour, int min) {
+	long era, yoe, doy, doe, days;
+
+	/* days from civil, after Howard Hinnant */
+	if (mon <= 2)
+		year--;
+	era = (year >= 0 ? year : year - 399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (mon + (mon > 2 ? -3 : 9)) + 2) / 5 + mday - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	days = era * 146097 + doe - 719468;
+	return ((time_t)days * SECONDS_PER_DAY + hour * SECONDS_PER_HOUR + min * SECONDS_PER_MINUTE);
+}
+
+void TimeZone::civilFromSeconds(time_t secs, struct tm *tm) {
+	long days, rem, era, doe, yoe, doy, mp, y;
+
+	days = secs / SECONDS_PER_DAY;
+	rem = secs % SECONDS_PER_DAY;
+	if (rem < 0) {
+		rem += SECONDS_PER_DAY;
+		days--;
+	}
+	tm->tm_hour = rem / SECONDS_PER_HOUR;
+	tm->tm_min = (rem % SECONDS_PER_HOUR) / SECONDS_PER_MINUTE;
+	tm->tm_sec = rem % SECONDS_PER_MINUTE;
+	/* 1970-01-01 was a Thursday */
+	tm->tm_wday = (days % 7 + 11) % 7;
+
+	/* civil from days, after Howard Hinnant */
+	days += 719468;
+	era = (days >= 0 ? days : days - 146096) / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	y = yoe + era * 400;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	tm->tm_mday = doy - (153 * mp + 2) / 5 + 1;
+	tm->tm_mon = mp < 10 ? mp + 2 : mp - 10;
+	if (tm->tm_mon < 2)
+		y++;
+	tm->tm_year = y - 1900;
+	tm->tm_yday = (secs - civilSeconds(y, 1, 1, 0, 0)) / SECONDS_PER_DAY;
+}
@@ -0,0 +1,386 @@
+/* Tinjac - usercache.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file usercache.cpp
+ *  @brief Shared, refreshed passwd records for the users crontabs run as
+ */
+
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <boost/bind.hpp>
+#include "config.h"
+#include "log.hpp"
+#include "misc.hpp"
+#include "scheduler.hpp"
+#include "usercache.hpp"
+
+/* a change to this expires every user */
+#define PASSWD_FILE	"/etc/passwd"
+
+
+static time_t passwd_mtime() {
+	struct stat st;
+
+	if (stat(PASSWD_FILE, &st) != 0)
+		return (0);
+	return (st.st_mtime);
+}
+
+static inline bool same_str(const char *a, const char *b) {
+	if (a == NULL || b == NULL)
+		return (a == b);
+	return (strcmp(a, b) == 0);
+}
+
+/* would a job run any differently as a than as b? */
+static bool same_user(const struct passwd *a, const struct passwd *b) {
+	return (a->pw_uid == b->pw_uid && a->pw_gid == b->pw_gid &&
+		same_str(a->pw_name, b->pw_name) &&
+		same_str(a->pw_dir, b->pw_dir) &&
+		same_str(a->pw_shell, b->pw_shell) &&
+		same_str(a->pw_gecos, b->pw_gecos));
+}
+
+
+UserCache::UserCache(time_t ttl, time_t negttl) :
+	ttl(ttl), negttl(negttl), passwdmtime(passwd_mtime()), nextcheck(0),
+	sched(NULL), started(false), npending(0), stopping(false) {
+	memset(&this->stats, 0, sizeof(this->stats));
+	pthread_mutex_init(&this->lock, NULL);
+	pthread_cond_init(&this->ready, NULL);
+	this->wake[0] = this->wake[1] = -1;
+}
+
+UserCache::~UserCache() {
+	if (this->started) {
+		pthread_mutex_lock(&this->lock);
+		this->stopping = true;
+		pthread_cond_broadcast(&this->ready);
+		pthread_mutex_unlock(&this->lock);
+		pthread_join(this->worker, NULL);
+		this->sched->unwatchFd(this->wake[0]);
+	}
+	for (; !this->answers.empty(); this->answers.pop_front())
+		pw_release(this->answers.front().pw);
+	if (this->wake[0] != -1) {
+		::close(this->wake[0]);
+		::close(this->wake[1]);
+	}
+	pthread_cond_destroy(&this->ready);
+	pthread_mutex_destroy(&this->lock);
+	for (map<string, User>::iterator it = this->users.begin(); it != this->users.end(); ++it)
+		pw_release(it->second.pw);
+}
+
+bool UserCache::start(Scheduler *sched) {
+	sigset_t all, old;
+	int err;
+
+	if (this->started)
+		return (true);
+	if (pipe(this->wake) != 0) {
+		ELOG("Can't make a pipe for user lookups: %s", strerror(errno));
+		return (false);
+	}
+	fcntl(this->wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(this->wake[1], F_SETFD, FD_CLOEXEC);
+	fcntl(this->wake[0], F_SETFL, O_NONBLOCK);
+	/* signals are for the scheduler's thread, not this one */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&this->worker, NULL, UserCache::loop, this);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		ELOG("Can't start the thread for user lookups: %s", strerror(err));
+		::close(this->wake[0]);
+		::close(this->wake[1]);
+		this->wake[0] = this->wake[1] = -1;
+		return (false);
+	}
+	this->started = true;
+	this->sched = sched;
+	this->sched->watchFd(this->wake[0], boost::bind(&UserCache::processDone, this));
+	return (true);
+}
+
+void *UserCache::loop(void *arg) {
+	((UserCache *)arg)->work();
+	return (NULL);
+}
+
+/* look up what refresh() queues until the UserCache goes */
+void UserCache::work() {
+	Answer answer;
+	char c = 0;
+
+	pthread_mutex_lock(&this->lock);
+	while (!this->stopping) {
+		if (this->queue.empty()) {
+			pthread_cond_wait(&this->ready, &this->lock);
+			continue;
+		}
+		answer.name = this->queue.front();
+		this->queue.pop_front();
+		pthread_mutex_unlock(&this->lock);
+		answer.found = lookup(answer.name, &answer.pw);
+		pthread_mutex_lock(&this->lock);
+		this->answers.push_back(answer);
+		while (::write(this->wake[1], &c, 1) < 0 && errno == EINTR)
+			;
+	}
+	pthread_mutex_unlock(&this->lock);
+}
+
+void UserCache::processDone() {
+	deque<Answer> ready;
+	vector<string> changed;
+	time_t now = time(NULL);
+	char buf[64];
+
+	while (::read(this->wake[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&this->lock);
+	ready.swap(this->answers);
+	pthread_mutex_unlock(&this->lock);
+	for (; !ready.empty(); ready.pop_front()) {
+		this->npending--;
+		if (this->apply(ready.front(), now))
+			changed.push_back(ready.front().name);
+	}
+	/* only now, whoever is told may well come back to get() */
+	if (this->changed)
+		for (size_t i = 0; i < changed.size(); i++)
+			this->changed(changed[i]);
+}
+
+/* ask NSS about name. Returns 1 and a new record in pw if the user
+ * exists, 0 if it doesn't, and -1 if we couldn't find out.
+ */
+int UserCache::lookup(const string &name, struct passwd **pw) {
+	struct passwd pwbuf, *res = NULL;
+	long size = sysconf(_SC_GETPW_R_SIZE_MAX);
+	char *buf;
+	int err;
+
+	if (size <= 0)
+		size = 16384;
+	for (;;) {
+		if ((buf = (char *)malloc(size)) == NULL)
+			return (-1);
+		err = getpwnam_r(name.c_str(), &pwbuf, buf, size, &res);
+		if (err != ERANGE)
+			break;
+		free(buf);
+		size *= 2;
+	}
+	if (err != 0) {
+		ELOG("Looking up user %s failed: %s", name.c_str(), strerror(err));
+		free(buf);
+		return (-1);
+	}
+	*pw = NULL;
+	if (res != NULL && (*pw = pw_dup(res)) == NULL) {
+		free(buf);
+		return (-1);
+	}
+	free(buf);
+	return (*pw != NULL);
+}
+
+struct passwd *UserCache::get(const string &name) {
+	map<string, User>::iterator it = this->users.find(name);
+	struct passwd *pw;
+	time_t now = time(NULL);
+	User user;
+
+	/* a stale record is still good enough, refresh() catches up with
+	 * it. A user that didn't exist is only believed until it expires,
+	 * so a crontab for a user that was just added loads.
+	 */
+	if (it != this->users.end() && (it->second.pw != NULL || it->second.expires > now)) {
+		this->stats.hits++;
+		if (it->second.pw == NULL)
+			this->stats.negative++;
+		return (pw_hold(it->second.pw));
+	}
+	if (this->started) {
+		/* not here, the thread finds out */
+		if (it == this->users.end())
+			it = this->users.insert(make_pair(name, User())).first;
+		if (!it->second.pending) {
+			this->stats.misses++;
+			it->second.pw = NULL;
+			it->second.expires = 0;
+			it->second.pending = it->second.first = true;
+			this->ask(deque<string>(1, name));
+		}
+		return (NULL);
+	}
+	this->stats.misses++;
+	switch (lookup(name, &pw)) {
+		case -1:
+			/* don't remember failures, the next ask might work */
+			this->stats.errors++;
+			return (NULL);
+		case 0:
+			user.expires = now + this->negttl;
+			break;
+		default:
+			user.expires = now + this->ttl;
+			break;
+	}
+	user.pw = pw;
+	user.pending = user.first = false;
+	if (it != this->users.end())
+		it->second = user;
+	else
+		this->users[name] = user;
+	return (pw_hold(pw));
+}
+
+/* take in what a refresh found out about the user. Returns true if
+ * they changed or went away.
+ */
+bool UserCache::apply(const Answer &answer, time_t now) {
+	map<string, User>::iterator it = this->users.find(answer.name);
+	bool changed = false, first;
+
+	if (it == this->users.end()) {
+		pw_release(answer.pw);
+		return (false);
+	}
+	User &user = it->second;
+	/* whoever get() said no to wants to know, whatever the answer */
+	first = user.first;
+	user.pending = user.first = false;
+	switch (answer.found) {
+		case -1:
+			/* keep what we had and try again soon */
+			this->stats.errors++;
+			user.expires = now + this->negttl;
+			break;
+		case 0:
+			if (user.pw == NULL) {
+				user.expires = now + this->negttl;
+				break;
+			}
+			DLOG("User %s has gone away", answer.name.c_str());
+			this->stats.changed++;
+			pw_release(user.pw);
+			user.pw = NULL;
+			user.expires = now + this->negttl;
+			changed = true;
+			break;
+		default:
+			if (user.pw != NULL && same_user(answer.pw, user.pw)) {
+				pw_release(answer.pw);
+			} else {
+				DLOG("User %s has changed", answer.name.c_str());
+				this->stats.changed++;
+				pw_release(user.pw);
+				user.pw = answer.pw;
+				changed = true;
+			}
+			user.expires = now + this->ttl;
+			break;
+	}
+	return (changed || first);
+}
+
+size_t UserCache::refresh(time_t now, size_t max) {
+	map<string, User>::iterator it;
+	vector<string> changed;
+	deque<string> batch;
+	Answer answer;
+	time_t mtime;
+	size_t done = 0;
+
+	if (now < this->nextcheck)
+		return (0);
+	this->nextcheck = now + USERCACHE_CHECK;
+	if ((mtime = passwd_mtime()) != this->passwdmtime) {
+		DLOG("%s changed, expiring %d cached users", PASSWD_FILE, (int)this->users.size());
+		this->passwdmtime = mtime;
+		this->invalidate();
+	}
+	for (it = this->users.begin(); it != this->users.end() && (this->started || done < max); ) {
+		User &user = it->second;
+		if (user.expires > now || user.pending) {
+			++it;
+			continue;
+		}
+		/* nothing but us holds it, so there's no point asking again
+		 * until someone does
+		 */
+		if (user.pw == NULL || pw_refs(user.pw) == 1) {
+			pw_release(user.pw);
+			this->users.erase(it++);
+			continue;
+		}
+		done++;
+		this->stats.refreshes++;
+		if (this->started) {
+			user.pending = true;
+			batch.push_back(it->first);
+		} else {
+			answer.name = it->first;
+			answer.found = lookup(answer.name, &answer.pw);
+			if (this->apply(answer, now))
+				changed.push_back(answer.name);
+		}
+		++it;
+	}
+	if (!batch.empty())
+		this->ask(batch);
+	if (this->changed)
+		for (size_t i = 0; i < changed.size(); i++)
+			this->changed(changed[i]);
+	return (done);
+}
+
+bool UserCache::looking(const string &name) const {
+	map<string, User>::const_iterator it = this->users.find(name);
+
+	return (it != this->users.end() && it->second.first);
+}
+
+/* hand names to the thread */
+void UserCache::ask(const deque<string> &names) {
+	pthread_mutex_lock(&this->lock);
+	this->queue.insert(this->queue.end(), names.begin(), names.end());
+	pthread_cond_signal(&this->ready);
+	pthread_mutex_unlock(&this->lock);
+	this->npending += names.size();
+}
+
+void UserCache::invalidate() {
+	for (map<string, User>::iterator it = this->users.begin(); it != this->users.end(); ++it)
+		it->second.expires = 0;
+}
@@ -0,0 +1,605 @@
+/* Tinjac - webcron.cpp
+** Copyright (c) 2010 Justin Hammond
+**
+**  This program is free software; you can redistribute it and/or modify
+**  it under the terms of the GNU General Public License as published by
+**  the Free Software Foundation; either version 2 of the License, or
+**  (at your option) any later version.
+**
+**  This program is distributed in the hope that it will be useful,
+**  but WITHOUT ANY WARRANTY; without even the implied warranty of
+**  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+**  GNU General Public License for more details.
+**
+**  You should have received a copy of the GNU General Public License
+**  along with this program; if not, write to the Free Software
+**  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+**  USA
+**
+** Tinjac SVN Identification:
+** $Rev$
+*/
+
+
+/** @file webcron.cpp
+ *  @brief Runs URL jobs as HTTP requests, from a shared Asio loop
+ */
+
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include "log.hpp"
+#include "scheduler.hpp"
+#include "webcron.hpp"
+
+/* how much of the body is read at a time */
+#define WEBCRON_CHUNK	8192
+
+using boost::asio::ip::tcp;
+namespace ssl = boost::asio::ssl;
+
+/* the stream's own reads and writes for https, its socket's for http */
+template <typename Handler>
+static void write_all(boost::asio::ssl::stream<tcp::socket> &s, bool tls, const string &data, Handler h) {
+	if (tls)
+		boost::asio::async_write(s, boost::asio::buffer(data), h);
+	else
+		boost::asio::async_write(s.next_layer(), boost::asio::buffer(data), h);
+}
+
+template <typename Handler>
+static void read_until(boost::asio::ssl::stream<tcp::socket> &s, bool tls, boost::asio::streambuf &in, const char *delim, Handler h) {
+	if (tls)
+		boost::asio::async_read_until(s, in, delim, h);
+	else
+		boost::asio::async_read_until(s.next_layer(), in, delim, h);
+}
+
+template <typename Handler>
+static void read_some(boost::asio::ssl::stream<tcp::socket> &s, bool tls, boost::asio::streambuf &in, Handler h) {
+	if (tls)
+		s.async_read_some(in.prepare(WEBCRON_CHUNK), h);
+	else
+		s.next_layer().async_read_some(in.prepare(WEBCRON_CHUNK), h);
+}
+
+static bool is_eof(const boost::system::error_code &ec) {
+	/* plenty of servers close https connections without a close_notify */
+	return (ec == boost::asio::error::eof || ec == ssl::error::stream_truncated);
+}
+
+/* a header's value, if line is that header */
+static bool header(const string &line, const char *name, string &value) {
+	size_t len = strlen(name), start;
+
+	if (line.size() <= len || line[len] != ':' || strncasecmp(line.c_str(), name, len) != 0)
+		return (false);
+	for (start = len + 1; start < line.size() && (line[start] == ' ' || line[start] == '\t'); start++)
+		;
+	value = line.substr(start);
+	return (true);
+}
+
+WebCron::Connection::Connection(boost::asio::io_service &io, ssl::context &ctx, Host *host) :
+	stream(io, ctx), idle(io), host(host), busy(true), in(WEBCRON_HEADER_MAX) {
+}
+
+WebCron::Fetch::Fetch(boost::asio::io_service &io, const Request &request, const Url &url) :
+	request(request), url(url), host(NULL), active(false), reused(false), started(false), done(false),
+	deadline(io), resolver(io), state(LENGTH), remaining(0), keepalive(false) {
+	this->response.id = request.id;
+	this->response.status = 0;
+	this->response.bytes = 0;
+	this->response.output = request.output;
+}
+
+WebCron::WebCron(Scheduler *sched, size_t hostmax) :
+	sched(sched), hostmax(hostmax ? hostmax : 1), work(NULL), ctx(ssl::context::sslv23_client), threaded(false), pending(0) {
+	boost::system::error_code ec;
+
+	memset(&this->stats, 0, sizeof(this->stats));
+	pthread_mutex_init(&this->lock, NULL);
+	this->wake[0] = this->wake[1] = -1;
+	this->ctx.set_options(ssl::context::default_workarounds | ssl::context::no_sslv2 | ssl::context::no_sslv3);
+	this->ctx.set_default_verify_paths(ec);
+}
+
+WebCron::~WebCron() {
+	if (this->threaded) {
+		delete this->work;
+		this->io.stop();
+		pthread_join(this->thread, NULL);
+		this->sched->unwatchFd(this->wake[0]);
+	}
+	/* before the io_service their sockets belong to */
+	this->fetches.clear();
+	this->hosts.clear();
+	if (this->wake[0] != -1) {
+		::close(this->wake[0]);
+		::close(this->wake[1]);
+	}
+	pthread_mutex_destroy(&this->lock);
+}
+
+bool WebCron::isUrl(const char *cmd) {
+	return (strncmp(cmd, "http://", 7) == 0 || strncmp(cmd, "https://", 8) == 0);
+}
+
+bool WebCron::parseUrl(const string &url, Url &out) {
+	size_t start, end, colon;
+
+	if (url.compare(0, 7, "http://") == 0) {
+		out.tls = false;
+		start = 7;
+	} else if (url.compare(0, 8, "https://") == 0) {
+		out.tls = true;
+		start = 8;
+	} else
+		return (false);
+	if ((end = url.find_first_of("/?#", start)) == string::npos)
+		end = url.size();
+	/* no userinfo, and nothing that could break the request line */
+	if (url.find('@', start) < end || url.find_first_of(" \t\r\n") != string::npos)
+		return (false);
+	if (url[start] == '[') {
+		/* [v6 address]:port */
+		if ((colon = url.find(']', start)) == string::npos || colon > end)
+			return (false);
+		out.host = url.substr(start + 1, colon - start - 1);
+		colon++;
+		if (colon != end && url[colon] != ':')
+			return (false);
+	} else {
+		if ((colon = url.find(':', start)) > end)
+			colon = end;
+		out.host = url.substr(start, colon - start);
+	}
+	if (out.host.empty())
+		return (false);
+	if (colon < end) {
+		out.port = url.substr(colon + 1, end - colon - 1);
+		if (out.port.empty() || out.port.find_first_not_of("0123456789") != string::npos || atoi(out.port.c_str()) > 65535)
+			return (false);
+	} else
+		out.port = out.tls ? "443" : "80";
+	out.target = end < url.size() && url[end] != '#' ? url.substr(end) : "/";
+	if (out.target[0] != '/')
+		out.target = "/" + out.target;
+	/* the fragment stays with the client */
+	if ((end = out.target.find('#')) != string::npos)
+		out.target.erase(end);
+	return (true);
+}
+
+bool WebCron::start() {
+	sigset_t all, old;
+	int err;
+
+	if (this->threaded)
+		return (true);
+	if (pipe(this->wake) != 0) {
+		ELOG("Can't make a pipe for URL jobs: %s", strerror(errno));
+		return (false);
+	}
+	fcntl(this->wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(this->wake[1], F_SETFD, FD_CLOEXEC);
+	fcntl(this->wake[0], F_SETFL, O_NONBLOCK);
+	this->work = new boost::asio::io_service::work(this->io);
+	/* signals are for the scheduler's thread, not this one */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&this->thread, NULL, WebCron::loop, this);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		ELOG("Can't start the thread for URL jobs: %s", strerror(err));
+		delete this->work;
+		this->work = NULL;
+		return (false);
+	}
+	this->threaded = true;
+	this->sched->watchFd(this->wake[0], boost::bind(&WebCron::processDone, this));
+	return (true);
+}
+
+void *WebCron::loop(void *arg) {
+	WebCron *web = (WebCron *)arg;
+
+	web->io.run();
+	return (NULL);
+}
+
+bool WebCron::fetch(const Request &request) {
+	Url url;
+
+	if (!this->threaded || !parseUrl(request.url, url))
+		return (false);
+	FetchPtr f(new Fetch(this->io, request, url));
+	this->pending++;
+	this->io.post(boost::bind(&WebCron::begin, this, f));
+	return (true);
+}
+
+void WebCron::cancel(Spawner::JobId id) {
+	if (this->threaded)
+		this->io.post(boost::bind(&WebCron::doCancel, this, id));
+}
+
+WebCron::Stats WebCron::getStats() {
+	Stats stats;
+
+	pthread_mutex_lock(&this->lock);
+	stats = this->stats;
+	pthread_mutex_unlock(&this->lock);
+	return (stats);
+}
+
+void WebCron::begin(FetchPtr f) {
+	string key = string(f->url.tls ? "https://" : "http://") + f->url.host + ":" + f->url.port;
+	Host &host = this->hosts[key];
+
+	host.key = key;
+	f->host = &host;
+	this->fetches[f->request.id] = f;
+	f->deadline.expires_from_now(boost::posix_time::seconds(f->request.timeout));
+	f->deadline.async_wait(boost::bind(&WebCron::timedOut, this, f, boost::asio::placeholders::error));
+	pthread_mutex_lock(&this->lock);
+	this->stats.requests++;
+	if (host.active >= this->hostmax)
+		this->stats.queued++;
+	pthread_mutex_unlock(&this->lock);
+	if (host.active >= this->hostmax)
+		host.waiting.push_back(f);
+	else
+		this->dispatch(f);
+}
+
+/* f's turn: on a kept connection if there is one */
+void WebCron::dispatch(FetchPtr f) {
+	Host *host = f->host;
+	string hostport;
+
+	f->active = true;
+	host->active++;
+	hostport = f->url.host.find(':') != string::npos ? "[" + f->url.host + "]" : f->url.host;
+	if (f->url.port != (f->url.tls ? "443" : "80"))
+		hostport += ":" + f->url.port;
+	f->head = f->request.method + " " + f->url.target + " HTTP/1.1\r\nHost: " + hostport +
+		"\r\nUser-Agent: tinjac\r\nAccept: */*\r\nConnection: keep-alive\r\n";
+	if (f->request.method != "GET" && f->request.method != "HEAD")
+		f->head += "Content-Length: 0\r\n";
+	f->head += "\r\n";
+	if (!host->idle.empty()) {
+		f->conn = host->idle.front();
+		host->idle.pop_front();
+		f->conn->busy = true;
+		f->conn->idle.cancel();
+		f->reused = true;
+		pthread_mutex_lock(&this->lock);
+		this->stats.reused++;
+		pthread_mutex_unlock(&this->lock);
+		this->send(f);
+		return;
+	}
+	this->connect(f);
+}
+
+void WebCron::connect(FetchPtr f) {
+	f->reused = false;
+	f->conn.reset(new Connection(this->io, this->ctx, f->host));
+	f->resolver.async_resolve(tcp::resolver::query(f->url.host, f->url.port),
+		boost::bind(&WebCron::resolved, this, f, boost::asio::placeholders::error, boost::asio::placeholders::iterator));
+}
+
+void WebCron::resolved(FetchPtr f, const boost::system::error_code &ec, tcp::resolver::iterator it) {
+	if (f->done)
+		return;
+	if (ec) {
+		this->fail(f, "can't resolve " + f->url.host, ec);
+		return;
+	}
+	boost::asio::async_connect(f->conn->stream.lowest_layer(), it,
+		boost::bind(&WebCron::connected, this, f, boost::asio::placeholders::error));
+}
+
+void WebCron::connected(FetchPtr f, const boost::system::error_code &ec) {
+	if (f->done)
+		return;
+	if (ec) {
+		this->fail(f, "can't connect to " + f->url.host, ec);
+		return;
+	}
+	pthread_mutex_lock(&this->lock);
+	this->stats.connections++;
+	pthread_mutex_unlock(&this->lock);
+	f->conn->stream.lowest_layer().set_option(tcp::no_delay(true));
+	if (!f->url.tls) {
+		this->send(f);
+		return;
+	}
+	/* SNI, and the certificate has to be for this host */
+	SSL_set_tlsext_host_name(f->conn->stream.native_handle(), f->url.host.c_str());
+	f->conn->stream.set_verify_mode(ssl::verify_peer);
+	f->conn->stream.set_verify_callback(ssl::rfc2818_verification(f->url.host));
+	f->conn->stream.async_handshake(ssl::stream_base::client,
+		boost::bind(&WebCron::handshaken, this, f, boost::asio::placeholders::error));
+}
+
+void WebCron::handshaken(FetchPtr f, const boost::system::error_code &ec) {
+	if (f->done)
+		return;
+	if (ec) {
+		this->fail(f, "TLS handshake with " + f->url.host + " failed", ec);
+		return;
+	}
+	this->send(f);
+}
+
+void WebCron::send(FetchPtr f) {
+	write_all(f->conn->stream, f->url.tls, f->head,
+		boost::bind(&WebCron::sent, this, f, boost::asio::placeholders::error));
+}
+
+void WebCron::sent(FetchPtr f, const boost::system::error_code &ec) {
+	if (f->done)
+		return;
+	if (ec) {
+		this->fail(f, "can't send the request", ec);
+		return;
+	}
+	read_until(f->conn->stream, f->url.tls, f->conn->in, "\r\n\r\n",
+		boost::bind(&WebCron::gotHead, this, f, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
+
+void WebCron::gotHead(FetchPtr f, const boost::system::error_code &ec, size_t n) {
+	const char *data;
+	string head, line, value;
+	size_t start, end;
+	bool length = false, http10;
+	int status;
+
+	if (f->done)
+		return;
+	if (ec) {
+		this->fail(f, ec == boost::asio::error::not_found ? "the response headers are too big" : "no response", ec);
+		return;
+	}
+	f->started = true;
+	data = boost::asio::buffer_cast<const char *>(f->conn->in.data());
+	head.assign(data, n);
+	f->conn->in.consume(n);
+	if ((end = head.find("\r\n")) == string::npos || sscanf(head.c_str(), "HTTP/1.%*1d %3d", &status) != 1 || status < 100) {
+		this->fail(f, "a malformed response");
+		return;
+	}
+	/* an informational response comes before the real one */
+	if (status < 200) {
+		this->sent(f, ec);
+		return;
+	}
+	f->response.status = status;
+	http10 = head.compare(0, 8, "HTTP/1.0") == 0;
+	f->keepalive = !http10;
+	f->state = Fetch::CLOSE;
+	for (start = end + 2; start < head.size() && (end = head.find("\r\n", start)) != string::npos && end > start; start = end + 2) {
+		line = head.substr(start, end - start);
+		if (header(line, "Content-Length", value)) {
+			f->remaining = strtoull(value.c_str(), NULL, 10);
+			length = true;
+		} else if (header(line, "Transfer-Encoding", value) && strcasestr(value.c_str(), "chunked") != NULL)
+			f->state = Fetch::CHUNK_SIZE;
+		else if (header(line, "Connection", value)) {
+			if (strcasestr(value.c_str(), "close") != NULL)
+				f->keepalive = false;
+			else if (strcasestr(value.c_str(), "keep-alive") != NULL)
+				f->keepalive = true;
+		}
+	}
+	if (f->request.method == "HEAD" || status == 204 || status == 304) {
+		f->state = Fetch::LENGTH;
+		f->remaining = 0;
+	} else if (f->state != Fetch::CHUNK_SIZE && length)
+		f->state = Fetch::LENGTH;
+	/* the end of the body is the end of the connection */
+	if (f->state == Fetch::CLOSE)
+		f->keepalive = false;
+	this->pump(f);
+}
+
+void WebCron::gotData(FetchPtr f, const boost::system::error_code &ec, size_t n) {
+	if (f->done)
+		return;
+	f->conn->in.commit(n);
+	if (ec && !(is_eof(ec) && f->state == Fetch::CLOSE)) {
+		this->fail(f, "the response was cut short", ec);
+		return;
+	}
+	if (ec) {
+		f->response.output.feed(boost::asio::buffer_cast<const char *>(f->conn->in.data()), f->conn->in.size());
+		f->response.bytes += f->conn->in.size();
+		this->finish(f, false);
+		return;
+	}
+	this->pump(f);
+}
+
+/* as much of the body as has arrived, then read more if there is more */
+void WebCron::pump(FetchPtr f) {
+	boost::asio::streambuf &in = f->conn->in;
+	const char *data;
+	size_t n, eol;
+	string line;
+
+	for (;;) {
+		data = boost::asio::buffer_cast<const char *>(in.data());
+		switch (f->state) {
+		case Fetch::LENGTH:
+		case Fetch::CHUNK_DATA:
+		case Fetch::CLOSE:
+			n = f->state == Fetch::CLOSE ? in.size() : (size_t)min((unsigned long long)in.size(), f->remaining);
+			f->response.output.feed(data, n);
+			f->response.bytes += n;
+			in.consume(n);
+			if (f->state == Fetch::CLOSE)
+				break;
+			f->remaining -= n;
+			if (f->remaining > 0)
+				break;
+			if (f->state == Fetch::LENGTH) {
+				this->finish(f, f->keepalive && in.size() == 0);
+				return;
+			}
+			f->state = Fetch::CHUNK_END;
+			continue;
+		case Fetch::CHUNK_END:
+			if (in.size() < 2)
+				break;
+			in.consume(2);
+			f->state = Fetch::CHUNK_SIZE;
+			continue;
+		case Fetch::CHUNK_SIZE:
+		case Fetch::TRAILER:
+			line.assign(data, in.size());
+			if ((eol = line.find("\r\n")) == string::npos) {
+				if (in.size() > WEBCRON_CHUNK) {
+					this->fail(f, "a malformed chunk");
+					return;
+				}
+				break;
+			}
+			line.erase(eol);
+			in.consume(eol + 2);
+			if (f->state == Fetch::TRAILER) {
+				if (line.empty()) {
+					this->finish(f, f->keepalive && in.size() == 0);
+					return;
+				}
+				continue;
+			}
+			if (line.empty() || !isxdigit((unsigned char)line[0])) {
+				this->fail(f, "a malformed chunk");
+				return;
+			}
+			f->remaining = strtoull(line.c_str(), NULL, 16);
+			f->state = f->remaining == 0 ? Fetch::TRAILER : Fetch::CHUNK_DATA;
+			continue;
+		}
+		break;
+	}
+	read_some(f->conn->stream, f->url.tls, in,
+		boost::bind(&WebCron::gotData, this, f, boost::asio::placeholders::error, boost::asio::placeholders::bytes_transferred));
+}
+
+void WebCron::timedOut(FetchPtr f, const boost::system::error_code &ec) {
+	if (ec == boost::asio::error::operation_aborted || f->done)
+		return;
+	this->fail(f, "timed out");
+}
+
+void WebCron::doCancel(Spawner::JobId id) {
+	map<Spawner::JobId, FetchPtr>::iterator it = this->fetches.find(id);
+
+	if (it != this->fetches.end())
+		this->fail(it->second, "cancelled");
+}
+
+void WebCron::fail(FetchPtr f, const string &error, const boost::system::error_code &ec) {
+	deque<FetchPtr>::iterator it;
+
+	/* a kept connection the server had given up on; try a new one */
+	if (f->reused && !f->started && ec && error != "timed out") {
+		this->close(f->conn);
+		this->connect(f);
+		return;
+	}
+	f->response.error = ec ? error + ": " + ec.message() : error;
+	if (!f->active) {
+		/* still waiting its turn */
+		for (it = f->host->waiting.begin(); it != f->host->waiting.end(); ++it)
+			if (*it == f) {
+				f->host->waiting.erase(it);
+				break;
+			}
+	}
+	pthread_mutex_lock(&this->lock);
+	this->stats.failed++;
+	pthread_mutex_unlock(&this->lock);
+	f->response.status = 0;
+	this->finish(f, false);
+}
+
+/* queue f's response, and hand its connection on or close it */
+void WebCron::finish(FetchPtr f, bool keep) {
+	Host *host = f->host;
+	ConnectionPtr conn = f->conn;
+	char c = 0;
+
+	f->done = true;
+	f->deadline.cancel();
+	f->resolver.cancel();
+	/* f keeps conn until its last handler has run, aborted or not */
+	this->fetches.erase(f->request.id);
+	if (conn && keep) {
+		conn->busy = false;
+		host->idle.push_front(conn);
+		conn->idle.expires_from_now(boost::posix_time::seconds(WEBCRON_KEEPALIVE));
+		conn->idle.async_wait(boost::bind(&WebCron::idleOut, this, conn, boost::asio::placeholders::error));
+	} else if (conn)
+		this->close(conn);
+	f->response.output.finish();
+	gettimeofday(&f->response.finished, NULL);
+	pthread_mutex_lock(&this->lock);
+	this->finished.push_back(f->response);
+	pthread_mutex_unlock(&this->lock);
+	while (::write(this->wake[1], &c, 1) < 0 && errno == EINTR)
+		;
+	if (f->active) {
+		host->active--;
+		if (!host->waiting.empty()) {
+			FetchPtr next = host->waiting.front();
+			host->waiting.pop_front();
+			this->dispatch(next);
+		}
+	}
+}
+
+void WebCron::idleOut(ConnectionPtr conn, const boost::system::error_code &ec) {
+	list<ConnectionPtr>::iterator it;
+
+	/* or it was taken just as the timer went off */
+	if (ec == boost::asio::error::operation_aborted || conn->busy)
+		return;
+	for (it = conn->host->idle.begin(); it != conn->host->idle.end(); ++it)
+		if (*it == conn) {
+			conn->host->idle.erase(it);
+			break;
+		}
+	this->close(conn);
+}
+
+/* anything still waiting on it finishes with operation_aborted */
+void WebCron::close(ConnectionPtr conn) {
+	boost::system::error_code ec;
+
+	conn->stream.lowest_layer().close(ec);
+}
+
+void WebCron::processDone() {
+	deque<Response> ready;
+	char buf[256];
+
+	while (::read(this->wake[0], buf, sizeof(buf)) > 0)
+		;
+	pthread_mutex_lock(&this->lock);
+	ready.swap(this->finished);
+	pthread_mutex_unlock(&this->lock);
+	for (deque<Response>::iterator it = ready.begin(); it != ready.end(); ++it) {
+		this->pending--;
+		if (this->done)
+			this->done(*it);
+	}
+}
@@ -0,0 +1,160 @@
+/*
+ *  bench-crontabcache.cpp
+ *  Tinjac
+ *
+ *  Startup cost of loading a directory of system crontabs by parsing
+ *  every file, against loading them from a CrontabCache saved by the
+ *  first run. The floor is stat()ing each file, which the cache still
+ *  has to do to know it is up to date. Both runs must end up with the
+ *  same entries.
+ *
+ *  usage: bench-crontabcache [entries] [files] [rounds]
+ *
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "log.hpp"
+#include "crontabs.hpp"
+#include "crontabcache.hpp"
+#include "crontabparser.hpp"
+#include "usercache.hpp"
+
+using namespace std;
+
+Log *logFacility;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static const char *samples[] = {
+	"%d * * * * root /usr/bin/hourly --job %d\n",
+	"%d %d * * * root /usr/bin/daily --job %d\n",
+	"%d %d * * 1-5 root /usr/bin/weekdays --job %d\n",
+	"*/15 * * * * root /usr/bin/quarter --job %d\n",
+	"%d */6 * * * root /usr/bin/sixhourly --job %d\n",
+	"%d %d 1 * * root /usr/bin/monthly --job %d\n",
+};
+
+/* load the directory, through the cache if there is one */
+static double load(const string &dir, CrontabCache *cache, size_t *entries, unsigned long *parses) {
+	UserCache users;
+	crontabs tabs;
+	double t = now();
+
+	tabs.setUserCache(&users);
+	if (cache) {
+		cache->open();
+		tabs.setCache(cache);
+	}
+	tabs.setPath(dir, true);
+	t = now() - t;
+	if (cache) {
+		cache->close();
+		tabs.saveCache();
+	}
+	*entries = tabs.countEntries();
+	*parses = tabs.getParseCount();
+	return t;
+}
+
+int main(int argc, char *argv[]) {
+	int entries = argc > 1 ? atoi(argv[1]) : 20000;
+	int nfiles = argc > 2 ? atoi(argv[2]) : 200;
+	int rounds = argc > 3 ? atoi(argv[3]) : 5;
+	char tmpl[] = "/tmp/bench-crontabcache.XXXXXX";
+	vector<string> files;
+	string dir, cachefile;
+	unsigned int seed = 1;
+	unsigned long parses;
+	size_t parsedcount = 0, cachedcount = 0;
+	double parse = 1e9, cached = 1e9, stats = 1e9, save, t;
+	struct stat st;
+	char line[256];
+	int i, r;
+
+	logFacility = new Log((char *)"/dev/null");
+	if (mkdtemp(tmpl) == NULL) {
+		perror("mkdtemp");
+		return 1;
+	}
+	dir = tmpl;
+	cachefile = dir + ".cache";
+	for (i = 0; i < nfiles; i++) {
+		snprintf(line, sizeof(line), "%s/job%04d", dir.c_str(), i);
+		files.push_back(line);
+		FILE *fp = fopen(line, "w");
+		fprintf(fp, "MAILTO=team%d\nPATH=/usr/local/bin:/usr/bin:/bin\n", i % 10);
+		for (int j = i; j < entries; j += nfiles) {
+			const char *s = samples[j % (sizeof(samples) / sizeof(samples[0]))];
+			int a = rand_r(&seed) % 60, b = rand_r(&seed) % 24;
+			if (!strncmp(s, "*/", 2))
+				snprintf(line, sizeof(line), s, j);
+			else if (!strncmp(s, "%d * ", 5) || !strncmp(s, "%d */", 5))
+				snprintf(line, sizeof(line), s, a, j);
+			else
+				snprintf(line, sizeof(line), s, a, b, j);
+			fputs(line, fp);
+		}
+		fclose(fp);
+	}
+
+	/* the first load parses everything and writes the cache */
+	{
+		CrontabCache cache(cachefile);
+		t = now();
+		load(dir, &cache, &parsedcount, &parses);
+		save = now() - t;
+	}
+	for (r = 0; r < rounds; r++) {
+		size_t count;
+		t = load(dir, NULL, &count, &parses);
+		if (t < parse)
+			parse = t;
+		parsedcount = count;
+
+		CrontabCache cache(cachefile);
+		t = load(dir, &cache, &count, &parses);
+		if (parses != 0) {
+			fprintf(stderr, "%lu crontabs were parsed with the cache\n", parses);
+			return 1;
+		}
+		if (t < cached)
+			cached = t;
+		cachedcount = count;
+
+		t = now();
+		for (i = 0; i < nfiles; i++)
+			stat(files[i].c_str(), &st);
+		t = now() - t;
+		if (t < stats)
+			stats = t;
+	}
+	if (parsedcount != cachedcount) {
+		fprintf(stderr, "parsed %lu entries, %lu from the cache\n", (unsigned long)parsedcount, (unsigned long)cachedcount);
+		return 1;
+	}
+
+	stat(cachefile.c_str(), &st);
+	printf("%lu entries in %d crontabs, cache is %luKB, best of %d\n",
+		(unsigned long)parsedcount, nfiles, (unsigned long)st.st_size / 1024, rounds);
+	printf("parse + save cache : %8.3f ms\n", save * 1000);
+	printf("parse everything   : %8.3f ms\n", parse * 1000);
+	printf("load from cache    : %8.3f ms\n", cached * 1000);
+	printf("stat() every file  : %8.3f ms\n", stats * 1000);
+	printf("speedup            : %8.2fx\n", parse / cached);
+
+	for (i = 0; i < nfiles; i++)
+		unlink(files[i].c_str());
+	rmdir(dir.c_str());
+	unlink(cachefile.c_str());
+	return 0;
+}
@@ -0,0 +1,834 @@
+/*
+ *  bench-crontabparser.cpp
+ *  Tinjac
+ *
+ *  Parse throughput of the buffer based CrontabParser against the
+ *  original stdio getc()/ungetc() loader it replaced. The legacy loader
+ *  is kept here verbatim (as it was in crontabs.cpp) purely as the
+ *  baseline; both loaders must produce identical entries. malloc() is
+ *  wrapped to count the allocations each one makes, and freeing the
+ *  legacy entries one by one is timed against dropping the arena the
+ *  new ones were loaded into.
+ *
+ *  usage: bench-crontabparser [lines] [rounds] [-s]
+ *    -s  parse as a system crontab (the legacy loader does getpwnam()
+ *        per line, the new one goes through a UserCache)
+ *
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include "log.hpp"
+#include "env.hpp"
+#include "misc.hpp"
+#include "mappedfile.hpp"
+#include "crontabparser.hpp"
+#include "usercache.hpp"
+#include "arena.hpp"
+
+using namespace std;
+
+Log *logFacility;
+
+/* count every allocation, strdup()s and the like inside libc included */
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t nmemb, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+static unsigned long allocs;
+
+extern "C" void *malloc(size_t size) {
+	allocs++;
+	return __libc_malloc(size);
+}
+extern "C" void *calloc(size_t nmemb, size_t size) {
+	allocs++;
+	return __libc_calloc(nmemb, size);
+}
+extern "C" void *realloc(void *ptr, size_t size) {
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+extern const char *MonthNames[];
+extern const char *DowNames[];
+
+typedef enum ecode {
+	e_none, e_minute, e_hour, e_dom, e_month, e_dow,
+	e_cmd, e_timespec, e_username, e_option, e_memory
+} ecode_e;
+
+static const char *ecodes[] = {
+	"no error",
+	"bad minute",
+	"bad hour",
+	"bad day-of-month",
+	"bad month",
+	"bad day-of-week",
+	"bad command",
+	"bad time specifier",
+	"bad username",
+	"bad option",
+	"out of memory"
+};
+
+class LegacyLoader {
+public:
+	LegacyLoader() : LineNumber(0) { }
+	entry *load_entry(FILE * file, void (*error_func) (), struct passwd *pw, char **envp, string fname);
+private:
+	int get_list(bitstr_t * bits, int low, int high, const char *names[], int ch, FILE * file);
+	int get_range(bitstr_t * bits, int low, int high, const char *names[], int ch, FILE * file);
+	int get_number(int *numptr, int low, const char *names[], int ch, FILE * file, const char *terms);
+	int set_element(bitstr_t * bits, int low, int high, int number);
+	void skip_comments(FILE * file);
+	int get_string(char *string, int size, FILE * file, const char *terms);
+	void unget_char(int ch, FILE * file);
+	int get_char(FILE * file);
+	int LineNumber;
+};
+
+/* the legacy loader's entries have their own env_copy() environments */
+static void free_legacy_entry(entry *e) {
+	env_free(e->envp);
+	e->envp = NULL;
+	free_entry(e);
+}
+
+/* return NULL if eof or syntax error occurs;
+ * otherwise return a pointer to a new entry.
+ */
+entry *LegacyLoader::load_entry(FILE * file, void (*error_func) (), struct passwd *pw, char **envp, string fname) {
+	/* this function reads one crontab entry -- the next -- from a file.
+	 * it skips any leading blank lines, ignores comments, and returns
+	 * NULL if for any reason the entry can't be read and parsed.
+	 *
+	 * the entry is also parsed here.
+	 *
+	 * syntax:
+	 *   user crontab:
+	 *  minutes hours doms months dows cmd\n
+	 *   system crontab (/etc/crontab):
+	 *  minutes hours doms months dows USERNAME cmd\n
+	 */
+
+	ecode_e ecode = e_none;
+	entry *e;
+	int ch;
+	char cmd[MAX_COMMAND];
+	char envstr[MAX_ENVSTR];
+	char **tenvp;
+
+	DLOG("load_entry()...about to eat comments in %s", fname.c_str());
+
+	skip_comments(file);
+
+	ch = get_char(file);
+	if (ch == EOF)
+		return (NULL);
+
+	/* ch is now the first useful character of a useful line.
+	 * it may be an @special or it may be the first character
+	 * of a list of minutes.
+	 */
+
+	e = (entry *) calloc(sizeof (entry), sizeof (char));
+
+	/* check for '-' as a first character, this option will disable
+	* writing a syslog message about command getting executed
+	*/
+	if (ch == '-') {
+	/* if we are editing system crontab or user uid is 0 (root)
+	* we are allowed to disable logging
+	*/
+		if (pw == NULL || pw->pw_uid == 0)
+			e->flags |= DONT_LOG;
+		else {
+			ELOG("Only Privileged Users can disable Logging in %s", fname.c_str());
+			ecode = e_option;
+			goto eof;
+		}
+		ch = get_char(file);
+		if (ch == EOF)
+			return NULL;
+	}
+
+	if (ch == '@') {
+		/* all of these should be flagged and load-limited; i.e.,
+		 * instead of @hourly meaning "0 * * * *" it should mean
+		 * "close to the front of every hour but not 'til the
+		 * system load is low".  Problems are: how do you know
+		 * what "low" means? (save me from /etc/cron.conf!) and:
+		 * how to guarantee low variance (how low is low?), which
+		 * means how to we run roughly every hour -- seems like
+		 * we need to keep a history or let the first hour set
+		 * the schedule, which means we aren't load-limited
+		 * anymore.  too much for my overloaded brain. (vix, jan90)
+		 * HINT
+		 */
+		ch = get_string(cmd, MAX_COMMAND, file, " \t\n");
+		if (!strcmp("reboot", cmd)) {
+			e->flags |= WHEN_REBOOT;
+		}
+		else if (!strcmp("yearly", cmd) || !strcmp("annually", cmd)) {
+			bit_set(e->minute, 0);
+			bit_set(e->hour, 0);
+			bit_set(e->dom, 0);
+			bit_set(e->month, 0);
+			bit_nset(e->dow, 0, (LAST_DOW - FIRST_DOW + 1));
+			e->flags |= DOW_STAR;
+		}
+		else if (!strcmp("monthly", cmd)) {
+			bit_set(e->minute, 0);
+			bit_set(e->hour, 0);
+			bit_set(e->dom, 0);
+			bit_nset(e->month, 0, (LAST_MONTH - FIRST_MONTH + 1));
+			bit_nset(e->dow, 0, (LAST_DOW - FIRST_DOW + 1));
+			e->flags |= DOW_STAR;
+		}
+		else if (!strcmp("weekly", cmd)) {
+			bit_set(e->minute, 0);
+			bit_set(e->hour, 0);
+			bit_nset(e->dom, 0, (LAST_DOM - FIRST_DOM + 1));
+			bit_nset(e->month, 0, (LAST_MONTH - FIRST_MONTH + 1));
+			bit_set(e->dow, 0);
+			e->flags |= DOW_STAR;
+		}
+		else if (!strcmp("daily", cmd) || !strcmp("midnight", cmd)) {
+			bit_set(e->minute, 0);
+			bit_set(e->hour, 0);
+			bit_nset(e->dom, 0, (LAST_DOM - FIRST_DOM + 1));
+			bit_nset(e->month, 0, (LAST_MONTH - FIRST_MONTH + 1));
+			bit_nset(e->dow, 0, (LAST_DOW - FIRST_DOW + 1));
+		}
+		else if (!strcmp("hourly", cmd)) {
+			bit_set(e->minute, 0);
+			bit_nset(e->hour, 0, (LAST_HOUR - FIRST_HOUR));
+			bit_nset(e->dom, 0, (LAST_DOM - FIRST_DOM));
+			bit_nset(e->month, 0, (LAST_MONTH - FIRST_MONTH));
+			bit_nset(e->dow, 0, (LAST_DOW - FIRST_DOW));
+			e->flags |= HR_STAR;
+		}
+		else {
+			ecode = e_timespec;
+			goto eof;
+		}
+		/* Advance past whitespace between shortcut and
+		 * username/command.
+		 */
+		Skip_Blanks(ch, file);
+		if (ch == EOF || ch == '\n') {
+			ecode = e_cmd;
+			goto eof;
+		}
+	}
+	else {
+		DLOG("load_entry()...about to parse numerics in %s", fname.c_str());
+
+		if (ch == '*')
+			e->flags |= MIN_STAR;
+		ch = get_list(e->minute, FIRST_MINUTE, LAST_MINUTE, PPC_NULL, ch, file);
+		if (ch == EOF) {
+			ecode = e_minute;
+			goto eof;
+		}
+
+		/* hours
+		 */
+
+		if (ch == '*')
+			e->flags |= HR_STAR;
+		ch = get_list(e->hour, FIRST_HOUR, LAST_HOUR, PPC_NULL, ch, file);
+		if (ch == EOF) {
+			ecode = e_hour;
+			goto eof;
+		}
+
+		/* DOM (days of month)
+		 */
+
+		if (ch == '*')
+			e->flags |= DOM_STAR;
+		ch = get_list(e->dom, FIRST_DOM, LAST_DOM, PPC_NULL, ch, file);
+		if (ch == EOF) {
+			ecode = e_dom;
+			goto eof;
+		}
+
+		/* month
+		 */
+		if (ch == '*')
+			e->flags |= MON_STAR;
+		ch = get_list(e->month, FIRST_MONTH, LAST_MONTH, MonthNames, ch, file);
+		if (ch == EOF) {
+			ecode = e_month;
+			goto eof;
+		}
+
+		/* DOW (days of week)
+		 */
+
+		if (ch == '*')
+			e->flags |= DOW_STAR;
+		ch = get_list(e->dow, FIRST_DOW, LAST_DOW, DowNames, ch, file);
+		if (ch == EOF) {
+			ecode = e_dow;
+			goto eof;
+		}
+	}
+
+	/* make sundays equivalent */
+	if (bit_test(e->dow, 0) || bit_test(e->dow, 7)) {
+		bit_set(e->dow, 0);
+		bit_set(e->dow, 7);
+	}
+
+	/* check for permature EOL and catch a common typo */
+	if (ch == '\n' || ch == '*') {
+		ecode = e_cmd;
+		goto eof;
+	}
+
+	/* ch is the first character of a command, or a username */
+	unget_char(ch, file);
+
+	if (!pw) {
+		char *username = cmd;	/* temp buffer */
+
+		DLOG("load_entry()...about to parse username in %s", fname.c_str());
+		ch = get_string(username, MAX_COMMAND, file, " \t\n");
+
+		DLOG("load_entry()...got %s in %s", username, fname.c_str());
+		if (ch == EOF || ch == '\n' || ch == '*') {
+			ecode = e_cmd;
+			goto eof;
+		}
+
+		pw = getpwnam(username);
+		if (pw == NULL) {
+			ecode = e_username;
+			goto eof;
+		}
+		DLOG("load_entry()...uid %ld, gid %ld",(long) pw->pw_uid, (long) pw->pw_gid);
+	}
+
+	if ((e->pwd = pw_dup(pw)) == NULL) {
+		ecode = e_memory;
+		goto eof;
+	}
+	bzero(e->pwd->pw_passwd, strlen(e->pwd->pw_passwd));
+
+	/* copy and fix up environment.  some variables are just defaults and
+	 * others are overrides.
+	 */
+	if ((e->envp = env_copy(envp)) == NULL) {
+		ecode = e_memory;
+		goto eof;
+	}
+	if (!env_get((char *)"SHELL", e->envp)) {
+		if (glue_strings(envstr, sizeof envstr, "SHELL", _PATH_BSHELL, '=')) {
+			if ((tenvp = env_set(e->envp, envstr)) == NULL) {
+				ecode = e_memory;
+				goto eof;
+			}
+			e->envp = tenvp;
+		}
+		else
+			ELOG("ERROR: can't set SHELL in %s", fname.c_str());
+	}
+	if (!env_get((char *)"HOME", e->envp)) {
+		if (glue_strings(envstr, sizeof envstr, "HOME", pw->pw_dir, '=')) {
+			if ((tenvp = env_set(e->envp, envstr)) == NULL) {
+				ecode = e_memory;
+				goto eof;
+			}
+			e->envp = tenvp;
+		}
+		else
+			ELOG("ERROR: can't set HOME in %s", fname.c_str());
+	}
+#ifndef LOGIN_CAP
+	/* If login.conf is in used we will get the default PATH later. */
+	if (!env_get((char *)"PATH", e->envp)) {
+		if (glue_strings(envstr, sizeof envstr, "PATH", _PATH_DEFPATH, '=')) {
+			if ((tenvp = env_set(e->envp, envstr)) == NULL) {
+				ecode = e_memory;
+				goto eof;
+			}
+			e->envp = tenvp;
+		}
+		else
+			ELOG("ERROR can't set PATH in %s", fname.c_str());
+	}
+#endif /* LOGIN_CAP */
+	if (glue_strings(envstr, sizeof envstr, "LOGNAME", pw->pw_name, '=')) {
+		if ((tenvp = env_set(e->envp, envstr)) == NULL) {
+			ecode = e_memory;
+			goto eof;
+		}
+		e->envp = tenvp;
+	}
+	else
+		ELOG("ERROR can't set LOGNAME in %s", fname.c_str());
+#if defined(BSD) || defined(__linux)
+	if (glue_strings(envstr, sizeof envstr, "USER", pw->pw_name, '=')) {
+		if ((tenvp = env_set(e->envp, envstr)) == NULL) {
+			ecode = e_memory;
+			goto eof;
+		}
+		e->envp = tenvp;
+	}
+	else
+		ELOG("ERROR can't set USER in %s", fname.c_str());
+#endif
+
+	DLOG("load_entry()...about to parse command in %s", fname.c_str());
+
+	/* Everything up to the next \n or EOF is part of the command...
+	 * too bad we don't know in advance how long it will be, since we
+	 * need to malloc a string for it... so, we limit it to MAX_COMMAND.
+	 */
+	ch = get_string(cmd, MAX_COMMAND, file, "\n");
+
+	/* a file without a \n before the EOF is rude, so we'll complain...
+	 */
+	if (ch == EOF) {
+		ecode = e_cmd;
+		goto eof;
+	}
+
+	/* got the command in the 'cmd' string; save it in *e.
+	 */
+	if ((e->cmd = strdup(cmd)) == NULL) {
+		ecode = e_memory;
+		goto eof;
+	}
+
+	DLOG("load_entry()...returning successfully from parsing %s", fname.c_str());
+
+		/* success, fini, return pointer to the entry we just created...
+		 */
+		return (e);
+
+  eof:
+	if (e->envp)
+		env_free(e->envp);
+	if (e->pwd)
+		free(e->pwd);
+	if (e->cmd)
+		free(e->cmd);
+	free(e);
+	while (ch != '\n' && !feof(file))
+		ch = get_char(file);
+	if (ecode != e_none && error_func)
+		//(*error_func) (ecodes[(int) ecode]);
+		ELOG("Error: %s in %s", ecodes[(int) ecode], fname.c_str());
+	return (NULL);
+}
+
+int LegacyLoader::get_list(bitstr_t * bits, int low, int high, const char *names[], int ch, FILE * file) {
+	int done;
+
+	/* we know that we point to a non-blank character here;
+	 * must do a Skip_Blanks before we exit, so that the
+	 * next call (or the code that picks up the cmd) can
+	 * assume the same thing.
+	 */
+
+	DLOG("%s", "get_list()...entered");
+
+	/* list = range {"," range}
+	 */
+	/* clear the bit string, since the default is 'off'.
+	 */
+	bit_nclear(bits, 0, (high - low + 1));
+
+	/* process all ranges
+	 */
+	done = FALSE;
+	while (!done) {
+		if (EOF == (ch = get_range(bits, low, high, names, ch, file)))
+			return (EOF);
+		if (ch == ',')
+			ch = get_char(file);
+		else
+			done = TRUE;
+	}
+
+	/* exiting.  skip to some blanks, then skip over the blanks.
+	 */
+	Skip_Nonblanks(ch, file)
+	Skip_Blanks(ch, file)
+
+	DLOG("get_list()...exiting w/ %02x", ch);
+
+	return (ch);
+}
+
+int LegacyLoader::get_range(bitstr_t * bits, int low, int high, const char *names[], int ch, FILE * file) {
+	/* range = number | number "-" number [ "/" number ]
+	 */
+
+	int i, num1, num2, num3;
+
+	DLOG("%s", "get_range()...entering, exit won't show");
+
+	if (ch == '*') {
+		/* '*' means "first-last" but can still be modified by /step
+		 */
+		num1 = low;
+		num2 = high;
+		ch = get_char(file);
+		if (ch == EOF)
+			return (EOF);
+	}
+	else {
+		ch = get_number(&num1, low, names, ch, file, ",- \t\n");
+		if (ch == EOF)
+			return (EOF);
+
+		if (ch != '-') {
+			/* not a range, it's a single number.
+			 */
+			if (EOF == set_element(bits, low, high, num1)) {
+				unget_char(ch, file);
+				return (EOF);
+			}
+			return (ch);
+		}
+		else {
+			/* eat the dash
+			 */
+			ch = get_char(file);
+			if (ch == EOF)
+				return (EOF);
+
+			/* get the number following the dash
+			 */
+			ch = get_number(&num2, low, names, ch, file, "/, \t\n");
+			if (ch == EOF || num1 > num2)
+				return (EOF);
+		}
+	}
+
+	/* check for step size
+	 */
+	if (ch == '/') {
+		/* eat the slash
+		 */
+		ch = get_char(file);
+		if (ch == EOF)
+			return (EOF);
+
+		/* get the step size -- note: we don't pass the
+		 * names here, because the number is not an
+		 * element id, it's a step size.  'low' is
+		 * sent as a 0 since there is no offset either.
+		 */
+		ch = get_number(&num3, 0, PPC_NULL, ch, file, ", \t\n");
+		if (ch == EOF || num3 == 0)
+			return (EOF);
+	}
+	else {
+		/* no step.  default==1.
+		 */
+		num3 = 1;
+	}
+
+	/* range. set all elements from num1 to num2, stepping
+	 * by num3.  (the step is a downward-compatible extension
+	 * proposed conceptually by bob@acornrc, syntactically
+	 * designed then implemented by paul vixie).
+	 */
+	for (i = num1; i <= num2; i += num3)
+		if (EOF == set_element(bits, low, high, i)) {
+			unget_char(ch, file);
+			return (EOF);
+		}
+
+	return (ch);
+}
+
+int LegacyLoader::get_number(int *numptr, int low, const char *names[], int ch, FILE * file, const char *terms) {
+	char temp[MAX_TEMPSTR], *pc;
+	int len, i;
+
+	pc = temp;
+	len = 0;
+
+	/* first look for a number */
+	while (isdigit((unsigned char) ch)) {
+		if (++len >= MAX_TEMPSTR)
+			goto bad;
+		*pc++ = ch;
+		ch = get_char(file);
+	}
+	*pc = '\0';
+	if (len != 0) {
+		/* got a number, check for valid terminator */
+		if (!strchr(terms, ch))
+			goto bad;
+		*numptr = atoi(temp);
+		return (ch);
+	}
+
+	/* no numbers, look for a string if we have any */
+	if (names) {
+		while (isalpha((unsigned char) ch)) {
+			if (++len >= MAX_TEMPSTR)
+				goto bad;
+			*pc++ = ch;
+			ch = get_char(file);
+		}
+		*pc = '\0';
+		if (len != 0 && strchr(terms, ch)) {
+			for (i = 0; names[i] != NULL; i++) {
+				DLOG("get_num, compare(%s,%s)", names[i], temp);
+				if (!strcasecmp(names[i], temp)) {
+					*numptr = i + low;
+					return (ch);
+				}
+			}
+		}
+	}
+
+  bad:
+	unget_char(ch, file);
+	return (EOF);
+}
+
+int LegacyLoader::set_element(bitstr_t * bits, int low, int high, int number) {
+	DLOG("set_element(?,%d,%d,%d)", low, high, number);
+
+	if (number < low || number > high)
+		return (EOF);
+
+	bit_set(bits, (number - low));
+	return (OK);
+}
+
+
+/* get_char(file) : like getc() but increment LineNumber on newlines
+ */
+int LegacyLoader::get_char(FILE * file) {
+	int ch;
+
+	ch = getc(file);
+	if (ch == '\n')
+		Set_LineNum(LineNumber + 1)
+	return (ch);
+}
+
+/* unget_char(ch, file) : like ungetc but do LineNumber processing
+ */
+void LegacyLoader::unget_char(int ch, FILE * file) {
+	ungetc(ch, file);
+	if (ch == '\n')
+		Set_LineNum(LineNumber - 1)
+}
+
+/* get_string(str, max, file, termstr) : like fgets() but
+ *      (1) has terminator string which should include \n
+ *      (2) will always leave room for the null
+ *      (3) uses get_char() so LineNumber will be accurate
+ *      (4) returns EOF or terminating character, whichever
+ */
+int LegacyLoader::get_string(char *string, int size, FILE * file, const char *terms) {
+	int ch;
+
+	while (EOF != (ch = get_char(file)) && !strchr(terms, ch)) {
+		if (size > 1) {
+			*string++ = (char) ch;
+			size--;
+		}
+	}
+
+	if (size > 0)
+		*string = '\0';
+
+	return (ch);
+}
+
+/* skip_comments(file) : read past comment (if any)
+ */
+void LegacyLoader::skip_comments(FILE * file) {
+	int ch;
+
+	while (EOF != (ch = get_char(file))) {
+		/* ch is now the first character of a line.
+		 */
+		while (ch == ' ' || ch == '\t')
+			ch = get_char(file);
+
+		if (ch == EOF)
+			break;
+
+		/* ch is now the first non-blank character of a line.
+		 */
+
+		if (ch != '\n' && ch != '#')
+			break;
+
+		/* ch must be a newline or comment as first non-blank
+		 * character on a line.
+		 */
+
+		while (ch != '\n' && ch != EOF)
+			ch = get_char(file);
+
+		/* ch is now the newline of a line which we're going to
+		 * ignore.
+		 */
+	}
+	if (ch != EOF)
+		unget_char(ch, file);
+}
+
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* the legacy loader's @special handling sets one bit past the end of
+ * each field, so only compare the bits that are actually in range
+ */
+static bool same_bits(bitstr_t *a, bitstr_t *b, int count) {
+	for (int i = 0; i < count; i++)
+		if (!bit_test(a, i) != !bit_test(b, i))
+			return false;
+	return true;
+}
+
+static bool same_env(char **a, char **b) {
+	for (; *a != NULL && *b != NULL; a++, b++)
+		if (strcmp(*a, *b))
+			return false;
+	return *a == *b;
+}
+
+/* LOAD_LIMITED is the parser's own, the legacy loader never sets it */
+static bool same_entry(entry *a, entry *b) {
+	return same_bits(a->minute, b->minute, MINUTE_COUNT) && same_bits(a->hour, b->hour, HOUR_COUNT)
+		&& same_bits(a->dom, b->dom, DOM_COUNT) && same_bits(a->month, b->month, MONTH_COUNT)
+		&& same_bits(a->dow, b->dow, DOW_COUNT) && (a->flags & ~LOAD_LIMITED) == (b->flags & ~LOAD_LIMITED)
+		&& !strcmp(a->cmd, b->cmd)
+		&& a->pwd->pw_uid == b->pwd->pw_uid && same_env(a->envp, b->envp);
+}
+
+static const char *samples[] = {
+	"*/5 * * * * %s/usr/bin/check --quiet\n",
+	"0 2 * * sun %s/usr/local/bin/backup -a /srv\n",
+	"15,45 8-18 * * mon-fri %s/usr/bin/poll http://localhost/\n",
+	"@hourly %s/usr/sbin/logrotate /etc/logrotate.conf\n",
+	"30 4 1 jan,apr,jul,oct * %s/usr/bin/report > /dev/null 2>&1\n",
+	"# a comment line that both parsers have to skip\n",
+	"1-59/7 0-23/3 1-31/2 * * %s/bin/echo hello world\n",
+	"\n",
+};
+
+int main(int argc, char *argv[]) {
+	int lines = argc > 1 ? atoi(argv[1]) : 20000;
+	int rounds = argc > 2 ? atoi(argv[2]) : 5;
+	bool system = argc > 3 && !strcmp(argv[3], "-s");
+	char tmpl[] = "/tmp/tinjac-bench-XXXXXX";
+	char line[256];
+	int fd, i, r;
+	size_t bytes = 0;
+
+	logFacility = new Log((char *)"/dev/null");
+	if ((fd = mkstemp(tmpl)) == -1) {
+		perror("mkstemp");
+		return 1;
+	}
+	for (i = 0; i < lines; i++) {
+		snprintf(line, sizeof(line), samples[i % (sizeof(samples) / sizeof(samples[0]))], system ? "root " : "");
+		bytes += ::write(fd, line, strlen(line));
+	}
+	::close(fd);
+
+	struct passwd *pw = system ? NULL : getpwuid(getuid());
+	char **envp = env_init();
+	vector<entry *> a, b;
+	UserCache users;
+	double legacy = 0, mapped = 0, t;
+	double legacyfree = 0, arenafree = 0;
+	unsigned long legacyallocs = 0, mappedallocs = 0, start;
+	size_t envs = 0;
+
+	for (r = 0; r < rounds; r++) {
+		start = allocs;
+		t = now();
+		{
+			FILE *file = fopen(tmpl, "r");
+			LegacyLoader loader;
+			entry *e;
+			while (!feof(file))
+				if ((e = loader.load_entry(file, NULL, pw, envp, tmpl)) != NULL)
+					a.push_back(e);
+			fclose(file);
+		}
+		legacy += now() - t;
+		legacyallocs += allocs - start;
+
+		start = allocs;
+		t = now();
+		Arena *arena = new Arena();
+		{
+			MappedFile file;
+			file.open(tmpl);
+			CrontabParser parser(file.data(), file.size(), tmpl);
+			parser.setUserCache(&users);
+			parser.setArena(arena);
+			entry *e;
+			while (!parser.eof())
+				if ((e = parser.load_entry(pw, envp)) != NULL)
+					b.push_back(e);
+		}
+		mapped += now() - t;
+		mappedallocs += allocs - start;
+		envs = env_interned();
+
+		if (a.size() != b.size()) {
+			fprintf(stderr, "entry count mismatch: legacy %lu, mapped %lu\n", (unsigned long)a.size(), (unsigned long)b.size());
+			return 1;
+		}
+		for (i = 0; i < (int)a.size(); i++) {
+			if (!same_entry(a[i], b[i])) {
+				fprintf(stderr, "entry %d differs between loaders\n", i);
+				return 1;
+			}
+		}
+		/* the arena goes first: freeing a big block makes malloc
+		 * consolidate whatever small ones were freed before it, which
+		 * would bill the legacy entries' cleanup to the arena
+		 */
+		t = now();
+		delete arena;
+		arenafree += now() - t;
+		t = now();
+		for (i = 0; i < (int)a.size(); i++)
+			free_legacy_entry(a[i]);
+		legacyfree += now() - t;
+		a.clear();
+		b.clear();
+	}
+	unlink(tmpl);
+	env_free(envp);
+
+	printf("%d lines (%lu bytes) x %d rounds, %s crontab\n", lines, (unsigned long)bytes, rounds, system ? "system" : "user");
+	printf("legacy stdio : %8.3f ms/file %10.0f lines/s %7.1f MB/s\n", legacy * 1000 / rounds, lines * rounds / legacy, bytes * rounds / legacy / 1e6);
+	printf("mapped cursor: %8.3f ms/file %10.0f lines/s %7.1f MB/s\n", mapped * 1000 / rounds, lines * rounds / mapped, bytes * rounds / mapped / 1e6);
+	printf("speedup      : %8.2fx\n", legacy / mapped);
+	printf("free         : legacy %8.3f ms/file, arena %8.3f ms/file\n", legacyfree * 1000 / rounds, arenafree * 1000 / rounds);
+	printf("allocations  : legacy %.2f/line, mapped %.2f/line\n", (double)legacyallocs / rounds / lines, (double)mappedallocs / rounds / lines);
+	printf("environments : %lu shared\n", (unsigned long)envs);
+	printf("user cache   : %lu hits, %lu NSS lookups\n", users.getStats().hits, users.getStats().misses);
+	return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ *  bench-log.cpp
+ *  Tinjac
+ *
+ *  Lines a second through the Log, from one thread and from several at
+ *  once, written directly (as before start()) and through the ring, in
+ *  each format. "caller" is how fast the threads got their lines logged
+ *  (or dropped) and got back to work; "written" is how fast they reached
+ *  the file, including the writer catching up at stop().
+ *  Also what a DLOG costs when its level is turned off.
+ *
+ *  usage: bench-log [lines per thread] [threads] [file]
+ *
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "log.hpp"
+
+using namespace std;
+
+Log *logFacility;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+struct Job {
+	Log *log;
+	int lines;
+};
+
+/* something like a job finishing */
+static void *producer(void *arg) {
+	Job *job = (Job *)arg;
+	int i;
+
+	for (i = 0; i < job->lines; i++)
+		job->log->Write(LOGLEVEL_DEBUG, __FILE__, __LINE__, "Job %d (%s:%d pid %d) exited with status %d, user %d.%03ds",
+			i, "/etc/cron.d/backup", 12, 1000 + i, 0, i % 10, i % 1000);
+	return NULL;
+}
+
+static void run(const char *what, const char *file, Log::Format format, bool ring, int lines, int threads) {
+	Log log(file, 64 * 1024);
+	vector<pthread_t> tids(threads);
+	Job job = { &log, lines };
+	double t, caller, total;
+	unsigned long written;
+	int i;
+
+	log.setFormat(format);
+	if (ring)
+		log.start();
+	t = now();
+	for (i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, producer, &job);
+	for (i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	caller = now() - t;
+	log.stop();
+	total = now() - t;
+	written = log.getStats().written;
+	printf("%-24s %2d %12.0f %12.0f %10lu\n", what, threads, lines * threads / caller, written / total,
+		log.getStats().dropped);
+}
+
+int main(int argc, char *argv[]) {
+	int lines = argc > 1 ? atoi(argv[1]) : 200000;
+	int threads = argc > 2 ? atoi(argv[2]) : 4;
+	const char *file = argc > 3 ? argv[3] : "/tmp/bench-log.out";
+	int n, i;
+	double t;
+
+	logFacility = new Log((char *)"/dev/null");
+	printf("%d lines a thread to %s, lines/sec\n", lines, file);
+	printf("%-24s %2s %12s %12s %10s\n", "", "", "caller", "written", "dropped");
+	for (n = 1; n <= threads; n = n == threads ? n + 1 : min(n * 2, threads)) {
+		run("direct, text", file, Log::TEXT, false, lines, n);
+		run("ring, text", file, Log::TEXT, true, lines, n);
+		run("ring, kv", file, Log::KEYVALUE, true, lines, n);
+		run("ring, json", file, Log::JSON, true, lines, n);
+	}
+
+	logFacility->setLevel(LOGLEVEL_ERROR);
+	t = now();
+	for (i = 0; i < lines * 10; i++)
+		DLOG("load_entry()...parsed %s line %d", "bench", i);
+	t = now() - t;
+	printf("%-24s %2d %12.0f\n", "DLOG turned off", 1, lines * 10 / t);
+
+	delete logFacility;
+	unlink(file);
+	return 0;
+}
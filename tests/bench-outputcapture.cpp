@@ -0,0 +1,99 @@
+/*
+ *  bench-outputcapture.cpp
+ *  Tinjac
+ *
+ *  Throughput of an OutputCapture fed a chatty job's output in the
+ *  chunks the Supervisor reads, with no filter, one expression and a
+ *  keep/drop pipeline. Whatever the volume, what is kept must stay
+ *  within the head and tail.
+ *
+ *  usage: bench-outputcapture [megabytes] [rounds]
+ *
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/time.h>
+#include "outputcapture.hpp"
+
+using namespace std;
+
+/* what the Supervisor reads at a time */
+#define CHUNK	8192
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static const char *samples[] = {
+	"2010-06-01 03:00:%02d INFO backup: copied %d files\n",
+	"2010-06-01 03:00:%02d DEBUG rsync: sending incremental file list, %d entries\n",
+	"2010-06-01 03:00:%02d WARNING disk usage at %d%%\n",
+	"2010-06-01 03:00:%02d INFO backup: /var/lib/data/table%d.ibd unchanged\n",
+	"2010-06-01 03:00:%02d ERROR backup: can't read /home/user%d/.cache: permission denied\n",
+};
+
+/* feed total bytes of text through out, in CHUNK sized reads */
+static double run(const string &text, size_t total, OutputCapture &out) {
+	double t = now();
+	size_t done, off = 0, n;
+
+	for (done = 0; done < total; done += n) {
+		n = CHUNK;
+		if (off + n > text.size())
+			off = 0;
+		out.feed(text.data() + off, n);
+		off += n;
+	}
+	out.finish();
+	return now() - t;
+}
+
+int main(int argc, char *argv[]) {
+	size_t megs = argc > 1 ? atoi(argv[1]) : 256;
+	int rounds = argc > 2 ? atoi(argv[2]) : 3;
+	size_t total = megs * 1024 * 1024;
+	OutputFilter none, one, pipeline;
+	const OutputFilter *filters[] = { &none, &one, &pipeline };
+	const char *names[] = { "no filter", "keep ERROR|WARNING", "keep, then drop" };
+	double best[3] = { 1e9, 1e9, 1e9 };
+	size_t kept[3];
+	unsigned long dropped[3];
+	unsigned int seed = 1;
+	string text;
+	char line[256];
+	int i, r;
+
+	/* a few MB of log lines to go round */
+	while (text.size() < 4 * 1024 * 1024) {
+		i = rand_r(&seed) % (sizeof(samples) / sizeof(samples[0]));
+		snprintf(line, sizeof(line), samples[i], (int)(text.size() % 60), rand_r(&seed) % 1000);
+		text += line;
+	}
+	one.add("(ERROR|WARNING)", OutputFilter::KEEP);
+	pipeline.add("(ERROR|WARNING)", OutputFilter::KEEP);
+	pipeline.add("permission denied$", OutputFilter::DROP);
+
+	for (r = 0; r < rounds; r++) {
+		for (i = 0; i < 3; i++) {
+			OutputCapture out(CAPTURE_HEAD, CAPTURE_TAIL, filters[i]);
+			double t = run(text, total, out);
+			if (t < best[i])
+				best[i] = t;
+			kept[i] = out.text().size();
+			dropped[i] = out.getStats().dropped;
+			if (kept[i] > CAPTURE_HEAD + CAPTURE_TAIL + 64) {
+				fprintf(stderr, "%s kept %lu bytes\n", names[i], (unsigned long)kept[i]);
+				return 1;
+			}
+		}
+	}
+
+	printf("%luMB of output in %d byte reads, best of %d\n", (unsigned long)megs, CHUNK, rounds);
+	for (i = 0; i < 3; i++)
+		printf("%-20s: %8.1f MB/s, %lu lines dropped, %lu bytes kept\n",
+			names[i], megs / best[i], dropped[i], (unsigned long)kept[i]);
+	return 0;
+}
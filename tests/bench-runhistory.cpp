@@ -0,0 +1,106 @@
+/*
+ *  bench-runhistory.cpp
+ *  Tinjac
+ *
+ *  Runs a second through a RunHistory, committed a second's worth at a
+ *  time as the daemon does and committed after every run (a sync a
+ *  record, for comparison), how long reopening the history takes, and
+ *  what "the last 20 runs of a job" and a second of runs cost once
+ *  there are a lot of them.
+ *
+ *  usage: bench-runhistory [runs] [jobs] [directory]
+ *
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+#include <boost/filesystem.hpp>
+#include "log.hpp"
+#include "runhistory.hpp"
+
+using namespace std;
+
+Log *logFacility;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static string job(int i) {
+	char name[128];
+
+	snprintf(name, sizeof(name), "/etc/cron.d/app%d:www-data:/usr/local/bin/report --part %d", i / 10, i);
+	return (name);
+}
+
+static RunHistory::Run run(int i) {
+	RunHistory::Run r;
+
+	memset(&r, 0, sizeof(r));
+	r.started = 1275361200000000LL + (int64_t)i * 1000;
+	r.finished = r.started + 500;
+	r.utime = i % 1000;
+	r.maxrss = 2048;
+	r.digest = RunHistory::digest("done\n");
+	return (r);
+}
+
+/* runs added, committed every batch of them */
+static double add(const string &dir, int runs, int jobs, int batch) {
+	RunHistory history(dir);
+	double t;
+	int i;
+
+	boost::filesystem::remove_all(dir);
+	history.open();
+	t = now();
+	for (i = 0; i < runs; i++) {
+		history.add(job(i % jobs), run(i));
+		if ((i + 1) % batch == 0)
+			history.commit(0, true);
+	}
+	history.commit(0, true);
+	return (now() - t);
+}
+
+int main(int argc, char *argv[]) {
+	int runs = argc > 1 ? atoi(argv[1]) : 200000;
+	int jobs = argc > 2 ? atoi(argv[2]) : 1000;
+	string dir = argc > 3 ? argv[3] : "/tmp/bench-runhistory";
+	vector<pair<string, RunHistory::Run> > found;
+	vector<RunHistory::Run> last;
+	double t;
+	int i, queries = 100000;
+
+	logFacility = new Log((char *)"/dev/null");
+	printf("%d runs of %d jobs to %s\n", runs, jobs, dir.c_str());
+	t = add(dir, runs / 100, jobs, 1);
+	printf("%-24s %12.0f runs/sec\n", "a sync a run", runs / 100 / t);
+	t = add(dir, runs, jobs, 2000);
+	printf("%-24s %12.0f runs/sec\n", "a sync a second", runs / t);
+
+	RunHistory history(dir);
+	t = now();
+	history.open();
+	t = now() - t;
+	printf("%-24s %12.3f sec, %d runs kept\n", "reopened", t, (int)history.size());
+	t = now();
+	for (i = 0; i < queries; i++)
+		history.last(job(i % jobs), 20, last);
+	t = now() - t;
+	printf("%-24s %12.2f usec\n", "last 20 of a job", t / queries * 1e6);
+	t = now();
+	for (i = 0; i < queries / 100; i++)
+		history.between(run(runs - 1000 - i).finished, run(runs - i).finished, found);
+	t = now() - t;
+	printf("%-24s %12.2f usec, %d runs\n", "a second of runs", t / (queries / 100) * 1e6, (int)found.size());
+
+	delete logFacility;
+	boost::filesystem::remove_all(dir);
+	return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ *  bench-scheduler.cpp
+ *  Tinjac
+ *
+ *  Drives a large synthetic crontab through a simulated day with the
+ *  Scheduler, jumping the clock from one deadline to the next, and
+ *  compares the cost per tick with a cron style find_jobs() scan that
+ *  checks every entry once a minute. The scan is only run for a sample
+ *  of minutes and scaled up to a day, a full day of it at 1M entries
+ *  takes far too long. Both must agree on what fired in the sampled
+ *  minutes.
+ *
+ *  usage: bench-scheduler [entries] [scan minutes]
+ *
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+#include "log.hpp"
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "scheduler.hpp"
+
+using namespace std;
+
+Log *logFacility;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* a mix roughly like a real fleet: mostly hourly and daily jobs, some
+ * every few minutes, a few weekly and monthly ones
+ */
+static const char *samples[] = {
+	"%d * * * * /usr/bin/hourly\n",
+	"%d %d * * * /usr/bin/daily\n",
+	"%d %d * * * /usr/bin/daily\n",
+	"%d %d * * 1-5 /usr/bin/weekdays\n",
+	"*/15 * * * * /usr/bin/quarter\n",
+	"%d */6 * * * /usr/bin/sixhourly\n",
+	"%d %d * * 0 /usr/bin/weekly\n",
+	"%d %d 1 * * /usr/bin/monthly\n",
+	"%d %d * * * /usr/bin/daily\n",
+	"*/5 8-18 * * * /usr/bin/busy\n",
+};
+
+int main(int argc, char *argv[]) {
+	int entries = argc > 1 ? atoi(argv[1]) : 1000000;
+	int scanmins = argc > 2 ? atoi(argv[2]) : 10;
+	/* Monday 2021-01-04 00:00 UTC */
+	const time_t start = 1609718400;
+	const time_t end = start + 86400;
+	struct passwd *pw = getpwuid(0);
+	char **envp = env_init();
+	char line[256];
+	string tab;
+	unsigned int seed = 1;
+	int i;
+
+	logFacility = new Log((char *)"/dev/null");
+	setenv("TZ", "UTC", 1);
+	tzset();
+
+	for (i = 0; i < entries; i++) {
+		snprintf(line, sizeof(line), samples[i % (sizeof(samples) / sizeof(samples[0]))],
+			rand_r(&seed) % 60, rand_r(&seed) % 24);
+		tab += line;
+	}
+	CrontabFile *file = new CrontabFile("bench", NULL);
+	{
+		CrontabParser parser(tab.data(), tab.size(), "bench");
+		entry *e;
+		parser.setArena(&file->arena);
+		while (!parser.eof())
+			if ((e = parser.load_entry(pw, envp)) != NULL)
+				file->entries.push_back(e);
+	}
+	tab.clear();
+
+	Scheduler sched;
+	double t = now();
+	sched.addFile(file, start - 1);
+	double load = now() - t;
+
+	/* the simulated day: jump straight to each deadline */
+	vector<ScheduledJob *> due;
+	time_t clock, deadline;
+	size_t fired = 0, ticks = 0, sampled = 0;
+	t = now();
+	for (clock = start; (deadline = sched.nextDeadline()) != -1 && deadline < end; clock = deadline) {
+		due.clear();
+		fired += sched.runDue(deadline, due);
+		if (deadline < start + scanmins * 60)
+			sampled += due.size();
+		ticks++;
+	}
+	double day = now() - t;
+
+	/* the find_jobs() way: every entry, every minute, with cronie's
+	 * maketime() (setenv("TZ") and localtime()) per entry. getpwnam()
+	 * per entry is left out, it would only make the scan look worse.
+	 */
+	size_t scanned = 0;
+	const char *orig_tz = "UTC";
+	t = now();
+	for (clock = start; clock < start + scanmins * 60; clock += 60) {
+		for (i = 0; i < (int)file->entries.size(); i++) {
+			entry *e = file->entries[i];
+			char *job_tz = env_get((char *)"CRON_TZ", e->envp);
+			setenv("TZ", job_tz && *job_tz ? job_tz : orig_tz, 1);
+			struct tm *tm = localtime(&clock);
+			if (bit_test(e->minute, tm->tm_min) &&
+					bit_test(e->hour, tm->tm_hour) &&
+					bit_test(e->month, tm->tm_mon) &&
+					(((e->flags & DOM_STAR) || (e->flags & DOW_STAR))
+						? (bit_test(e->dow, tm->tm_wday) && bit_test(e->dom, tm->tm_mday - FIRST_DOM))
+						: (bit_test(e->dow, tm->tm_wday) || bit_test(e->dom, tm->tm_mday - FIRST_DOM))))
+				scanned++;
+		}
+	}
+	double scan = (now() - t) * (1440.0 / scanmins);
+	setenv("TZ", orig_tz, 1);
+
+	if (scanned != sampled) {
+		fprintf(stderr, "scheduler fired %lu jobs in the first %d minutes, scan found %lu\n",
+			(unsigned long)sampled, scanmins, (unsigned long)scanned);
+		return 1;
+	}
+
+	printf("%lu entries, %lu fired over a simulated day in %lu ticks\n",
+		(unsigned long)file->entries.size(), (unsigned long)fired, (unsigned long)ticks);
+	printf("initial schedule : %8.3f s (%6.2f us/entry)\n", load, load * 1e6 / file->entries.size());
+	printf("scheduler day    : %8.3f s (%6.2f us/fire, %8.3f ms/tick)\n", day, day * 1e6 / fired, day * 1000 / ticks);
+	printf("scan day (est.)  : %8.3f s (%8.3f ms/minute, from %d minutes)\n", scan, scan * 1000 / 1440, scanmins);
+	printf("speedup          : %8.2fx\n", scan / day);
+
+	sched.removeFile(file);
+	delete file;
+	env_free(envp);
+	return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ *  bench-spawner.cpp
+ *  Tinjac
+ *
+ *  Jobs started per second through the Spawner, against fork()ing the
+ *  daemon for each job the way cron's do_command() does, with small and
+ *  large crontab databases loaded. The Spawner's helper is started
+ *  before the entries are loaded, as the daemon does, so its rate should
+ *  not care how many there are; fork()ing has to copy the page tables of
+ *  everything loaded. Every job is "true" run by /bin/sh, with some
+ *  number kept in flight at once.
+ *
+ *  usage: bench-spawner [spawns] [in flight] [entries ...]
+ *
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <boost/bind.hpp>
+#include "log.hpp"
+#include "env.hpp"
+#include "arena.hpp"
+#include "crontabparser.hpp"
+#include "spawner.hpp"
+
+using namespace std;
+
+Log *logFacility;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* resident set size in MB */
+static double rss() {
+	long pages = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+
+	if (fp != NULL) {
+		if (fscanf(fp, "%ld %ld", &pages, &resident) != 2)
+			resident = 0;
+		fclose(fp);
+	}
+	return resident * (double)sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+static size_t done;
+
+static void exited(Spawner::JobId id, pid_t, int status, const struct rusage *) {
+	if (status != 0)
+		fprintf(stderr, "job %lu exited with %d\n", id, status);
+	done++;
+}
+
+static double with_spawner(Spawner &spawner, const entry *e, int spawns, int inflight) {
+	struct pollfd pfd;
+	int sent = 0;
+	double t = now();
+
+	done = 0;
+	while (done < (size_t)spawns) {
+		while (sent < spawns && sent - (int)done < inflight) {
+			if (spawner.spawn(e) == 0)
+				return -1;
+			sent++;
+		}
+		pfd.fd = spawner.getFd();
+		pfd.events = POLLIN;
+		poll(&pfd, 1, -1);
+		spawner.processReplies();
+	}
+	return spawns / (now() - t);
+}
+
+/* cron's way: fork the daemon and exec the job from the copy */
+static double with_fork(const entry *e, int spawns, int inflight) {
+	char *argv[] = { (char *)"/bin/sh", (char *)"-c", e->cmd, NULL };
+	int sent = 0, running = 0, status;
+	size_t reaped = 0;
+	double t = now();
+	pid_t pid;
+
+	while (reaped < (size_t)spawns) {
+		while (sent < spawns && running < inflight) {
+			if ((pid = fork()) == 0) {
+				execve(argv[0], argv, e->envp);
+				_exit(127);
+			}
+			if (pid < 0)
+				return -1;
+			sent++;
+			running++;
+		}
+		if (wait(&status) > 0) {
+			if (status != 0)
+				fprintf(stderr, "job exited with %d\n", status);
+			running--;
+			reaped++;
+		}
+	}
+	return spawns / (now() - t);
+}
+
+int main(int argc, char *argv[]) {
+	int spawns = argc > 1 ? atoi(argv[1]) : 2000;
+	int inflight = argc > 2 ? atoi(argv[2]) : 16;
+	vector<int> sizes;
+	struct passwd *pw = getpwuid(getuid());
+	char **envp = env_init();
+	int i;
+
+	logFacility = new Log((char *)"/dev/null");
+	for (i = 3; i < argc; i++)
+		sizes.push_back(atoi(argv[i]));
+	if (sizes.empty()) {
+		sizes.push_back(10000);
+		sizes.push_back(1000000);
+	}
+
+	printf("%d spawns of \"true\", %d in flight\n", spawns, inflight);
+	printf("%10s %10s %14s %14s\n", "entries", "RSS MB", "spawner/s", "fork/s");
+	for (vector<int>::iterator size = sizes.begin(); size != sizes.end(); ++size) {
+		Spawner spawner;
+		spawner.setExited(exited);
+		if (!spawner.start()) {
+			fprintf(stderr, "can't start the spawner\n");
+			return 1;
+		}
+
+		/* the database, loaded after the helper has been started */
+		Arena *arena = new Arena();
+		string tab;
+		char line[128];
+		for (i = 0; i < *size; i++) {
+			snprintf(line, sizeof(line), "%d %d * * * /usr/local/bin/job --number %d\n", i % 60, i % 24, i);
+			tab += line;
+		}
+		tab += "* * * * * true\n";
+		entry *e = NULL;
+		{
+			CrontabParser parser(tab.data(), tab.size(), "bench");
+			parser.setArena(arena);
+			while (!parser.eof())
+				e = parser.load_entry(pw, envp);
+		}
+		tab.clear();
+		string().swap(tab);
+
+		double spawned = with_spawner(spawner, e, spawns, inflight);
+		double forked = with_fork(e, spawns, inflight);
+		printf("%10d %10.1f %14.0f %14.0f\n", *size, rss(), spawned, forked);
+		spawner.stop();
+		delete arena;
+	}
+	env_free(envp);
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ *  bench-spread.cpp
+ *  Tinjac
+ *
+ *  Simulates an hour of a crontab full of jobs at the top of the hour
+ *  ("0 * * * *" and @hourly, with some every 15 minutes) through the
+ *  Scheduler, once as written and once with a 15 minute SPREAD, and
+ *  reports the peak number of jobs launched in one second and in any ten
+ *  seconds.
+ *  Then does the same across a fleet of hosts all running the same
+ *  crontab, where without a spread every host starts every job in the
+ *  same second.
+ *
+ *  usage: bench-spread [entries] [hosts]
+ *
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include "log.hpp"
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "scheduler.hpp"
+
+using namespace std;
+
+Log *logFacility;
+
+/* Monday 2021-01-04 00:00 UTC */
+static const time_t start = 1609718400;
+
+static const char *samples[] = {
+	"0 * * * * /usr/bin/hourly%d\n",
+	"@hourly /usr/bin/report%d\n",
+	"0 * * * * /usr/bin/sync%d\n",
+	"*/15 * * * * /usr/bin/poll%d\n",
+};
+
+struct Peaks {
+	size_t second, ten, busy;	/* busy: seconds with any launches */
+};
+
+/* the busiest second and ten seconds in a launches-per-second table */
+static Peaks peaks(const map<time_t, size_t> &launches) {
+	Peaks p = { 0, 0, 0 };
+	map<time_t, size_t>::const_iterator it, from;
+	size_t window = 0;
+
+	for (it = from = launches.begin(); it != launches.end(); ++it) {
+		p.second = max(p.second, it->second);
+		p.busy++;
+		window += it->second;
+		while (from->first <= it->first - 10)
+			window -= (from++)->second;
+		p.ten = max(p.ten, window);
+	}
+	return (p);
+}
+
+static CrontabFile *load(int entries, char **envp) {
+	struct passwd *pw = getpwuid(0);
+	CrontabFile *file = new CrontabFile("bench", NULL);
+	char line[256];
+	string tab;
+	entry *e;
+	int i;
+
+	for (i = 0; i < entries; i++) {
+		snprintf(line, sizeof(line), samples[i % (sizeof(samples) / sizeof(samples[0]))], i);
+		tab += line;
+	}
+	CrontabParser parser(tab.data(), tab.size(), "bench");
+	parser.setArena(&file->arena);
+	while (!parser.eof())
+		if ((e = parser.load_entry(pw, envp)) != NULL)
+			file->entries.push_back(e);
+	return (file);
+}
+
+/* an hour of one host's schedule, from just after the top of the hour */
+static Peaks simulate(CrontabFile *file) {
+	map<time_t, size_t> launches;
+	vector<ScheduledJob *> due;
+	Scheduler sched;
+	time_t deadline;
+
+	sched.addFile(file, start);
+	while ((deadline = sched.nextDeadline()) != -1 && deadline <= start + 3600) {
+		due.clear();
+		launches[deadline] += sched.runDue(deadline, due);
+	}
+	sched.removeFile(file);
+	return (peaks(launches));
+}
+
+/* the top of the hour across every host, from their spread offsets */
+static Peaks fleet(CrontabFile *file, int hosts) {
+	map<time_t, size_t> launches;
+	vector<entry *>::iterator e;
+	char host[32];
+	int h;
+
+	for (h = 0; h < hosts; h++) {
+		snprintf(host, sizeof(host), "host%04d", h);
+		for (e = file->entries.begin(); e != file->entries.end(); ++e)
+			launches[ScheduledJob::spreadOffset(*e, file->fname, host)]++;
+	}
+	return (peaks(launches));
+}
+
+static void report(const char *what, const Peaks &p) {
+	printf("%-28s %10lu %10lu %10lu\n", what, (unsigned long)p.second, (unsigned long)p.ten, (unsigned long)p.busy);
+}
+
+int main(int argc, char *argv[]) {
+	int entries = argc > 1 ? atoi(argv[1]) : 2000;
+	int hosts = argc > 2 ? atoi(argv[2]) : 100;
+	char **envp = env_init();
+	CrontabFile *plain, *spread;
+	char what[64];
+
+	logFacility = new Log((char *)"/dev/null");
+	setenv("TZ", "UTC", 1);
+	tzset();
+
+	plain = load(entries, envp);
+	envp = env_set(envp, (char *)"SPREAD=15m");
+	spread = load(entries, envp);
+
+	printf("%d entries over a simulated hour, launches per\n", entries);
+	printf("%-28s %10s %10s %10s\n", "", "second", "10 seconds", "busy secs");
+	report("as written", simulate(plain));
+	report("SPREAD=15m", simulate(spread));
+	snprintf(what, sizeof(what), "%d hosts, as written", hosts);
+	report(what, fleet(plain, hosts));
+	snprintf(what, sizeof(what), "%d hosts, SPREAD=15m", hosts);
+	report(what, fleet(spread, hosts));
+
+	delete plain;
+	delete spread;
+	env_free(envp);
+	return 0;
+}
@@ -0,0 +1,144 @@
+/*
+ *  bench-timezone.cpp
+ *  Tinjac
+ *
+ *  Matches a large crontab spread over a few CRON_TZ zones against a run
+ *  of minutes two ways: cronie's find_jobs(), which does maketime()
+ *  (setenv("TZ") and localtime()) for every entry, and with the entries
+ *  grouped by zone, converting the time once per zone per minute with a
+ *  TimeZone. Both must find the same jobs.
+ *
+ *  usage: bench-timezone [entries] [minutes]
+ *
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <sys/time.h>
+#include "log.hpp"
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "timezone.hpp"
+
+using namespace std;
+
+Log *logFacility;
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static const char *zonenames[] = {
+	"America/New_York",
+	"Europe/Berlin",
+	"Australia/Sydney",
+};
+
+static inline bool match(const entry *e, const struct tm *tm) {
+	return (bit_test(e->minute, tm->tm_min) &&
+		bit_test(e->hour, tm->tm_hour) &&
+		bit_test(e->month, tm->tm_mon) &&
+		(((e->flags & DOM_STAR) || (e->flags & DOW_STAR))
+			? (bit_test(e->dow, tm->tm_wday) && bit_test(e->dom, tm->tm_mday - FIRST_DOM))
+			: (bit_test(e->dow, tm->tm_wday) || bit_test(e->dom, tm->tm_mday - FIRST_DOM))));
+}
+
+int main(int argc, char *argv[]) {
+	int entries = argc > 1 ? atoi(argv[1]) : 50000;
+	int minutes = argc > 2 ? atoi(argv[2]) : 60;
+	const int nzones = sizeof(zonenames) / sizeof(zonenames[0]);
+	/* Monday 2021-01-04 00:00 UTC */
+	const time_t start = 1609718400;
+	struct passwd *pw = getpwuid(0);
+	char **envp = env_init();
+	char line[256], envstr[MAX_ENVSTR];
+	string tab;
+	unsigned int seed = 1;
+	vector<entry *> all;
+	time_t clock;
+	int i, z, status;
+
+	logFacility = new Log((char *)"/dev/null");
+	setenv("TZ", "UTC", 1);
+	tzset();
+
+	for (z = 0; z < nzones; z++) {
+		snprintf(line, sizeof(line), "CRON_TZ=%s\n", zonenames[z]);
+		tab += line;
+		for (i = z; i < entries; i += nzones) {
+			snprintf(line, sizeof(line), "%d * * * * /usr/bin/job\n", rand_r(&seed) % 60);
+			tab += line;
+		}
+	}
+	{
+		CrontabParser parser(tab.data(), tab.size(), "bench");
+		char **tenvp;
+		entry *e;
+		while ((status = parser.load_env(envstr)) >= OK) {
+			if (status == FALSE) {
+				if ((e = parser.load_entry(pw, envp)) != NULL)
+					all.push_back(e);
+			} else if ((tenvp = env_set(envp, envstr)) != NULL) {
+				envp = tenvp;
+			}
+		}
+	}
+	tab.clear();
+
+	/* the find_jobs() way */
+	size_t scanned = 0;
+	const char *orig_tz = "UTC";
+	double t = now();
+	for (clock = start; clock < start + minutes * 60; clock += 60) {
+		for (vector<entry *>::iterator it = all.begin(); it != all.end(); ++it) {
+			char *job_tz = env_get((char *)"CRON_TZ", (*it)->envp);
+			setenv("TZ", job_tz && *job_tz ? job_tz : orig_tz, 1);
+			if (match(*it, localtime(&clock)))
+				scanned++;
+		}
+	}
+	double scan = now() - t;
+	setenv("TZ", orig_tz, 1);
+	tzset();
+
+	/* grouped: one conversion per zone per minute */
+	map<TimeZone *, vector<entry *> > groups;
+	for (vector<entry *>::iterator it = all.begin(); it != all.end(); ++it) {
+		char *job_tz = env_get((char *)"CRON_TZ", (*it)->envp);
+		groups[TimeZone::get(job_tz ? job_tz : "")].push_back(*it);
+	}
+	size_t grouped = 0;
+	struct tm tm;
+	t = now();
+	for (clock = start; clock < start + minutes * 60; clock += 60) {
+		for (map<TimeZone *, vector<entry *> >::iterator g = groups.begin(); g != groups.end(); ++g) {
+			g->first->toWall(clock, &tm);
+			for (vector<entry *>::iterator it = g->second.begin(); it != g->second.end(); ++it)
+				if (match(*it, &tm))
+					grouped++;
+		}
+	}
+	double group = now() - t;
+
+	if (scanned != grouped) {
+		fprintf(stderr, "scan found %lu jobs, grouped found %lu\n",
+			(unsigned long)scanned, (unsigned long)grouped);
+		return 1;
+	}
+
+	printf("%lu entries in %lu zones, %lu fired over %d minutes\n",
+		(unsigned long)all.size(), (unsigned long)groups.size(), (unsigned long)scanned, minutes);
+	printf("setenv+localtime : %8.3f s (%8.3f ms/minute, %6.3f us/entry)\n", scan, scan * 1000 / minutes, scan * 1e6 / minutes / all.size());
+	printf("grouped by zone  : %8.3f s (%8.3f ms/minute, %6.3f us/entry)\n", group, group * 1000 / minutes, group * 1e6 / minutes / all.size());
+	printf("speedup          : %8.2fx\n", scan / group);
+
+	for (vector<entry *>::iterator it = all.begin(); it != all.end(); ++it)
+		free_entry(*it);
+	env_free(envp);
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ *  gtest-admission_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "gtest-entry_fixture.hpp"
+#include "scheduler.hpp"
+#include "admission.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			class AdmissionTest : public EntryTest {
+				protected:
+					virtual void SetUp() {
+						char dir[] = "/tmp/tinjac-admission.XXXXXX";
+
+						EntryTest::SetUp();
+						ASSERT_TRUE(mkdtemp(dir) != NULL);
+						this->proc = dir;
+						boost::filesystem::create_directory(this->proc + "/pressure");
+						this->write("loadavg", "0.10 0.20 0.30 1/100 1234\n");
+						this->write("pressure/cpu", "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+						this->write("pressure/io", "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\nfull avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+						this->write("pressure/memory", "some avg10=0.00 avg60=0.00 avg300=0.00 total=0\nfull avg10=0.00 avg60=0.00 avg300=0.00 total=0\n");
+						this->file = new CrontabFile("tab", NULL);
+						this->admission = new Admission(&this->sched, this->proc);
+						this->admission->setLaunch(boost::bind(&AdmissionTest::launched, this, _1, _2));
+					}
+					virtual void TearDown() {
+						delete this->admission;
+						delete this->file;
+						EntryTest::TearDown();
+						boost::filesystem::remove_all(this->proc);
+					}
+					void write(const char *name, const char *text) {
+						std::ofstream out((this->proc + "/" + name).c_str(), std::ios::trunc);
+						out << text;
+					}
+					void launched(const entry *e, const string &fname) {
+						this->launches.push_back(fname + ": " + e->cmd);
+					}
+				string proc;
+				CrontabFile *file;
+				Scheduler sched;
+				Admission *admission;
+				vector<string> launches;
+			};
+
+			TEST_F(AdmissionTest, ParsesTheProcFiles) {
+				double value;
+
+				EXPECT_TRUE(Admission::parseLoad("3.25 2.00 1.00 2/300 42\n", &value));
+				EXPECT_DOUBLE_EQ(3.25, value);
+				EXPECT_FALSE(Admission::parseLoad("", &value));
+				EXPECT_TRUE(Admission::parsePressure("some avg10=12.50 avg60=3.00 avg300=1.00 total=1\nfull avg10=99.00\n", &value));
+				EXPECT_DOUBLE_EQ(12.5, value);
+				EXPECT_FALSE(Admission::parsePressure("full avg10=1.00\n", &value));
+
+				const Admission::Sample &s = this->admission->sample(100);
+				EXPECT_DOUBLE_EQ(0.1, s.load);
+				EXPECT_DOUBLE_EQ(0, s.io);
+				/* the same second gets the same reading */
+				this->write("pressure/io", "some avg10=40.00 avg60=0.00 avg300=0.00 total=0\n");
+				EXPECT_DOUBLE_EQ(0, this->admission->sample(100).io);
+				EXPECT_DOUBLE_EQ(40, this->admission->sample(101).io);
+			}
+			TEST_F(AdmissionTest, StartsJobsWithoutLimits) {
+				this->write("loadavg", "100.00 100.00 100.00 1/100 1234\n");
+				EXPECT_TRUE(this->admission->admit(this->load("* * * * * /bin/true\n"), this->file, 100));
+				EXPECT_EQ(0u, this->admission->deferred());
+				EXPECT_EQ(-1, this->admission->nextCheck());
+				EXPECT_TRUE(this->admission->getStats().empty());
+			}
+			TEST_F(AdmissionTest, HoldsJobsUntilTheLoadDrops) {
+				this->envp = env_set(this->envp, (char *)"LOAD_MAX=2");
+				this->envp = env_set(this->envp, (char *)"JOB_CLASS=batch");
+				this->write("loadavg", "3.00 1.00 1.00 1/100 1234\n");
+				EXPECT_FALSE(this->admission->admit(this->load("* * * * * /bin/batch\n"), this->file, 100));
+				EXPECT_EQ(1u, this->admission->deferred());
+				EXPECT_EQ(100 + ADMIT_RECHECK, this->admission->nextCheck());
+				/* nothing to do before then */
+				this->admission->retry(101);
+				EXPECT_EQ(1u, this->admission->deferred());
+				this->admission->retry(100 + ADMIT_RECHECK);
+				EXPECT_EQ(100 + 2 * ADMIT_RECHECK, this->admission->nextCheck());
+				this->write("loadavg", "1.50 1.00 1.00 1/100 1234\n");
+				this->admission->retry(100 + 2 * ADMIT_RECHECK);
+				EXPECT_EQ(0u, this->admission->deferred());
+				ASSERT_EQ(1u, this->launches.size());
+				EXPECT_EQ("tab: /bin/batch", this->launches[0]);
+				const Admission::ClassStats &stats = this->admission->getStats().find("batch")->second;
+				EXPECT_EQ(0u, stats.admitted);
+				EXPECT_EQ(1u, stats.deferred);
+				EXPECT_EQ(1u, stats.released);
+				EXPECT_EQ(0u, stats.forced);
+				EXPECT_EQ((unsigned long)2 * ADMIT_RECHECK, stats.waited);
+			}
+			TEST_F(AdmissionTest, HoldsAnEntryOnlyOnce) {
+				this->envp = env_set(this->envp, (char *)"LOAD_MAX=2");
+				this->write("loadavg", "3.00 1.00 1.00 1/100 1234\n");
+				entry *e = this->load("* * * * * /bin/often\n");
+				int i;
+
+				/* due every minute while the load stays up */
+				for (i = 0; i < 5; i++)
+					EXPECT_FALSE(this->admission->admit(e, this->file, 100 + i * SECONDS_PER_MINUTE));
+				EXPECT_EQ(1u, this->admission->deferred());
+				const Admission::ClassStats &stats = this->admission->getStats().find("default")->second;
+				EXPECT_EQ(1u, stats.deferred);
+				EXPECT_EQ(4u, stats.skipped);
+				this->write("loadavg", "1.00 1.00 1.00 1/100 1234\n");
+				this->admission->retry(100 + 5 * SECONDS_PER_MINUTE);
+				/* one run, not a stampede of five */
+				EXPECT_EQ(1u, this->launches.size());
+				/* and once it has gone it can be held again */
+				this->write("loadavg", "3.00 1.00 1.00 1/100 1234\n");
+				EXPECT_FALSE(this->admission->admit(e, this->file, 100 + 6 * SECONDS_PER_MINUTE));
+				EXPECT_EQ(2u, stats.deferred);
+			}
+			TEST_F(AdmissionTest, NeverHoldsJobsPastDeferMax) {
+				this->envp = env_set(this->envp, (char *)"IO_PRESSURE_MAX=10");
+				this->envp = env_set(this->envp, (char *)"DEFER=delay");
+				this->envp = env_set(this->envp, (char *)"DEFER_DELAY=20");
+				this->envp = env_set(this->envp, (char *)"DEFER_MAX=30");
+				this->write("pressure/io", "some avg10=50.00 avg60=0.00 avg300=0.00 total=0\n");
+				EXPECT_FALSE(this->admission->admit(this->load("* * * * * /bin/io\n"), this->file, 100));
+				EXPECT_EQ(120, this->admission->nextCheck());
+				this->admission->retry(120);
+				/* the next delay would take it past DEFER_MAX */
+				EXPECT_EQ(130, this->admission->nextCheck());
+				this->admission->retry(130);
+				EXPECT_EQ(1u, this->launches.size());
+				const Admission::ClassStats &stats = this->admission->getStats().find("default")->second;
+				EXPECT_EQ(1u, stats.forced);
+				EXPECT_EQ(30, stats.maxwait);
+			}
+			TEST_F(AdmissionTest, JittersRetries) {
+				this->envp = env_set(this->envp, (char *)"MEMORY_PRESSURE_MAX=5");
+				this->envp = env_set(this->envp, (char *)"DEFER=jitter");
+				this->envp = env_set(this->envp, (char *)"DEFER_DELAY=10");
+				this->write("pressure/memory", "some avg10=6.00 avg60=0.00 avg300=0.00 total=0\n");
+				entry *e = this->load("* * * * * /bin/mem\n");
+				int i;
+
+				/* fifty different lines */
+				for (i = 0; i < 50; i++) {
+					e->lineno = i + 1;
+					EXPECT_FALSE(this->admission->admit(e, this->file, 100));
+				}
+				EXPECT_GE(this->admission->nextCheck(), 101);
+				/* spread over the next ten seconds, not all at once */
+				this->admission->retry(101);
+				EXPECT_LE(this->admission->nextCheck(), 110);
+				for (i = 102; i <= 110; i++)
+					this->admission->retry(i);
+				/* still busy, so they've all gone round again */
+				EXPECT_EQ(50u, this->admission->deferred());
+				EXPECT_GT(this->admission->nextCheck(), 110);
+				EXPECT_LE(this->admission->nextCheck(), 120);
+				EXPECT_TRUE(this->launches.empty());
+			}
+			TEST_F(AdmissionTest, LimitsPeriodicJobsToTheCPUs) {
+				long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+				char load[64];
+
+				snprintf(load, sizeof(load), "%ld.50 1.00 1.00 1/100 1234\n", ncpu);
+				this->write("loadavg", load);
+				EXPECT_FALSE(this->admission->admit(this->load("@hourly /bin/hourly\n"), this->file, 100));
+				EXPECT_TRUE(this->admission->admit(this->load("0 * * * * /bin/hourly\n"), this->file, 100));
+				this->envp = env_set(this->envp, (char *)"LOAD_MAX=0");
+				EXPECT_TRUE(this->admission->admit(this->load("@hourly /bin/hourly\n"), this->file, 100));
+				EXPECT_EQ(1u, this->admission->deferred());
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
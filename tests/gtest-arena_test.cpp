@@ -0,0 +1,101 @@
+/*
+ *  gtest-arena_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstring>
+#include <stdint.h>
+#include "env.hpp"
+#include "misc.hpp"
+#include "arena.hpp"
+#include "usercache.hpp"
+#include "crontabparser.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			static int released;
+
+			static void count_release(void *p) {
+				released += *(int *)p;
+			}
+
+			TEST(ArenaTest, AllocatesAlignedZeroedMemory) {
+				Arena arena;
+				char *a = (char *)arena.alloc(3);
+				char *b = (char *)arena.alloc(sizeof(double));
+				int i;
+
+				ASSERT_TRUE(a != NULL && b != NULL);
+				EXPECT_EQ(0u, (uintptr_t)a % (2 * sizeof(void *)));
+				EXPECT_EQ(0u, (uintptr_t)b % (2 * sizeof(void *)));
+				EXPECT_TRUE(b >= a + 3);
+				for (i = 0; i < 3; i++)
+					EXPECT_EQ(0, a[i]);
+				EXPECT_STREQ("abc", arena.strndup("abcdef", 3));
+				EXPECT_EQ(1u, arena.chunkCount());
+			}
+			TEST(ArenaTest, GrowsInChunks) {
+				Arena arena;
+				size_t last = 0;
+				int i;
+
+				/* chunks double, so this takes a handful of them */
+				for (i = 0; i < 10000; i++)
+					ASSERT_TRUE(arena.alloc(32) != NULL);
+				EXPECT_EQ(320000u, arena.used());
+				EXPECT_GE(arena.allocated(), arena.used());
+				EXPECT_LT(arena.chunkCount(), 15u);
+				/* a big one gets its own chunk, and the current one
+				 * carries on being used
+				 */
+				last = arena.chunkCount();
+				ASSERT_TRUE(arena.alloc(ARENA_MAX_CHUNK) != NULL);
+				EXPECT_EQ(last + 1, arena.chunkCount());
+				ASSERT_TRUE(arena.alloc(32) != NULL);
+				EXPECT_EQ(last + 1, arena.chunkCount());
+			}
+			TEST(ArenaTest, RunsCleanupsWhenDestroyed) {
+				int one = 1, two = 2;
+
+				released = 0;
+				{
+					Arena arena;
+					arena.keep(&one, count_release);
+					arena.keep(&two, count_release);
+					EXPECT_EQ(0, released);
+				}
+				EXPECT_EQ(3, released);
+			}
+			TEST(ArenaTest, HoldsEntryReferences) {
+				const char *tab = "* * * * * /bin/a\n0 * * * * /bin/b\n5 * * * * /bin/c\n";
+				UserCache users;
+				struct passwd *pw = users.get("root");
+				char **envp = env_init();
+				size_t envs = env_interned();
+				vector<entry *> entries;
+				entry *e;
+
+				{
+					Arena arena;
+					CrontabParser parser(tab, strlen(tab), "test");
+					parser.setArena(&arena);
+					parser.setUserCache(&users);
+					while ((e = parser.load_entry(pw, envp)) != NULL)
+						entries.push_back(e);
+					ASSERT_EQ(3u, entries.size());
+					EXPECT_STREQ("/bin/c", entries[2]->cmd);
+					EXPECT_TRUE(entries[0]->envp == entries[2]->envp);
+					EXPECT_TRUE(entries[0]->pwd == entries[2]->pwd);
+				}
+				/* the arena's references are gone with it */
+				EXPECT_EQ(envs, env_interned());
+				EXPECT_EQ(2u, pw_refs(pw));
+				pw_release(pw);
+				env_free(envp);
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
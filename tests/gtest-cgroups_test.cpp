@@ -0,0 +1,201 @@
+/*
+ *  gtest-cgroups_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "gtest-entry_fixture.hpp"
+#include "scheduler.hpp"
+#include "spawner.hpp"
+#include "supervisor.hpp"
+#include "cgroups.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			/* a pretend cgroup2 mount, with the daemon in /svc */
+			class CgroupsTest : public EntryTest {
+				protected:
+					virtual void SetUp() {
+						char dir[] = "/tmp/tinjac-cgroups.XXXXXX";
+
+						EntryTest::SetUp();
+						ASSERT_TRUE(mkdtemp(dir) != NULL);
+						this->root = dir;
+						boost::filesystem::create_directory(this->root + "/svc");
+						this->write("self", "1:name=systemd:/svc\n0::/svc\n");
+						this->write("svc/cgroup.controllers", "cpuset cpu io memory pids\n");
+						this->write("svc/cgroup.procs", "10\n20\n");
+						this->cgroups = new Cgroups(this->root, this->root + "/self");
+					}
+					virtual void TearDown() {
+						delete this->cgroups;
+						EntryTest::TearDown();
+						boost::filesystem::remove_all(this->root);
+					}
+					void write(const string &name, const char *text) {
+						std::ofstream out((this->root + "/" + name).c_str(), std::ios::trunc);
+						out << text;
+					}
+					string read(const string &name) {
+						std::ifstream in((this->root + "/" + name).c_str());
+						std::stringstream text;
+						text << in.rdbuf();
+						return text.str();
+					}
+					void done(const Supervisor::JobRun &run) {
+						this->runs.push_back(run);
+						this->sched.stop();
+					}
+					Supervisor *supervise(Spawner *spawner) {
+						Supervisor *supervisor = new Supervisor(spawner, &this->sched);
+						supervisor->setDone(boost::bind(&CgroupsTest::done, this, _1));
+						supervisor->setCgroups(this->cgroups);
+						return supervisor;
+					}
+				string root;
+				Scheduler sched;
+				Cgroups *cgroups;
+				vector<Supervisor::JobRun> runs;
+			};
+
+			TEST_F(CgroupsTest, ParsesTheCgroupFiles) {
+				unsigned long long usec = 0, rbytes, wbytes;
+				string out;
+
+				EXPECT_EQ("/system.slice/cron.service", Cgroups::parseSelf("0::/system.slice/cron.service\n"));
+				EXPECT_EQ("/", Cgroups::parseSelf("2:cpuacct:/\n1:cpu:/\n0::/\n"));
+				EXPECT_EQ("", Cgroups::parseSelf("4:memory:/a\n1:name=systemd:/\n"));
+				EXPECT_TRUE(Cgroups::parseCpuStat("usage_usec 1234567\nuser_usec 1000000\nsystem_usec 234567\n", &usec));
+				EXPECT_EQ(1234567ull, usec);
+				EXPECT_FALSE(Cgroups::parseCpuStat("user_usec 1\n", &usec));
+				Cgroups::parseIoStat("8:0 rbytes=4096 wbytes=100 rios=1 wios=1 dbytes=0 dios=0\n"
+					"253:0 rbytes=1000 wbytes=24 rios=1 wios=1 dbytes=0 dios=0\n", &rbytes, &wbytes);
+				EXPECT_EQ(5096ull, rbytes);
+				EXPECT_EQ(124ull, wbytes);
+				Cgroups::parseIoStat("", &rbytes, &wbytes);
+				EXPECT_EQ(0ull, rbytes);
+				EXPECT_TRUE(Cgroups::cpuMax("50%", out));
+				EXPECT_EQ("50000 100000", out);
+				EXPECT_TRUE(Cgroups::cpuMax("250%", out));
+				EXPECT_EQ("250000 100000", out);
+				EXPECT_TRUE(Cgroups::cpuMax("0.1%", out));
+				EXPECT_EQ("1000 100000", out);
+				EXPECT_TRUE(Cgroups::cpuMax("20000 50000", out));
+				EXPECT_EQ("20000 50000", out);
+				EXPECT_TRUE(Cgroups::cpuMax("max", out));
+				EXPECT_FALSE(Cgroups::cpuMax("half", out));
+				EXPECT_FALSE(Cgroups::cpuMax("-5%", out));
+				EXPECT_FALSE(Cgroups::cpuMax("50x", out));
+			}
+			TEST_F(CgroupsTest, IsOffWithoutCgroupV2) {
+				this->write("self", "4:memory:/svc\n1:name=systemd:/svc\n");
+				EXPECT_FALSE(this->cgroups->setup());
+				EXPECT_FALSE(this->cgroups->enabled());
+				EXPECT_EQ(-1, this->cgroups->create(1, this->load("* * * * * /bin/true\n")));
+			}
+			TEST_F(CgroupsTest, TakesOverADelegatedCgroup) {
+				ASSERT_TRUE(this->cgroups->setup());
+				EXPECT_TRUE(this->cgroups->enabled());
+				/* one pid to a write, as the kernel wants them */
+				EXPECT_EQ("10\n20\n", this->read("svc/daemon/cgroup.procs"));
+				EXPECT_EQ("+cpu +memory +io", this->read("svc/cgroup.subtree_control"));
+				EXPECT_EQ("+cpu +memory +io", this->read("svc/jobs/cgroup.subtree_control"));
+			}
+			TEST_F(CgroupsTest, SetsLimitsOnRunsOrTheirClass) {
+				int fd;
+
+				ASSERT_TRUE(this->cgroups->setup());
+				this->envp = env_set(this->envp, (char *)"CPU_MAX=50%");
+				this->envp = env_set(this->envp, (char *)"MEMORY_MAX=64M");
+				ASSERT_NE(-1, fd = this->cgroups->create(7, this->load("* * * * * /bin/true\n")));
+				close(fd);
+				EXPECT_EQ("50000 100000", this->read("svc/jobs/default/7/cpu.max"));
+				EXPECT_EQ("64M", this->read("svc/jobs/default/7/memory.max"));
+				EXPECT_FALSE(boost::filesystem::exists(this->root + "/svc/jobs/default/7/io.max"));
+				/* a class shares them between its runs */
+				this->envp = env_set(this->envp, (char *)"JOB_CLASS=batch");
+				this->envp = env_set(this->envp, (char *)"CPU_MAX=200%");
+				ASSERT_NE(-1, fd = this->cgroups->create(8, this->load("* * * * * /bin/true\n")));
+				close(fd);
+				std::ostringstream user;
+				user << "svc/jobs/" << this->pw->pw_uid;
+				string batch = user.str() + "/batch";
+				EXPECT_EQ("200000 100000", this->read(batch + "/cpu.max"));
+				EXPECT_EQ("+cpu +memory +io", this->read(user.str() + "/cgroup.subtree_control"));
+				EXPECT_EQ("+cpu +memory +io", this->read(batch + "/cgroup.subtree_control"));
+				EXPECT_FALSE(boost::filesystem::exists(this->root + "/" + batch + "/8/cpu.max"));
+				/* another user's class of the same name is theirs alone */
+				struct passwd other = *this->pw;
+				other.pw_uid = this->pw->pw_uid + 1;
+				this->pw = &other;
+				this->envp = env_set(this->envp, (char *)"CPU_MAX=1%");
+				ASSERT_NE(-1, fd = this->cgroups->create(10, this->load("* * * * * /bin/true\n")));
+				close(fd);
+				this->pw = getpwuid(getuid());
+				std::ostringstream theirs;
+				theirs << "svc/jobs/" << other.pw_uid << "/batch/cpu.max";
+				EXPECT_EQ("1000 100000", this->read(theirs.str()));
+				EXPECT_EQ("200000 100000", this->read(batch + "/cpu.max"));
+				this->envp = env_set(this->envp, (char *)"CPU_MAX=200%");
+				/* and one that could be mistaken for a file isn't a class */
+				this->envp = env_set(this->envp, (char *)"JOB_CLASS=cpu.max");
+				ASSERT_NE(-1, fd = this->cgroups->create(9, this->load("* * * * * /bin/true\n")));
+				close(fd);
+				EXPECT_TRUE(boost::filesystem::is_directory(this->root + "/svc/jobs/default/9"));
+			}
+			TEST_F(CgroupsTest, ReadsBackWhatARunUsed) {
+				Cgroups::Usage usage;
+				int fd;
+
+				ASSERT_TRUE(this->cgroups->setup());
+				ASSERT_NE(-1, fd = this->cgroups->create(3, this->load("* * * * * /bin/true\n")));
+				close(fd);
+				this->write("svc/jobs/default/3/cpu.stat", "usage_usec 2500000\nuser_usec 2000000\nsystem_usec 500000\n");
+				this->write("svc/jobs/default/3/memory.peak", "1048576\n");
+				this->write("svc/jobs/default/3/io.stat", "8:0 rbytes=10 wbytes=20 rios=1 wios=1\n");
+				EXPECT_TRUE(this->cgroups->finish(3, &usage));
+				EXPECT_EQ(2500000ull, usage.cpu);
+				EXPECT_EQ(1048576ull, usage.memory);
+				EXPECT_EQ(10ull, usage.rbytes);
+				EXPECT_EQ(20ull, usage.wbytes);
+				/* it's gone now */
+				EXPECT_FALSE(this->cgroups->finish(3, &usage));
+				EXPECT_FALSE(this->cgroups->finish(4, &usage));
+			}
+			TEST_F(CgroupsTest, JobsWriteThemselvesIntoTheirCgroup) {
+				Spawner spawner;
+				Supervisor *supervisor;
+				Spawner::JobId id;
+
+				ASSERT_TRUE(this->cgroups->setup());
+				spawner.setScheduler(&this->sched);
+				ASSERT_TRUE(spawner.start());
+				supervisor = this->supervise(&spawner);
+				ASSERT_NE(0u, id = supervisor->run(this->load("* * * * * echo hello\n"), "tab"));
+				std::ostringstream leaf;
+				leaf << "svc/jobs/default/" << id;
+				/* the loop hasn't run yet, so this is there before the exit is seen */
+				this->write(leaf.str() + "/cpu.stat", "usage_usec 1500\n");
+				this->sched.run(JobCallback());
+				ASSERT_EQ(1u, this->runs.size());
+				EXPECT_TRUE(this->runs[0].contained);
+				EXPECT_EQ(1500ull, this->runs[0].cgusage.cpu);
+				EXPECT_EQ("hello\n", this->runs[0].output.text());
+				EXPECT_EQ("0", this->read(leaf.str() + "/cgroup.procs"));
+				delete supervisor;
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
@@ -0,0 +1,200 @@
+/*
+ *  gtest-chains_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <boost/bind.hpp>
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "scheduler.hpp"
+#include "spawner.hpp"
+#include "supervisor.hpp"
+#include "jobgraph.hpp"
+#include "chains.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			class ChainsTest : public testing::Test {
+				protected:
+					virtual void SetUp() {
+						this->pw = getpwuid(getuid());
+						this->envp = env_init();
+						this->file = NULL;
+						this->spawner.setScheduler(&this->sched);
+						ASSERT_TRUE(this->spawner.start());
+						this->supervisor = new Supervisor(&this->spawner, &this->sched);
+						this->supervisor->setDone(boost::bind(&ChainsTest::done, this, _1));
+						this->chains = new Chains(this->supervisor);
+					}
+					virtual void TearDown() {
+						delete this->chains;
+						delete this->supervisor;
+						delete this->file;
+						env_free(this->envp);
+					}
+					/* a whole crontab, with its graph, the way crontabs loads it */
+					CrontabFile *load(const char *tab) {
+						CrontabParser parser(tab, strlen(tab), "chains");
+						char envstr[MAX_ENVSTR];
+						char **envp = env_copy(this->envp);
+						entry *e;
+						int status;
+
+						this->file = new CrontabFile("chains", NULL);
+						parser.setArena(&this->file->arena);
+						while ((status = parser.load_env(envstr)) >= OK) {
+							if (status == TRUE)
+								envp = env_set(envp, envstr);
+							else if ((e = parser.load_entry(this->pw, envp)) != NULL)
+								this->file->entries.push_back(e);
+						}
+						env_free(envp);
+						this->file->graph = JobGraph::build(this->file);
+						return (this->file);
+					}
+					void done(const Supervisor::JobRun &run) {
+						this->runs.push_back(run);
+						this->chains->jobDone(run);
+						if (this->supervisor->running() <= 1 && this->chains->running() == 0)
+							this->sched.stop();
+					}
+					void idle(time_t now) {
+						if (now >= this->timeout)
+							this->sched.stop();
+					}
+					void finish() {
+						this->timeout = time(NULL) + 30;
+						this->sched.setIdle(boost::bind(&ChainsTest::idle, this, _1), 1);
+						this->sched.run(JobCallback());
+					}
+					/* the run for the job on a line, NULL if it never ran */
+					const Supervisor::JobRun *ran(int lineno) {
+						for (size_t i = 0; i < this->runs.size(); i++)
+							if (this->runs[i].lineno == lineno)
+								return (&this->runs[i]);
+						return (NULL);
+					}
+				struct passwd *pw;
+				char **envp;
+				CrontabFile *file;
+				Scheduler sched;
+				Spawner spawner;
+				Supervisor *supervisor;
+				Chains *chains;
+				vector<Supervisor::JobRun> runs;
+				time_t timeout;
+			};
+
+			TEST_F(ChainsTest, LeavesOutCyclesAndUnknownLabels) {
+				CrontabFile *file = this->load(
+					"a: 0 1 * * * /bin/true\n"
+					"b: @after a,c /bin/true\n"
+					"c: @after b /bin/true\n"
+					"d: @after c /bin/true\n"
+					"e: @after nowhere /bin/true\n"
+					"f: @success a /bin/true\n"
+					"0 2 * * * /bin/true\n");
+
+				ASSERT_TRUE(file->graph != NULL);
+				/* the unlabelled job on its own isn't part of it */
+				EXPECT_EQ(6u, file->graph->size());
+				EXPECT_NE(-1, file->graph->find("a"));
+				EXPECT_EQ(-1, file->graph->find("b"));
+				EXPECT_EQ(-1, file->graph->find("c"));
+				EXPECT_EQ(-1, file->graph->find("d"));
+				EXPECT_EQ(-1, file->graph->find("e"));
+				EXPECT_NE(-1, file->graph->find("f"));
+				/* so a only leads to f */
+				EXPECT_EQ(2u, file->graph->reach(file->graph->find("a")).size());
+			}
+			TEST_F(ChainsTest, NeedsAChainToStart) {
+				CrontabFile *file = this->load("a: 0 1 * * * /bin/true\n0 2 * * * /bin/true\n");
+
+				EXPECT_TRUE(file->graph == NULL);
+				EXPECT_FALSE(this->chains->start(file->entries[0], file->graph));
+			}
+			TEST_F(ChainsTest, RunsOnSuccessOrFailure) {
+				CrontabFile *file = this->load(
+					"a: 0 1 * * * exit 1\n"
+					"b: @failure a echo b\n"
+					"c: @success a echo c\n"
+					"@after c echo d\n"
+					"@after b echo e\n"
+					"@after a,b echo f\n");
+
+				ASSERT_TRUE(this->chains->start(file->entries[0], file->graph));
+				this->finish();
+				EXPECT_EQ(0u, this->chains->running());
+				ASSERT_TRUE(this->ran(1) != NULL);
+				EXPECT_EQ(1, WEXITSTATUS(this->ran(1)->status));
+				EXPECT_TRUE(this->ran(2) != NULL);
+				EXPECT_TRUE(this->ran(3) == NULL);
+				EXPECT_TRUE(this->ran(4) == NULL);
+				EXPECT_TRUE(this->ran(5) != NULL);
+				/* after a failed job, but it doesn't ask for success */
+				EXPECT_TRUE(this->ran(6) != NULL);
+				EXPECT_EQ(4u, this->chains->getStats().jobs);
+				EXPECT_EQ(2u, this->chains->getStats().skipped);
+				EXPECT_EQ(1u, this->chains->getStats().finished);
+			}
+			TEST_F(ChainsTest, PipesOneJobIntoTheNext) {
+				CrontabFile *file = this->load(
+					"dump: 0 1 * * * seq 1 5000; echo to stderr >&2\n"
+					"@pipe dump wc -l\n");
+
+				ASSERT_TRUE(this->chains->start(file->entries[0], file->graph));
+				this->finish();
+				ASSERT_TRUE(this->ran(1) != NULL);
+				ASSERT_TRUE(this->ran(2) != NULL);
+				/* only its stderr came back to us, the rest went down the pipe */
+				EXPECT_EQ("to stderr\n", this->ran(1)->output.text());
+				EXPECT_EQ("5000\n", this->ran(2)->output.text());
+				EXPECT_EQ(0, this->ran(2)->status);
+			}
+			TEST_F(ChainsTest, KeepsToTheParallelLimit) {
+				CrontabFile *file;
+				time_t start;
+
+				this->envp = env_set(this->envp, (char *)"CHAIN_PARALLEL=2");
+				file = this->load(
+					"a: 0 1 * * * /bin/true\n"
+					"@after a sleep 1\n"
+					"@after a sleep 1\n"
+					"@after a sleep 1\n"
+					"@after a sleep 1\n");
+				start = time(NULL);
+				ASSERT_TRUE(this->chains->start(file->entries[0], file->graph));
+				/* a is running, its children wait for it */
+				EXPECT_EQ(1u, this->supervisor->running());
+				this->finish();
+				EXPECT_EQ(5u, this->runs.size());
+				/* two at a time, so they took two goes */
+				EXPECT_GE(time(NULL) - start, 2);
+			}
+			TEST_F(ChainsTest, IgnoresANegativeParallelLimit) {
+				CrontabFile *file;
+				time_t start;
+
+				this->chains->setParallel(1);
+				this->envp = env_set(this->envp, (char *)"CHAIN_PARALLEL=-1");
+				file = this->load(
+					"a: 0 1 * * * /bin/true\n"
+					"@after a sleep 1\n"
+					"@after a sleep 1\n");
+				start = time(NULL);
+				ASSERT_TRUE(this->chains->start(file->entries[0], file->graph));
+				this->finish();
+				EXPECT_EQ(3u, this->runs.size());
+				/* the default of one at a time, not no limit at all */
+				EXPECT_GE(time(NULL) - start, 2);
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
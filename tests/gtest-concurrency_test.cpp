@@ -0,0 +1,247 @@
+/*
+ *  gtest-concurrency_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <csignal>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <boost/bind.hpp>
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "gtest-entry_fixture.hpp"
+#include "scheduler.hpp"
+#include "spawner.hpp"
+#include "supervisor.hpp"
+#include "concurrency.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			class ConcurrencyTest : public EntryTest {
+				protected:
+					virtual void SetUp() {
+						EntryTest::SetUp();
+						this->spawner.setScheduler(&this->sched);
+						ASSERT_TRUE(this->spawner.start());
+						this->supervisor = new Supervisor(&this->spawner, &this->sched);
+						this->supervisor->setDone(boost::bind(&ConcurrencyTest::done, this, _1));
+						this->concurrency = new Concurrency(this->supervisor);
+						this->killed = 0;
+					}
+					virtual void TearDown() {
+						delete this->concurrency;
+						delete this->supervisor;
+						EntryTest::TearDown();
+					}
+					void done(const Supervisor::JobRun &run) {
+						this->runs.push_back(run);
+						this->concurrency->jobDone(run);
+						/* and the job that took the place of a killed one */
+						if (this->killed != 0 && run.id == this->killed)
+							this->supervisor->kill(this->killed + 1, SIGKILL);
+						if (this->concurrency->running() == 0 && this->concurrency->waiting() == 0)
+							this->sched.stop();
+					}
+					void idle(time_t now) {
+						if (now >= this->timeout)
+							this->sched.stop();
+					}
+					void finish() {
+						this->timeout = time(NULL) + 30;
+						this->sched.setIdle(boost::bind(&ConcurrencyTest::idle, this, _1), 1);
+						this->sched.run(JobCallback());
+					}
+					/* replies from the spawner, so the jobs have pids */
+					void started() {
+						while (this->spawner.getStats().started < this->concurrency->getStats().started)
+							this->spawner.processReplies();
+					}
+				Scheduler sched;
+				Spawner spawner;
+				Supervisor *supervisor;
+				Concurrency *concurrency;
+				vector<Supervisor::JobRun> runs;
+				Spawner::JobId killed;
+				time_t timeout;
+			};
+
+			TEST_F(ConcurrencyTest, ReadsTheLimitsFromTheEnvironment) {
+				size_t n;
+
+				EXPECT_EQ(Concurrency::ALLOW, Concurrency::getPolicy(this->load("* * * * * /bin/true\n"), &n));
+				EXPECT_EQ(0u, n);
+				/* an @period job runs alone unless it's told otherwise */
+				EXPECT_EQ(Concurrency::SKIP, Concurrency::getPolicy(this->load("@period daily /bin/true\n"), &n));
+				EXPECT_EQ(1u, n);
+				this->envp = env_set(this->envp, (char *)"MAX_INSTANCES=3");
+				EXPECT_EQ(Concurrency::SKIP, Concurrency::getPolicy(this->load("* * * * * /bin/true\n"), &n));
+				EXPECT_EQ(3u, n);
+				this->envp = env_set(this->envp, (char *)"OVERLAP=queue");
+				EXPECT_EQ(Concurrency::QUEUE, Concurrency::getPolicy(this->load("* * * * * /bin/true\n"), &n));
+				EXPECT_EQ(3u, n);
+				this->envp = env_set(this->envp, (char *)"MAX_INSTANCES=");
+				this->envp = env_set(this->envp, (char *)"OVERLAP=kill");
+				EXPECT_EQ(Concurrency::KILL, Concurrency::getPolicy(this->load("* * * * * /bin/true\n"), &n));
+				EXPECT_EQ(1u, n);
+				this->envp = env_set(this->envp, (char *)"MAX_INSTANCES=2");
+				this->envp = env_set(this->envp, (char *)"OVERLAP=allow");
+				EXPECT_EQ(Concurrency::ALLOW, Concurrency::getPolicy(this->load("* * * * * /bin/true\n"), &n));
+				EXPECT_EQ(0u, n);
+				EXPECT_EQ(Concurrency::ALLOW, Concurrency::getPolicy(this->load("@period daily /bin/true\n"), &n));
+			}
+			TEST_F(ConcurrencyTest, SkipsCopiesOverMaxInstances) {
+				this->envp = env_set(this->envp, (char *)"MAX_INSTANCES=2");
+				entry *e = this->load("* * * * * sleep 0.2\n");
+				int i;
+
+				for (i = 0; i < 4; i++)
+					EXPECT_EQ(i < 2, this->concurrency->launch(e, "tab"));
+				EXPECT_EQ(2u, this->concurrency->running());
+				EXPECT_EQ(2u, this->concurrency->getStats().skipped);
+				this->finish();
+				EXPECT_EQ(2u, this->runs.size());
+				/* and once they're done there's room again */
+				EXPECT_TRUE(this->concurrency->launch(e, "tab"));
+				this->finish();
+				EXPECT_EQ(3u, this->runs.size());
+			}
+			TEST_F(ConcurrencyTest, QueuesOneRunBehindTheCopyRunning) {
+				this->envp = env_set(this->envp, (char *)"OVERLAP=queue");
+				entry *e = this->load("* * * * * sleep 0.2\n");
+
+				EXPECT_TRUE(this->concurrency->launch(e, "tab"));
+				EXPECT_TRUE(this->concurrency->launch(e, "tab"));
+				/* one waits, the rest are skipped */
+				EXPECT_FALSE(this->concurrency->launch(e, "tab"));
+				EXPECT_EQ(1u, this->concurrency->running());
+				EXPECT_EQ(1u, this->concurrency->waiting());
+				this->finish();
+				ASSERT_EQ(2u, this->runs.size());
+				EXPECT_FALSE(timercmp(&this->runs[1].started, &this->runs[0].finished, <));
+				const Concurrency::Stats &stats = this->concurrency->getStats();
+				EXPECT_EQ(2u, stats.started);
+				EXPECT_EQ(1u, stats.queued);
+				EXPECT_EQ(1u, stats.skipped);
+			}
+			TEST_F(ConcurrencyTest, KillsThePreviousCopy) {
+				this->envp = env_set(this->envp, (char *)"OVERLAP=kill");
+				entry *e = this->load("* * * * * sleep 30\n");
+
+				this->killed = this->spawner.nextId();
+				EXPECT_TRUE(this->concurrency->launch(e, "tab"));
+				this->started();
+				EXPECT_TRUE(this->concurrency->launch(e, "tab"));
+				EXPECT_EQ(1u, this->concurrency->getStats().killed);
+				this->started();
+				this->finish();
+				ASSERT_EQ(2u, this->runs.size());
+				EXPECT_EQ(this->killed, this->runs[0].id);
+				EXPECT_TRUE(WIFSIGNALED(this->runs[0].status));
+				EXPECT_EQ(SIGTERM, WTERMSIG(this->runs[0].status));
+			}
+			TEST_F(ConcurrencyTest, CapsTheJobsRunning) {
+				entry *a = this->load("* * * * * sleep 0.2; echo a\n");
+				entry *b = this->load("* * * * * sleep 0.2; echo b\n");
+				entry *c = this->load("* * * * * sleep 0.2; echo c\n");
+
+				this->concurrency->setMax(2);
+				EXPECT_TRUE(this->concurrency->launch(a, "tab"));
+				EXPECT_TRUE(this->concurrency->launch(b, "tab"));
+				EXPECT_TRUE(this->concurrency->launch(c, "tab"));
+				/* c is already waiting */
+				EXPECT_FALSE(this->concurrency->launch(c, "tab"));
+				EXPECT_EQ(2u, this->concurrency->running());
+				EXPECT_EQ(1u, this->concurrency->waiting());
+				this->finish();
+				ASSERT_EQ(3u, this->runs.size());
+				EXPECT_EQ("c\n", this->runs[2].output.text());
+				EXPECT_EQ(1u, this->concurrency->getStats().capped);
+			}
+			TEST_F(ConcurrencyTest, CapsAUsersJobs) {
+				this->envp = env_set(this->envp, (char *)"USER_JOBS_MAX=1");
+				entry *a = this->load("* * * * * sleep 0.1; echo a\n");
+				entry *b = this->load("* * * * * sleep 0.1; echo b\n");
+				entry *c = this->load("* * * * * sleep 0.1; echo c\n");
+				size_t i;
+
+				EXPECT_TRUE(this->concurrency->launch(a, "tab"));
+				EXPECT_TRUE(this->concurrency->launch(b, "tab"));
+				EXPECT_TRUE(this->concurrency->launch(c, "tab"));
+				EXPECT_EQ(1u, this->concurrency->running());
+				EXPECT_EQ(2u, this->concurrency->waiting());
+				this->finish();
+				ASSERT_EQ(3u, this->runs.size());
+				/* one after the other, in the order they came due */
+				EXPECT_EQ("a\n", this->runs[0].output.text());
+				EXPECT_EQ("b\n", this->runs[1].output.text());
+				EXPECT_EQ("c\n", this->runs[2].output.text());
+				for (i = 1; i < this->runs.size(); i++)
+					EXPECT_FALSE(timercmp(&this->runs[i].started, &this->runs[i - 1].finished, <));
+			}
+			TEST_F(ConcurrencyTest, TakesPeriodJobsInTurn) {
+				entry *a = this->load("@period daily sleep 0.1; echo a\n");
+				entry *b = this->load("@period daily sleep 0.1; echo b\n");
+				entry *c = this->load("@period daily sleep 0.1; echo c\n");
+				entry *d = this->load("* * * * * sleep 0.1; echo d\n");
+				size_t i;
+
+				this->concurrency->setPeriodMax(1);
+				EXPECT_TRUE(this->concurrency->launch(a, "tab"));
+				EXPECT_TRUE(this->concurrency->launch(b, "tab"));
+				EXPECT_TRUE(this->concurrency->launch(c, "tab"));
+				/* c is already waiting its turn */
+				EXPECT_FALSE(this->concurrency->launch(c, "tab"));
+				/* and the cap is only on catching up */
+				EXPECT_TRUE(this->concurrency->launch(d, "tab"));
+				EXPECT_EQ(2u, this->concurrency->running());
+				EXPECT_EQ(2u, this->concurrency->waiting());
+				this->finish();
+				ASSERT_EQ(4u, this->runs.size());
+				EXPECT_EQ(2u, this->concurrency->getStats().capped);
+				EXPECT_EQ(1u, this->concurrency->getStats().skipped);
+				for (i = 0; i < this->runs.size(); i++)
+					if (this->runs[i].output.text() == "d\n")
+						this->runs.erase(this->runs.begin() + i--);
+				ASSERT_EQ(3u, this->runs.size());
+				EXPECT_EQ("a\n", this->runs[0].output.text());
+				EXPECT_EQ("b\n", this->runs[1].output.text());
+				EXPECT_EQ("c\n", this->runs[2].output.text());
+				for (i = 1; i < this->runs.size(); i++)
+					EXPECT_FALSE(timercmp(&this->runs[i].started, &this->runs[i - 1].finished, <));
+			}
+			TEST_F(ConcurrencyTest, ForgetsUsersWithNothingRunning) {
+				entry *e = this->load("* * * * * sleep 0.1\n");
+
+				EXPECT_TRUE(this->concurrency->launch(e, "tab"));
+				EXPECT_EQ(1u, this->concurrency->userCount());
+				this->finish();
+				EXPECT_EQ(0u, this->concurrency->userCount());
+				/* nor keep one whose job couldn't start */
+				this->spawner.stop();
+				EXPECT_FALSE(this->concurrency->launch(e, "tab"));
+				EXPECT_EQ(0u, this->concurrency->userCount());
+			}
+			TEST_F(ConcurrencyTest, ForgetsAUserWhoseQueuedRunCantStart) {
+				this->envp = env_set(this->envp, (char *)"OVERLAP=queue");
+				entry *e = this->load("* * * * * sleep 0.2\n");
+				Supervisor::JobRun run;
+
+				run.id = this->spawner.nextId();
+				EXPECT_TRUE(this->concurrency->launch(e, "tab"));
+				EXPECT_TRUE(this->concurrency->launch(e, "tab"));
+				EXPECT_EQ(1u, this->concurrency->waiting());
+				/* the copy running finishes, and the one queued can't start */
+				this->spawner.stop();
+				EXPECT_TRUE(this->concurrency->jobDone(run));
+				EXPECT_EQ(0u, this->concurrency->running());
+				EXPECT_EQ(0u, this->concurrency->waiting());
+				EXPECT_EQ(0u, this->concurrency->userCount());
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
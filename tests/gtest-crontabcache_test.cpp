@@ -0,0 +1,132 @@
+/*
+ *  gtest-crontabcache_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include "env.hpp"
+#include "misc.hpp"
+#include "crontabs.hpp"
+#include "crontabcache.hpp"
+#include "crontabparser.hpp"
+#include "scheduler.hpp"
+#include "usercache.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			class CrontabCacheTest : public testing::Test {
+				protected:
+					virtual void SetUp() {
+						char tmpl[] = "/tmp/tinjac_test.XXXXXX";
+						ASSERT_TRUE(mkdtemp(tmpl) != NULL);
+						this->dir = tmpl;
+						this->cachefile = this->dir + ".cache";
+						this->write("a", "MAILTO=ops\n*/5 * * * * root /bin/five\n-10 0 * * 1-5 root /bin/ten\n");
+						this->write("b", "CRON_TZ=Europe/London\n@weekly root /bin/b\n@watch~30s /srv/in/** root /bin/in\n@period~10m weekly root /bin/week\n");
+					}
+					virtual void TearDown() {
+						::remove((this->dir + "/a").c_str());
+						::remove((this->dir + "/b").c_str());
+						::rmdir(this->dir.c_str());
+						::remove(this->cachefile.c_str());
+					}
+					void write(const char *name, const char *tab) {
+						FILE *fp = fopen((this->dir + "/" + name).c_str(), "w");
+						ASSERT_TRUE(fp != NULL);
+						fputs(tab, fp);
+						fclose(fp);
+					}
+					/* load the directory through a cache, then save it */
+					unsigned long load(crontabs &tabs, CrontabCache &cache) {
+						cache.open();
+						tabs.setUserCache(&this->users);
+						tabs.setCache(&cache);
+						tabs.setPath(this->dir, true);
+						cache.close();
+						tabs.saveCache();
+						return tabs.getParseCount();
+					}
+				string dir;
+				string cachefile;
+				/* what a started cache watches, so it goes after it */
+				Scheduler sched;
+				UserCache users;
+			};
+
+			TEST_F(CrontabCacheTest, LoadsWhatWasParsed) {
+				CrontabCache cold(this->cachefile), warm(this->cachefile);
+				crontabs parsed, cached;
+
+				EXPECT_EQ(2u, this->load(parsed, cold));
+				EXPECT_EQ(0u, this->load(cached, warm));
+				EXPECT_EQ(2u, warm.getStats().hits);
+				EXPECT_EQ(5u, cached.countEntries());
+				for (CrontabFileMap::const_iterator it = parsed.getCrontabs().begin(); it != parsed.getCrontabs().end(); ++it) {
+					CrontabFile *a = it->second, *b = cached.getCrontab(it->first);
+					ASSERT_TRUE(b != NULL);
+					ASSERT_EQ(a->entries.size(), b->entries.size());
+					for (size_t i = 0; i < a->entries.size(); i++) {
+						/* the same interned environment, and user */
+						EXPECT_TRUE(entry_same(a->entries[i], b->entries[i]));
+						EXPECT_EQ(a->entries[i]->envp, b->entries[i]->envp);
+						EXPECT_EQ(a->entries[i]->pwd, b->entries[i]->pwd);
+						EXPECT_EQ(a->entries[i]->lineno, b->entries[i]->lineno);
+					}
+				}
+				EXPECT_TRUE(cached.getCrontab(this->dir + "/a")->entries[1]->flags & DONT_LOG);
+				EXPECT_STREQ("/srv/in/**", cached.getCrontab(this->dir + "/b")->entries[1]->watch);
+				EXPECT_EQ(7 * SECONDS_PER_DAY, cached.getCrontab(this->dir + "/b")->entries[2]->period);
+			}
+			TEST_F(CrontabCacheTest, ParsesWhatChanged) {
+				CrontabCache cold(this->cachefile), warm(this->cachefile);
+				crontabs parsed, cached;
+
+				EXPECT_EQ(2u, this->load(parsed, cold));
+				/* a different size, so it's stale whatever the mtime says */
+				this->write("b", "@daily root /bin/b\n");
+				EXPECT_EQ(1u, this->load(cached, warm));
+				EXPECT_EQ(1u, warm.getStats().hits);
+				EXPECT_STREQ("/bin/b", cached.getCrontab(this->dir + "/b")->entries[0]->cmd);
+			}
+			TEST_F(CrontabCacheTest, IgnoresABadCache) {
+				CrontabCache cold(this->cachefile), warm(this->cachefile);
+				crontabs parsed, cached;
+				FILE *fp;
+
+				EXPECT_EQ(2u, this->load(parsed, cold));
+				/* chop the string table off */
+				ASSERT_EQ(0, truncate(this->cachefile.c_str(), 100));
+				EXPECT_FALSE(warm.open());
+				ASSERT_TRUE((fp = fopen(this->cachefile.c_str(), "w")) != NULL);
+				fputs("not a cache", fp);
+				fclose(fp);
+				EXPECT_EQ(2u, this->load(cached, warm));
+				EXPECT_EQ(0u, warm.getStats().hits);
+				EXPECT_EQ(5u, cached.countEntries());
+			}
+			TEST_F(CrontabCacheTest, DoesntKeepLinesWaitingForTheirUser) {
+				CrontabCache cold(this->cachefile), warm(this->cachefile);
+				crontabs parsed, cached;
+
+				/* root is known, daemon is looked up on the thread,
+				 * and only the scheduler's loop hears back, so it
+				 * stays pending
+				 */
+				pw_release(this->users.get("root"));
+				ASSERT_TRUE(this->users.start(&this->sched));
+				this->write("b", "@weekly root /bin/b\n@daily daemon /bin/d\n");
+				EXPECT_EQ(2u, this->load(parsed, cold));
+				EXPECT_TRUE(parsed.getCrontab(this->dir + "/b")->partial);
+				EXPECT_EQ(1u, this->load(cached, warm));
+				EXPECT_EQ(1u, warm.getStats().hits);
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
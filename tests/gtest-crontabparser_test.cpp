@@ -0,0 +1,258 @@
+/*
+ *  gtest-crontabparser_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstring>
+#include <cstdlib>
+#include <pwd.h>
+#include <vector>
+#include "env.hpp"
+#include "misc.hpp"
+#include "crontabparser.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			class CrontabParserTest : public testing::Test {
+				protected:
+					virtual void SetUp() {
+						this->pw = getpwuid(0);
+						this->envp = env_init();
+					}
+					virtual void TearDown() {
+						env_free(this->envp);
+					}
+					entry *parse(const char *tab, CrontabParser **p = NULL) {
+						CrontabParser *parser = new CrontabParser(tab, strlen(tab), "test");
+						entry *e = parser->load_entry(this->pw, this->envp);
+						if (p)
+							*p = parser;
+						else
+							delete parser;
+						return e;
+					}
+					void release(entry *e) {
+						env_release(e->envp);
+						pw_release(e->pwd);
+						free(e->cmd);
+						free(e);
+					}
+				struct passwd *pw;
+				char **envp;
+			};
+
+			TEST_F(CrontabParserTest, ParsesSimpleNumbers) {
+				entry *e = parse("5 4 3 2 1 /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				EXPECT_STREQ("/bin/true", e->cmd);
+				EXPECT_TRUE(bit_test(e->minute, 5));
+				EXPECT_FALSE(bit_test(e->minute, 4));
+				EXPECT_TRUE(bit_test(e->hour, 4));
+				EXPECT_TRUE(bit_test(e->dom, 3 - FIRST_DOM));
+				EXPECT_TRUE(bit_test(e->month, 2 - FIRST_MONTH));
+				EXPECT_TRUE(bit_test(e->dow, 1));
+				EXPECT_EQ(0, e->flags);
+				release(e);
+			}
+			TEST_F(CrontabParserTest, ParsesRangesStepsAndNames) {
+				entry *e = parse("*/15 1-5/2 * jan,Mar sun /bin/true arg\n");
+				ASSERT_TRUE(e != NULL);
+				EXPECT_STREQ("/bin/true arg", e->cmd);
+				for (int i = FIRST_MINUTE; i <= LAST_MINUTE; i++)
+					EXPECT_EQ(i % 15 == 0, bit_test(e->minute, i) != 0) << "minute " << i;
+				EXPECT_TRUE(bit_test(e->hour, 1));
+				EXPECT_FALSE(bit_test(e->hour, 2));
+				EXPECT_TRUE(bit_test(e->hour, 3));
+				EXPECT_TRUE(bit_test(e->hour, 5));
+				EXPECT_FALSE(bit_test(e->hour, 6));
+				EXPECT_TRUE(bit_test(e->month, 0));
+				EXPECT_FALSE(bit_test(e->month, 1));
+				EXPECT_TRUE(bit_test(e->month, 2));
+				/* sunday is both 0 and 7 */
+				EXPECT_TRUE(bit_test(e->dow, 0));
+				EXPECT_TRUE(bit_test(e->dow, 7));
+				EXPECT_EQ(MIN_STAR | DOM_STAR, e->flags);
+				release(e);
+			}
+			TEST_F(CrontabParserTest, ParsesSpecials) {
+				entry *e = parse("@hourly /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				EXPECT_TRUE(bit_test(e->minute, 0));
+				EXPECT_FALSE(bit_test(e->minute, 1));
+				for (int i = FIRST_HOUR; i <= LAST_HOUR; i++)
+					EXPECT_TRUE(bit_test(e->hour, i));
+				EXPECT_EQ(HR_STAR | LOAD_LIMITED, e->flags);
+				release(e);
+				e = parse("@reboot /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				EXPECT_EQ(WHEN_REBOOT, e->flags);
+				release(e);
+			}
+			TEST_F(CrontabParserTest, SetsUserEnvironment) {
+				entry *e = parse("* * * * * /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				EXPECT_STREQ(pw->pw_name, env_get((char *)"LOGNAME", e->envp));
+				EXPECT_STREQ(_PATH_BSHELL, env_get((char *)"SHELL", e->envp));
+				EXPECT_EQ(MIN_STAR | HR_STAR | DOM_STAR | MON_STAR | DOW_STAR, e->flags);
+				release(e);
+			}
+			TEST_F(CrontabParserTest, SkipsCommentsAndTracksLines) {
+				CrontabParser *p;
+				entry *e = parse("# comment\n\n   \n\t# another\n1 * * * * /bin/true\n", &p);
+				ASSERT_TRUE(e != NULL);
+				EXPECT_EQ(6, p->getLineNumber());
+				EXPECT_EQ(0, p->getErrors());
+				release(e);
+				delete p;
+			}
+			TEST_F(CrontabParserTest, ReportsErrorsAndResyncs) {
+				const char *tab = "61 * * * * /bin/false\n# ok\n1 2 3 4 5 /bin/true\n";
+				CrontabParser parser(tab, strlen(tab), "test");
+				EXPECT_TRUE(parser.load_entry(this->pw, this->envp) == NULL);
+				EXPECT_EQ(1, parser.getErrors());
+				EXPECT_EQ(2, parser.getLineNumber());
+				entry *e = parser.load_entry(this->pw, this->envp);
+				ASSERT_TRUE(e != NULL);
+				EXPECT_STREQ("/bin/true", e->cmd);
+				EXPECT_TRUE(parser.load_entry(this->pw, this->envp) == NULL);
+				EXPECT_TRUE(parser.eof());
+				release(e);
+			}
+			TEST_F(CrontabParserTest, RejectsMissingNewline) {
+				EXPECT_TRUE(parse("* * * * * /bin/true") == NULL);
+				EXPECT_TRUE(parse("* * * * *\n") == NULL);
+				EXPECT_TRUE(parse("1-x * * * * /bin/true\n") == NULL);
+			}
+			TEST_F(CrontabParserTest, LoadsEnvironmentAndAllEntries) {
+				const char *tab = "# header\nMAILTO=root\n 1 * * * * /bin/one\nFOO = \"a b\" \n2 * * * * /bin/two\n\n3 * * * * /bin/three\n";
+				CrontabParser parser(tab, strlen(tab), "test");
+				char envstr[MAX_ENVSTR];
+				char **envp = env_copy(this->envp);
+				vector<entry *> entries;
+				int status;
+				while ((status = parser.load_env(envstr)) >= OK) {
+					if (status == TRUE) {
+						envp = env_set(envp, envstr);
+						continue;
+					}
+					entry *e = parser.load_entry(this->pw, envp);
+					if (e)
+						entries.push_back(e);
+				}
+				env_free(envp);
+				EXPECT_EQ(0, parser.getErrors());
+				ASSERT_EQ(3u, entries.size());
+				EXPECT_STREQ("/bin/one", entries[0]->cmd);
+				EXPECT_EQ(3, entries[0]->lineno);
+				EXPECT_STREQ("root", env_get((char *)"MAILTO", entries[0]->envp));
+				EXPECT_TRUE(env_get((char *)"FOO", entries[0]->envp) == NULL);
+				/* same settings and user, same environment */
+				EXPECT_TRUE(entries[1]->envp == entries[2]->envp);
+				EXPECT_TRUE(entries[0]->envp != entries[1]->envp);
+				EXPECT_STREQ("/bin/two", entries[1]->cmd);
+				EXPECT_STREQ("a b", env_get((char *)"FOO", entries[1]->envp));
+				EXPECT_STREQ("/bin/three", entries[2]->cmd);
+				EXPECT_EQ(7, entries[2]->lineno);
+				for (size_t i = 0; i < entries.size(); i++)
+					free_entry(entries[i]);
+			}
+			TEST_F(CrontabParserTest, EnvRewindsOnEntries) {
+				const char *tab = "1 * * * * FOO=bar /bin/true\n";
+				CrontabParser parser(tab, strlen(tab), "test");
+				char envstr[MAX_ENVSTR];
+				EXPECT_EQ(FALSE, parser.load_env(envstr));
+				EXPECT_EQ(1, parser.getLineNumber());
+				entry *e = parser.load_entry(this->pw, this->envp);
+				ASSERT_TRUE(e != NULL);
+				EXPECT_STREQ("FOO=bar /bin/true", e->cmd);
+				release(e);
+				EXPECT_EQ(ERR, parser.load_env(envstr));
+			}
+			TEST_F(CrontabParserTest, ParsesLabelsAndChains) {
+				entry *e = parse("backup: 0 3 * * * /bin/backup\n");
+				ASSERT_TRUE(e != NULL);
+				EXPECT_STREQ("backup", e->name);
+				EXPECT_TRUE(e->after == NULL);
+				EXPECT_STREQ("/bin/backup", e->cmd);
+				free_entry(e);
+
+				e = parse("report: @success backup,dump /bin/report\n");
+				ASSERT_TRUE(e != NULL);
+				EXPECT_STREQ("report", e->name);
+				EXPECT_STREQ("backup,dump", e->after);
+				EXPECT_EQ(WHEN_AFTER | AFTER_SUCCESS, e->flags);
+				EXPECT_STREQ("/bin/report", e->cmd);
+				free_entry(e);
+
+				e = parse("@pipe dump gzip > /tmp/dump.gz\n");
+				ASSERT_TRUE(e != NULL);
+				EXPECT_TRUE(e->name == NULL);
+				EXPECT_STREQ("dump", e->after);
+				EXPECT_EQ(WHEN_AFTER | AFTER_PIPE, e->flags);
+				free_entry(e);
+
+				/* a pipe only has the one job on the other end */
+				CrontabParser *parser;
+				EXPECT_TRUE(parse("@pipe a,b /bin/true\n", &parser) == NULL);
+				EXPECT_EQ(1, parser->getErrors());
+				delete parser;
+				EXPECT_TRUE(parse("@after ,a /bin/true\n") == NULL);
+				EXPECT_TRUE(parse("9x: * * * * * /bin/true\n") == NULL);
+			}
+			TEST_F(CrontabParserTest, ParsesWatches) {
+				entry *e = parse("@watch /srv/in/**,/etc/app.conf /bin/ingest\n");
+				ASSERT_TRUE(e != NULL);
+				EXPECT_STREQ("/srv/in/**,/etc/app.conf", e->watch);
+				EXPECT_EQ(WHEN_WATCH, e->flags);
+				EXPECT_EQ(0, e->spread);
+				EXPECT_STREQ("/bin/ingest", e->cmd);
+				free_entry(e);
+
+				/* the window is what changes are gathered over */
+				e = parse("ingest: @watch~30s /srv/in /bin/ingest\n");
+				ASSERT_TRUE(e != NULL);
+				EXPECT_STREQ("ingest", e->name);
+				EXPECT_EQ(30, e->spread);
+				free_entry(e);
+
+				EXPECT_TRUE(parse("@watch srv/in /bin/true\n") == NULL);
+				EXPECT_TRUE(parse("@watch /srv/**/in /bin/true\n") == NULL);
+				EXPECT_TRUE(parse("@watch /** /bin/true\n") == NULL);
+				EXPECT_TRUE(parse("@watch /srv/in,,/tmp /bin/true\n") == NULL);
+				EXPECT_TRUE(parse("@watch /srv/in\n") == NULL);
+			}
+			TEST_F(CrontabParserTest, ParsesPeriods) {
+				entry *e = parse("@period 7 /bin/weekly\n");
+				ASSERT_TRUE(e != NULL);
+				EXPECT_EQ(WHEN_PERIOD | LOAD_LIMITED, e->flags);
+				EXPECT_EQ(7 * SECONDS_PER_DAY, e->period);
+				EXPECT_EQ(0, e->spread);
+				EXPECT_STREQ("/bin/weekly", e->cmd);
+				free_entry(e);
+
+				/* the delay is anacron's, on top of when it's due */
+				e = parse("@period~45m monthly /bin/monthly\n");
+				ASSERT_TRUE(e != NULL);
+				EXPECT_EQ(PERIOD_MONTHLY, e->period);
+				EXPECT_EQ(45 * 60, e->spread);
+				free_entry(e);
+
+				EXPECT_EQ(SECONDS_PER_DAY, parse_period("daily", 5));
+				EXPECT_EQ(7 * SECONDS_PER_DAY, parse_period("weekly", 6));
+				EXPECT_EQ(6 * 3600, parse_period("6h", 2));
+				EXPECT_EQ(90 * 60, parse_period("90m", 3));
+				EXPECT_EQ(2 * SECONDS_PER_DAY, parse_period("2d", 2));
+				EXPECT_EQ(0, parse_period("0", 1));
+				EXPECT_EQ(0, parse_period("5x", 2));
+				EXPECT_EQ(0, parse_period("3651", 4));
+				EXPECT_EQ(0, parse_period("d", 1));
+				EXPECT_TRUE(parse("@period /bin/true\n") == NULL);
+				EXPECT_TRUE(parse("@period yearly /bin/true\n") == NULL);
+				EXPECT_TRUE(parse("@period daily\n") == NULL);
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
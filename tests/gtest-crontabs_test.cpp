@@ -0,0 +1,136 @@
+/*
+ *  gtest-crontabs_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <poll.h>
+#include <unistd.h>
+#include <utime.h>
+#include <boost/bind.hpp>
+#include "crontabs.hpp"
+#include "mappedfile.hpp"
+#include "crontabparser.hpp"
+#include "scheduler.hpp"
+#include "usercache.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			void wait_for_lookups(Scheduler *sched, UserCache *users, time_t until, time_t now) {
+				if (users->pending() == 0 || now >= until)
+					sched->stop();
+			}
+
+			class CrontabsTest : public testing::Test {
+				protected:
+					virtual void SetUp() {
+						char tmpl[] = "/tmp/tinjac_test.XXXXXX";
+						ASSERT_TRUE(mkdtemp(tmpl) != NULL);
+						this->dir = tmpl;
+						this->write("a", "*/5 * * * * root /bin/five\n10 0 * * * root /bin/ten\n", 1000);
+						this->write("b", "0 * * * * root /bin/b\n", 1000);
+						this->tabs.setScheduler(&this->sched);
+						this->tabs.setUserCache(&this->users);
+						ASSERT_TRUE(this->tabs.setPath(this->dir, true));
+					}
+					virtual void TearDown() {
+						this->tabs.removeCrontab(this->dir + "/a");
+						this->tabs.removeCrontab(this->dir + "/b");
+						::remove((this->dir + "/a").c_str());
+						::remove((this->dir + "/b").c_str());
+						::rmdir(this->dir.c_str());
+					}
+					void write(const char *name, const char *tab, time_t mtime) {
+						string fname = this->dir + "/" + name;
+						struct utimbuf ut;
+						FILE *fp = fopen(fname.c_str(), "w");
+						ASSERT_TRUE(fp != NULL);
+						fputs(tab, fp);
+						fclose(fp);
+						ut.actime = ut.modtime = mtime;
+						utime(fname.c_str(), &ut);
+					}
+				string dir;
+				Scheduler sched;
+				UserCache users;
+				crontabs tabs;
+			};
+
+			TEST_F(CrontabsTest, ReadsACrontabRatherThanMappingIt) {
+				string fname = this->dir + "/a";
+				MappedFile file;
+
+				ASSERT_TRUE(file.open(fname, 0, false));
+				/* as an editor rewriting it would; a mapping would SIGBUS now */
+				ASSERT_EQ(0, truncate(fname.c_str(), 0));
+				EXPECT_EQ("*/5 * * * * root /bin/five\n10 0 * * * root /bin/ten\n", string(file.data(), file.size()));
+			}
+			TEST_F(CrontabsTest, RescanOnlyParsesWhatChanged) {
+				EXPECT_EQ(2u, this->tabs.getParseCount());
+				EXPECT_EQ(3u, this->sched.size());
+				this->tabs.rescan();
+				EXPECT_EQ(2u, this->tabs.getParseCount());
+				this->write("a", "*/5 * * * * root /bin/five\n", 2000);
+				this->tabs.rescan();
+				EXPECT_EQ(3u, this->tabs.getParseCount());
+				EXPECT_EQ(2u, this->sched.size());
+				::remove((this->dir + "/b").c_str());
+				this->tabs.rescan();
+				EXPECT_EQ(3u, this->tabs.getParseCount());
+				EXPECT_EQ(1u, this->sched.size());
+				EXPECT_TRUE(this->tabs.getCrontab(this->dir + "/b") == NULL);
+			}
+			TEST_F(CrontabsTest, ReloadsWhatRunsAsAChangedUser) {
+				this->write("b", "0 * * * * daemon /bin/b\n", 2000);
+				this->tabs.rescan();
+				EXPECT_EQ(3u, this->tabs.getParseCount());
+				/* only a runs as root now */
+				this->tabs.userChanged("root");
+				EXPECT_EQ(4u, this->tabs.getParseCount());
+				EXPECT_EQ(3u, this->sched.size());
+				this->tabs.userChanged("tinjac-no-such-user");
+				EXPECT_EQ(4u, this->tabs.getParseCount());
+			}
+			TEST_F(CrontabsTest, LoadsLinesOnceTheirUserIsLookedUp) {
+				ASSERT_TRUE(this->users.start(&this->sched));
+				this->users.setChanged(boost::bind(&crontabs::userChanged, &this->tabs, _1));
+				this->write("b", "0 * * * * root /bin/b\n0 * * * * daemon /bin/d\n", 2000);
+				this->tabs.rescan();
+				/* daemon's line isn't an error, it's waiting */
+				EXPECT_EQ(3u, this->sched.size());
+				EXPECT_EQ(0, this->tabs.getCrontab(this->dir + "/b")->errors);
+				this->sched.setIdle(boost::bind(wait_for_lookups, &this->sched, &this->users, time(NULL) + 30, _1), 1);
+				this->sched.run(JobCallback());
+				EXPECT_EQ(4u, this->sched.size());
+				EXPECT_EQ(4u, this->tabs.getParseCount());
+			}
+#ifdef __linux
+			TEST_F(CrontabsTest, WatchReloadsOneFile) {
+				struct pollfd pfd;
+				int fd = this->tabs.watch();
+
+				ASSERT_NE(-1, fd);
+				EXPECT_EQ(2u, this->tabs.getParseCount());
+				this->write("b", "0 * * * * root /bin/b\n1 * * * * root /bin/b1\n", 2000);
+				pfd.fd = fd;
+				pfd.events = POLLIN;
+				ASSERT_EQ(1, poll(&pfd, 1, 1000));
+				this->tabs.processEvents();
+				/* written once and touched once, parsed once */
+				EXPECT_EQ(3u, this->tabs.getParseCount());
+				EXPECT_EQ(4u, this->sched.size());
+				::remove((this->dir + "/a").c_str());
+				ASSERT_EQ(1, poll(&pfd, 1, 1000));
+				this->tabs.processEvents();
+				EXPECT_EQ(3u, this->tabs.getParseCount());
+				EXPECT_EQ(2u, this->sched.size());
+			}
+#endif
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
@@ -0,0 +1,278 @@
+/*
+ *  gtest-dbcron_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <boost/bind.hpp>
+#include "config.h"
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "scheduler.hpp"
+#include "spawner.hpp"
+#include "supervisor.hpp"
+#include "dbcron.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			class DbCronTest : public testing::Test {
+				protected:
+					virtual void SetUp() {
+						char name[] = "/tmp/tinjac-db.XXXXXX";
+						int fd;
+
+						/* an empty file is an empty database */
+						ASSERT_NE(-1, fd = mkstemp(name));
+						::close(fd);
+						this->path = name;
+						this->db = new DbCron(&this->sched);
+						this->db->setDone(boost::bind(&DbCronTest::done, this, _1));
+						this->id = 0;
+						this->want = 0;
+					}
+					virtual void TearDown() {
+						delete this->db;
+						unlink(this->path.c_str());
+					}
+					void query(const string &sql, int timeout = 10) {
+						DbCron::Request request;
+
+						request.id = ++this->id;
+						request.database = "sqlite:" + this->path;
+						request.sql = sql;
+						request.timeout = timeout;
+						EXPECT_TRUE(this->db->query(request));
+					}
+					void done(const DbCron::Response &response) {
+						this->responses.push_back(response);
+						if (this->db->running() == 0 || this->responses.size() == this->want)
+							this->sched.stop();
+					}
+					void watch(Supervisor *supervisor) {
+						supervisor->setDone(boost::bind(&DbCronTest::jobDone, this, _1));
+					}
+					void jobDone(const Supervisor::JobRun &run) {
+						this->runs.push_back(run);
+						if (this->runs.size() == 2)
+							this->sched.stop();
+					}
+					void idle(time_t now) {
+						if (now >= this->timeout)
+							this->sched.stop();
+					}
+					void finish() {
+						this->timeout = time(NULL) + 30;
+						this->sched.setIdle(boost::bind(&DbCronTest::idle, this, _1), 1);
+						this->sched.run(JobCallback());
+					}
+				string path;
+				Scheduler sched;
+				DbCron *db;
+				Spawner::JobId id;
+				vector<DbCron::Response> responses;
+				size_t want;		/* stop at this many, as well as at none running */
+				vector<Supervisor::JobRun> runs;
+				time_t timeout;
+			};
+
+			TEST(DbCronCommandTest, ParsesCommands) {
+				string database, sql;
+
+				EXPECT_TRUE(DbCron::isDatabase("sqlite:/var/lib/app.db VACUUM"));
+				EXPECT_TRUE(DbCron::isDatabase("postgres://localhost/app SELECT 1"));
+				EXPECT_FALSE(DbCron::isDatabase("psql -c 'SELECT 1'"));
+				ASSERT_TRUE(DbCron::parseCommand("sqlite:///var/lib/app.db   DELETE FROM t WHERE a LIKE 'x%'", database, sql));
+				EXPECT_EQ("sqlite:///var/lib/app.db", database);
+				EXPECT_EQ("DELETE FROM t WHERE a LIKE 'x%'", sql);
+				ASSERT_TRUE(DbCron::parseCommand("postgresql://app@db.example.com:5433/app?sslmode=require\tSELECT purge()", database, sql));
+				EXPECT_EQ("postgresql://app@db.example.com:5433/app?sslmode=require", database);
+				EXPECT_EQ("SELECT purge()", sql);
+				EXPECT_FALSE(DbCron::parseCommand("sqlite:/var/lib/app.db", database, sql));
+				EXPECT_FALSE(DbCron::parseCommand("sqlite:/var/lib/app.db  ", database, sql));
+				EXPECT_FALSE(DbCron::parseCommand("sqlite: SELECT 1", database, sql));
+			}
+			TEST(DbCronCommandTest, SplitsStatementsWhereTheServerWould) {
+				vector<string> out;
+
+				DbCron::splitStatements("SELECT 1; SELECT ';', \"a;b\";SELECT $$a;b$$; SELECT $f$ $$; $f$ -- c;\n"
+					"; /* a /* ; */ ; */ SELECT E'\\';', 'it''s;';;  ", out);
+				ASSERT_EQ(5u, out.size());
+				EXPECT_EQ("SELECT 1", out[0]);
+				EXPECT_EQ("SELECT ';', \"a;b\"", out[1]);
+				EXPECT_EQ("SELECT $$a;b$$", out[2]);
+				EXPECT_EQ("SELECT $f$ $$; $f$ -- c;\n", out[3]);
+				EXPECT_EQ("/* a /* ; */ ; */ SELECT E'\\';', 'it''s;'", out[4]);
+				/* $1 is a parameter, not a quote */
+				DbCron::splitStatements("SELECT $1; SELECT a$b$", out);
+				ASSERT_EQ(2u, out.size());
+				EXPECT_EQ("SELECT a$b$", out[1]);
+			}
+#ifdef HAVE_SQLITE3
+			TEST_F(DbCronTest, KeepsConnectionsAndStatements) {
+				ASSERT_TRUE(this->db->start());
+				this->query("CREATE TABLE t (a INTEGER, b TEXT); INSERT INTO t VALUES (1, 'x'); INSERT INTO t VALUES (2, NULL)");
+				this->finish();
+				this->query("SELECT a, b FROM t ORDER BY a; SELECT count(*) FROM t");
+				this->finish();
+				this->query("SELECT a, b FROM t ORDER BY a; SELECT count(*) FROM t");
+				this->finish();
+				ASSERT_EQ(3u, this->responses.size());
+				EXPECT_TRUE(this->responses[0].ok);
+				EXPECT_EQ(2u, this->responses[0].changes);
+				EXPECT_EQ(0u, this->responses[0].rows);
+				EXPECT_TRUE(this->responses[1].ok);
+				EXPECT_EQ("1|x\n2|\n2\n", this->responses[1].output.text());
+				EXPECT_EQ(3u, this->responses[1].rows);
+				EXPECT_EQ(0u, this->responses[1].changes);
+				EXPECT_EQ(this->responses[1].output.text(), this->responses[2].output.text());
+				DbCron::Stats stats = this->db->getStats();
+				EXPECT_EQ(3u, stats.requests);
+				EXPECT_EQ(1u, stats.connections);
+				EXPECT_EQ(2u, stats.reused);
+				EXPECT_EQ(2u, stats.prepared);
+				EXPECT_EQ(1u, stats.cached);
+				EXPECT_EQ(0u, stats.failed);
+			}
+			TEST_F(DbCronTest, StopsAtAnErrorAndRollsBack) {
+				ASSERT_TRUE(this->db->start());
+				this->query("CREATE TABLE u (a UNIQUE)");
+				this->finish();
+				this->query("SELECT * FROM nope");
+				this->finish();
+				this->query("BEGIN; INSERT INTO u VALUES (1); INSERT INTO u VALUES (1); COMMIT");
+				this->finish();
+				this->query("SELECT count(*) FROM u");
+				this->finish();
+				ASSERT_EQ(4u, this->responses.size());
+				EXPECT_FALSE(this->responses[1].ok);
+				EXPECT_EQ("no such table: nope", this->responses[1].error);
+				EXPECT_EQ("ERROR: no such table: nope\n", this->responses[1].output.text());
+				EXPECT_FALSE(this->responses[2].ok);
+				EXPECT_NE(string::npos, this->responses[2].error.find("UNIQUE"));
+				/* the open transaction went, not the connection */
+				EXPECT_TRUE(this->responses[3].ok);
+				EXPECT_EQ("0\n", this->responses[3].output.text());
+				EXPECT_EQ(1u, this->db->getStats().connections);
+				EXPECT_EQ(2u, this->db->getStats().failed);
+			}
+#endif
+#if defined(HAVE_SQLITE3) && defined(HAVE_LIBPQ)
+			TEST_F(DbCronTest, SaysWhyItCantConnect) {
+				DbCron::Request request;
+
+				ASSERT_TRUE(this->db->start());
+				request.id = 1;
+				request.database = "sqlite:" + this->path + ".missing";
+				request.sql = "SELECT 1";
+				request.timeout = 10;
+				ASSERT_TRUE(this->db->query(request));
+				request.id = 2;
+				request.database = "postgresql://127.0.0.1:1/app";
+				ASSERT_TRUE(this->db->query(request));
+				this->finish();
+				ASSERT_EQ(2u, this->responses.size());
+				EXPECT_FALSE(this->responses[0].ok);
+				EXPECT_FALSE(this->responses[1].ok);
+				for (size_t i = 0; i < 2; i++)
+					if (this->responses[i].id == 1)
+						EXPECT_EQ("unable to open database file", this->responses[i].error);
+					else
+						EXPECT_NE(string::npos, this->responses[i].error.find("refused"));
+				/* and there's nothing to keep */
+				EXPECT_EQ(0u, this->db->getStats().connections);
+			}
+#else
+			TEST_F(DbCronTest, SaysWhatWasntBuiltIn) {
+				DbCron::Request request;
+
+				ASSERT_TRUE(this->db->start());
+				request.id = 1;
+#ifndef HAVE_SQLITE3
+				request.database = "sqlite:" + this->path;
+#else
+				request.database = "postgresql://127.0.0.1:1/app";
+#endif
+				request.sql = "SELECT 1";
+				request.timeout = 10;
+				ASSERT_TRUE(this->db->query(request));
+				this->finish();
+				ASSERT_EQ(1u, this->responses.size());
+				EXPECT_FALSE(this->responses[0].ok);
+				EXPECT_EQ(0u, this->responses[0].error.find("built without"));
+				EXPECT_EQ(0u, this->db->getStats().connections);
+			}
+#endif
+#ifdef HAVE_SQLITE3
+			TEST_F(DbCronTest, GivesUpOnSlowOrCancelledQueries) {
+				const char *forever = "WITH RECURSIVE c(x) AS (SELECT 1 UNION ALL SELECT x + 1 FROM c) SELECT count(*) FROM c";
+
+				this->db->setWorkers(1);
+				ASSERT_TRUE(this->db->start());
+				this->query(forever, 1);
+				this->query(forever, 30);
+				this->query(forever, 30);
+				/* one still queued, then one running */
+				this->db->cancel(3);
+				this->want = 1;
+				this->finish();
+				ASSERT_EQ(1u, this->responses.size());
+				EXPECT_EQ(3u, this->responses[0].id);
+				EXPECT_EQ("cancelled", this->responses[0].error);
+				this->want = 2;
+				this->finish();
+				this->db->cancel(2);
+				this->want = 0;
+				this->finish();
+				ASSERT_EQ(3u, this->responses.size());
+				EXPECT_EQ(1u, this->responses[1].id);
+				EXPECT_EQ("timed out", this->responses[1].error);
+				EXPECT_EQ(2u, this->responses[2].id);
+				EXPECT_EQ("cancelled", this->responses[2].error);
+				EXPECT_EQ(3u, this->db->getStats().failed);
+			}
+			TEST_F(DbCronTest, RunsDatabaseJobsWithoutAProcess) {
+				struct passwd *pw = getpwuid(getuid());
+				char **envp = env_init();
+				Spawner spawner;
+				Supervisor supervisor(&spawner, &this->sched);
+				Arena arena;
+				string tab;
+
+				ASSERT_TRUE(this->db->start());
+				supervisor.setDbCron(this->db);
+				this->watch(&supervisor);
+				tab = "* * * * * sqlite:" + this->path + " SELECT 40 + 2, 'x' LIKE 'x%'\n";
+				CrontabParser answer(tab.data(), tab.size(), "tab");
+				answer.setArena(&arena);
+				ASSERT_NE(0u, supervisor.run(answer.load_entry(pw, envp), "tab"));
+				tab = "* * * * * sqlite:" + this->path + " SELEKT 1\n";
+				CrontabParser typo(tab.data(), tab.size(), "tab");
+				typo.setArena(&arena);
+				ASSERT_NE(0u, supervisor.run(typo.load_entry(pw, envp), "tab"));
+				this->finish();
+				env_free(envp);
+				ASSERT_EQ(2u, this->runs.size());
+				/* they went to different workers, and either could finish first */
+				if (this->runs[0].id > this->runs[1].id)
+					swap(this->runs[0], this->runs[1]);
+				EXPECT_TRUE(this->runs[0].database);
+				EXPECT_EQ(0, this->runs[0].pid);
+				EXPECT_TRUE(WIFEXITED(this->runs[0].status));
+				EXPECT_EQ(0, WEXITSTATUS(this->runs[0].status));
+				EXPECT_EQ("42|1\n", this->runs[0].output.text());
+				EXPECT_EQ(1u, this->runs[0].dbrows);
+				EXPECT_EQ(1, WEXITSTATUS(this->runs[1].status));
+				EXPECT_NE(string::npos, this->runs[1].dberror.find("syntax error"));
+			}
+#endif
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
@@ -0,0 +1,44 @@
+/*
+ *  gtest-entry_fixture.hpp
+ *  Tinjac
+ *
+ *  The fixture the job running tests share: crontab lines parsed one at
+ *  a time, as the user running the tests, into an arena of their own.
+ *
+ */
+#ifndef GTEST_ENTRY_FIXTURE_HPP_
+#define GTEST_ENTRY_FIXTURE_HPP_
+
+#include <gtest/gtest.h>
+#include <cstring>
+#include <pwd.h>
+#include <unistd.h>
+#include "env.hpp"
+#include "arena.hpp"
+#include "crontabparser.hpp"
+
+namespace testing {
+	namespace internal {
+		class EntryTest : public testing::Test {
+			protected:
+				virtual void SetUp() {
+					this->pw = getpwuid(getuid());
+					this->envp = env_init();
+				}
+				virtual void TearDown() {
+					env_free(this->envp);
+				}
+				/* the first line of tab, with this->envp for its environment */
+				entry *load(const char *tab) {
+					CrontabParser parser(tab, strlen(tab), "tab");
+					parser.setArena(&this->arena);
+					return parser.load_entry(this->pw, this->envp);
+				}
+			struct passwd *pw;
+			char **envp;
+			Arena arena;
+		};
+	}  // namespace internal
+}  // namespace testing
+
+#endif /* GTEST_ENTRY_FIXTURE_HPP_ */
@@ -0,0 +1,233 @@
+/*
+ *  gtest-filewatch_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/bind.hpp>
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "scheduler.hpp"
+#include "filewatch.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			class FileWatchTest : public testing::Test {
+				protected:
+					virtual void SetUp() {
+						char tmpl[] = "/tmp/tinjac_test.XXXXXX";
+
+						ASSERT_TRUE(mkdtemp(tmpl) != NULL);
+						this->dir = tmpl;
+						this->pw = getpwuid(getuid());
+						this->envp = env_init();
+						this->watcher = new FileWatch(&this->sched);
+						this->watcher->setLaunch(boost::bind(&FileWatchTest::launched, this, _1, _2, _3));
+						ASSERT_TRUE(this->watcher->start());
+					}
+					virtual void TearDown() {
+						delete this->watcher;
+						for (size_t i = 0; i < this->files.size(); i++)
+							delete this->files[i];
+						env_free(this->envp);
+						remove_all(this->dir);
+					}
+					/* a crontab of tab, with DIR standing for the directory */
+					CrontabFile *load(string tab, struct passwd *pw = NULL) {
+						char envstr[MAX_ENVSTR];
+						CrontabFile *file = new CrontabFile("watch", NULL);
+						size_t at;
+						entry *e;
+
+						while ((at = tab.find("DIR")) != string::npos)
+							tab.replace(at, 3, this->dir);
+						CrontabParser parser(tab.data(), tab.size(), "watch");
+						parser.setArena(&file->arena);
+						while (parser.load_env(envstr) >= OK)
+							if ((e = parser.load_entry(pw ? pw : this->pw, this->envp)) != NULL)
+								file->entries.push_back(e);
+						this->files.push_back(file);
+						return (file);
+					}
+					void put(const string &name, const char *text = "x") {
+						FILE *fp = fopen((this->dir + "/" + name).c_str(), "w");
+
+						ASSERT_TRUE(fp != NULL);
+						fputs(text, fp);
+						fclose(fp);
+					}
+					void launched(const entry *, CrontabFile *file, int infd) {
+						string list;
+						char buf[4096];
+						ssize_t n;
+
+						ASSERT_NE(-1, infd);
+						while ((n = ::read(infd, buf, sizeof(buf))) > 0)
+							list.append(buf, n);
+						this->lists.push_back(list);
+						this->from.push_back(file);
+					}
+					void idle(time_t now) {
+						time_t next;
+
+						if ((next = this->watcher->tick(now)) != -1)
+							this->sched.wakeAt(next);
+						if (this->lists.size() >= this->want || now >= this->timeout)
+							this->sched.stop();
+					}
+					void finish(size_t want) {
+						this->want = want;
+						this->timeout = time(NULL) + 30;
+						this->sched.setIdle(boost::bind(&FileWatchTest::idle, this, _1), 1);
+						this->sched.run(JobCallback());
+					}
+				string dir;
+				struct passwd *pw;
+				char **envp;
+				Scheduler sched;
+				FileWatch *watcher;
+				vector<CrontabFile *> files;
+				vector<string> lists;
+				vector<CrontabFile *> from;
+				size_t want;
+				time_t timeout;
+			};
+
+			TEST_F(FileWatchTest, GathersABurstIntoOneRun) {
+				char name[32];
+
+				this->watcher->addFile(this->load("@watch~1s DIR /bin/true\n"));
+				EXPECT_EQ(1u, this->watcher->size());
+				EXPECT_EQ(1u, this->watcher->watchCount());
+				for (int i = 0; i < 500; i++) {
+					snprintf(name, sizeof(name), "f%03d", i);
+					this->put(name);
+				}
+				/* written again, and renamed into place */
+				this->put("f000");
+				this->put(".f500");
+				ASSERT_EQ(0, rename((this->dir + "/.f500").c_str(), (this->dir + "/f500").c_str()));
+				this->finish(1);
+				ASSERT_EQ(1u, this->lists.size());
+				/* .f500 was there for a moment, but it was written */
+				EXPECT_EQ(502, count(this->lists[0].begin(), this->lists[0].end(), '\n'));
+				EXPECT_EQ(0u, this->lists[0].find(this->dir + "/.f500\n" + this->dir + "/f000\n" + this->dir + "/f001\n"));
+				EXPECT_NE(string::npos, this->lists[0].find(this->dir + "/f500\n"));
+				EXPECT_EQ(1u, this->watcher->getStats().runs);
+				EXPECT_EQ(-1, this->watcher->tick(time(NULL)));
+			}
+			TEST_F(FileWatchTest, WatchesDirectoriesAsTheyAppear) {
+				ASSERT_EQ(0, mkdir((this->dir + "/old").c_str(), 0755));
+				this->watcher->addFile(this->load("@watch~1s DIR/** /bin/true\n"));
+				EXPECT_EQ(2u, this->watcher->watchCount());
+				this->put("old/a");
+				/* likely written before the new directories are watched */
+				ASSERT_EQ(0, mkdir((this->dir + "/new").c_str(), 0755));
+				ASSERT_EQ(0, mkdir((this->dir + "/new/deeper").c_str(), 0755));
+				this->put("new/deeper/b");
+				this->finish(1);
+				ASSERT_EQ(1u, this->lists.size());
+				EXPECT_EQ(this->dir + "/new/deeper/b\n" + this->dir + "/old/a\n", this->lists[0]);
+				EXPECT_EQ(4u, this->watcher->watchCount());
+				/* moved within the tree, it's watched where it is now */
+				ASSERT_EQ(0, rename((this->dir + "/new").c_str(), (this->dir + "/moved").c_str()));
+				this->put("moved/deeper/c");
+				this->finish(2);
+				ASSERT_EQ(2u, this->lists.size());
+				EXPECT_NE(string::npos, this->lists[1].find(this->dir + "/moved/deeper/c\n"));
+				EXPECT_EQ(string::npos, this->lists[1].find(this->dir + "/new/"));
+				EXPECT_EQ(4u, this->watcher->watchCount());
+			}
+			TEST_F(FileWatchTest, WatchesAFileThroughItsDirectory) {
+				this->watcher->addFile(this->load("@watch~1s DIR/app.conf /bin/true\n"));
+				this->put("other");
+				this->put("app.conf.new");
+				ASSERT_EQ(0, rename((this->dir + "/app.conf.new").c_str(), (this->dir + "/app.conf").c_str()));
+				this->finish(1);
+				ASSERT_EQ(1u, this->lists.size());
+				EXPECT_EQ(this->dir + "/app.conf\n", this->lists[0]);
+			}
+			TEST_F(FileWatchTest, ListsItsPathsAfterAnOverflow) {
+				FILE *fp = fopen("/proc/sys/fs/inotify/max_queued_events", "r");
+				int queued = 0;
+				char name[32];
+
+				ASSERT_TRUE(fp != NULL);
+				ASSERT_EQ(1, fscanf(fp, "%d", &queued));
+				fclose(fp);
+				/* each file is two events, so this overflows whatever */
+				if (queued > 100000)
+					return;
+				this->watcher->addFile(this->load("@watch~1s DIR/** /bin/true\n@watch~1s DIR/app.conf /bin/true\n"));
+				for (int i = 0; i < queued; i++) {
+					snprintf(name, sizeof(name), "f%d", i);
+					this->put(name);
+				}
+				this->finish(2);
+				ASSERT_EQ(2u, this->lists.size());
+				/* anything may have changed, so both are told to look */
+				EXPECT_EQ(1u, this->watcher->getStats().overflows);
+				EXPECT_EQ(1u, this->watcher->getStats().rescans);
+				EXPECT_NE(this->lists[0], this->lists[1]);
+				for (size_t i = 0; i < 2; i++)
+					EXPECT_TRUE(this->lists[i] == this->dir + "\n" || this->lists[i] == this->dir + "/app.conf\n");
+			}
+			TEST_F(FileWatchTest, OnlyWatchesWhatItsUserCouldList) {
+				struct passwd *nobody = getpwnam("nobody");
+
+				if (nobody == NULL || getuid() == nobody->pw_uid)
+					return;
+				ASSERT_EQ(0, chmod(this->dir.c_str(), 0700));
+				this->watcher->addFile(this->load("@watch DIR /bin/true\n", nobody));
+				EXPECT_EQ(0u, this->watcher->watchCount());
+				/* it's tried again later */
+				EXPECT_NE(-1, this->watcher->tick(time(NULL)));
+				ASSERT_EQ(0, chmod(this->dir.c_str(), 0755));
+				this->watcher->tick(time(NULL) + WATCH_RETRY);
+				EXPECT_EQ(1u, this->watcher->watchCount());
+				EXPECT_EQ(-1, this->watcher->tick(time(NULL) + WATCH_RETRY));
+			}
+			TEST_F(FileWatchTest, OnlyWatchesWhatItsUserCouldGetTo) {
+				struct passwd *nobody = getpwnam("nobody");
+
+				if (nobody == NULL || getuid() == nobody->pw_uid)
+					return;
+				/* open to all, but inside a directory that isn't */
+				ASSERT_EQ(0, mkdir((this->dir + "/open").c_str(), 0755));
+				ASSERT_EQ(0, chmod(this->dir.c_str(), 0700));
+				this->watcher->addFile(this->load("@watch DIR/open/** /bin/true\n@watch DIR/open/file /bin/true\n", nobody));
+				EXPECT_EQ(0u, this->watcher->watchCount());
+				ASSERT_EQ(0, chmod(this->dir.c_str(), 0711));
+				this->watcher->tick(time(NULL) + WATCH_RETRY);
+				EXPECT_EQ(1u, this->watcher->watchCount());
+			}
+			TEST_F(FileWatchTest, KeepsABurstAcrossAReload) {
+				CrontabFile *old = this->load("@watch~1s DIR /bin/true\n@watch~1s DIR /bin/false\n");
+				CrontabFile *file = this->load("@watch~1s DIR /bin/true\n");
+
+				this->watcher->addFile(old);
+				this->put("a");
+				this->watcher->processEvents();
+				EXPECT_EQ(1u, this->watcher->replaceFile(old, file));
+				EXPECT_EQ(1u, this->watcher->size());
+				EXPECT_EQ(1u, this->watcher->watchCount());
+				this->finish(1);
+				ASSERT_EQ(1u, this->lists.size());
+				EXPECT_EQ(this->dir + "/a\n", this->lists[0]);
+				EXPECT_EQ(file, this->from[0]);
+				this->watcher->removeFile(file);
+				EXPECT_EQ(0u, this->watcher->size());
+				EXPECT_EQ(0u, this->watcher->watchCount());
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
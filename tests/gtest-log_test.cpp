@@ -0,0 +1,208 @@
+/*
+ *  gtest-log_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "log.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			class LogTest : public testing::Test {
+				protected:
+					virtual void SetUp() {
+						char name[] = "/tmp/tinjac-log.XXXXXX";
+						int fd;
+
+						ASSERT_NE(-1, fd = mkstemp(name));
+						close(fd);
+						this->name = name;
+					}
+					virtual void TearDown() {
+						unlink(this->name.c_str());
+					}
+					string read() {
+						std::ifstream in(this->name.c_str());
+						std::stringstream text;
+						text << in.rdbuf();
+						return text.str();
+					}
+					vector<string> lines() {
+						std::istringstream in(this->read());
+						vector<string> lines;
+						string line;
+						while (getline(in, line))
+							lines.push_back(line);
+						return lines;
+					}
+				string name;
+			};
+
+			struct Writer {
+				Log *log;
+				int id, lines;
+			};
+
+			static void *write_lines(void *arg) {
+				Writer *w = (Writer *)arg;
+				int i;
+
+				for (i = 0; i < w->lines; i++)
+					w->log->Write(LOGLEVEL_DEBUG, "writer.cpp", w->id, "%d %d", w->id, i);
+				return NULL;
+			}
+
+			static int counted;
+			static int count() {
+				return ++counted;
+			}
+
+			TEST_F(LogTest, WritesTextAsItAlwaysHas) {
+				Log log(this->name.c_str());
+
+				log.Write(LOGLEVEL_ERROR, "main.cpp", 12, "hello %s %d", "world", 3);
+				EXPECT_EQ("main.cpp:12: hello world 3\n", this->read());
+				EXPECT_EQ(1u, log.getStats().written);
+			}
+			TEST_F(LogTest, WritesKeyValuesAndJson) {
+				Log log(this->name.c_str());
+
+				EXPECT_FALSE(log.setFormat("xml"));
+				ASSERT_TRUE(log.setFormat("kv"));
+				log.Write(LOGLEVEL_ERROR, "main.cpp", 12, "said \"%s\"", "hi\nthere");
+				ASSERT_TRUE(log.setFormat("json"));
+				log.Write(LOGLEVEL_DEBUG, "main.cpp", 13, "tab\tand \\%c", '\001');
+				vector<string> lines = this->lines();
+				ASSERT_EQ(2u, lines.size());
+				/* time=2021-01-04T00:00:00.123Z */
+				EXPECT_EQ(0u, lines[0].find("time="));
+				EXPECT_EQ('Z', lines[0][28]);
+				EXPECT_EQ(" level=error file=main.cpp line=12 msg=\"said \\\"hi\\nthere\\\"\"", lines[0].substr(29));
+				EXPECT_EQ(0u, lines[1].find("{\"time\":\""));
+				EXPECT_EQ("\",\"level\":\"debug\",\"file\":\"main.cpp\",\"line\":13,\"msg\":\"tab\\tand \\\\\\u0001\"}",
+					lines[1].substr(33));
+			}
+			TEST_F(LogTest, LeavesOutWhatIsntWanted) {
+				Log log(this->name.c_str()), *saved = logFacility;
+
+				counted = 0;
+				logFacility = &log;
+				log.setLevel(LOGLEVEL_ERROR);
+				/* not even the arguments */
+				DLOG("debug %d", count());
+				ELOG("error %d", count());
+				logFacility = saved;
+				EXPECT_EQ(1, counted);
+				vector<string> lines = this->lines();
+				ASSERT_EQ(1u, lines.size());
+				EXPECT_NE(string::npos, lines[0].find(": error 1"));
+			}
+			TEST_F(LogTest, WritesReportsAtEveryLevel) {
+				Log log(this->name.c_str()), *saved = logFacility;
+
+				logFacility = &log;
+				log.setLevel(LOGLEVEL_ERROR);
+				log.setFormat(Log::KEYVALUE);
+				RLOG("%d crontabs", 3);
+				logFacility = saved;
+				vector<string> lines = this->lines();
+				ASSERT_EQ(1u, lines.size());
+				EXPECT_NE(string::npos, lines[0].find(" level=report "));
+				EXPECT_NE(string::npos, lines[0].find("msg=\"3 crontabs\""));
+			}
+			TEST_F(LogTest, KeepsEachThreadsLinesInOrder) {
+				Log log(this->name.c_str(), 16384);
+				pthread_t threads[4];
+				Writer writers[4];
+				vector<int> next(4, 0);
+				int i, id, n;
+
+				ASSERT_TRUE(log.start());
+				for (i = 0; i < 4; i++) {
+					writers[i].log = &log;
+					writers[i].id = i;
+					writers[i].lines = 2000;
+					ASSERT_EQ(0, pthread_create(&threads[i], NULL, write_lines, &writers[i]));
+				}
+				for (i = 0; i < 4; i++)
+					pthread_join(threads[i], NULL);
+				log.stop();
+				EXPECT_EQ(8000u, log.getStats().written);
+				EXPECT_EQ(0u, log.getStats().dropped);
+				vector<string> lines = this->lines();
+				ASSERT_EQ(8000u, lines.size());
+				for (i = 0; i < (int)lines.size(); i++) {
+					ASSERT_EQ(2, sscanf(lines[i].c_str(), "writer.cpp:%*d: %d %d", &id, &n));
+					ASSERT_TRUE(id >= 0 && id < 4);
+					EXPECT_EQ(next[id]++, n);
+				}
+			}
+			TEST_F(LogTest, StopsWhileThreadsAreWriting) {
+				Log log(this->name.c_str(), 16384);
+				pthread_t threads[4];
+				Writer writers[4];
+				int i;
+
+				ASSERT_TRUE(log.start());
+				for (i = 0; i < 4; i++) {
+					writers[i].log = &log;
+					writers[i].id = i;
+					writers[i].lines = 20000;
+					ASSERT_EQ(0, pthread_create(&threads[i], NULL, write_lines, &writers[i]));
+				}
+				/* the rest of their lines are written directly */
+				log.stop();
+				for (i = 0; i < 4; i++)
+					pthread_join(threads[i], NULL);
+				Log::Stats stats = log.getStats();
+				EXPECT_EQ(80000u, stats.written + stats.dropped);
+				EXPECT_EQ(stats.written, this->lines().size() - (stats.dropped > 0 ? 1 : 0));
+			}
+			TEST_F(LogTest, DropsLinesRatherThanWait) {
+				Log log(this->name.c_str(), 2);
+				Writer w = { &log, 0, 50000 };
+
+				ASSERT_TRUE(log.start());
+				write_lines(&w);
+				log.stop();
+				Log::Stats stats = log.getStats();
+				EXPECT_EQ(50000u, stats.written + stats.dropped);
+				if (stats.dropped > 0) {
+					EXPECT_NE(string::npos, this->read().find("log lines, the log couldn't keep up"));
+				}
+				/* and after stop() it writes directly again */
+				log.Write(LOGLEVEL_ERROR, "main.cpp", 1, "%s", "after");
+				EXPECT_EQ(stats.written + 1, log.getStats().written);
+			}
+			TEST_F(LogTest, AForkedChildWritesItsOwnLines) {
+				Log log(this->name.c_str());
+				pid_t pid;
+				int status;
+
+				ASSERT_TRUE(log.start());
+				log.Write(LOGLEVEL_DEBUG, "parent.cpp", 1, "%s", "before");
+				if ((pid = fork()) == 0) {
+					log.Write(LOGLEVEL_DEBUG, "child.cpp", 1, "%s", "from the child");
+					_exit(0);
+				}
+				ASSERT_NE(-1, pid);
+				ASSERT_EQ(pid, waitpid(pid, &status, 0));
+				log.stop();
+				string text = this->read();
+				EXPECT_NE(string::npos, text.find("parent.cpp:1: before\n"));
+				EXPECT_NE(string::npos, text.find("child.cpp:1: from the child\n"));
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
@@ -0,0 +1,332 @@
+/*
+ *  gtest-mailspool_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <boost/bind.hpp>
+#include <boost/filesystem.hpp>
+#include "mailtransport.hpp"
+#include "mailspool.hpp"
+#include "scheduler.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			/* keeps what it is given, or turns it away */
+			class FakeTransport : public MailTransport {
+			public:
+				struct Message {
+					string from, to, text;
+				};
+				FakeTransport() : refuse(false) {}
+				bool send(const string &from, const string &to, const string &message) {
+					Message m = { from, to, message };
+
+					if (this->refuse)
+						return (false);
+					this->messages.push_back(m);
+					return (true);
+				}
+				string describe() const { return ("fake"); }
+				bool refuse;
+				vector<Message> messages;
+			};
+
+			class MailSpoolTest : public testing::Test {
+				protected:
+					virtual void SetUp() {
+						char dir[] = "/tmp/tinjac-mail.XXXXXX";
+
+						ASSERT_TRUE(mkdtemp(dir) != NULL);
+						this->dir = dir;
+						this->spool = new MailSpool(this->dir + "/spool");
+						ASSERT_TRUE(this->spool->open());
+						this->spool->setTransport(&this->transport);
+					}
+					virtual void TearDown() {
+						delete this->spool;
+						boost::filesystem::remove_all(this->dir);
+					}
+					/* does what a crash part way through a flush would leave behind */
+					void crash() {
+						delete this->spool;
+						rename((this->dir + "/spool").c_str(), (this->dir + "/spool.sending").c_str());
+						this->spool = new MailSpool(this->dir + "/spool");
+						ASSERT_TRUE(this->spool->open());
+						this->spool->setTransport(&this->transport);
+					}
+					void idle(time_t now) {
+						if (this->spool->getStats().messages > 0 || now >= this->timeout)
+							this->sched.stop();
+					}
+					/* until the thread has sent something */
+					void finish() {
+						this->timeout = time(NULL) + 30;
+						this->sched.setIdle(boost::bind(&MailSpoolTest::idle, this, _1), 1);
+						this->sched.run(JobCallback());
+					}
+				string dir;
+				Scheduler sched;
+				MailSpool *spool;
+				FakeTransport transport;
+				time_t timeout;
+			};
+
+			TEST_F(MailSpoolTest, SendsEachRecipientOneDigest) {
+				EXPECT_TRUE(this->spool->add("alice", "root", "Cron <alice@host> one", "first\n", 100));
+				EXPECT_TRUE(this->spool->add("bob", "root", "Cron <bob@host> two", "second", 100));
+				EXPECT_TRUE(this->spool->add("alice", "root", "Cron <alice@host> three", "third\n", 160));
+				EXPECT_EQ(2u, this->spool->flush(0, true));
+				ASSERT_EQ(2u, this->transport.messages.size());
+				const FakeTransport::Message &alice = this->transport.messages[0];
+				EXPECT_EQ("alice", alice.to);
+				EXPECT_EQ("root", alice.from);
+				EXPECT_NE(string::npos, alice.text.find("Subject: Cron <"));
+				EXPECT_NE(string::npos, alice.text.find("> output of 2 jobs\n"));
+				EXPECT_NE(string::npos, alice.text.find("\nAuto-Submitted: auto-generated\n"));
+				/* a section for each job, in the order they finished */
+				size_t one = alice.text.find("--- Cron <alice@host> one, ");
+				size_t three = alice.text.find("--- Cron <alice@host> three, ");
+				ASSERT_NE(string::npos, one);
+				ASSERT_NE(string::npos, three);
+				EXPECT_LT(one, three);
+				EXPECT_NE(string::npos, alice.text.find("first\n"));
+				/* just the one job keeps its own subject */
+				const FakeTransport::Message &bob = this->transport.messages[1];
+				EXPECT_NE(string::npos, bob.text.find("\nSubject: Cron <bob@host> two\n"));
+				EXPECT_NE(string::npos, bob.text.find("second\n"));
+				EXPECT_EQ(3u, this->spool->getStats().queued);
+				EXPECT_EQ(2u, this->spool->getStats().messages);
+				/* and there is nothing left */
+				EXPECT_EQ(-1, this->spool->nextFlush());
+				EXPECT_EQ(0u, this->spool->flush(0, true));
+			}
+			TEST_F(MailSpoolTest, WaitsForTheInterval) {
+				time_t now = time(NULL);
+
+				this->spool->setInterval(60);
+				EXPECT_EQ(-1, this->spool->nextFlush());
+				EXPECT_TRUE(this->spool->add("alice", "root", "subject", "body\n", now));
+				EXPECT_LE(this->spool->nextFlush(), now + 60);
+				EXPECT_GT(this->spool->nextFlush(), now);
+				EXPECT_EQ(0u, this->spool->flush(now));
+				EXPECT_EQ(1u, this->spool->flush(this->spool->nextFlush()));
+				EXPECT_EQ(1u, this->transport.messages.size());
+			}
+			TEST_F(MailSpoolTest, KeepsWhatCouldntBeSent) {
+				EXPECT_TRUE(this->spool->add("alice", "root", "subject", "body\n", 100));
+				this->transport.refuse = true;
+				EXPECT_EQ(0u, this->spool->flush(0, true));
+				EXPECT_EQ(1u, this->spool->getStats().failed);
+				EXPECT_NE(-1, this->spool->nextFlush());
+				this->transport.refuse = false;
+				EXPECT_EQ(1u, this->spool->flush(0, true));
+				ASSERT_EQ(1u, this->transport.messages.size());
+				EXPECT_NE(string::npos, this->transport.messages[0].text.find("body\n"));
+			}
+			TEST_F(MailSpoolTest, BacksOffBeforeTryingAgain) {
+				time_t now = time(NULL);
+
+				this->spool->setInterval(0);
+				EXPECT_TRUE(this->spool->add("alice", "root", "subject", "body\n", now));
+				this->transport.refuse = true;
+				EXPECT_EQ(0u, this->spool->flush(now));
+				EXPECT_EQ(1u, this->spool->getStats().failed);
+				this->transport.refuse = false;
+				/* it isn't due again yet */
+				EXPECT_EQ(0u, this->spool->flush(now + MAIL_RETRY - 1));
+				EXPECT_EQ(0u, this->transport.messages.size());
+				EXPECT_NE(-1, this->spool->nextFlush());
+				EXPECT_EQ(1u, this->spool->flush(now + MAIL_RETRY));
+				EXPECT_EQ(1u, this->transport.messages.size());
+				EXPECT_EQ(-1, this->spool->nextFlush());
+			}
+			TEST_F(MailSpoolTest, GivesUpOnWhatNeverGoes) {
+				time_t now = time(NULL);
+				string dead = this->dir + "/spool.dead";
+				int i;
+
+				this->spool->setInterval(0);
+				EXPECT_TRUE(this->spool->add("alice", "root", "tried", "body\n", now));
+				EXPECT_TRUE(this->spool->add("bob", "root", "old", "body\n", now - MAIL_AGE_MAX));
+				this->transport.refuse = true;
+				EXPECT_EQ(0u, this->spool->flush(now, true));
+				/* bob's was too old to try again */
+				EXPECT_EQ(1u, this->spool->getStats().dead);
+				for (i = 1; i < MAIL_ATTEMPTS_MAX; i++)
+					EXPECT_EQ(0u, this->spool->flush(now, true));
+				EXPECT_EQ((unsigned long)MAIL_ATTEMPTS_MAX + 1, this->spool->getStats().failed);
+				EXPECT_EQ(2u, this->spool->getStats().dead);
+				EXPECT_EQ(-1, this->spool->nextFlush());
+				ASSERT_TRUE(boost::filesystem::exists(dead));
+				std::ifstream in(dead.c_str());
+				string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+				EXPECT_NE(string::npos, text.find("bobrootold"));
+				EXPECT_NE(string::npos, text.find("aliceroottried"));
+				boost::filesystem::remove(dead);
+			}
+			TEST_F(MailSpoolTest, SendsOnItsOwnThread) {
+				ASSERT_TRUE(this->spool->start(&this->sched));
+				EXPECT_TRUE(this->spool->add("alice", "root", "subject", "body\n", 100));
+				/* it is only asked for */
+				EXPECT_EQ(0u, this->spool->flush(0, true));
+				EXPECT_EQ(-1, this->spool->nextFlush());
+				this->finish();
+				ASSERT_EQ(1u, this->transport.messages.size());
+				EXPECT_EQ("alice", this->transport.messages[0].to);
+				EXPECT_EQ(1u, this->spool->getStats().messages);
+			}
+			TEST_F(MailSpoolTest, SendsWhatACrashLeftBehind) {
+				EXPECT_TRUE(this->spool->add("alice", "root", "subject", "kept\n", 100));
+				EXPECT_TRUE(this->spool->add("bob", "root", "subject", "cut short\n", 100));
+				/* the last record half written */
+				off_t size = boost::filesystem::file_size(this->dir + "/spool");
+				ASSERT_EQ(0, truncate((this->dir + "/spool").c_str(), size - 5));
+				this->crash();
+				EXPECT_NE(-1, this->spool->nextFlush());
+				EXPECT_EQ(1u, this->spool->flush(0, true));
+				ASSERT_EQ(1u, this->transport.messages.size());
+				EXPECT_EQ("alice", this->transport.messages[0].to);
+				EXPECT_FALSE(boost::filesystem::exists(this->dir + "/spool.sending"));
+			}
+			TEST_F(MailSpoolTest, RefusesUnsafeAddresses) {
+				EXPECT_TRUE(MailSpool::safeAddress("alice@example.com"));
+				EXPECT_TRUE(MailSpool::safeAddress("a.b+c_d%e-f"));
+				EXPECT_FALSE(MailSpool::safeAddress(""));
+				EXPECT_FALSE(MailSpool::safeAddress("-oQ/tmp"));
+				EXPECT_FALSE(MailSpool::safeAddress("alice>\r\nRCPT TO:<bob"));
+				EXPECT_FALSE(MailSpool::safeAddress("alice bob"));
+				EXPECT_FALSE(this->spool->add("-f", "root", "subject", "body\n", 100));
+				EXPECT_FALSE(this->spool->add("alice", "root;rm", "subject", "body\n", 100));
+				/* nor can a subject add headers */
+				EXPECT_TRUE(this->spool->add("alice", "root", "one\nBcc: bob", "body\n", 100));
+				EXPECT_EQ(1u, this->spool->flush(0, true));
+				EXPECT_NE(string::npos, this->transport.messages[0].text.find("\nSubject: one Bcc: bob\n"));
+			}
+
+			/* a mail server that takes one message, and hands back what it was sent */
+			static string smtp_server(int listener) {
+				string in;
+				char buf[4096];
+				bool data = false;
+				ssize_t n;
+				size_t eol;
+				int fd = accept(listener, NULL, NULL);
+
+				if (fd == -1)
+					return ("");
+				::write(fd, "220 stand-in ESMTP\r\n", 20);
+				for (;;) {
+					if ((n = ::read(fd, buf, sizeof(buf))) <= 0)
+						break;
+					in.append(buf, n);
+					if (data) {
+						if (in.size() < 5 || in.compare(in.size() - 5, 5, "\r\n.\r\n") != 0)
+							continue;
+						data = false;
+						::write(fd, "250 queued\r\n", 12);
+						continue;
+					}
+					if ((eol = in.rfind("\r\n")) != in.size() - 2)
+						continue;
+					eol = in.rfind("\r\n", eol - 1);
+					string line = in.substr(eol == string::npos ? 0 : eol + 2);
+					if (line.compare(0, 4, "EHLO") == 0)
+						::write(fd, "250-stand-in\r\n250 8BITMIME\r\n", 28);
+					else if (line.compare(0, 4, "DATA") == 0) {
+						data = true;
+						::write(fd, "354 go ahead\r\n", 14);
+					} else if (line.compare(0, 4, "QUIT") == 0) {
+						::write(fd, "221 bye\r\n", 9);
+						break;
+					} else
+						::write(fd, "250 ok\r\n", 8);
+				}
+				::close(fd);
+				return (in);
+			}
+
+			TEST(SendmailTransportTest, SeesASendmailThatGivesUp) {
+				char dir[] = "/tmp/tinjac-sendmail.XXXXXX";
+				string message(1024 * 1024, 'x');
+
+				ASSERT_TRUE(mkdtemp(dir) != NULL);
+				string good = string(dir) + "/good", bad = string(dir) + "/bad";
+				/* named, a temporary stream would print the address of the text */
+				std::ofstream goodsh(good.c_str()), badsh(bad.c_str());
+				goodsh << "#!/bin/sh\ncat >/dev/null\n";
+				badsh << "#!/bin/sh\nexit 75\n";
+				goodsh.close();
+				badsh.close();
+				chmod(good.c_str(), 0700);
+				chmod(bad.c_str(), 0700);
+				EXPECT_TRUE(SendmailTransport(good).send("root", "alice", message));
+				/* going away without reading is EPIPE, not a SIGPIPE that kills us */
+				EXPECT_FALSE(SendmailTransport(bad).send("root", "alice", message));
+				boost::filesystem::remove_all(dir);
+			}
+			TEST(SmtpTransportTest, ParsesTheServer) {
+				SmtpTransport *smtp;
+
+				ASSERT_TRUE((smtp = SmtpTransport::parse("mail.example.com")) != NULL);
+				EXPECT_EQ("smtp://mail.example.com:25", smtp->describe());
+				delete smtp;
+				ASSERT_TRUE((smtp = SmtpTransport::parse("127.0.0.1:2525")) != NULL);
+				EXPECT_EQ("smtp://127.0.0.1:2525", smtp->describe());
+				delete smtp;
+				EXPECT_TRUE(SmtpTransport::parse("") == NULL);
+				EXPECT_TRUE(SmtpTransport::parse("host:") == NULL);
+				EXPECT_TRUE(SmtpTransport::parse("host:99999") == NULL);
+			}
+			TEST(SmtpTransportTest, SendsAMessage) {
+				struct sockaddr_in sin;
+				socklen_t len = sizeof(sin);
+				int listener, out[2];
+				string got;
+				char buf[4096];
+				ssize_t n;
+				pid_t pid;
+
+				ASSERT_NE(-1, listener = socket(AF_INET, SOCK_STREAM, 0));
+				memset(&sin, 0, sizeof(sin));
+				sin.sin_family = AF_INET;
+				sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+				ASSERT_EQ(0, bind(listener, (struct sockaddr *)&sin, sizeof(sin)));
+				ASSERT_EQ(0, listen(listener, 1));
+				ASSERT_EQ(0, getsockname(listener, (struct sockaddr *)&sin, &len));
+				ASSERT_EQ(0, pipe(out));
+				if ((pid = fork()) == 0) {
+					string in = smtp_server(listener);
+					::write(out[1], in.data(), in.size());
+					_exit(0);
+				}
+				ASSERT_NE(-1, pid);
+				::close(listener);
+				::close(out[1]);
+				SmtpTransport smtp("127.0.0.1", ntohs(sin.sin_port));
+				EXPECT_TRUE(smtp.send("root", "alice", "Subject: hi\n\nline\n.dot\n..two\n"));
+				while ((n = ::read(out[0], buf, sizeof(buf))) > 0)
+					got.append(buf, n);
+				::close(out[0]);
+				waitpid(pid, NULL, 0);
+				EXPECT_EQ(0u, got.find("EHLO "));
+				EXPECT_NE(string::npos, got.find("\r\nMAIL FROM:<root>\r\nRCPT TO:<alice>\r\nDATA\r\n"));
+				/* with \r\n line ends and the dots doubled */
+				EXPECT_NE(string::npos, got.find("Subject: hi\r\n\r\nline\r\n..dot\r\n...two\r\n.\r\nQUIT\r\n"));
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
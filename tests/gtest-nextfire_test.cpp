@@ -0,0 +1,237 @@
+/*
+ *  gtest-nextfire_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <pwd.h>
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "nextfire.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			class NextFireTest : public testing::Test {
+				protected:
+					virtual void SetUp() {
+						this->pw = getpwuid(0);
+						this->envp = env_init();
+						setenv("TZ", "UTC", 1);
+						tzset();
+					}
+					virtual void TearDown() {
+						env_free(this->envp);
+					}
+					entry *parse(const char *tab) {
+						CrontabParser parser(tab, strlen(tab), "test");
+						return parser.load_entry(this->pw, this->envp);
+					}
+					/* random entry, each field is either '*' or 1 - 4 values */
+					entry *random_entry(unsigned int *seed, const char *tz) {
+						entry *e = (entry *) calloc(sizeof (entry), sizeof (char));
+						char envstr[MAX_ENVSTR];
+						char **envp = env_copy(this->envp);
+
+						if (tz) {
+							snprintf(envstr, sizeof(envstr), "CRON_TZ=%s", tz);
+							envp = env_set(envp, envstr);
+						}
+						e->envp = env_intern(envp);
+						env_free(envp);
+						random_field(seed, e->minute, FIRST_MINUTE, LAST_MINUTE, 0, e, MIN_STAR);
+						random_field(seed, e->hour, FIRST_HOUR, LAST_HOUR, 0, e, HR_STAR);
+						random_field(seed, e->dom, FIRST_DOM, LAST_DOM, FIRST_DOM, e, DOM_STAR);
+						random_field(seed, e->month, FIRST_MONTH, LAST_MONTH, FIRST_MONTH, e, MON_STAR);
+						random_field(seed, e->dow, FIRST_DOW, LAST_DOW, 0, e, DOW_STAR);
+						return e;
+					}
+					void random_field(unsigned int *seed, bitstr_t *bits, int low, int high, int offset, entry *e, int star) {
+						int n;
+						if (rand_r(seed) % 3 == 0) {
+							bit_nset(bits, low - offset, high - offset);
+							e->flags |= star;
+							return;
+						}
+						for (n = rand_r(seed) % 4; n >= 0; n--)
+							bit_set(bits, low - offset + rand_r(seed) % (high - low + 1));
+					}
+					/* does e fire at this wall clock time, straight off the bitsets */
+					static bool brute_match(entry *e, const struct tm *tm) {
+						bool dom, dow;
+						if (!bit_test(e->minute, tm->tm_min) || !bit_test(e->hour, tm->tm_hour) ||
+								!bit_test(e->month, tm->tm_mon))
+							return false;
+						dom = bit_test(e->dom, tm->tm_mday - FIRST_DOM) != 0;
+						dow = bit_test(e->dow, tm->tm_wday) || (tm->tm_wday == 0 && bit_test(e->dow, 7));
+						if (e->flags & (DOM_STAR | DOW_STAR))
+							return dom && dow;
+						return dom || dow;
+					}
+					/* wall clock as seconds, so it can be compared and stepped */
+					static time_t wall(time_t t, struct tm *tm) {
+						localtime_r(&t, tm);
+						struct tm w = *tm;
+						return timegm(&w);
+					}
+					/* walk every minute from 'after' and return the first one
+					 * the entry fires on: wall clock times we haven't seen yet
+					 * that match, or the first minute after a DST gap that
+					 * skipped a matching time.
+					 */
+					static time_t brute_next(entry *e, time_t after, int days) {
+						struct tm tm, gtm;
+						time_t t, w, seen, end;
+
+						t = after - after % 60 - 3 * 3600;
+						seen = wall(t, &tm);
+						end = after + (time_t)days * 86400;
+						for (t += 60; t <= end; t += 60) {
+							w = wall(t, &tm);
+							bool fire = false;
+							if (w > seen) {
+								fire = brute_match(e, &tm);
+								for (time_t g = seen + 60; !fire && g < w; g += 60) {
+									gmtime_r(&g, &gtm);
+									fire = brute_match(e, &gtm);
+								}
+								seen = w;
+							}
+							if (fire && t > after)
+								return t;
+						}
+						return -1;
+					}
+				struct passwd *pw;
+				char **envp;
+			};
+
+			TEST_F(NextFireTest, SimpleTimes) {
+				entry *e = parse("30 2 * * * /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				NextFireCalculator calc(e);
+				/* 2021-01-01 00:00:00 UTC */
+				EXPECT_EQ(1609468200, calc.next(1609459200));
+				EXPECT_EQ(1609468200 + 86400, calc.next(1609468200));
+				free_entry(e);
+			}
+			TEST_F(NextFireTest, DayOfMonthIsNotOffByOne) {
+				entry *e = parse("0 0 15 * * /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				NextFireCalculator calc(e);
+				/* 2021-01-01 -> 2021-01-15 00:00 UTC */
+				EXPECT_EQ(1610668800, calc.next(1609459200));
+				free_entry(e);
+			}
+			TEST_F(NextFireTest, DomDowOrRule) {
+				/* the 13th, or any Friday */
+				entry *e = parse("0 0 13 * 5 /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				NextFireCalculator calc(e);
+				/* 2021-01-01 00:00 is a Friday, so the next is Friday 8th */
+				EXPECT_EQ(1610064000, calc.next(1609459200));
+				/* then the 13th, a Wednesday */
+				EXPECT_EQ(1610496000, calc.next(1610064000));
+				free_entry(e);
+				/* with a '*' in dom, only Fridays */
+				e = parse("0 0 * * 5 /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				NextFireCalculator calc2(e);
+				EXPECT_EQ(1610064000, calc2.next(1609459200));
+				EXPECT_EQ(1610668800, calc2.next(1610064000));
+				free_entry(e);
+			}
+			TEST_F(NextFireTest, YearRollover) {
+				entry *e = parse("0 0 1 1 * /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				NextFireCalculator calc(e);
+				/* 2021-01-01 00:00 -> 2022-01-01 00:00 */
+				EXPECT_EQ(1640995200, calc.next(1609459200));
+				free_entry(e);
+			}
+			TEST_F(NextFireTest, LeapDayAndNever) {
+				entry *e = parse("0 0 29 2 * /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				NextFireCalculator calc(e);
+				/* 2021-01-01 -> 2024-02-29 */
+				EXPECT_EQ(1709164800, calc.next(1609459200));
+				free_entry(e);
+				e = parse("0 0 30 2 * /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				NextFireCalculator calc2(e);
+				EXPECT_EQ(-1, calc2.next(1609459200));
+				free_entry(e);
+				e = parse("@reboot /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				NextFireCalculator calc3(e);
+				EXPECT_EQ(-1, calc3.next(1609459200));
+				free_entry(e);
+			}
+			TEST_F(NextFireTest, CronTZAndDST) {
+				char **save = this->envp;
+				this->envp = env_set(env_copy(save), (char *)"CRON_TZ=America/New_York");
+				/* 02:30 doesn't exist on 2021-03-14 in New York */
+				entry *e = parse("30 2 * * * /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				NextFireCalculator calc(e);
+				EXPECT_EQ("America/New_York", calc.getTimeZone());
+				/* 2021-03-14 05:00 UTC is 00:00 EST; fires at 03:00 EDT = 07:00 UTC */
+				EXPECT_EQ(1615705200, calc.next(1615698000));
+				free_entry(e);
+				/* 01:30 happens twice on 2021-11-07, but only fires once */
+				e = parse("30 1 * * * /bin/true\n");
+				ASSERT_TRUE(e != NULL);
+				NextFireCalculator calc2(e);
+				/* 2021-11-07 04:00 UTC is 00:00 EDT; 01:30 EDT = 05:30 UTC */
+				EXPECT_EQ(1636263000, calc2.next(1636257600));
+				/* and the next one is 01:30 EST on the 8th = 06:30 UTC */
+				EXPECT_EQ(1636353000, calc2.next(1636263000));
+				free_entry(e);
+				env_free(this->envp);
+				this->envp = save;
+				/* process TZ is left as it was */
+				EXPECT_STREQ("UTC", getenv("TZ"));
+			}
+			TEST_F(NextFireTest, MatchesBruteForce) {
+				const char *zones[] = { NULL, "America/New_York", "Europe/London", "Australia/Lord_Howe" };
+				/* around DST changes as well as random times */
+				const time_t starts[] = { 1615690800, 1636246800, 1616893200, 1635642000, 1617465600, 1633190400 };
+				unsigned int seed = 1;
+				int z, i, checked = 0;
+
+				for (z = 0; z < 4; z++) {
+					for (i = 0; i < 100; i++) {
+						entry *e = random_entry(&seed, zones[z]);
+						time_t after = (i % 2) ? starts[(i / 2) % 6] + rand_r(&seed) % 7200 :
+							1577836800 + rand_r(&seed) % (10 * 365 * 86400);
+						NextFireCalculator calc(e);
+						time_t got = calc.next(after);
+						if (zones[z]) {
+							setenv("TZ", zones[z], 1);
+							tzset();
+						}
+						time_t want = brute_next(e, after, 60);
+						setenv("TZ", "UTC", 1);
+						tzset();
+						if (want != -1 || got - after <= 60 * 86400) {
+							EXPECT_EQ(want, got) << "zone " << (zones[z] ? zones[z] : "UTC") << " after " << after << " case " << i;
+							checked++;
+						}
+						/* every time it fires should match, stepping along */
+						for (int n = 0; got != -1 && n < 5; n++) {
+							time_t nx = calc.next(got);
+							EXPECT_GT(nx, got);
+							got = nx;
+						}
+						free_entry(e);
+					}
+				}
+				EXPECT_GT(checked, 200);
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
@@ -0,0 +1,84 @@
+/*
+ *  gtest-outputcapture_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstring>
+#include <string>
+#include "outputcapture.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			TEST(OutputCaptureTest, KeepsEverythingThatFits) {
+				OutputCapture out(64, 64);
+
+				EXPECT_TRUE(out.empty());
+				out.feed("one\ntwo\n", 8);
+				out.feed("three", 5);
+				out.finish();
+				EXPECT_EQ("one\ntwo\nthree", out.text());
+				EXPECT_EQ(2u, out.getStats().lines);
+				EXPECT_EQ(0u, out.getStats().omitted);
+			}
+			TEST(OutputCaptureTest, KeepsTheHeadAndTailOfLongOutput) {
+				OutputCapture out(10, 10);
+				string chunk(1000, 'x');
+				int i;
+
+				out.feed("0123456789", 10);
+				for (i = 0; i < 10000; i++)
+					out.feed(chunk.data(), chunk.size());
+				out.feed("abc", 3);
+				out.feed("defghij\n", 8);
+				out.finish();
+				EXPECT_EQ(10u + 10000000 + 11, out.getStats().kept);
+				EXPECT_EQ(10000000u + 1, out.getStats().omitted);
+				EXPECT_EQ("0123456789\n[... 10000001 bytes omitted ...]\nbcdefghij\n", out.text());
+			}
+			TEST(OutputCaptureTest, WrapsTheTailInSmallPieces) {
+				OutputCapture out(0, 8);
+				const char *s = "abcdefghijklmnopqrstuvwxyz";
+				size_t i;
+
+				for (i = 0; i < 26; i += 3)
+					out.feed(s + i, min((size_t)26 - i, (size_t)3));
+				EXPECT_EQ("[... 18 bytes omitted ...]\nstuvwxyz", out.text());
+			}
+			TEST(OutputCaptureTest, FiltersLines) {
+				OutputFilter filter;
+				OutputCapture out(1024, 1024, &filter);
+				string err;
+				const char *text = "ok: one\nerror: two\nok: three\nwarning: four\nerror: five";
+
+				ASSERT_TRUE(filter.add("^(error|warning):", OutputFilter::KEEP));
+				ASSERT_TRUE(filter.add("four$", OutputFilter::DROP));
+				EXPECT_FALSE(filter.add("(unbalanced", OutputFilter::DROP, &err));
+				EXPECT_NE("", err);
+				/* a byte at a time, so every line arrives in pieces */
+				for (; *text; text++)
+					out.feed(text, 1);
+				out.finish();
+				EXPECT_EQ("error: two\nerror: five", out.text());
+				EXPECT_EQ(5u, out.getStats().lines);
+				EXPECT_EQ(3u, out.getStats().dropped);
+			}
+			TEST(OutputCaptureTest, FiltersLongLinesInPieces) {
+				OutputFilter filter;
+				OutputCapture out(1024 * 1024, 0, &filter);
+				string line(CAPTURE_LINE_MAX * 2 + 10, 'a');
+
+				ASSERT_TRUE(filter.add("b", OutputFilter::DROP));
+				line[CAPTURE_LINE_MAX + 5] = 'b';
+				line += '\n';
+				out.feed(line.data(), line.size());
+				out.finish();
+				EXPECT_EQ(3u, out.getStats().lines);
+				EXPECT_EQ(1u, out.getStats().dropped);
+				EXPECT_EQ((size_t)CAPTURE_LINE_MAX + 11, out.text().size());
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
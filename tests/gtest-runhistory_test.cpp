@@ -0,0 +1,271 @@
+/*
+ *  gtest-runhistory_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <boost/filesystem.hpp>
+#include "runhistory.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			class RunHistoryTest : public testing::Test {
+				protected:
+					virtual void SetUp() {
+						char dir[] = "/tmp/tinjac-history.XXXXXX";
+
+						ASSERT_TRUE(mkdtemp(dir) != NULL);
+						this->dir = dir;
+						this->history = new RunHistory(this->dir + "/history");
+						ASSERT_TRUE(this->history->open());
+					}
+					virtual void TearDown() {
+						delete this->history;
+						boost::filesystem::remove_all(this->dir);
+					}
+					/* what a fresh daemon makes of the directory */
+					void reopen(size_t keep = HISTORY_KEEP) {
+						delete this->history;
+						this->history = new RunHistory(this->dir + "/history");
+						this->history->setKeep(keep);
+						ASSERT_TRUE(this->history->open());
+					}
+					RunHistory::Run run(int64_t finished, int status = 0) {
+						RunHistory::Run r;
+
+						memset(&r, 0, sizeof(r));
+						r.started = finished - 1000;
+						r.finished = finished;
+						r.status = status;
+						r.utime = 250;
+						r.maxrss = 4096;
+						r.digest = RunHistory::digest("output");
+						return (r);
+					}
+					/* the segments in the history, by kind */
+					vector<string> segments(const char *kind) {
+						string history = this->dir + "/history", suffix = string(".") + kind;
+						vector<string> names;
+						struct dirent *de;
+						DIR *d;
+
+						if ((d = opendir(history.c_str())) == NULL)
+							return (names);
+						while ((de = readdir(d)) != NULL) {
+							string name = de->d_name;
+							if (name.size() > suffix.size() && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0)
+								names.push_back(history + "/" + name);
+						}
+						closedir(d);
+						return (names);
+					}
+				string dir;
+				RunHistory *history;
+			};
+
+			/* of the ten jobs the compaction tests add, the first five */
+			static bool first_five(boost::unordered_set<string> &live) {
+				char job[16];
+
+				for (int i = 0; i < 5; i++) {
+					snprintf(job, sizeof(job), ":%d", i);
+					live.insert(string(4000, 'x') + job);
+				}
+				return (true);
+			}
+
+			TEST(RunHistoryDigestTest, DigestsOutput) {
+				EXPECT_EQ(0u, RunHistory::digest(""));
+				EXPECT_NE(0u, RunHistory::digest("a"));
+				EXPECT_NE(RunHistory::digest("a"), RunHistory::digest("b"));
+				EXPECT_EQ(RunHistory::digest("same\n"), RunHistory::digest("same\n"));
+			}
+			TEST_F(RunHistoryTest, KeepsTheLastRunsOfEachJob) {
+				vector<pair<string, RunHistory::Run> > found;
+				vector<RunHistory::Run> runs;
+
+				this->history->setKeep(3);
+				for (int i = 1; i <= 5; i++)
+					this->history->add("tab:root:/bin/a", this->run(i * 1000000, i));
+				this->history->add("tab:root:/bin/b", this->run(2500000));
+				EXPECT_EQ(2u, this->history->jobs());
+				EXPECT_EQ(4u, this->history->size());
+				ASSERT_EQ(3u, this->history->last("tab:root:/bin/a", 10, runs));
+				/* the latest first */
+				EXPECT_EQ(5, runs[0].status);
+				EXPECT_EQ(4, runs[1].status);
+				EXPECT_EQ(3, runs[2].status);
+				ASSERT_EQ(1u, this->history->last("tab:root:/bin/a", 1, runs));
+				EXPECT_EQ(5000000, runs[0].finished);
+				EXPECT_EQ(0u, this->history->last("tab:root:/bin/c", 10, runs));
+				/* the first two runs of a have gone from here too */
+				ASSERT_EQ(3u, this->history->between(0, 4000001, found));
+				EXPECT_EQ("tab:root:/bin/b", found[0].first);
+				EXPECT_EQ("tab:root:/bin/a", found[1].first);
+				EXPECT_EQ(3, found[1].second.status);
+				EXPECT_EQ(4000000, found[2].second.finished);
+				EXPECT_EQ(6u, this->history->getStats().added);
+			}
+			TEST_F(RunHistoryTest, KnowsWhenAJobLastStarted) {
+				RunHistory::Run r = this->run(7000000);
+
+				EXPECT_EQ(-1, this->history->lastRun("tab:root:/bin/a"));
+				this->history->add("tab:root:/bin/a", this->run(5000000));
+				/* one that never started doesn't count */
+				r.flags = RunHistory::Run::UNSTARTED;
+				this->history->add("tab:root:/bin/a", r);
+				EXPECT_EQ(4, this->history->lastRun("tab:root:/bin/a"));
+				EXPECT_EQ(-1, this->history->lastRun("tab:root:/bin/b"));
+				EXPECT_EQ("tab:root:/bin/a", RunHistory::jobId("tab", "root", "/bin/a"));
+			}
+			TEST_F(RunHistoryTest, CommitsInGroups) {
+				time_t next;
+
+				EXPECT_EQ(-1, this->history->nextCommit());
+				for (int i = 0; i < 1000; i++)
+					this->history->add("tab:root:/bin/a", this->run(i));
+				ASSERT_NE(-1, next = this->history->nextCommit());
+				EXPECT_EQ(0u, this->history->commit(next - 1));
+				EXPECT_EQ(0u, this->history->getStats().commits);
+				EXPECT_EQ(1000u, this->history->commit(next));
+				EXPECT_EQ(1u, this->history->getStats().commits);
+				EXPECT_EQ(-1, this->history->nextCommit());
+				/* or sooner, when there's enough waiting */
+				for (int i = 0; this->history->getStats().commits < 2 && i < HISTORY_BUFFER_MAX; i++)
+					this->history->add("tab:root:/bin/b", this->run(i));
+				EXPECT_EQ(2u, this->history->getStats().commits);
+				EXPECT_EQ(-1, this->history->nextCommit());
+			}
+			TEST_F(RunHistoryTest, ReadsBackWhatWasCommitted) {
+				vector<RunHistory::Run> runs;
+
+				this->history->add("tab:root:/bin/a", this->run(1000000, 1));
+				this->history->add("tab:root:/bin/a", this->run(2000000, 2));
+				this->history->commit(0, true);
+				/* and what is still waiting when it's closed */
+				this->history->add("tab:root:/bin/b", this->run(3000000, 3));
+				this->reopen();
+				EXPECT_EQ(2u, this->history->jobs());
+				ASSERT_EQ(2u, this->history->last("tab:root:/bin/a", 10, runs));
+				EXPECT_EQ(2, runs[0].status);
+				EXPECT_EQ(1000000, runs[1].finished);
+				EXPECT_EQ(250, runs[1].utime);
+				EXPECT_EQ(4096u, runs[1].maxrss);
+				EXPECT_EQ(RunHistory::digest("output"), runs[1].digest);
+				ASSERT_EQ(1u, this->history->last("tab:root:/bin/b", 10, runs));
+				EXPECT_EQ(3, runs[0].status);
+				/* it goes on adding to the same segment */
+				this->history->add("tab:root:/bin/a", this->run(4000000, 4));
+				this->reopen();
+				EXPECT_EQ(3u, this->history->last("tab:root:/bin/a", 10, runs));
+				EXPECT_EQ(1u, this->segments("log").size());
+			}
+			TEST_F(RunHistoryTest, DropsARecordCutShort) {
+				vector<RunHistory::Run> runs;
+				vector<string> logs;
+				struct stat sb;
+				FILE *fp;
+
+				this->history->add("tab:root:/bin/a", this->run(1000000, 1));
+				this->history->commit(0, true);
+				logs = this->segments("log");
+				ASSERT_EQ(1u, logs.size());
+				ASSERT_EQ(0, stat(logs[0].c_str(), &sb));
+				/* the start of a record, as a crash part way through a write would leave */
+				ASSERT_TRUE((fp = fopen(logs[0].c_str(), "a")) != NULL);
+				fputs("TJRH\x10", fp);
+				fclose(fp);
+				this->reopen();
+				ASSERT_EQ(1u, this->history->last("tab:root:/bin/a", 10, runs));
+				this->history->add("tab:root:/bin/a", this->run(2000000, 2));
+				this->reopen();
+				ASSERT_EQ(2u, this->history->last("tab:root:/bin/a", 10, runs));
+				EXPECT_EQ(2, runs[0].status);
+				EXPECT_EQ(1, runs[1].status);
+			}
+			TEST_F(RunHistoryTest, CompactsClosedSegments) {
+				vector<RunHistory::Run> runs;
+				string name(4000, 'x');
+				char job[16];
+				int i;
+
+				this->reopen(2);
+				/* ten jobs with long names, until a compaction */
+				for (i = 0; this->history->getStats().compactions == 0 && i < 100000; i++) {
+					snprintf(job, sizeof(job), ":%d", i % 10);
+					this->history->add(name + job, this->run(i, i));
+				}
+				EXPECT_EQ(1u, this->history->getStats().compactions);
+				EXPECT_EQ((unsigned long)HISTORY_SEGMENTS, this->history->getStats().segments);
+				EXPECT_EQ(1u, this->segments("base").size());
+				/* and the segment after it, begun */
+				EXPECT_EQ(1u, this->segments("log").size());
+				EXPECT_EQ(0u, this->segments("tmp").size());
+				this->reopen(2);
+				EXPECT_EQ(10u, this->history->jobs());
+				EXPECT_EQ(20u, this->history->size());
+				snprintf(job, sizeof(job), ":%d", (i - 1) % 10);
+				ASSERT_EQ(2u, this->history->last(name + job, 10, runs));
+				EXPECT_EQ(i - 1, runs[0].status);
+				EXPECT_EQ(i - 11, runs[1].status);
+			}
+			TEST_F(RunHistoryTest, WritesOnAThread) {
+				vector<RunHistory::Run> runs;
+
+				ASSERT_TRUE(this->history->start());
+				this->history->add("tab:root:/bin/a", this->run(1000000, 1));
+				this->history->add("tab:root:/bin/a", this->run(2000000, 2));
+				EXPECT_EQ(2u, this->history->commit(0, true));
+				EXPECT_EQ(-1, this->history->nextCommit());
+				this->history->add("tab:root:/bin/b", this->run(3000000, 3));
+				/* which finishes what it was given before it goes */
+				this->reopen();
+				ASSERT_EQ(2u, this->history->last("tab:root:/bin/a", 10, runs));
+				EXPECT_EQ(2, runs[0].status);
+				EXPECT_EQ(1u, this->history->last("tab:root:/bin/b", 10, runs));
+			}
+			TEST_F(RunHistoryTest, ForgetsJobsThatLeftEveryCrontab) {
+				vector<RunHistory::Run> runs;
+				string name(4000, 'x');
+				char job[16];
+				int i;
+
+				this->reopen(2);
+				this->history->setLiveJobs(first_five);
+				ASSERT_TRUE(this->history->start());
+				for (i = 0; (i < 10 || this->history->jobs() == 10) && i < 100000; i++) {
+					snprintf(job, sizeof(job), ":%d", i % 10);
+					this->history->add(name + job, this->run(i, i));
+				}
+				/* gone at the compaction, from memory as well */
+				EXPECT_EQ(5u, this->history->jobs());
+				EXPECT_EQ(0u, this->history->last(name + ":9", 10, runs));
+				EXPECT_EQ(2u, this->history->last(name + ":4", 10, runs));
+				this->reopen(2);
+				EXPECT_EQ(5u, this->history->jobs());
+				EXPECT_EQ(10u, this->history->size());
+				EXPECT_EQ(1u, this->segments("base").size());
+				EXPECT_EQ(1u, this->segments("log").size());
+			}
+			TEST_F(RunHistoryTest, KeepsRunsInMemoryWithoutTheDirectory) {
+				vector<RunHistory::Run> runs;
+				RunHistory nowhere("/proc/tinjac-history");
+
+				EXPECT_FALSE(nowhere.open());
+				nowhere.add("tab:root:/bin/a", this->run(1000000));
+				EXPECT_EQ(1u, nowhere.last("tab:root:/bin/a", 10, runs));
+				EXPECT_EQ(-1, nowhere.nextCommit());
+				EXPECT_EQ(0u, nowhere.commit(0, true));
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
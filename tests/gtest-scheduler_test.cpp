@@ -0,0 +1,302 @@
+/*
+ *  gtest-scheduler_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <map>
+#include <pwd.h>
+#include <unistd.h>
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "scheduler.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			/* 2021-01-01 00:00:00 UTC */
+			const time_t T0 = 1609459200;
+
+			/* the run history the @period jobs are taken from, by command */
+			static map<string, time_t> lastruns;
+
+			static time_t last_run(const entry *e, const string &) {
+				map<string, time_t>::const_iterator it = lastruns.find(e->cmd);
+
+				return (it == lastruns.end() ? -1 : it->second);
+			}
+			static size_t ran_count(const vector<ScheduledJob *> &due, const char *cmd) {
+				size_t n = 0;
+
+				for (size_t i = 0; i < due.size(); i++)
+					n += !strcmp(due[i]->e->cmd, cmd);
+				return (n);
+			}
+
+			class SchedulerTest : public testing::Test {
+				protected:
+					virtual void SetUp() {
+						this->pw = getpwuid(0);
+						this->envp = env_init();
+						setenv("TZ", "UTC", 1);
+						tzset();
+					}
+					virtual void TearDown() {
+						env_free(this->envp);
+					}
+					CrontabFile *load(const char *name, const char *tab) {
+						CrontabFile *file = new CrontabFile(name, NULL);
+						CrontabParser parser(tab, strlen(tab), name);
+						entry *e;
+						parser.setArena(&file->arena);
+						while (!parser.eof())
+							if ((e = parser.load_entry(this->pw, this->envp)) != NULL)
+								file->entries.push_back(e);
+						return file;
+					}
+				struct passwd *pw;
+				char **envp;
+			};
+
+			TEST_F(SchedulerTest, RunsJobsInDeadlineOrder) {
+				Scheduler sched;
+				CrontabFile *file = load("a", "10 0 * * * /bin/ten\n*/5 * * * * /bin/five\n@reboot /bin/boot\n0 0 30 2 * /bin/never\n");
+				vector<ScheduledJob *> due;
+
+				sched.addFile(file, T0);
+				EXPECT_EQ(4u, sched.size());
+				EXPECT_EQ(T0 + 300, sched.nextDeadline());
+				EXPECT_EQ(0u, sched.runDue(T0 + 299, due));
+				EXPECT_EQ(1u, sched.runDue(T0 + 300, due));
+				EXPECT_STREQ("/bin/five", due[0]->e->cmd);
+				EXPECT_EQ(T0 + 600, due[0]->when);
+				due.clear();
+				/* both due at 00:10 */
+				EXPECT_EQ(2u, sched.runDue(T0 + 600, due));
+				EXPECT_EQ(T0 + 900, sched.nextDeadline());
+				due.clear();
+				EXPECT_EQ(1u, sched.rebootJobs(due));
+				EXPECT_STREQ("/bin/boot", due[0]->e->cmd);
+				sched.removeFile(file);
+				delete file;
+			}
+			TEST_F(SchedulerTest, LateTicksRunOnce) {
+				Scheduler sched;
+				CrontabFile *file = load("a", "* * * * * /bin/true\n");
+				vector<ScheduledJob *> due;
+
+				sched.addFile(file, T0);
+				/* an hour late, it runs once and is next due the minute after */
+				EXPECT_EQ(1u, sched.runDue(T0 + 3600, due));
+				EXPECT_EQ(T0 + 3660, sched.nextDeadline());
+				sched.removeFile(file);
+				delete file;
+			}
+			TEST_F(SchedulerTest, RemovingAFileLeavesTheOthers) {
+				Scheduler sched;
+				CrontabFile *a = load("a", "1 * * * * /bin/a\n");
+				CrontabFile *b = load("b", "2 * * * * /bin/b\n");
+				vector<ScheduledJob *> due;
+
+				sched.addFile(a, T0);
+				sched.addFile(b, T0);
+				EXPECT_EQ(2u, sched.size());
+				sched.removeFile(a);
+				delete a;
+				EXPECT_EQ(1u, sched.size());
+				/* a's job is cancelled, not run */
+				EXPECT_EQ(T0 + 120, sched.nextDeadline());
+				EXPECT_EQ(1u, sched.runDue(T0 + 120, due));
+				EXPECT_STREQ("/bin/b", due[0]->e->cmd);
+				sched.removeFile(b);
+				delete b;
+				EXPECT_EQ(0u, sched.size());
+				EXPECT_EQ(-1, sched.nextDeadline());
+			}
+			TEST_F(SchedulerTest, CompactsCancelledJobs) {
+				Scheduler sched;
+				string tab;
+				vector<ScheduledJob *> due;
+				int i;
+
+				for (i = 0; i < 3000; i++)
+					tab += "30 * * * * /bin/true\n";
+				CrontabFile *a = load("a", tab.c_str());
+				CrontabFile *b = load("b", "0 * * * * /bin/b\n");
+				sched.addFile(a, T0);
+				sched.addFile(b, T0);
+				sched.removeFile(a);
+				delete a;
+				/* the entries are gone, so running must not touch them */
+				EXPECT_EQ(1u, sched.runDue(T0 + 7200, due));
+				EXPECT_EQ(1u, sched.size());
+				sched.removeFile(b);
+				delete b;
+			}
+			TEST_F(SchedulerTest, ReplacingAFileKeepsUnchangedJobs) {
+				Scheduler sched;
+				CrontabFile *a = load("a", "*/5 * * * * /bin/five\n10 0 * * * /bin/ten\n");
+				vector<ScheduledJob *> due;
+
+				sched.addFile(a, T0);
+				EXPECT_EQ(1u, sched.runDue(T0 + 300, due));
+				CrontabFile *b = load("a", "*/5 * * * * /bin/five\n0 1 * * * /bin/one\n");
+				/* five keeps its slot, ten is dropped and one is new */
+				EXPECT_EQ(1u, sched.replaceFile(a, b, T0 + 301));
+				delete a;
+				EXPECT_EQ(2u, sched.size());
+				EXPECT_EQ(T0 + 600, sched.nextDeadline());
+				due.clear();
+				EXPECT_EQ(1u, sched.runDue(T0 + 600, due));
+				EXPECT_EQ(b, due[0]->file);
+				EXPECT_EQ(b->entries[0], due[0]->e);
+				due.clear();
+				EXPECT_EQ(2u, sched.runDue(T0 + 3600, due));
+				EXPECT_STREQ("/bin/one", due.back()->e->cmd);
+				sched.removeFile(b);
+				delete b;
+			}
+			TEST_F(SchedulerTest, SpreadsJobsOverTheirWindow) {
+				Scheduler sched;
+				string tab;
+				char line[64];
+				set<time_t> seconds;
+				vector<ScheduledJob *> due;
+				int i;
+
+				for (i = 0; i < 200; i++) {
+					snprintf(line, sizeof(line), "0 * * * * /bin/job%d\n", i);
+					tab += line;
+				}
+				this->envp = env_set(this->envp, (char *)"SPREAD=15m");
+				CrontabFile *file = load("a", tab.c_str());
+				/* after this hour's window */
+				sched.addFile(file, T0 + 900);
+				EXPECT_GE(sched.nextDeadline(), T0 + 3600);
+				/* every one of them inside the first 15 minutes of the hour */
+				for (time_t t = T0 + 3600; t < T0 + 3600 + 900; t++) {
+					due.clear();
+					if (sched.runDue(t, due) > 0)
+						seconds.insert(t);
+					for (i = 0; i < (int)due.size(); i++) {
+						EXPECT_EQ(t - T0 - 3600, due[i]->offset);
+						/* the same point in the next hour */
+						EXPECT_EQ(t + 3600, due[i]->when);
+						/* and the same again if it is worked out afresh */
+						EXPECT_EQ(due[i]->offset, ScheduledJob::spreadOffset(due[i]->e, "a"));
+					}
+				}
+				EXPECT_EQ(T0 + 7200 + *seconds.begin() - T0 - 3600, sched.nextDeadline());
+				EXPECT_GT(seconds.size(), 150u);
+				sched.removeFile(file);
+				delete file;
+			}
+			TEST_F(SchedulerTest, ParsesSpreadWindows) {
+				CrontabFile *file = load("a", "@hourly~10m /bin/hourly\n@daily~2h /bin/daily\n@reboot~5m /bin/boot\n@hourly~2d /bin/long\n");
+
+				ASSERT_EQ(2u, file->entries.size());
+				EXPECT_EQ(600, file->entries[0]->spread);
+				EXPECT_EQ(7200, file->entries[1]->spread);
+				EXPECT_LT(ScheduledJob::spreadOffset(file->entries[0], "a"), 600);
+				EXPECT_EQ(-1, parse_window("", 0));
+				EXPECT_EQ(-1, parse_window("10x", 3));
+				EXPECT_EQ(30, parse_window("30s", 3));
+				EXPECT_EQ(86400, parse_window("24h", 3));
+				EXPECT_EQ(-1, parse_window("25h", 3));
+				delete file;
+			}
+			TEST_F(SchedulerTest, CatchesUpOnMissedPeriods) {
+				Scheduler sched;
+				CrontabFile *file = load("a", "@period daily /bin/daily\n@period 7 /bin/weekly\n@period monthly /bin/monthly\n"
+					"@period 6h /bin/six\n@period~30m daily /bin/delayed\n");
+				time_t now = T0 + 10 * 3600, at = now + 1 + 1800;
+				vector<ScheduledJob *> due;
+				size_t i;
+
+				lastruns.clear();
+				lastruns["/bin/daily"] = T0 - 3600;
+				lastruns["/bin/weekly"] = T0 - 2 * 86400 + 5 * 3600;
+				lastruns["/bin/monthly"] = T0 + 3600;
+				lastruns["/bin/six"] = T0 + 8 * 3600;
+				sched.setLastRun(last_run);
+				sched.addFile(file, now);
+				EXPECT_EQ(5u, sched.size());
+				/* yesterday's run was at 23:00, but that was yesterday */
+				EXPECT_EQ(now + 1, sched.nextDeadline());
+				EXPECT_EQ(2u, sched.runDue(at, due));
+				EXPECT_EQ(1u, ran_count(due, "/bin/daily"));
+				EXPECT_EQ(1u, ran_count(due, "/bin/delayed"));
+				/* until the history has them, they are only tried again */
+				for (i = 0; i < due.size(); i++)
+					EXPECT_EQ(at + PERIOD_RETRY, due[i]->when);
+				/* the daily one started, the other was turned away */
+				lastruns["/bin/daily"] = at;
+				EXPECT_EQ(at + PERIOD_RETRY, sched.nextDeadline());
+				due.clear();
+				ASSERT_EQ(1u, sched.runDue(at + PERIOD_RETRY, due));
+				EXPECT_STREQ("/bin/delayed", due[0]->e->cmd);
+				lastruns["/bin/delayed"] = at + PERIOD_RETRY;
+				/* the rest are counted from when they last ran */
+				due.clear();
+				EXPECT_EQ(0u, sched.runDue(T0 + 14 * 3600 - 1, due));
+				EXPECT_EQ(T0 + 14 * 3600, sched.nextDeadline());
+				EXPECT_EQ(1u, sched.runDue(T0 + 14 * 3600, due));
+				EXPECT_STREQ("/bin/six", due[0]->e->cmd);
+				lastruns["/bin/six"] = T0 + 14 * 3600;
+				due.clear();
+				sched.runDue(T0 + 86400 - 1, due);
+				EXPECT_EQ(0u, ran_count(due, "/bin/daily"));
+				/* next due at midnight, not 24 hours on */
+				due.clear();
+				sched.runDue(T0 + 86400, due);
+				EXPECT_EQ(1u, ran_count(due, "/bin/daily"));
+				due.clear();
+				sched.runDue(T0 + 5 * 86400 - 1, due);
+				EXPECT_EQ(0u, ran_count(due, "/bin/weekly"));
+				due.clear();
+				sched.runDue(T0 + 5 * 86400, due);
+				EXPECT_EQ(1u, ran_count(due, "/bin/weekly"));
+				due.clear();
+				sched.runDue(T0 + 31 * 86400 - 1, due);
+				EXPECT_EQ(0u, ran_count(due, "/bin/monthly"));
+				due.clear();
+				sched.runDue(T0 + 31 * 86400, due);
+				EXPECT_EQ(1u, ran_count(due, "/bin/monthly"));
+				sched.removeFile(file);
+				delete file;
+			}
+
+			TEST(SchedulerBootTest, RunsRebootJobsOncePerBoot) {
+				char dir[] = "/tmp/tinjac_test.XXXXXX";
+				string marker, bootid;
+				FILE *fp;
+
+				ASSERT_TRUE(mkdtemp(dir) != NULL);
+				marker = string(dir) + "/reboot";
+				bootid = string(dir) + "/boot_id";
+				ASSERT_TRUE((fp = fopen(bootid.c_str(), "w")) != NULL);
+				fputs("0e0a1c2d-aaaa\n", fp);
+				fclose(fp);
+				EXPECT_TRUE(Scheduler::firstSinceBoot(marker.c_str(), bootid.c_str()));
+				/* a restart */
+				EXPECT_FALSE(Scheduler::firstSinceBoot(marker.c_str(), bootid.c_str()));
+				ASSERT_TRUE((fp = fopen(bootid.c_str(), "w")) != NULL);
+				fputs("0e0a1c2d-bbbb\n", fp);
+				fclose(fp);
+				EXPECT_TRUE(Scheduler::firstSinceBoot(marker.c_str(), bootid.c_str()));
+				EXPECT_FALSE(Scheduler::firstSinceBoot(marker.c_str(), bootid.c_str()));
+				/* with no boot id, only the marker being there counts */
+				unlink(bootid.c_str());
+				EXPECT_FALSE(Scheduler::firstSinceBoot(marker.c_str(), bootid.c_str()));
+				unlink(marker.c_str());
+				EXPECT_TRUE(Scheduler::firstSinceBoot(marker.c_str(), bootid.c_str()));
+				unlink(marker.c_str());
+				rmdir(dir);
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
@@ -0,0 +1,97 @@
+/*
+ *  gtest-spawner_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstring>
+#include <csignal>
+#include <string>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <boost/bind.hpp>
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "gtest-entry_fixture.hpp"
+#include "spawner.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			class SpawnerTest : public EntryTest {
+				protected:
+					virtual void SetUp() {
+						EntryTest::SetUp();
+						this->lost = false;
+						this->spawner.setExited(boost::bind(&SpawnerTest::exited, this, _1, _2, _3, _4));
+						this->spawner.setGone(boost::bind(&SpawnerTest::gone, this));
+						ASSERT_TRUE(this->spawner.start());
+					}
+					void exited(Spawner::JobId id, pid_t, int status, const struct rusage *) {
+						this->statuses[id] = status;
+					}
+					void gone() {
+						this->lost = true;
+					}
+					/* wait for the spawner to tell us about id */
+					bool wait(Spawner::JobId id) {
+						struct pollfd pfd;
+						int i;
+
+						for (i = 0; i < 100 && !this->statuses.count(id); i++) {
+							pfd.fd = this->spawner.getFd();
+							pfd.events = POLLIN;
+							if (pfd.fd == -1 || poll(&pfd, 1, 100) < 0)
+								return false;
+							this->spawner.processReplies();
+						}
+						return this->statuses.count(id) != 0;
+					}
+				Spawner spawner;
+				map<Spawner::JobId, int> statuses;
+				bool lost;
+			};
+
+			TEST_F(SpawnerTest, ReportsHowJobsExit) {
+				Spawner::JobId a = this->spawner.spawn(this->load("* * * * * exit 3\n"));
+				Spawner::JobId b = this->spawner.spawn(this->load("* * * * * kill -TERM $$\n"));
+
+				ASSERT_NE(0u, a);
+				ASSERT_TRUE(this->wait(a));
+				ASSERT_TRUE(this->wait(b));
+				EXPECT_TRUE(WIFEXITED(this->statuses[a]));
+				EXPECT_EQ(3, WEXITSTATUS(this->statuses[a]));
+				EXPECT_TRUE(WIFSIGNALED(this->statuses[b]));
+				EXPECT_EQ(0u, this->spawner.running());
+				EXPECT_EQ(2u, this->spawner.getStats().started);
+			}
+			TEST_F(SpawnerTest, RunsWithTheJobsEnvironment) {
+				char buf[256];
+				ssize_t n;
+				int fds[2];
+
+				ASSERT_EQ(0, pipe(fds));
+				this->envp = env_set(this->envp, (char *)"GREETING=hello");
+				Spawner::JobId id = this->spawner.spawn(this->load("* * * * * echo $GREETING from $PWD; pwd >&2\n"), fds[1]);
+				::close(fds[1]);
+				ASSERT_TRUE(this->wait(id));
+				n = ::read(fds[0], buf, sizeof(buf) - 1);
+				::close(fds[0]);
+				ASSERT_GT(n, 0);
+				buf[n] = '\0';
+				EXPECT_EQ(string("hello from ") + this->pw->pw_dir + "\n" + this->pw->pw_dir + "\n", buf);
+			}
+			TEST_F(SpawnerTest, GivesUpWhenTheHelperDies) {
+				kill(this->spawner.getHelperPid(), SIGKILL);
+				waitpid(this->spawner.getHelperPid(), NULL, 0);
+				EXPECT_EQ(0u, this->spawner.spawn(this->load("* * * * * true\n")));
+				EXPECT_TRUE(this->lost);
+				/* no new helper from a daemon that may have threads */
+				EXPECT_FALSE(this->spawner.start());
+				EXPECT_EQ(0u, this->spawner.spawn(this->load("* * * * * true\n")));
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
@@ -0,0 +1,126 @@
+/*
+ *  gtest-supervisor_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <csignal>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <boost/bind.hpp>
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "gtest-entry_fixture.hpp"
+#include "scheduler.hpp"
+#include "spawner.hpp"
+#include "supervisor.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			class SupervisorTest : public EntryTest {
+				protected:
+					virtual void SetUp() {
+						EntryTest::SetUp();
+						this->spawner.setScheduler(&this->sched);
+						ASSERT_TRUE(this->spawner.start());
+						this->supervisor = new Supervisor(&this->spawner, &this->sched);
+						this->supervisor->setDone(boost::bind(&SupervisorTest::done, this, _1));
+					}
+					virtual void TearDown() {
+						delete this->supervisor;
+						EntryTest::TearDown();
+					}
+					void done(const Supervisor::JobRun &run) {
+						this->runs[run.id] = run;
+						if (this->supervisor->running() <= 1)
+							this->sched.stop();
+					}
+					/* give up on the jobs if they take too long */
+					void idle(time_t now) {
+						if (now >= this->timeout)
+							this->sched.stop();
+					}
+					/* run the loop until every job is done */
+					void finish(time_t wait = 30) {
+						this->timeout = time(NULL) + wait;
+						this->sched.setIdle(boost::bind(&SupervisorTest::idle, this, _1), 1);
+						this->sched.run(JobCallback());
+					}
+				Scheduler sched;
+				Spawner spawner;
+				Supervisor *supervisor;
+				map<Spawner::JobId, Supervisor::JobRun> runs;
+				time_t timeout;
+			};
+
+			TEST_F(SupervisorTest, CountsOutputAndReportsHowJobsExit) {
+				Spawner::JobId id = this->supervisor->run(this->load("* * * * * head -c 100000 /dev/zero; echo oops >&2; exit 2\n"), "tab");
+
+				ASSERT_NE(0u, id);
+				this->finish();
+				ASSERT_EQ(1u, this->runs.count(id));
+				Supervisor::JobRun &run = this->runs[id];
+				EXPECT_EQ(100005u, run.outbytes);
+				EXPECT_TRUE(WIFEXITED(run.status));
+				EXPECT_EQ(2, WEXITSTATUS(run.status));
+				EXPECT_GT(run.pid, 0);
+				EXPECT_GT(run.usage.ru_maxrss, 0);
+				EXPECT_EQ("tab", run.fname);
+				EXPECT_EQ(1, run.lineno);
+				EXPECT_EQ(0u, this->supervisor->running());
+				/* just the spawner is left */
+				EXPECT_EQ(1u, this->sched.watchCount());
+			}
+			TEST_F(SupervisorTest, ALoudJobLeavesTheLoopATurn) {
+				Spawner::JobId id = this->supervisor->run(this->load("* * * * * exec yes\n"), "tab");
+
+				ASSERT_NE(0u, id);
+				/* the pipe never empties, but idle still gets to stop us */
+				this->finish(2);
+				EXPECT_EQ(1u, this->supervisor->running());
+				EXPECT_GT(this->supervisor->getStats().outbytes, 0u);
+				EXPECT_TRUE(this->supervisor->kill(id, SIGKILL));
+				this->finish();
+				ASSERT_EQ(1u, this->runs.count(id));
+				EXPECT_TRUE(WIFSIGNALED(this->runs[id].status));
+			}
+			TEST_F(SupervisorTest, CapturesOutputAsTheCrontabSays) {
+				Spawner::JobId id;
+
+				this->envp = env_set(this->envp, (char *)"OUTPUT_KEEP=^keep");
+				this->envp = env_set(this->envp, (char *)"OUTPUT_DROP=2$");
+				this->envp = env_set(this->envp, (char *)"OUTPUT_HEAD=7");
+				this->envp = env_set(this->envp, (char *)"OUTPUT_TAIL=7");
+				id = this->supervisor->run(this->load("* * * * * for i in 1 2 3 4; do echo keep $i; echo drop $i; done\n"), "tab");
+				ASSERT_NE(0u, id);
+				this->finish();
+				ASSERT_EQ(1u, this->runs.count(id));
+				const OutputCapture &out = this->runs[id].output;
+				EXPECT_EQ(8u, out.getStats().lines);
+				EXPECT_EQ(5u, out.getStats().dropped);
+				EXPECT_EQ("keep 1\n[... 7 bytes omitted ...]\nkeep 4\n", out.text());
+			}
+			TEST_F(SupervisorTest, SupervisesManyJobsAtOnce) {
+				entry *e = this->load("* * * * * sleep 1; echo done\n");
+				time_t start = time(NULL);
+				int i;
+
+				for (i = 0; i < 200; i++)
+					ASSERT_NE(0u, this->supervisor->run(e, "tab"));
+				EXPECT_EQ(200u, this->supervisor->running());
+				this->finish();
+				EXPECT_EQ(200u, this->runs.size());
+				EXPECT_EQ(200u, this->supervisor->getStats().finished);
+				EXPECT_EQ(200u * 5, this->supervisor->getStats().outbytes);
+				/* they ran side by side, not one after another */
+				EXPECT_LT(time(NULL) - start, 20);
+				for (map<Spawner::JobId, Supervisor::JobRun>::iterator it = this->runs.begin(); it != this->runs.end(); ++it)
+					EXPECT_EQ(0, it->second.status);
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
@@ -0,0 +1,113 @@
+/*
+ *  gtest-timezone_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstdlib>
+#include <ctime>
+#include "timezone.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			class TimeZoneTest : public testing::Test {
+				protected:
+					virtual void SetUp() {
+						setenv("TZ", "UTC", 1);
+						tzset();
+					}
+			};
+
+			TEST_F(TimeZoneTest, CivilRoundTrip) {
+				struct tm tm;
+				/* 2024-02-29 13:45 UTC */
+				EXPECT_EQ(1709214300, TimeZone::civilSeconds(2024, 2, 29, 13, 45));
+				TimeZone::civilFromSeconds(1709214300, &tm);
+				EXPECT_EQ(124, tm.tm_year);
+				EXPECT_EQ(1, tm.tm_mon);
+				EXPECT_EQ(29, tm.tm_mday);
+				EXPECT_EQ(13, tm.tm_hour);
+				EXPECT_EQ(45, tm.tm_min);
+				EXPECT_EQ(4, tm.tm_wday);
+				EXPECT_EQ(59, tm.tm_yday);
+				TimeZone::civilFromSeconds(-1, &tm);
+				EXPECT_EQ(69, tm.tm_year);
+				EXPECT_EQ(31, tm.tm_mday);
+				EXPECT_EQ(3, tm.tm_wday);
+			}
+			TEST_F(TimeZoneTest, SharedPerName) {
+				EXPECT_TRUE(TimeZone::get("Europe/Paris") == TimeZone::get("Europe/Paris"));
+				EXPECT_TRUE(TimeZone::get("Europe/Paris") != TimeZone::get("Asia/Tokyo"));
+				/* no CRON_TZ is the daemon's zone */
+				EXPECT_TRUE(TimeZone::get("") == TimeZone::get("UTC"));
+			}
+			TEST_F(TimeZoneTest, Transitions) {
+				TimeZone *ny = TimeZone::get("America/New_York");
+				/* 2021-03-14 07:00 UTC the clocks go forward */
+				EXPECT_EQ(1615705200, ny->nextTransition(1615000000));
+				EXPECT_EQ(-5 * 3600, ny->offset(1615705199));
+				EXPECT_EQ(-4 * 3600, ny->offset(1615705200));
+				EXPECT_EQ(1615705200, ny->lastTransition(1615800000));
+				/* the process TZ is left alone */
+				EXPECT_STREQ("UTC", getenv("TZ"));
+			}
+			TEST_F(TimeZoneTest, MatchesLocaltime) {
+				const char *zones[] = { "America/New_York", "Europe/London", "Australia/Lord_Howe", "Asia/Kolkata", "America/Sao_Paulo",
+					"AEST-10AEDT,M10.1.0,M4.1.0/3" };
+				unsigned int seed = 1;
+				struct tm want, got;
+				int z, i;
+
+				for (z = 0; z < 6; z++) {
+					TimeZone *zone = TimeZone::get(zones[z]);
+					/* ask for times in a random order, so the table grows both ways */
+					for (i = 0; i < 2000; i++) {
+						time_t t = 946684800 + (time_t)rand_r(&seed) % (40 * 365 * 86400L);
+						zone->toWall(t, &got);
+						setenv("TZ", zones[z], 1);
+						tzset();
+						localtime_r(&t, &want);
+						setenv("TZ", "UTC", 1);
+						tzset();
+						ASSERT_EQ(want.tm_year, got.tm_year) << zones[z] << " " << t;
+						ASSERT_EQ(want.tm_mon, got.tm_mon) << zones[z] << " " << t;
+						ASSERT_EQ(want.tm_mday, got.tm_mday) << zones[z] << " " << t;
+						ASSERT_EQ(want.tm_hour, got.tm_hour) << zones[z] << " " << t;
+						ASSERT_EQ(want.tm_min, got.tm_min) << zones[z] << " " << t;
+						ASSERT_EQ(want.tm_wday, got.tm_wday) << zones[z] << " " << t;
+						ASSERT_EQ(want.tm_yday, got.tm_yday) << zones[z] << " " << t;
+						ASSERT_EQ(want.tm_isdst, got.tm_isdst) << zones[z] << " " << t;
+					}
+				}
+			}
+			TEST_F(TimeZoneTest, ReadsPosixRules) {
+				/* the US rules, when only the names are given */
+				TimeZone *us = TimeZone::get("XST5XDT");
+				EXPECT_EQ(1615705200, us->nextTransition(1615000000));
+				EXPECT_EQ(-4 * 3600, us->offset(1615705200));
+				EXPECT_EQ(12600, TimeZone::get("<+0330>-3:30")->offset(1615705200));
+				EXPECT_EQ(-9000, TimeZone::get("<-0230>2:30")->offset(0));
+				/* neither a zone nor a rule is UTC */
+				EXPECT_EQ(0, TimeZone::get("Nowhere/Atall")->offset(1615705200));
+				EXPECT_EQ(0, TimeZone::get("../zoneinfo/Asia/Tokyo")->offset(1615705200));
+				EXPECT_EQ(-1, TimeZone::get("Nowhere/Atall")->nextTransition(1615705200));
+				EXPECT_STREQ("UTC", getenv("TZ"));
+			}
+			TEST_F(TimeZoneTest, KeepsChangesFarFromTheFirstAsked) {
+				/* summer starts at midnight UTC, on a day boundary */
+				TimeZone *later = TimeZone::get("XST0XDT,M3.5.0/0,M10.5.0/1");
+				EXPECT_EQ(0, later->offset(1742947200));
+				EXPECT_EQ(3600, later->offset(TimeZone::civilSeconds(2027, 3, 28, 1, 0)));
+				EXPECT_EQ(TimeZone::civilSeconds(2027, 3, 28, 0, 0), later->lastTransition(TimeZone::civilSeconds(2027, 3, 28, 1, 0)));
+				/* and going back from the first time asked */
+				TimeZone *earlier = TimeZone::get("YST0YDT,M3.5.0/0,M10.5.0/1");
+				EXPECT_EQ(0, earlier->offset(1742947200));
+				EXPECT_EQ(3600, earlier->offset(TimeZone::civilSeconds(2023, 3, 26, 1, 0)));
+				EXPECT_EQ(0, earlier->offset(TimeZone::civilSeconds(2023, 3, 25, 23, 0)));
+				EXPECT_EQ(TimeZone::civilSeconds(2023, 3, 26, 0, 0), earlier->nextTransition(TimeZone::civilSeconds(2023, 3, 25, 23, 0)));
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
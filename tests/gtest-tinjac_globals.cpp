@@ -0,0 +1,11 @@
+/*
+ *  gtest-tinjac_globals.cpp
+ *  Tinjac
+ *
+ *  Globals normally provided by main.cpp, so the units under test link
+ *  without pulling in the daemon itself.
+ *
+ */
+#include "log.hpp"
+
+Log *logFacility = new Log((char *)"/dev/null");
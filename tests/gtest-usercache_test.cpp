@@ -0,0 +1,146 @@
+/*
+ *  gtest-usercache_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <cstring>
+#include <boost/bind.hpp>
+#include "env.hpp"
+#include "misc.hpp"
+#include "crontabparser.hpp"
+#include "scheduler.hpp"
+#include "usercache.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			void wait_for_lookups(Scheduler *sched, UserCache *users, time_t until, time_t now) {
+				if (users->pending() == 0 || now >= until)
+					sched->stop();
+			}
+			void note_change(vector<string> *changed, const string &name) {
+				changed->push_back(name);
+			}
+
+			TEST(UserCacheTest, SharesOneRecordPerUser) {
+				UserCache users;
+				struct passwd *a = users.get("root");
+				struct passwd *b = users.get("root");
+
+				ASSERT_TRUE(a != NULL);
+				EXPECT_TRUE(a == b);
+				EXPECT_EQ(0u, a->pw_uid);
+				/* the hash isn't kept */
+				EXPECT_STREQ("", a->pw_passwd);
+				/* the cache's own reference and ours */
+				EXPECT_EQ(3u, pw_refs(a));
+				EXPECT_EQ(1ul, users.getStats().misses);
+				EXPECT_EQ(1ul, users.getStats().hits);
+				pw_release(a);
+				pw_release(b);
+			}
+			TEST(UserCacheTest, RemembersMissingUsers) {
+				UserCache users;
+
+				EXPECT_TRUE(users.get("tinjac-no-such-user") == NULL);
+				EXPECT_TRUE(users.get("tinjac-no-such-user") == NULL);
+				EXPECT_EQ(1ul, users.getStats().misses);
+				EXPECT_EQ(1ul, users.getStats().negative);
+
+				/* but not once they have expired */
+				UserCache quick(USERCACHE_TTL, 0);
+				EXPECT_TRUE(quick.get("tinjac-no-such-user") == NULL);
+				EXPECT_TRUE(quick.get("tinjac-no-such-user") == NULL);
+				EXPECT_EQ(2ul, quick.getStats().misses);
+			}
+			TEST(UserCacheTest, RefreshesUsersInUse) {
+				UserCache users(0, 0);
+				struct passwd *pw = users.get("root");
+				time_t later = time(NULL) + 1;
+
+				ASSERT_TRUE(pw != NULL);
+				/* still handed out while it is stale */
+				pw_release(users.get("root"));
+				EXPECT_EQ(1ul, users.getStats().misses);
+				EXPECT_EQ(1u, users.refresh(later, USERCACHE_REFRESH_MAX));
+				EXPECT_EQ(1ul, users.getStats().refreshes);
+				EXPECT_EQ(0ul, users.getStats().changed);
+				EXPECT_EQ(1u, users.size());
+				/* and it isn't looked at again straight away */
+				EXPECT_EQ(0u, users.refresh(later + 1, USERCACHE_REFRESH_MAX));
+				EXPECT_EQ(1u, users.size());
+				/* nothing else holds root now, so it is forgotten */
+				pw_release(pw);
+				EXPECT_EQ(0u, users.refresh(later + USERCACHE_CHECK, USERCACHE_REFRESH_MAX));
+				EXPECT_EQ(0u, users.size());
+			}
+			TEST(UserCacheTest, RefreshesOnItsOwnThread) {
+				Scheduler sched;
+				UserCache users(0, 0);
+				vector<string> changed;
+				struct passwd *pw;
+
+				/* in the cache before the thread starts */
+				ASSERT_TRUE((pw = users.get("root")) != NULL);
+				ASSERT_TRUE(users.start(&sched));
+				users.setChanged(boost::bind(note_change, &changed, _1));
+				/* on the thread every stale user goes at once, whatever max says */
+				EXPECT_EQ(1u, users.refresh(time(NULL) + 1, 0));
+				EXPECT_EQ(1u, users.pending());
+				sched.setIdle(boost::bind(wait_for_lookups, &sched, &users, time(NULL) + 30, _1), 1);
+				sched.run(JobCallback());
+				EXPECT_EQ(0u, users.pending());
+				EXPECT_EQ(1ul, users.getStats().refreshes);
+				EXPECT_EQ(0ul, users.getStats().changed);
+				/* root is still root, so nobody is told */
+				EXPECT_TRUE(changed.empty());
+				pw_release(pw);
+			}
+			TEST(UserCacheTest, LooksUpNewUsersOnItsOwnThread) {
+				Scheduler sched;
+				UserCache users;
+				vector<string> changed;
+				struct passwd *pw;
+
+				ASSERT_TRUE(users.start(&sched));
+				users.setChanged(boost::bind(note_change, &changed, _1));
+				/* not known yet, rather than not there */
+				EXPECT_TRUE(users.get("root") == NULL);
+				EXPECT_TRUE(users.looking("root"));
+				EXPECT_TRUE(users.get("root") == NULL);
+				EXPECT_EQ(1u, users.pending());
+				sched.setIdle(boost::bind(wait_for_lookups, &sched, &users, time(NULL) + 30, _1), 1);
+				sched.run(JobCallback());
+				ASSERT_EQ(1u, changed.size());
+				EXPECT_EQ("root", changed[0]);
+				EXPECT_FALSE(users.looking("root"));
+				ASSERT_TRUE((pw = users.get("root")) != NULL);
+				EXPECT_EQ(0u, pw->pw_uid);
+				EXPECT_EQ(1ul, users.getStats().misses);
+				pw_release(pw);
+			}
+			TEST(UserCacheTest, EntriesShareTheRecord) {
+				const char *tab = "* * * * * root /bin/a\n0 * * * * root /bin/b\n* * * * * tinjac-no-such-user /bin/c\n";
+				UserCache users;
+				CrontabParser parser(tab, strlen(tab), "system");
+				char **envp = env_init();
+				entry *a, *b;
+
+				parser.setUserCache(&users);
+				a = parser.load_entry(NULL, envp);
+				b = parser.load_entry(NULL, envp);
+				ASSERT_TRUE(a != NULL && b != NULL);
+				EXPECT_TRUE(a->pwd == b->pwd);
+				EXPECT_STREQ("root", env_get((char *)"LOGNAME", b->envp));
+				EXPECT_TRUE(parser.load_entry(NULL, envp) == NULL);
+				EXPECT_EQ(1, parser.getErrors());
+				EXPECT_EQ(2ul, users.getStats().misses);
+				free_entry(a);
+				free_entry(b);
+				env_free(envp);
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing
@@ -0,0 +1,297 @@
+/*
+ *  gtest-webcron_test.cpp
+ *  Tinjac
+ *
+ */
+#include <gtest/gtest.h>
+#include <csignal>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <boost/bind.hpp>
+#include "env.hpp"
+#include "crontabparser.hpp"
+#include "scheduler.hpp"
+#include "spawner.hpp"
+#include "supervisor.hpp"
+#include "webcron.hpp"
+
+namespace testing {
+	namespace internal {
+		namespace {
+			static void reply(int fd, const string &text) {
+				size_t off = 0;
+				ssize_t n;
+
+				while (off < text.size() && (n = ::write(fd, text.data() + off, text.size() - off)) > 0)
+					off += n;
+			}
+
+			/* one connection to the stand-in, a request at a time until it's closed */
+			static void serve(int fd) {
+				string in, request, target;
+				char buf[4096];
+				size_t end;
+				ssize_t n;
+
+				for (;;) {
+					while ((end = in.find("\r\n\r\n")) == string::npos) {
+						if ((n = ::read(fd, buf, sizeof(buf))) <= 0)
+							return;
+						in.append(buf, n);
+					}
+					request = in.substr(0, end + 4);
+					in.erase(0, end + 4);
+					target = request.substr(request.find(' ') + 1);
+					target.erase(target.find(' '));
+					if (target == "/len")
+						reply(fd, "HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello");
+					else if (target == "/chunked")
+						reply(fd, "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n3\r\nhel\r\n2;x=y\r\nlo\r\n0\r\nX-Trailer: 1\r\n\r\n");
+					else if (target == "/method")
+						reply(fd, "HTTP/1.1 200 OK\r\nContent-Length: " + string(1, '0' + request.find(' ')) + "\r\n\r\n" +
+							request.substr(0, request.find(' ')));
+					else if (target == "/missing")
+						reply(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 9\r\n\r\nnot found");
+					else if (target == "/big") {
+						reply(fd, "HTTP/1.1 200 OK\r\nContent-Length: 1048576\r\n\r\n");
+						reply(fd, "first line\n" + string(1048576 - 21, 'x') + "\nlast line\n");
+					} else if (target == "/close") {
+						reply(fd, "HTTP/1.0 200 OK\r\n\r\nbye");
+						return;
+					} else {
+						/* /slow */
+						sleep(5);
+						return;
+					}
+				}
+			}
+
+			/* a local HTTP server, a process for each connection */
+			static void stand_in(int listener) {
+				int fd;
+
+				signal(SIGCHLD, SIG_IGN);
+				for (;;) {
+					if ((fd = accept(listener, NULL, NULL)) == -1)
+						continue;
+					if (fork() == 0) {
+						::close(listener);
+						serve(fd);
+						_exit(0);
+					}
+					::close(fd);
+				}
+			}
+
+			class WebCronTest : public testing::Test {
+				protected:
+					virtual void SetUp() {
+						struct sockaddr_in sin;
+						socklen_t len = sizeof(sin);
+						int listener;
+						char url[64];
+
+						ASSERT_NE(-1, listener = socket(AF_INET, SOCK_STREAM, 0));
+						memset(&sin, 0, sizeof(sin));
+						sin.sin_family = AF_INET;
+						sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+						ASSERT_EQ(0, bind(listener, (struct sockaddr *)&sin, sizeof(sin)));
+						ASSERT_EQ(0, listen(listener, 16));
+						ASSERT_EQ(0, getsockname(listener, (struct sockaddr *)&sin, &len));
+						if ((this->server = fork()) == 0) {
+							stand_in(listener);
+							_exit(0);
+						}
+						::close(listener);
+						snprintf(url, sizeof(url), "http://127.0.0.1:%d", ntohs(sin.sin_port));
+						this->base = url;
+						this->web = new WebCron(&this->sched);
+						this->web->setDone(boost::bind(&WebCronTest::done, this, _1));
+						this->id = 0;
+					}
+					virtual void TearDown() {
+						delete this->web;
+						kill(this->server, SIGKILL);
+						waitpid(this->server, NULL, 0);
+					}
+					void fetch(const string &path, int timeout = 10, OutputCapture output = OutputCapture()) {
+						WebCron::Request request;
+
+						request.id = ++this->id;
+						request.method = "GET";
+						request.url = this->base + path;
+						request.timeout = timeout;
+						request.output = output;
+						EXPECT_TRUE(this->web->fetch(request));
+					}
+					void done(const WebCron::Response &response) {
+						this->responses.push_back(response);
+						if (this->web->running() == 0)
+							this->sched.stop();
+					}
+					void watch(Supervisor *supervisor) {
+						supervisor->setDone(boost::bind(&WebCronTest::jobDone, this, _1));
+					}
+					void jobDone(const Supervisor::JobRun &run) {
+						this->runs.push_back(run);
+						if (this->runs.size() == 2)
+							this->sched.stop();
+					}
+					void idle(time_t now) {
+						if (now >= this->timeout)
+							this->sched.stop();
+					}
+					void finish() {
+						this->timeout = time(NULL) + 30;
+						this->sched.setIdle(boost::bind(&WebCronTest::idle, this, _1), 1);
+						this->sched.run(JobCallback());
+					}
+				pid_t server;
+				string base;
+				Scheduler sched;
+				WebCron *web;
+				Spawner::JobId id;
+				vector<WebCron::Response> responses;
+				vector<Supervisor::JobRun> runs;
+				time_t timeout;
+			};
+
+			TEST(WebCronUrlTest, ParsesUrls) {
+				WebCron::Url url;
+
+				EXPECT_TRUE(WebCron::isUrl("https://example.com/"));
+				EXPECT_FALSE(WebCron::isUrl("curl https://example.com/"));
+				ASSERT_TRUE(WebCron::parseUrl("http://example.com", url));
+				EXPECT_FALSE(url.tls);
+				EXPECT_EQ("example.com", url.host);
+				EXPECT_EQ("80", url.port);
+				EXPECT_EQ("/", url.target);
+				ASSERT_TRUE(WebCron::parseUrl("https://example.com:8443/hook?a=1#top", url));
+				EXPECT_TRUE(url.tls);
+				EXPECT_EQ("8443", url.port);
+				EXPECT_EQ("/hook?a=1", url.target);
+				ASSERT_TRUE(WebCron::parseUrl("http://[::1]:8080/x", url));
+				EXPECT_EQ("::1", url.host);
+				EXPECT_EQ("8080", url.port);
+				ASSERT_TRUE(WebCron::parseUrl("https://example.com?q", url));
+				EXPECT_EQ("443", url.port);
+				EXPECT_EQ("/?q", url.target);
+				EXPECT_FALSE(WebCron::parseUrl("ftp://example.com/", url));
+				EXPECT_FALSE(WebCron::parseUrl("http:///path", url));
+				EXPECT_FALSE(WebCron::parseUrl("http://user:pw@example.com/", url));
+				EXPECT_FALSE(WebCron::parseUrl("http://example.com:99999/", url));
+				EXPECT_FALSE(WebCron::parseUrl("http://example.com/a b", url));
+			}
+			TEST_F(WebCronTest, KeepsAConnectionToAHost) {
+				this->web->setHostMax(1);
+				ASSERT_TRUE(this->web->start());
+				this->fetch("/len");
+				this->fetch("/chunked");
+				this->fetch("/missing");
+				this->fetch("/len");
+				this->finish();
+				ASSERT_EQ(4u, this->responses.size());
+				/* one after the other, as the host only gets one at a time */
+				EXPECT_EQ(1u, this->responses[0].id);
+				EXPECT_EQ(200, this->responses[0].status);
+				EXPECT_EQ("hello", this->responses[0].output.text());
+				EXPECT_EQ(200, this->responses[1].status);
+				EXPECT_EQ("hello", this->responses[1].output.text());
+				EXPECT_EQ(5u, this->responses[1].bytes);
+				EXPECT_EQ(404, this->responses[2].status);
+				EXPECT_EQ("not found", this->responses[2].output.text());
+				WebCron::Stats stats = this->web->getStats();
+				EXPECT_EQ(4u, stats.requests);
+				EXPECT_EQ(1u, stats.connections);
+				EXPECT_EQ(3u, stats.reused);
+				EXPECT_EQ(3u, stats.queued);
+				EXPECT_EQ(0u, stats.failed);
+			}
+			TEST_F(WebCronTest, ReadsABodyToTheEndOfTheConnection) {
+				ASSERT_TRUE(this->web->start());
+				this->fetch("/close");
+				this->finish();
+				this->fetch("/len");
+				this->finish();
+				ASSERT_EQ(2u, this->responses.size());
+				EXPECT_EQ(200, this->responses[0].status);
+				EXPECT_EQ("bye", this->responses[0].output.text());
+				EXPECT_EQ("hello", this->responses[1].output.text());
+				/* that one couldn't be kept */
+				EXPECT_EQ(2u, this->web->getStats().connections);
+			}
+			TEST_F(WebCronTest, KeepsTheHeadAndTailOfABigBody) {
+				ASSERT_TRUE(this->web->start());
+				this->web->setHostMax(1);
+				this->fetch("/big", 10, OutputCapture(64, 64));
+				this->fetch("/len");
+				this->finish();
+				ASSERT_EQ(2u, this->responses.size());
+				ASSERT_EQ(1u, this->responses[0].id);
+				EXPECT_EQ(1048576u, this->responses[0].bytes);
+				string text = this->responses[0].output.text();
+				EXPECT_LT(text.size(), 512u);
+				EXPECT_EQ(0u, text.find("first line\n"));
+				EXPECT_NE(string::npos, text.find("\nlast line"));
+				/* and the connection was good for the next one */
+				EXPECT_EQ("hello", this->responses[1].output.text());
+			}
+			TEST_F(WebCronTest, GivesUpOnSlowOrCancelledRequests) {
+				ASSERT_TRUE(this->web->start());
+				this->fetch("/slow", 1);
+				this->fetch("/slow");
+				this->web->cancel(2);
+				this->finish();
+				ASSERT_EQ(2u, this->responses.size());
+				EXPECT_EQ(2u, this->responses[0].id);
+				EXPECT_EQ(0, this->responses[0].status);
+				EXPECT_EQ("cancelled", this->responses[0].error);
+				EXPECT_EQ(1u, this->responses[1].id);
+				EXPECT_EQ("timed out", this->responses[1].error);
+				EXPECT_EQ(2u, this->web->getStats().failed);
+			}
+			TEST_F(WebCronTest, RunsUrlJobsWithoutAProcess) {
+				struct passwd *pw = getpwuid(getuid());
+				char **envp = env_init();
+				Spawner spawner;
+				Supervisor supervisor(&spawner, &this->sched);
+				Arena arena;
+				string tab;
+
+				ASSERT_TRUE(this->web->start());
+				supervisor.setWebCron(this->web);
+				this->watch(&supervisor);
+				tab = "* * * * * " + this->base + "/missing\n";
+				CrontabParser missing(tab.data(), tab.size(), "tab");
+				missing.setArena(&arena);
+				ASSERT_NE(0u, supervisor.run(missing.load_entry(pw, envp), "tab"));
+				envp = env_set(envp, (char *)"HTTP_METHOD=POST");
+				tab = "* * * * * " + this->base + "/method\n";
+				CrontabParser post(tab.data(), tab.size(), "tab");
+				post.setArena(&arena);
+				ASSERT_NE(0u, supervisor.run(post.load_entry(pw, envp), "tab"));
+				this->finish();
+				env_free(envp);
+				ASSERT_EQ(2u, this->runs.size());
+				/* they went on connections of their own, and either could finish first */
+				if (this->runs[0].id > this->runs[1].id)
+					swap(this->runs[0], this->runs[1]);
+				EXPECT_TRUE(this->runs[0].url);
+				EXPECT_EQ(0, this->runs[0].pid);
+				EXPECT_EQ(404, this->runs[0].httpstatus);
+				EXPECT_TRUE(WIFEXITED(this->runs[0].status));
+				EXPECT_EQ(1, WEXITSTATUS(this->runs[0].status));
+				EXPECT_EQ(200, this->runs[1].httpstatus);
+				EXPECT_EQ(0, WEXITSTATUS(this->runs[1].status));
+				EXPECT_EQ("POST", this->runs[1].output.text());
+			}
+
+		}  // namespace
+	}  // namespace internal
+}  // namespace testing